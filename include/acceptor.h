@@ -0,0 +1,75 @@
+#ifndef ACCEPTOR_H
+#define ACCEPTOR_H
+
+#include <stdio.h>
+
+/*
+ * Acceptance of connections on the listening sockets.
+ *
+ * The listening sockets are non-blocking, and each time one is readable
+ * the connections waiting on it are accepted in a batch of at most
+ * ACC_BATCH, so that a spike of connections costs one poll(2) per batch
+ * and both sockets get their turn.  Each connection is handed to a new
+ * session with its descriptor cast to the argument pointer, so nothing is
+ * allocated for it.
+ *
+ * No error on a connection stops the server.  Errors are classified:
+ *
+ * - A connection that failed before it could be accepted (ECONNABORTED,
+ *   and the network errors that Linux reports from accept(2)), or an
+ *   interrupted call, is skipped, and the batch goes on.
+ * - When the process runs out of descriptors (EMFILE, ENFILE), the
+ *   descriptor kept in reserve for this is closed, so that up to
+ *   ACC_BATCH of the waiting connections can be accepted and closed at
+ *   once rather than left to time out in the backlog, and then it is
+ *   reopened.
+ * - When the system runs short of memory (ENOBUFS, ENOMEM), nothing more
+ *   is accepted for the moment; when a session cannot be started, its
+ *   connection is closed.
+ *
+ * In the last two cases, the acceptor backs off before accepting again,
+ * for ACC_BACKOFF_MIN_MS at first and twice as long after each further
+ * failure, up to ACC_BACKOFF_MAX_MS, until a connection is served.  Only
+ * an error that means the listening socket itself is unusable is returned
+ * to the caller.
+ */
+
+#define ACC_BATCH 64
+#define ACC_BACKOFF_MIN_MS 1
+#define ACC_BACKOFF_MAX_MS 1000
+
+/*
+ * Set up the acceptor.
+ *
+ * @param coroutines  Nonzero to run each session as a coroutine (see
+ * chla_client_coroutine()), or zero to run it on a thread of its own
+ * (see chla_client_service()).
+ * @return 0 on success, or -1 if the reserve descriptor could not be
+ * opened.
+ */
+int acc_init(int coroutines);
+
+/*
+ * Make a listening socket non-blocking, as the acceptor requires, and
+ * have the TCP connections accepted on it send each write at once.
+ *
+ * @return 0 on success, or -1 on error.
+ */
+int acc_listen(int fd);
+
+/*
+ * Accept the connections waiting on a listening socket and start a
+ * session for each of them.
+ *
+ * @param fd  The listening socket, which has been passed to acc_listen().
+ * @return 0 if the socket is still usable, or -1 if it is not.
+ */
+int acc_accept(int fd);
+
+/*
+ * Print the number of connections accepted, and of those shed or closed
+ * because of a shortage of resources.
+ */
+void acc_report(FILE *out);
+
+#endif
@@ -75,8 +75,9 @@ void client_unref(CLIENT *client, char *why);
  * The handle is registered with the user registry, creating a new
  * USER object corresponding to the handle if one did not already
  * exist.  A MAILBOX is also created and retained by the CLIENT.
- * The login fails if the CLIENT is already logged in or there is already
- * some other CLIENT that is logged under the specified handle.
+ * The login fails if the CLIENT is already logged in, is an inter-node
+ * link, or there is already some other CLIENT that is logged under the
+ * specified handle.
  * Otherwise, the login is successful and the CLIENT is marked as "logged in".
  *
  * @param CLIENT  The CLIENT that is to be logged in.
@@ -151,6 +152,95 @@ int client_get_fd(CLIENT *client);
  */
 int client_send_packet(CLIENT *user, CHLA_PACKET_HEADER *pkt, void *data);
 
+/*
+ * Send a packet to a client, with a payload that is built only once the
+ * connection is held: build() is called with exclusive access to the
+ * connection, so that the packet goes out before anything another thread
+ * sends after build() has run.  This lets the payload be a snapshot of
+ * some state that the client is to see before any later change to it.
+ *
+ * @param client  The CLIENT who should be sent the packet.
+ * @param pkt  The header of the packet to be sent; its payload length is
+ * filled in.
+ * @param build  Returns the payload in a buffer to be freed and its length,
+ * or NULL if the packet is not to be sent.  It must not sleep.
+ * @param arg  Passed to build().
+ * @return 0 if the packet was built and sent, -1 otherwise.
+ */
+int client_send_built(CLIENT *client, CHLA_PACKET_HEADER *pkt,
+                      char *(*build)(void *arg, size_t *lengthp), void *arg);
+
+/*
+ * Receive a packet from a client, over the shared-memory transport if the
+ * client has attached one (see shm.h), or else from its connection with
+ * proto_recv_packet().  Only the thread serving the client's requests
+ * may call this.
+ *
+ * @param client  The CLIENT from which a packet is to be received.
+ * @param pkt  Storage for the header of the packet.
+ * @param data  Variable in which to store the payload, if any, which the
+ * caller must free.
+ * @return 0 if a packet was received, -1 otherwise.
+ */
+int client_recv_packet(CLIENT *client, CHLA_PACKET_HEADER *pkt, void **data);
+
+/*
+ * Switch a client to a shared-memory transport, in response to its SHM
+ * request: the ACK of the request, which carries the shared memory, is
+ * sent on the connection, and all later packets in both directions go
+ * through the shared memory.  The transport lasts as long as the CLIENT.
+ *
+ * @param client  The CLIENT that sent the request.
+ * @param msgid  Message ID of the request.
+ * @return 0 if the client has been switched and sent the ACK, or -1 if
+ * the transport could not be set up, in which case the request should
+ * be NACKed.
+ */
+int client_attach_shm(CLIENT *client, uint32_t msgid);
+
+/*
+ * Check whether a client has attached a shared-memory transport.
+ *
+ * @return 1 if it has, otherwise 0.
+ */
+int client_has_shm(CLIENT *client);
+
+/*
+ * Mark a client as an inter-node link, in response to a LINK request that
+ * carried the cluster secret (see cluster.h).  Only a link may then send
+ * the node-to-node requests, and it may not log in.
+ *
+ * @param client  The CLIENT that sent the request.
+ * @return 0 if the client is now a link, or -1 if it is logged in.
+ */
+int client_set_node_link(CLIENT *client);
+
+/*
+ * Check whether a client is an inter-node link.
+ *
+ * @return 1 if it is, otherwise 0.
+ */
+int client_is_node_link(CLIENT *client);
+
+/*
+ * Stop sending packets to a client, so that its connection can be handed
+ * off to another process (see handoff.h) without a packet being written
+ * to it halfway: this waits for a packet being sent to the client to have
+ * been sent, and thereafter client_send_packet() fails at once until
+ * client_unsuspend() is called.
+ *
+ * @param client  The CLIENT to be suspended.
+ * @param deadline  When to stop waiting, as an absolute CLOCK_REALTIME time.
+ * @return 0 if the client has been suspended, or -1 if a packet was still
+ * being sent at the deadline.
+ */
+int client_suspend(CLIENT *client, const struct timespec *deadline);
+
+/*
+ * Let packets be sent again to a client suspended by client_suspend().
+ */
+void client_unsuspend(CLIENT *client);
+
 /*
  * Send an ACK packet to a client.  This is a convenience function that
  * streamlines a common case.
@@ -16,9 +16,12 @@
  */
 
 /*
- * The maximum number of simultaneous clients supported by the registry.
+ * The number of clients the registry has room for at first.  It grows as
+ * clients connect, so the number of simultaneous clients is bounded only
+ * by memory and by the limit on the descriptors of the process (see
+ * acceptor.h).
  */
-#define MAX_CLIENTS 64
+#define CREG_INITIAL_CAPACITY 64
 
 /*
  * The CLIENT_REGISTRY type is a structure that defines the state of a
@@ -92,6 +95,19 @@ int creg_unregister(CLIENT_REGISTRY *cr, CLIENT *client);
  */
 CLIENT **creg_all_clients(CLIENT_REGISTRY *cr);
 
+/*
+ * Find the currently connected CLIENT that is logged in under a
+ * specified handle.  The returned CLIENT has had its reference count
+ * incremented by one, to account for the pointer being returned.
+ * It is the caller's responsibility to decrement the reference count
+ * when the pointer is no longer needed.
+ *
+ * @param cr  The client registry.
+ * @param handle  The handle to search for.
+ * @return the CLIENT logged in under the handle, or NULL if there is none.
+ */
+CLIENT *creg_lookup(CLIENT_REGISTRY *cr, char *handle);
+
 /*
  * Shut down (using shutdown(2)) all the sockets for connections
  * to currently registered clients.  The calling thread will block
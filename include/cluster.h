@@ -0,0 +1,127 @@
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Cluster mode.
+ *
+ * Several server processes, on one host or several, can be run as a
+ * cluster in which each node owns a hash-partitioned shard of the handles.
+ * A client must log in at the node that owns its handle; a LOGIN at any
+ * other node is refused.  A SEND to a handle owned by another node is
+ * forwarded to that node over a persistent inter-node link, and a USERS
+ * request returns the merged list of users logged in at all the nodes,
+ * as a USERS_QUERY does the merged page of them.  A SUBSCRIBE covers only
+ * the users of the node at which it is made (see presence.h).
+ *
+ * Inter-node links are ordinary connections to the client port of the
+ * peer, carrying the node-to-node packet types defined in protocol.h.
+ * Each link starts with a LINK request carrying the cluster secret, which
+ * every node reads from the same file at startup; a node NACKs the
+ * node-to-node requests on any connection that has not shown it, so that
+ * a client cannot pass itself off as a node and send messages in the name
+ * of any user.  The secret, like the messages, travels in the clear, so
+ * links should run over a private network.
+ *
+ * Each link is opened on first use and reopened if it fails.  Requests
+ * on a link are synchronous: the sending node waits for the ACK or NACK
+ * with the msgid of the request from the owner, skipping keepalive probes,
+ * before acknowledging its own client.  A request is sent at most once: a
+ * link that the peer has closed while it was idle is reopened before the
+ * request is written, but if the link fails once the request has been
+ * written, the request fails rather than risking a second delivery.
+ *
+ * Messages forwarded to another node carry no reference to the sender's
+ * mailbox, so no delivery or bounce notice is returned for them.
+ *
+ * If the cluster has not been initialized, the server runs as a single
+ * node that owns every handle.
+ */
+
+/*
+ * The maximum number of nodes in a cluster.
+ */
+#define MAX_NODES 16
+
+/*
+ * The maximum length of the cluster secret.
+ */
+#define MAX_SECRET 1024
+
+/*
+ * Initialize cluster mode.
+ *
+ * @param nodes  Comma-separated list of "host:port" of all the nodes,
+ * in the same order at every node.
+ * @param self  The index of this node in the list.
+ * @param secret_path  Path of the file holding the cluster secret, which
+ * must be the same at every node.  A final newline is not part of it.
+ * @return 0 if successful, otherwise -1.
+ */
+int cluster_init(char *nodes, int self, char *secret_path);
+
+/*
+ * Check the payload of a LINK request against the cluster secret.
+ *
+ * @return 0 if it is the secret, otherwise -1, as it is whenever this
+ * server is not in cluster mode.
+ */
+int cluster_check_secret(void *payload, size_t length);
+
+/*
+ * Close all inter-node links and free the cluster state.
+ */
+void cluster_fini(void);
+
+/*
+ * Get the index of the node that owns a handle.
+ */
+int cluster_owner(char *handle);
+
+/*
+ * Determine whether a handle is owned by this node.
+ */
+int cluster_is_local(char *handle);
+
+/*
+ * Forward a message to the node that owns the receiver's handle.
+ *
+ * @param sender  The handle of the sender.
+ * @param receiver  The handle of the receiver.
+ * @param msgid  The message ID.
+ * @param flags  The flags of the SEND request, which are passed on.
+ * @param body  The body of the message.
+ * @param length  The number of bytes in the body.
+ * @return 0 if the owner accepted the message, otherwise -1.
+ */
+int cluster_forward_send(char *sender, char *receiver, uint32_t msgid,
+                         uint8_t flags, void *body, size_t length);
+
+/*
+ * Collect the users logged in at all the other nodes.  The result is a
+ * malloc'ed buffer with one handle per line, in the format of the USERS
+ * reply, which the caller must free.  Nodes that cannot be reached are
+ * skipped.
+ *
+ * @param lengthp  Variable into which to store the length of the result.
+ * @return the list of handles, or NULL if there are none.
+ */
+char *cluster_users(size_t *lengthp);
+
+/*
+ * Collect a page of the users logged in at each of the other nodes that
+ * match a USERS_QUERY (see handle_index.h).  The result is a malloc'ed
+ * buffer with the pages of all the nodes one after the other, each in
+ * sorted order, which the caller must free.  Nodes that cannot be
+ * reached are skipped.
+ *
+ * @param query  The payload of the USERS_QUERY request.
+ * @param length  The number of bytes in the payload.
+ * @param lengthp  Variable into which to store the length of the result.
+ * @return the pages of handles, or NULL if there are none.
+ */
+char *cluster_users_query(void *query, size_t length, size_t *lengthp);
+
+#endif
@@ -0,0 +1,108 @@
+#ifndef CORO_H
+#define CORO_H
+
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+
+/*
+ * Coroutine-based client sessions.
+ *
+ * A small pool of scheduler threads runs many stackful coroutines, so that
+ * each client session can still be written as straight-line code (read a
+ * packet, dispatch it, reply) without tying up a kernel thread while it
+ * waits.  A coroutine that would block waiting for a file descriptor calls
+ * coro_poll(), which parks it and lets its scheduler thread run other
+ * coroutines until one of the descriptors is ready.  Descriptors used by
+ * coroutines must be in non-blocking mode.
+ *
+ * Each coroutine runs on a small stack of CORO_STACK_SIZE bytes, allocated
+ * with mmap() below a guard page and reused from a pool when coroutines
+ * terminate.  A coroutine stays on the scheduler thread it was assigned to
+ * when it was spawned.  Scheduler threads are pinned to the CPUs of the io
+ * role, if it has any, and each keeps its pool of stacks on its own NUMA
+ * node (see placement.h).  Coroutines are scheduled cooperatively: a coroutine
+ * that blocks in a system call or on a mutex blocks its scheduler thread.
+ * So a coroutine must not hold a pthread mutex across coro_poll(), where
+ * another coroutine of the same thread could block on it; a CORO_LOCK,
+ * which parks the coroutines that wait for it, may be held instead.
+ */
+
+#define CORO_STACK_SIZE (64 * 1024)
+
+/*
+ * Start the scheduler threads.
+ *
+ * @param nthreads  The number of scheduler threads.
+ * @return 0 if successful, otherwise -1.
+ */
+int coro_init(int nthreads);
+
+/*
+ * Start a new coroutine, which will run fn(arg) on one of the scheduler
+ * threads.  Coroutines are assigned to scheduler threads in rotation.
+ * This may be called from any thread.
+ *
+ * @return 0 if successful, otherwise -1.
+ */
+int coro_spawn(void (*fn)(void *), void *arg);
+
+/*
+ * Start a new coroutine, as coro_spawn() does, on the scheduler thread
+ * pinned to a CPU, or else on one on the same NUMA node.
+ *
+ * @param cpu  The CPU, or -1 to assign the coroutine in rotation.
+ * @return 0 if successful, otherwise -1.
+ */
+int coro_spawn_near(void (*fn)(void *), void *arg, int cpu);
+
+/*
+ * Wait until at least one of a set of file descriptors is ready, as poll(2)
+ * does with an infinite timeout.  When called from a coroutine, only the
+ * coroutine is suspended; when called from any other thread, this simply
+ * calls poll(2).  Entries with a negative fd are ignored.  Any number of
+ * coroutines may wait on the same descriptor at once.
+ *
+ * @return the number of ready descriptors, or -1 on error.
+ */
+int coro_poll(struct pollfd *pfds, nfds_t nfds);
+
+/*
+ * A lock for which a waiting coroutine parks, rather than blocking its
+ * scheduler thread, so that it may be held across coro_poll().  Other
+ * threads may take it too, and block while they wait.  The lock is handed
+ * to the waiting coroutines in turn before any waiting thread.
+ */
+typedef struct coro_lock {
+    pthread_mutex_t mutex; // Protects the fields below, held only briefly
+    pthread_cond_t cond; // Signaled for a waiting thread when the lock is free
+    int locked;
+    int thread_waiters; // Number of threads waiting for the lock
+    struct coro *head; // Coroutines waiting for the lock, in order
+    struct coro *tail;
+} CORO_LOCK;
+
+void coro_lock_init(CORO_LOCK *lock);
+void coro_lock_destroy(CORO_LOCK *lock);
+
+/*
+ * Take a lock, waiting for it as long as it takes.
+ */
+void coro_lock(CORO_LOCK *lock);
+
+/*
+ * Take a lock, as coro_lock() does, but give up if a thread other than a
+ * coroutine has not got it by a deadline.  A coroutine waits as long as it
+ * takes.
+ *
+ * @param deadline  When to give up, as an absolute CLOCK_REALTIME time.
+ * @return 0 if the lock was taken, or -1 at the deadline.
+ */
+int coro_lock_timed(CORO_LOCK *lock, const struct timespec *deadline);
+
+/*
+ * Release a lock, handing it to the next waiter, if any.
+ */
+void coro_unlock(CORO_LOCK *lock);
+
+#endif
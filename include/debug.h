@@ -2,8 +2,7 @@
 #define DEBUG_H
 
 #include <stdio.h>
-
-#define NL "\n"
+#include "log.h"
 
 #ifdef COLOR
 #define KNRM "\033[0m"
@@ -35,52 +34,37 @@
 #define SUCCESS
 #endif
 
+/*
+ * Each macro that is compiled in records its call for the logging thread
+ * to format, rather than writing to stderr itself (see log.h).
+ */
+
 #ifdef DEBUG
-#define debug(S, ...)                                                          \
-  do {                                                                         \
-    fprintf(stderr, KMAG "DEBUG: %s:%s:%d " KNRM S NL, __FILE__,               \
-            __extension__ __FUNCTION__, __LINE__, ##__VA_ARGS__);                \
-  } while (0)
+#define debug(S, ...) LOG_CALL(LOG_DEBUG, S, ##__VA_ARGS__)
 #else
 #define debug(S, ...)
 #endif
 
 #ifdef INFO
-#define info(S, ...)                                                           \
-  do {                                                                         \
-    fprintf(stderr, KBLU "INFO: %s:%s:%d " KNRM S NL, __FILE__,                \
-            __extension__ __FUNCTION__, __LINE__, ##__VA_ARGS__);                \
-  } while (0)
+#define info(S, ...) LOG_CALL(LOG_INFO, S, ##__VA_ARGS__)
 #else
 #define info(S, ...)
 #endif
 
 #ifdef WARN
-#define warn(S, ...)                                                           \
-  do {                                                                         \
-    fprintf(stderr, KYEL "WARN: %s:%s:%d " KNRM S NL, __FILE__,                \
-            __extension__ __FUNCTION__, __LINE__, ##__VA_ARGS__);                \
-  } while (0)
+#define warn(S, ...) LOG_CALL(LOG_WARN, S, ##__VA_ARGS__)
 #else
 #define warn(S, ...)
 #endif
 
 #ifdef SUCCESS
-#define success(S, ...)                                                        \
-  do {                                                                         \
-    fprintf(stderr, KGRN "SUCCESS: %s:%s:%d " KNRM S NL, __FILE__,             \
-            __extension__ __FUNCTION__, __LINE__, ##__VA_ARGS__);                \
-  } while (0)
+#define success(S, ...) LOG_CALL(LOG_SUCCESS, S, ##__VA_ARGS__)
 #else
 #define success(S, ...)
 #endif
 
 #ifdef ERROR
-#define error(S, ...)                                                          \
-  do {                                                                         \
-    fprintf(stderr, KRED "ERROR: %s:%s:%d " KNRM S NL, __FILE__,               \
-            __extension__ __FUNCTION__, __LINE__, ##__VA_ARGS__);                \
-  } while (0)
+#define error(S, ...) LOG_CALL(LOG_ERROR, S, ##__VA_ARGS__)
 #else
 #define error(S, ...)
 #endif
@@ -0,0 +1,56 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <stdint.h>
+
+/*
+ * Deduplication of retried SEND requests.
+ *
+ * A client whose connection drops after it has sent a SEND, but before it
+ * has seen the ACK, cannot tell whether the message was delivered, so it
+ * sends it again with the same msgid.  To make that safe, the msgids of
+ * the messages recently accepted from each sender are remembered, and a
+ * SEND whose msgid has been seen from the same sender within the window
+ * is ACKed without being delivered again.
+ *
+ * The set of msgids is kept per handle rather than per connection, since
+ * a retry normally arrives on a new connection.  Each set is bounded both
+ * in time, by the window, and in size, by DEDUP_CAPACITY msgids, beyond
+ * which the oldest are forgotten.  A set is dropped once all of its msgids
+ * have aged out of the window.  A msgid of zero is never deduplicated.
+ */
+
+#define DEDUP_CAPACITY 128
+
+/*
+ * Set the length of the deduplication window.  Must be called before any
+ * client connects.
+ *
+ * @param ms  The window in milliseconds, or 0 to disable deduplication
+ * (the default).
+ */
+void dedup_set_window(int ms);
+
+/*
+ * Check whether a msgid has been recorded for a sender within the window.
+ *
+ * @param handle  The interned handle of the sender (see intern.h).
+ * @param msgid  The msgid of the SEND request.
+ * @return 1 if the request is a duplicate, otherwise 0.
+ */
+int dedup_check(char *handle, uint32_t msgid);
+
+/*
+ * Record the msgid of a SEND request that has been accepted.
+ *
+ * @param handle  The interned handle of the sender (see intern.h).
+ * @param msgid  The msgid of the SEND request.
+ */
+void dedup_record(char *handle, uint32_t msgid);
+
+/*
+ * Forget every recorded msgid.
+ */
+void dedup_fini(void);
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef HANDLE_INDEX_H
+#define HANDLE_INDEX_H
+
+#include <stddef.h>
+
+/*
+ * Index of the handles of logged-in users.
+ *
+ * The index is a trie, maintained as users log in and out, which allows
+ * the handles that start with a given prefix to be listed in sorted order
+ * at a cost proportional to the length of the prefix plus the number of
+ * handles listed, rather than to the number of users that are logged in.
+ * It serves the USERS_QUERY request, whose payload has the format
+ *
+ *   (prefix)\r\n(limit)\r\n(cursor)
+ *
+ * where the prefix may be empty, the limit is a decimal number of handles
+ * to return (zero meaning no limit), and the cursor, which may be empty,
+ * is the last handle returned by a previous query.  The reply lists, one
+ * per line, the handles after the cursor that start with the prefix.
+ * If fewer handles than the limit are returned, there are no more.
+ * In cluster mode, each node indexes only the users logged in at it, and
+ * the node that serves the query merges the pages of all the nodes.
+ *
+ * The index is safe to use concurrently: queries share a read lock and
+ * updates take a write lock.
+ */
+
+/*
+ * Add a handle to the index.  A handle that is added more than once is
+ * listed once, and stays in the index until it has been removed as many
+ * times as it was added.
+ *
+ * @param handle  The handle to add.
+ * @return 0 if successful, otherwise -1.
+ */
+int hidx_insert(char *handle);
+
+/*
+ * Remove a handle from the index.  Nothing is done if it is not present.
+ *
+ * @param handle  The handle to remove.
+ */
+void hidx_remove(char *handle);
+
+/*
+ * List handles in sorted order.
+ *
+ * @param prefix  Only handles that start with this prefix are listed.
+ * @param cursor  Only handles that sort after this one are listed,
+ * or NULL to start from the beginning.
+ * @param limit  The maximum number of handles to list, or 0 for no limit.
+ * @param lengthp  Variable into which to store the length of the result.
+ * @return a malloc'ed buffer with one handle per line, which the caller
+ * must free, or NULL if allocation fails.
+ */
+char *hidx_query(char *prefix, char *cursor, size_t limit, size_t *lengthp);
+
+/*
+ * Free all the storage used by the index.
+ */
+void hidx_fini(void);
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include "client_registry.h"
+
+/*
+ * Hot upgrade of a running server.
+ *
+ * A running server can hand its listening socket and all of its live
+ * client connections over to a newly started server process, so that
+ * the new process resumes service without clients noticing and without
+ * every client reconnecting at once.  The two processes rendezvous on
+ * a Unix-domain socket: the new process is started in "resume" mode and
+ * waits on the socket, and the old process (upon receipt of SIGUSR2)
+ * first stops serving its clients (see chla_quiesce()), then connects to
+ * it and sends the file descriptors using SCM_RIGHTS, followed by a
+ * snapshot of the handles under which the clients are logged in, of
+ * their subscriptions to presence changes (see presence.h) and the
+ * changes not yet sent to them, of whether they take batched receipts
+ * (see protocol.h), and of the entries still queued in their mailboxes.
+ * The old process then exits without shutting down the connections.  Since no packet is being
+ * read or written by the old process by then, every request is served by
+ * one process or the other, and every entry is delivered by one of them.
+ * If the clients do not all stop in time, or the handoff fails, the old
+ * process resumes service.
+ *
+ * Messages that are being sent in parts (see protocol.h) are not fully
+ * covered by the snapshot: the parts already queued are handed off and
+ * delivered, but the new process NACKs any further parts, and the receiver
+ * is not told that the rest will not arrive.  A message that carries a
+ * lifetime of its own (see mailbox.h) starts it again in the new process,
+ * as it does when restored from a snapshot.  Clients that use a
+ * shared-memory transport (see shm.h) are not handed off at all: they are
+ * disconnected when the old process stops serving its clients, and their
+ * undelivered entries are lost.  Neither are links from other nodes of a
+ * cluster (see cluster.h), which are closed when the old process exits;
+ * the other node opens a new link to the new process when it next needs one.
+ */
+
+/*
+ * Version of the snapshot format.  A process refuses a handoff that
+ * has a different version.
+ */
+#define HANDOFF_VERSION 8
+
+/*
+ * Hand off the listening socket and all the clients in a registry to
+ * the process waiting at a specified Unix-domain socket path.
+ *
+ * @param path  The path of the rendezvous socket.
+ * @param listenfd  The listening socket of this server.
+ * @param cr  The client registry whose clients are to be handed off.
+ * @return 0 if the handoff was completed, otherwise -1.
+ */
+int handoff_send(char *path, int listenfd, CLIENT_REGISTRY *cr);
+
+/*
+ * Wait at a specified Unix-domain socket path for a handoff from another
+ * server process, resume service of the client connections that are
+ * received, and restore the undelivered mailbox entries.
+ *
+ * @param path  The path of the rendezvous socket.
+ * @return the inherited listening socket, or -1 if the handoff failed.
+ */
+int handoff_recv(char *path);
+
+#endif
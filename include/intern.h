@@ -0,0 +1,67 @@
+#ifndef INTERN_H
+#define INTERN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Interned handle strings.
+ *
+ * Every distinct handle in use is stored once, in an immutable allocation
+ * that also records its hash and length.  The USER, MAILBOX and registry
+ * entries for a handle all share that one copy, and two interned handles
+ * are equal exactly when they are the same pointer, so lookups need not
+ * compare strings.  Each interned handle has a reference count that
+ * corresponds to the number of pointers that exist to it; it is freed
+ * when the count reaches zero.
+ */
+
+/*
+ * Intern a handle.  If the handle is already interned, the reference count
+ * of the existing copy is incremented, otherwise a new copy is made with a
+ * reference count of one.
+ *
+ * @param handle  The handle to intern, which need not itself be interned.
+ * @return the interned handle, or NULL if allocation fails.
+ */
+char *intern_handle(char *handle);
+
+/*
+ * Find the interned copy of a handle without creating one.  The reference
+ * count is incremented, as by intern_ref(), so that the copy cannot be
+ * freed, and its address reused for another handle, while the caller
+ * compares it with others.
+ *
+ * @param handle  The handle to look up.
+ * @return the interned handle, to be released with intern_unref(), or NULL
+ * if it is not interned.
+ */
+char *intern_lookup(char *handle);
+
+/*
+ * Increase the reference count on an interned handle.
+ *
+ * @param handle  An interned handle.
+ * @return the same handle.
+ */
+char *intern_ref(char *handle);
+
+/*
+ * Decrease the reference count on an interned handle, freeing it when
+ * the count reaches zero.
+ *
+ * @param handle  An interned handle, or NULL.
+ */
+void intern_unref(char *handle);
+
+/*
+ * Get the precomputed hash of an interned handle.
+ */
+uint32_t intern_hash(char *handle);
+
+/*
+ * Get the precomputed length of an interned handle.
+ */
+size_t intern_length(char *handle);
+
+#endif
@@ -0,0 +1,255 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Asynchronous logging.
+ *
+ * The debug(), info(), warn(), success() and error() macros of debug.h
+ * do not format anything on the calling thread.  Each call site has a
+ * static LOG_SITE holding its level, location and format string, and a
+ * call that passes the level threshold just fills in a fixed-size
+ * LOG_RECORD (the site, a timestamp, the thread and the arguments) in a
+ * ring of the calling thread.  The rings are single-producer,
+ * single-consumer queues, so that the calling thread takes no lock: a
+ * background thread drains them every few milliseconds (sooner when one
+ * fills up), and either formats the records to stderr, merged in time
+ * order, or writes them unformatted to a binary log file, which can be
+ * decoded later with tools/logdecode.c.  If a ring is full, the record is
+ * dropped and counted, and the count is reported when the ring drains.
+ *
+ * An argument is recorded by its type: integers and pointers by value,
+ * and strings (char *) by copying them into the record, where they share
+ * LOG_STRINGS bytes and are truncated to fit.  At most LOG_MAX_ARGS
+ * arguments are recorded.  Only the conversions d, i, u, o, x, X, c, s, p,
+ * e, f, g and a are supported in format strings.
+ *
+ * The binary log file starts with LOG_FILE_MAGIC and is followed by
+ * entries, each a LOG_ENTRY_HEADER and then as many bytes as it says.  A
+ * LOG_ENTRY_SITE entry describes a site the first time it is used: its id
+ * (uint32_t) and line (uint32_t), and then its file, function and format
+ * as NUL-terminated strings.  A LOG_ENTRY_EVENT entry is a LOG_EVENT
+ * followed by the strings of the record.  A LOG_ENTRY_DROPPED entry is a
+ * LOG_DROPPED.  All fields are in host byte order.
+ */
+
+typedef enum log_level {
+    LOG_DEBUG, LOG_INFO, LOG_SUCCESS, LOG_WARN, LOG_ERROR, LOG_OFF
+} LOG_LEVEL;
+
+typedef enum log_arg_type {
+    LOG_ARG_INT, LOG_ARG_UINT, LOG_ARG_DOUBLE, LOG_ARG_STR, LOG_ARG_PTR
+} LOG_ARG_TYPE;
+
+#define LOG_MAX_ARGS 8
+#define LOG_STRINGS 160
+#define LOG_FILE_MAGIC "CHLALOG1"
+
+/*
+ * A call site, of which there is one static instance per use of a
+ * logging macro.
+ */
+typedef struct log_site {
+    int level;
+    const char *file;
+    const char *func;
+    int line;
+    const char *format;
+    uint32_t id; // Assigned by the logging thread when first written to a file
+} LOG_SITE;
+
+/*
+ * One call, as recorded in a ring.
+ */
+typedef struct log_record {
+    LOG_SITE *site;
+    uint64_t time; // Nanoseconds since the epoch
+    uint32_t tid; // Kernel id of the calling thread
+    uint8_t nargs;
+    uint8_t types[LOG_MAX_ARGS]; // LOG_ARG_TYPE of each argument
+    uint16_t used; // Bytes of strings used
+    uint64_t args[LOG_MAX_ARGS]; // Values, or offsets into strings for strings
+    char strings[LOG_STRINGS];
+} LOG_RECORD;
+
+typedef enum log_entry_kind {
+    LOG_ENTRY_SITE, LOG_ENTRY_EVENT, LOG_ENTRY_DROPPED
+} LOG_ENTRY_KIND;
+
+typedef struct log_entry_header {
+    uint8_t kind; // LOG_ENTRY_KIND
+    uint8_t level; // Level of the site, for LOG_ENTRY_SITE
+    uint16_t reserved;
+    uint32_t length; // Bytes that follow
+} LOG_ENTRY_HEADER;
+
+typedef struct log_event {
+    uint32_t site; // Id of the site
+    uint32_t tid;
+    uint64_t time;
+    uint8_t nargs;
+    uint8_t types[LOG_MAX_ARGS];
+    uint8_t reserved[7];
+    uint64_t args[LOG_MAX_ARGS];
+} LOG_EVENT;
+
+typedef struct log_dropped {
+    uint32_t tid;
+    uint32_t reserved;
+    uint64_t count; // Records dropped since the last report
+} LOG_DROPPED;
+
+/*
+ * The threshold: calls at lower levels are not recorded.
+ */
+extern int log_threshold;
+
+/*
+ * Start the logging thread.  Records made before this are kept (as far as
+ * the rings hold them) and written once it starts.  The logging thread is
+ * stopped, after writing out every record, when the process exits.
+ *
+ * @param path  The binary log file to write, or NULL to format the
+ * records to stderr.
+ * @return 0 on success, or -1 if the file could not be opened or the
+ * thread could not be started.
+ */
+int log_init(char *path);
+
+/*
+ * Set the threshold.  This may be called at any time, from any thread,
+ * and from a signal handler.
+ *
+ * @param level  The lowest level to be recorded, or LOG_OFF.
+ */
+void log_set_level(int level);
+
+/*
+ * Parse the name of a level ("debug", "info", "success", "warn", "error"
+ * or "off").
+ *
+ * @return the level, or -1 if the name is not known.
+ */
+int log_parse_level(const char *name);
+
+/*
+ * Write out every record made so far and stop the logging thread.
+ */
+void log_fini(void);
+
+/*
+ * Start a record in the ring of the calling thread.
+ *
+ * @return the record to be filled in, or NULL if it is to be dropped.
+ */
+LOG_RECORD *log_begin(LOG_SITE *site);
+
+/*
+ * Publish a record started by log_begin().
+ */
+void log_commit(LOG_RECORD *rec);
+
+/*
+ * Format a record as a line of text.
+ *
+ * @param out  The stream to write to.
+ * @param rec  The record, with its site.
+ */
+void log_print(FILE *out, LOG_RECORD *rec);
+
+static inline void log_arg_int(LOG_RECORD *rec, long long value) {
+    if (rec->nargs < LOG_MAX_ARGS) {
+        rec->types[rec->nargs] = LOG_ARG_INT;
+        rec->args[rec->nargs++] = value;
+    }
+}
+
+static inline void log_arg_uint(LOG_RECORD *rec, unsigned long long value) {
+    if (rec->nargs < LOG_MAX_ARGS) {
+        rec->types[rec->nargs] = LOG_ARG_UINT;
+        rec->args[rec->nargs++] = value;
+    }
+}
+
+static inline void log_arg_double(LOG_RECORD *rec, double value) {
+    if (rec->nargs < LOG_MAX_ARGS) {
+        rec->types[rec->nargs] = LOG_ARG_DOUBLE;
+        memcpy(&rec->args[rec->nargs++], &value, sizeof(double));
+    }
+}
+
+static inline void log_arg_ptr(LOG_RECORD *rec, const void *value) {
+    if (rec->nargs < LOG_MAX_ARGS) {
+        rec->types[rec->nargs] = LOG_ARG_PTR;
+        rec->args[rec->nargs++] = (uintptr_t)value;
+    }
+}
+
+// Copy a string into the record, truncating it to the room left.  When
+// there is no room, the last byte of the strings, which then always ends
+// another string, serves as an empty one.
+static inline void log_arg_str(LOG_RECORD *rec, const char *value) {
+    if (rec->nargs < LOG_MAX_ARGS) {
+        const char *s = value != NULL ? value : "(null)";
+        size_t room = LOG_STRINGS - rec->used;
+        rec->types[rec->nargs] = LOG_ARG_STR;
+        if (room == 0) {
+            rec->args[rec->nargs++] = LOG_STRINGS - 1;
+            return;
+        }
+        size_t n = strnlen(s, room - 1);
+        memcpy(rec->strings + rec->used, s, n);
+        rec->strings[rec->used + n] = '\0';
+        rec->args[rec->nargs++] = rec->used;
+        rec->used += n + 1;
+    }
+}
+
+// Record one argument according to its type
+#define LOG_ARG(R, X)                                                          \
+  _Generic((X),                                                                \
+           char *: log_arg_str, const char *: log_arg_str,                     \
+           _Bool: log_arg_uint, char: log_arg_int,                             \
+           signed char: log_arg_int, unsigned char: log_arg_uint,              \
+           short: log_arg_int, unsigned short: log_arg_uint,                   \
+           int: log_arg_int, unsigned int: log_arg_uint,                       \
+           long: log_arg_int, unsigned long: log_arg_uint,                     \
+           long long: log_arg_int, unsigned long long: log_arg_uint,           \
+           float: log_arg_double, double: log_arg_double,                      \
+           default: log_arg_ptr)(R, X)
+
+#define LOG_NARGS(...) LOG_NARGS_(0, ##__VA_ARGS__, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+#define LOG_NARGS_(_0, _1, _2, _3, _4, _5, _6, _7, _8, N, ...) N
+#define LOG_CAT(A, B) LOG_CAT_(A, B)
+#define LOG_CAT_(A, B) A##B
+#define LOG_ARGS(R, ...) LOG_CAT(LOG_ARGS_, LOG_NARGS(__VA_ARGS__))(R, ##__VA_ARGS__)
+#define LOG_ARGS_0(R)
+#define LOG_ARGS_1(R, X) LOG_ARG(R, X)
+#define LOG_ARGS_2(R, X, ...) LOG_ARG(R, X); LOG_ARGS_1(R, __VA_ARGS__)
+#define LOG_ARGS_3(R, X, ...) LOG_ARG(R, X); LOG_ARGS_2(R, __VA_ARGS__)
+#define LOG_ARGS_4(R, X, ...) LOG_ARG(R, X); LOG_ARGS_3(R, __VA_ARGS__)
+#define LOG_ARGS_5(R, X, ...) LOG_ARG(R, X); LOG_ARGS_4(R, __VA_ARGS__)
+#define LOG_ARGS_6(R, X, ...) LOG_ARG(R, X); LOG_ARGS_5(R, __VA_ARGS__)
+#define LOG_ARGS_7(R, X, ...) LOG_ARG(R, X); LOG_ARGS_6(R, __VA_ARGS__)
+#define LOG_ARGS_8(R, X, ...) LOG_ARG(R, X); LOG_ARGS_7(R, __VA_ARGS__)
+
+/*
+ * Record a call at a level, if it passes the threshold.
+ */
+#define LOG_CALL(LEVEL, S, ...)                                                \
+  do {                                                                         \
+    static LOG_SITE log_site_ = {LEVEL, __FILE__, __extension__ __FUNCTION__,  \
+                                 __LINE__, S, 0};                              \
+    if ((LEVEL) >= __atomic_load_n(&log_threshold, __ATOMIC_RELAXED)) {        \
+      LOG_RECORD *log_rec_ = log_begin(&log_site_);                            \
+      if (log_rec_ != NULL) {                                                  \
+        LOG_ARGS(log_rec_, ##__VA_ARGS__);                                     \
+        log_commit(log_rec_);                                                  \
+      }                                                                        \
+    }                                                                          \
+  } while (0)
+
+#endif
@@ -3,25 +3,63 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 
 /*
  * A mailbox is a queue that contains two types of entries:
  * "messages" and "notices".
+ *
+ * Entries are kept in separate lanes by priority class: notices, which
+ * are small and which a sender may be waiting for, in the control lane;
+ * messages sent as urgent in the urgent lane; and all other messages in
+ * the normal lane.  Entries are removed from the lanes by weighted round
+ * robin, up to 8 control entries, then up to 4 urgent entries, then one
+ * normal entry, and so on, skipping lanes that are empty.  Entries of the
+ * same class are removed in the order in which they were added, and no
+ * class is starved however busy the others are.
+ *
+ * The client of a mailbox may limit how many messages, and how many bytes
+ * of them, it is ready to take (see mb_grant_credit()).  Messages then
+ * stay in their lanes while the client is out of credit, but notices are
+ * still removed, and the messages that may wait are bounded.
  */
 typedef struct mailbox MAILBOX;
 
+/*
+ * The priority classes of mailbox entries, from highest to lowest.
+ */
+typedef enum {
+    CONTROL_PRIORITY, URGENT_PRIORITY, NORMAL_PRIORITY
+} MAILBOX_PRIORITY;
+
+#define MB_PRIORITIES 3
+
 /*
  * A message is a user-generated transmission from one client to another.
  * it contains a message ID that uniquely identifies the message,
  * the mailbox of the sender of the message, a body that may consist of
  * arbitary data, and a length field that specifies the number of bytes
- * of data in the body.
+ * of data in the body.  A message may also be marked as urgent, in
+ * which case it is queued in the urgent lane, and may carry a lifetime
+ * of its own (see mb_add_timed_message()).
+ *
+ * A large message may be sent in parts (see protocol.h), each of which
+ * is queued as a message of its own with the same message ID, marked
+ * with its place in the whole.  An aborted part has no body of its own
+ * and tells the recipient that the remaining parts will never arrive.
  */
+typedef enum {
+    WHOLE_MESSAGE, FIRST_PART, NEXT_PART, LAST_PART, ABORTED_PART
+} MESSAGE_PART;
+
 typedef struct message {
     int msgid;
     MAILBOX *from;
     void *body;
     int length;
+    int urgent;
+    MESSAGE_PART part;
+    int ttl; // Lifetime in milliseconds, or 0 for that of the server
 } MESSAGE;
 
 /*
@@ -54,12 +92,21 @@ typedef struct message {
 typedef enum {
     NO_NOTICE_TYPE,
     BOUNCE_NOTICE_TYPE,
-    RRCPT_NOTICE_TYPE
+    RRCPT_NOTICE_TYPE,
+    ACK_NOTICE_TYPE,
+    NACK_NOTICE_TYPE
 } NOTICE_TYPE;
 
+/*
+ * Return receipts may be batched (see mb_set_batch_receipts()), in which
+ * case a single delivery notice carries the message IDs of all the
+ * messages it pertains to, of which msgid is the first.
+ */
 typedef struct notice {
     NOTICE_TYPE type;
     int msgid;
+    int count; // Number of message IDs in a batch of receipts, or 0
+    int *msgids; // The message IDs in a batch of receipts, or NULL
 } NOTICE;
 
 /*
@@ -110,8 +157,10 @@ typedef struct mailbox_entry {
 typedef void (MAILBOX_DISCARD_HOOK)(MAILBOX_ENTRY *);
 
 /*
- * Create a new mailbox for a given handle.  A private copy of the
- * handle is made.  The mailbox is returned with a reference count of 1.
+ * Create a new mailbox for a given handle.  The handle is interned
+ * (see intern.h), so the mailbox shares the one copy of it that exists
+ * for each distinct handle.  The mailbox is returned with a reference
+ * count of 1.
  */
 MAILBOX *mb_init(char *handle);
 
@@ -170,23 +219,97 @@ char *mb_get_handle(MAILBOX *mb);
  * sender's mailbox, to ensure that this mailbox persists so that it can receive
  * a notification in case the message bounces.
  *
- * An attempt to add a message to a defunct mailbox is ignored.
+ * If the client of the mailbox has limited its credit, the number of
+ * bytes of whole messages that may wait in the mailbox is bounded by
+ * MB_CREDIT_BACKLOG, so that a client that takes its messages slowly
+ * cannot make the server hold an unbounded number of them.  A message is
+ * refused if it would exceed the bound, unless no other messages are
+ * waiting.
+ *
+ * @return 0 if the message was added, 1 if it was refused because too
+ * many messages are waiting, or -1 if the mailbox is defunct.  In either
+ * of the latter cases the body is freed and the reference count of the
+ * sender's mailbox is left as it was.
+ */
+int mb_add_message(MAILBOX *mb, int msgid, MAILBOX *from, void *body, int length);
+
+#define MB_CREDIT_BACKLOG (256 * 1024)
+
+/*
+ * Add an urgent message to the end of the urgent lane of the mailbox.
+ * This is otherwise the same as mb_add_message().
+ */
+int mb_add_urgent_message(MAILBOX *mb, int msgid, MAILBOX *from, void *body, int length);
+
+/*
+ * Add a message with a lifetime of its own, to the end of the urgent lane
+ * if urgent is nonzero, or else of the normal lane.  This is otherwise
+ * the same as mb_add_message().  The message expires as described for
+ * mb_set_message_ttl(), after its own lifetime or that of the server,
+ * whichever is shorter.
+ *   ttl - the lifetime in milliseconds, or 0 for that of the server
+ */
+int mb_add_timed_message(MAILBOX *mb, int msgid, MAILBOX *from, void *body, int length,
+                         int urgent, int ttl);
+
+/*
+ * Add one part of a message sent in parts to the end of its lane.  This
+ * is otherwise the same as mb_add_message(), except that the number of
+ * bytes of parts that may wait in a mailbox is bounded by MB_PART_BUFFER,
+ * so that a fast sender cannot make the server buffer a whole large
+ * message for a slow recipient.  A part is refused if it would exceed
+ * the bound, unless no other parts are waiting; an aborted part is never
+ * refused.  Parts do not expire (see mb_set_message_ttl()).
+ *   part - the place of the part in the whole message
+ *   urgent - nonzero to queue the part in the urgent lane
+ *
+ * @return 0 if the part was added, 1 if it was refused because too many
+ * parts are waiting, or -1 if the mailbox is defunct.  In either of the
+ * latter cases the body is freed and the reference count of the sender's
+ * mailbox is left as it was.
  */
-void mb_add_message(MAILBOX *mb, int msgid, MAILBOX *from, void *body, int length);
+int mb_add_part(MAILBOX *mb, int msgid, MAILBOX *from, void *body, int length,
+                MESSAGE_PART part, int urgent);
+
+#define MB_PART_BUFFER (256 * 1024)
 
 /*
- * Add a notice to the end of the mailbox queue.
+ * Add a notice to the end of the control lane of the mailbox.
  *   ntype - the notice type
  *   msgid - the ID of the message to which the notice pertains
  *
+ * If return receipts are batched for the mailbox (see
+ * mb_set_batch_receipts()), a delivery notice is instead added to
+ * the batch that is open in the mailbox, if any, or else opens a new
+ * batch.  A batch is added to the control lane once the receipt window
+ * has elapsed since it was opened, or as soon as it holds MB_RECEIPT_BATCH
+ * message IDs.
+ *
  * An attempt to add a notice to a defunct mailbox is ignored.
  */
 void mb_add_notice(MAILBOX *mb, NOTICE_TYPE ntype, int msgid);
 
 /*
- * Remove the first entry from the mailbox, blocking until there is
- * one.  The caller assumes the responsibility of freeing the entry
- * and its body, if present.  In addition, if it is a message entry,
+ * Grant credit to the client of a mailbox, which is the number of
+ * messages (whole messages and parts alike), and of bytes in their
+ * bodies, that may still be removed from it; notices need no credit.
+ * Each kind of credit is unlimited until the first grant of that kind,
+ * and each grant adds to what is left.  A message is removed as long as
+ * at least one message and one byte of credit are left, so that a
+ * message larger than the byte credit is not held back forever: the
+ * byte credit is then overdrawn, and the next message waits until the
+ * client has made up the difference.  A defunct mailbox ignores the
+ * credit as it discards its entries.
+ *
+ * @param messages  The number of messages to grant, or -1 for none.
+ * @param bytes  The number of bytes to grant, or -1 for none.
+ */
+void mb_grant_credit(MAILBOX *mb, long messages, long bytes);
+
+/*
+ * Remove the next entry from the mailbox, in the order described above,
+ * blocking until there is one.  The caller assumes the responsibility of freeing the entry,
+ * using mb_free_entry(), and its body, if present.  In addition, if it is a message entry,
  * then the caller must decrease the reference count on the sender's
  * mailbox to account for the destruction of the pointer to it.
  *
@@ -201,4 +324,133 @@ void mb_add_notice(MAILBOX *mb, NOTICE_TYPE ntype, int msgid);
  */
 MAILBOX_ENTRY *mb_next_entry(MAILBOX *mb);
 
+/*
+ * Remove the next entry from the mailbox without blocking.  This behaves
+ * like mb_next_entry(), except that NULL is returned immediately if the
+ * mailbox is empty, or holds only messages for which there is no credit.  Once the mailbox is defunct, remaining entries are
+ * discarded and NULL is returned, just as by mb_next_entry().
+ */
+MAILBOX_ENTRY *mb_try_next_entry(MAILBOX *mb);
+
+/*
+ * Get a file descriptor that can be used with poll(2) to wait for entries
+ * to arrive in a mailbox, so that a single thread can wait both for its
+ * mailbox and for other descriptors.  The descriptor becomes readable when
+ * an entry is added or the mailbox is shut down.  The waiting thread must
+ * read it (it is non-blocking) to reset it, and then remove entries with
+ * mb_try_next_entry() until it returns NULL.  The descriptor is created
+ * on the first call and is closed when the mailbox is finalized.
+ *
+ * @return the file descriptor, or -1 if it could not be created.
+ */
+int mb_event_fd(MAILBOX *mb);
+
+/*
+ * Set the lifetime of undelivered messages.  A message that is still in
+ * a mailbox when its lifetime has elapsed is removed from the queue and
+ * discarded, just as if the mailbox had become defunct: it is passed to
+ * the discard hook, so that the sender can be sent a bounce notification.
+ * The expiry is tracked with a timer (see timer.h), and the timer wheel
+ * is the index by time that finds the messages to expire, so no mailbox
+ * is scanned: when a message expires, the messages at the heads of its
+ * mailbox's lanes that have expired by then are reaped with it, and
+ * their bodies are freed at once.  Notices and parts of messages sent in
+ * parts do not expire.  This applies to messages added after it is called.
+ *
+ * @param ms  The lifetime in milliseconds, or 0 for no limit (the default).
+ */
+void mb_set_message_ttl(int ms);
+
+/*
+ * Set the window within which return receipts for the same mailbox are
+ * batched into one delivery notice, so that a sender of many messages
+ * gets one notice for many deliveries rather than one for each.  Only
+ * the mailboxes of clients that take batched receipts are batched (see
+ * mb_set_batch_receipts()).  The window is tracked with a timer (see
+ * timer.h), so it is rounded up to a whole number of ticks.  Must be
+ * called before any mailbox is created.
+ *
+ * @param ms  The window in milliseconds, or 0 to send a notice for each
+ * delivery (the default).
+ */
+void mb_set_receipt_window(int ms);
+
+/*
+ * Set whether the client of a mailbox takes batched return receipts,
+ * which it must ask for, since a batch is a different format of RCVD
+ * (see protocol.h).  A mailbox starts without, and gets a delivery
+ * notice for each delivery even if there is a receipt window.  Receipts
+ * already batched stay so.
+ *
+ * @param on  Nonzero to batch the receipts for the mailbox, if there is a
+ * receipt window, or zero not to.
+ */
+void mb_set_batch_receipts(MAILBOX *mb, int on);
+
+/*
+ * Get whether the client of a mailbox takes batched return receipts.
+ *
+ * @return nonzero if it does, as set by mb_set_batch_receipts().
+ */
+int mb_batches_receipts(MAILBOX *mb);
+
+#define MB_RECEIPT_BATCH 1024
+
+/*
+ * Set how long mb_next_entry() may spin waiting for an entry before it
+ * parks the calling thread, for deployments in which the cost of waking
+ * a parked thread dominates the latency of delivery.  Each mailbox keeps
+ * its own budget, up to this limit, which doubles each time an entry
+ * arrives while the thread spins and halves each time none does, down to
+ * an MB_SPIN_FLOOR-th of the limit, so that a busy mailbox is served by
+ * a thread that stays awake while an idle one soon parks.  Spinning only
+ * pays off if the spinning threads have CPUs to themselves (see
+ * placement.h), and never on a host with a single CPU, where it is
+ * turned off.  Must be called before any mailbox is created.
+ *
+ * @param us  The longest spin in microseconds, or 0 to park at once (the
+ * default).
+ */
+void mb_set_spin(int us);
+
+#define MB_SPIN_FLOOR 16
+
+/*
+ * Free a mailbox entry returned by mb_next_entry() or mb_try_next_entry().
+ * Entries are allocated from a pool (see slab.h), so they must not be
+ * passed to free().
+ * The body of a message entry is not freed by this function, but the
+ * message IDs of a batch of receipts are.
+ */
+void mb_free_entry(MAILBOX_ENTRY *entry);
+
+/*
+ * Hold the entries of a mailbox where they are, so that they can be handed
+ * off to another process (see handoff.h): until mb_release() is called,
+ * no entry is removed, unless the mailbox is defunct.  This then waits
+ * until the caller of mb_next_entry() or mb_try_next_entry() has dealt with
+ * the entry it removed last, which is when it next calls either function.
+ *
+ * @param deadline  When to stop waiting, as an absolute CLOCK_REALTIME time.
+ * @return 0 once no removed entry is being dealt with, or -1 if one still
+ * was at the deadline.  Either way, the mailbox is held.
+ */
+int mb_hold(MAILBOX *mb, const struct timespec *deadline);
+
+/*
+ * Let entries be removed again from a mailbox held by mb_hold().
+ */
+void mb_release(MAILBOX *mb);
+
+/*
+ * Apply a function to each entry currently queued in a mailbox, lane by
+ * lane from the highest priority, in queue order within each lane,
+ * and then to the open batch of receipts, if any, without removing any
+ * of them.  The mailbox is locked
+ * for the duration of the call, so the function must not call back
+ * into this mailbox.  This is used to take a snapshot of undelivered
+ * entries, for example when handing the server off to a new process.
+ */
+void mb_foreach(MAILBOX *mb, void (*fn)(MAILBOX_ENTRY *, void *), void *arg);
+
 #endif
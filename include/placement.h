@@ -0,0 +1,108 @@
+#ifndef PLACEMENT_H
+#define PLACEMENT_H
+
+#include <stddef.h>
+
+/*
+ * Placement of threads and memory on CPUs and NUMA nodes.
+ *
+ * Each thread of the server has a role, and each role may be given a set
+ * of CPUs to which its threads are pinned:
+ *
+ * - acceptor: the main thread, which accepts connections.
+ * - io: the threads that serve connections, that is, the client service
+ *   and mailbox service threads of each client, or the coroutine
+ *   schedulers, of which the i-th is pinned to the i-th CPU of the set
+ *   (wrapping around).
+ * - worker: the threads that process pipelined requests and the
+ *   background threads (timer wheel, presence notifications).  Threads
+ *   that process requests stay with their connection unless this set is
+ *   given.
+ *
+ * The placement is given as a list of role=cpus separated by colons, as
+ * in "acceptor=0:io=2-7,10:worker=8,9", where cpus is a list of CPUs and
+ * ranges as in /sys/devices/system/cpu/online.  Roles without a set are
+ * not pinned.
+ *
+ * With steering, each connection is served near the CPU on which the
+ * kernel processed its incoming packets (SO_INCOMING_CPU), which is where
+ * the interrupts of the NIC queue it hashes to are handled: its threads
+ * are pinned to that CPU if it is in the io set, or else to the CPUs of
+ * the io set on the same NUMA node, and a coroutine session is run by the
+ * scheduler pinned to that CPU, or else by one on the same node.
+ *
+ * Memory follows the threads: the mailbox service thread of a client
+ * inherits the placement of its client service thread, so the buffers
+ * and objects of a connection are allocated (and first touched) on the
+ * node that serves it, and the larger per-connection mappings, coroutine
+ * stacks and shared-memory rings, are explicitly bound to that node.  The
+ * topology is read from /sys/devices/system/node; without it, all CPUs are
+ * taken to be on node 0.
+ */
+
+typedef enum place_role {
+    PLACE_ACCEPTOR, PLACE_IO, PLACE_WORKER, PLACE_ROLES
+} PLACE_ROLE;
+
+/*
+ * Set up the placement.  Must be called before any thread is started.
+ *
+ * @param spec  The CPU sets of the roles, as described above, or NULL.
+ * @param steer  Nonzero to steer connections to their incoming CPU.
+ * @return 0 on success, or -1 if the specification is invalid or names
+ * no CPU on which the process may run.
+ */
+int place_init(char *spec, int steer);
+
+/*
+ * Pin the calling thread to the CPU set of a role, if it has one.
+ */
+void place_thread(PLACE_ROLE role);
+
+/*
+ * Pin the calling thread to a single CPU.
+ *
+ * @return 0 on success, or -1 on error.
+ */
+int place_pin(int cpu);
+
+/*
+ * Get a CPU of the set of a role.
+ *
+ * @param index  Which CPU of the set, modulo its size.
+ * @return the CPU, or -1 if the role has no set.
+ */
+int place_cpu(PLACE_ROLE role, int index);
+
+/*
+ * Get the NUMA node of a CPU.
+ *
+ * @param cpu  The CPU, or -1 for the one the calling thread is running on.
+ * @return the node, or 0 if it is not known.
+ */
+int place_node(int cpu);
+
+/*
+ * Get the CPU near which a connection should be served.
+ *
+ * @return the CPU on which the packets of the connection arrive, or -1
+ * if steering is off or that CPU is not known.
+ */
+int place_incoming_cpu(int fd);
+
+/*
+ * Pin the calling thread, which is to serve a connection, as the io role
+ * and steering require.
+ */
+void place_session(int fd);
+
+/*
+ * Ask for a range of mapped memory to be allocated on a node.  This does
+ * nothing on a host with a single node.
+ *
+ * @param addr  The start of the range, which must be page-aligned.
+ * @param node  The node, or -1 for that of the calling thread.
+ */
+void place_bind(void *addr, size_t length, int node);
+
+#endif
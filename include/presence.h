@@ -0,0 +1,132 @@
+#ifndef PRESENCE_H
+#define PRESENCE_H
+
+#include "client_registry.h"
+
+/*
+ * Presence subscriptions.
+ *
+ * A logged-in client may send a SUBSCRIBE request, which is acknowledged
+ * with the current list of users (in the same format as the reply to USERS).
+ * After that, instead of polling with USERS, the client receives PRESENCE
+ * packets whenever users log in or out.  Changes are collected over a short
+ * window and then sent to every subscriber as a single packet whose payload
+ * has one line per change: "+handle\n" for a login and "-handle\n" for a
+ * logout.  A login and a logout of the same handle within one window cancel
+ * each other, unless a client subscribed in between, since its list of
+ * users already shows the first of them.  A subscription ends when the
+ * client logs out.
+ *
+ * In a cluster (see cluster.h), a subscription covers only the users
+ * logged in at the node the client is connected to: the list it is ACKed
+ * with holds only them, and only their changes are sent.  A client that
+ * needs the users at every node must still poll with USERS.
+ */
+
+/*
+ * The length of the window over which changes are collected.
+ */
+#define PRESENCE_WINDOW_MS 100
+
+/*
+ * Initialize presence subscriptions and start the thread that sends
+ * the batched changes to subscribers.
+ *
+ * @return 0 if successful, otherwise -1.
+ */
+int presence_init(void);
+
+/*
+ * Stop the sending thread and drop all subscriptions.
+ */
+void presence_fini(void);
+
+/*
+ * Subscribe a client to presence changes, and ACK its SUBSCRIBE request
+ * with the current list of users.  The list is taken at the moment the
+ * subscription starts and sent before any PRESENCE packet, so every
+ * change the client is sent is newer than the list.  The reference count
+ * of the CLIENT is incremented to account for the pointer held by the
+ * subscription.
+ *
+ * @param client  The client to subscribe.
+ * @param msgid  The msgid of the SUBSCRIBE request.
+ * @param snapshot  Returns the list of users in a buffer to be freed, and
+ * its length, or NULL on error.  It is called with the subscriptions
+ * locked, so it must not sleep, nor log a user in or out.
+ * @param arg  Passed to snapshot().
+ * @return 0 if the client was subscribed and ACKed, otherwise -1.
+ */
+int presence_subscribe(CLIENT *client, uint32_t msgid,
+                       char *(*snapshot)(void *arg, size_t *lengthp), void *arg);
+
+/*
+ * Check whether a client is subscribed to presence changes.
+ *
+ * @return 1 if it is, otherwise 0.
+ */
+int presence_subscribed(CLIENT *client);
+
+/*
+ * Subscribe a client that was subscribed in the process it was handed off
+ * from (see handoff.h), without sending it a list of users: the list it
+ * was sent there, and the changes handed off with it, keep it up to date.
+ * The reference count of the CLIENT is incremented to account for the
+ * pointer held by the subscription.
+ *
+ * @param client  The client to subscribe.
+ * @return 0 if the client was subscribed, otherwise -1.
+ */
+int presence_resubscribe(CLIENT *client);
+
+/*
+ * End the subscription of a client, if it has one.
+ *
+ * @param client  The client to unsubscribe.
+ */
+void presence_unsubscribe(CLIENT *client);
+
+/*
+ * Record that a handle has logged in or out, to be sent to subscribers
+ * at the end of the current window.
+ *
+ * @param handle  The handle that has changed state.
+ * @param online  Nonzero for a login, zero for a logout.
+ */
+void presence_changed(char *handle, int online);
+
+/*
+ * Call a function on each change that has not yet been sent, oldest first,
+ * so that the changes can be handed off.  The subscriptions are locked
+ * meanwhile.
+ *
+ * @param func  Called with the handle, nonzero for a login, and nonzero if
+ * a subscriber has been sent a list of users that reflects the change.
+ * @param arg  Passed to func().
+ */
+void presence_foreach_pending(void (*func)(char *handle, int online, int listed, void *arg), void *arg);
+
+/*
+ * Queue a change handed off from another process, as it was there, to be
+ * sent at the end of the current window.  Its subscribers must have been
+ * restored with presence_resubscribe() first.
+ */
+void presence_restore(char *handle, int online, int listed);
+
+/*
+ * Stop sending changes, so that those not yet sent can be handed off:
+ * until presence_release() is called, changes are collected but none is
+ * sent.  This waits for a batch being sent to have been sent.
+ *
+ * @param deadline  When to stop waiting, as an absolute CLOCK_REALTIME time.
+ * @return 0 once no batch is being sent, or -1 if one still was at the
+ * deadline.  Either way, the changes are held.
+ */
+int presence_hold(const struct timespec *deadline);
+
+/*
+ * Let changes be sent again after presence_hold().
+ */
+void presence_release(void);
+
+#endif
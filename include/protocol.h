@@ -1,6 +1,7 @@
 #ifndef PROTOCOL_H
 #define PROTOCOL_H
 
+#include <stddef.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
@@ -30,6 +31,13 @@
  *   LOGOUT: Log client out of the system
  *   USERS: Get list of all users currently logged in to the system
  *   SEND: Send a message to a user
+ *   SUBSCRIBE: Get list of local users, and subscribe to presence changes
+ *   USERS_QUERY: Get a page of the users whose handles start with a prefix
+ *   PING: Show that the client is still there (no effect other than the ACK)
+ *   CHUNK: Send the next part of a message sent in parts (see below)
+ *   SHM: Switch the connection to a shared-memory transport (see shm.h)
+ *   SEARCH: Find past messages of the client by their words (see search.h)
+ *   CREDIT: Let the server deliver more messages to the client (see below)
  *
  * Server-to-client notices, not acknowledged by client:
  *   ACK: Positive acknowledgement of previous server-to-client packet
@@ -37,12 +45,31 @@
  *   MESG: Delivery of a message previously sent by SEND
  *   RCVD: Notice of successful delivery of a previously sent message
  *   BOUNCE: Notice of unsuccessful delivery of a previously sent message
+ *   PRESENCE: Notice of users that have logged in or out (see presence.h)
+ *   PING: Keepalive probe sent to an idle client, which should answer it
+ *         with a PING request before the idle timeout closes the connection
+ *   CHUNK: Delivery of the next part of a message delivered in parts
+ *
+ * Node-to-node requests in cluster mode (see cluster.h), acknowledged by
+ * the receiving node:
+ *   LINK: Show that the connection is a link from another node, with the
+ *         cluster secret as its payload
+ *   FWD_SEND: Deliver a message to a user owned by the receiving node
+ *   FWD_USERS: Get list of users logged in at the receiving node only
+ *   FWD_USERS_QUERY: Get a page of the users logged in at the receiving
+ *         node only, with the payload of a USERS_QUERY
+ * FWD_SEND, FWD_USERS and FWD_USERS_QUERY are NACKed on a connection that
+ * has not been shown to be a link by a LINK request.
  */
 
 typedef enum {
     CHLA_NO_PKT,  // Unused
     CHLA_LOGIN_PKT, CHLA_LOGOUT_PKT, CHLA_USERS_PKT, CHLA_SEND_PKT,
-    CHLA_ACK_PKT, CHLA_NACK_PKT, CHLA_MESG_PKT, CHLA_RCVD_PKT, CHLA_BOUNCE_PKT
+    CHLA_ACK_PKT, CHLA_NACK_PKT, CHLA_MESG_PKT, CHLA_RCVD_PKT, CHLA_BOUNCE_PKT,
+    CHLA_FWD_SEND_PKT, CHLA_FWD_USERS_PKT, CHLA_SUBSCRIBE_PKT, CHLA_PRESENCE_PKT,
+    CHLA_USERS_QUERY_PKT, CHLA_PING_PKT, CHLA_CHUNK_PKT,
+    CHLA_SHM_PKT, CHLA_SEARCH_PKT, CHLA_CREDIT_PKT, CHLA_LINK_PKT,
+    CHLA_FWD_USERS_QUERY_PKT
 } CHLA_PACKET_TYPE;
 
 /*
@@ -54,13 +81,52 @@ typedef enum {
  */
 typedef struct {
     uint8_t type;		   // Type of the packet
+    uint8_t flags;                 // Flags modifying the request (see below)
     uint32_t payload_length;       // Length of payload
     uint32_t msgid;                // Message ID to which packet pertains
     uint32_t timestamp_sec;        // Seconds field of time packet was sent
     uint32_t timestamp_nsec;       // Nanoseconds field of time packet was sent
 } CHLA_PACKET_HEADER;
 
+#define CHLA_URGENT_FLAG 0x01
+#define CHLA_MORE_FLAG 0x02
+#define CHLA_ABORT_FLAG 0x04
+#define CHLA_BUSY_FLAG 0x08
+#define CHLA_EXPIRE_FLAG 0x10
+#define CHLA_BATCH_FLAG 0x20
+
 /*
+ * The flags field occupies what was padding after the type field, so the
+ * header is the same size as before and a client that leaves it zero sees
+ * no difference.  The following flags are defined:
+ *
+ *   CHLA_URGENT_FLAG: on SEND (and FWD_SEND), queue the message in the
+ *   urgent lane of the recipient's mailbox (see mailbox.h), so that it is
+ *   delivered ahead of messages sent without the flag
+ *
+ *   CHLA_MORE_FLAG: on SEND, MESG and CHUNK, more parts of the message
+ *   follow in CHUNK packets (see below)
+ *
+ *   CHLA_ABORT_FLAG: on CHUNK from the server, the sender of a message
+ *   delivered in parts went away before sending the last part, which will
+ *   never arrive
+ *
+ *   CHLA_BUSY_FLAG: on NACK of SEND or CHUNK, the receiver is not taking
+ *   messages as fast as they are sent, and the server holds as many for
+ *   it as it will; the request may be sent again later
+ *
+ *   CHLA_EXPIRE_FLAG: on SEND (and FWD_SEND), the message has a lifetime
+ *   of its own, given on the line after the receiver's username (see
+ *   below); a message not delivered within it bounces.  Not allowed with
+ *   CHLA_MORE_FLAG, since parts do not expire
+ *
+ *   CHLA_BATCH_FLAG: on LOGIN, the client takes RCVD packets that
+ *   acknowledge several messages at once (see below), for the rest of
+ *   the login session
+ *
+ * Other bits are reserved and must be zero.  The server sends zero flags
+ * except as described.
+ *
  * The msgid field in the packet header should contain a non-zero
  * client-generated value that uniquely identifies a particular
  * message.  The client may use any convenient technique to produce
@@ -87,14 +153,105 @@ typedef struct {
  * Format of message sent by client:
  *   (username of receiver)\r\n(message body)
  *
+ * Format of message sent by client with CHLA_EXPIRE_FLAG, where the
+ * lifetime is a positive number of milliseconds, which the server may
+ * shorten to its own limit (see mailbox.h):
+ *   (username of receiver)\r\n(lifetime)\r\n(message body)
+ *
  * Format of message delivered to client:
  *   (username of sender)\r\n(message body)
  *
  * In the case of a login request, the payload part of the packet
  * contains just the requested username and the message body is omitted.
- * An empty payload is not permitted in this case.
+ * An empty payload is not permitted in this case, except on a connection
+ * to the server's Unix-domain socket, where it requests a login under
+ * the name of the local user that owns the connecting process, as the
+ * kernel reports it (SO_PEERCRED), so that no handle need be configured.
+ *
+ * Format of a USERS_QUERY request (see handle_index.h):
+ *   (prefix)\r\n(limit)\r\n(cursor)
+ *
+ * Format of a SEARCH request (see search.h), where the limit is optional:
+ *   (query)\r\n(limit)
+ *
+ * Format of the ACK of a SEARCH request, with one line per message found:
+ *   (msgid)\t(sender)\t(receiver)\t(time)\t(snippet)\r\n
+ *
+ * Format of a CREDIT request, where either number may be left empty:
+ *   (messages)\r\n(bytes)
+ *
+ * Format of message forwarded between nodes:
+ *   (username of sender)\r\n(username of receiver)\r\n(message body)
+ * where the message body starts with the lifetime line, as in a SEND, if
+ * CHLA_EXPIRE_FLAG is set.
+ *
+ * A client may send further requests without waiting for the ACK or NACK
+ * of earlier ones.  If the server allows more than one request in flight
+ * per client (see server.h), replies may then arrive in a different order
+ * from the requests, so a client that pipelines its requests should give
+ * each one a distinct msgid by which to match its reply.
+ *
+ * If the server batches return receipts (see mailbox.h), and the client
+ * logged in with CHLA_BATCH_FLAG, a RCVD packet may acknowledge the
+ * delivery of several messages.  Its payload is then
+ * the list of their msgids, as 32-bit integers in network byte order, and
+ * the msgid in its header is the first of them.
+ *
+ * A payload may be at most proto_max_payload bytes long.  A larger
+ * message is sent in parts, which the server relays to the receiver
+ * one at a time, so that neither the server nor the receiver's mailbox
+ * ever holds the whole of it:
+ *
+ *   - The client sends SEND with CHLA_MORE_FLAG, whose payload is the
+ *     receiver's username, \r\n, and the first part of the body.  It
+ *     then sends each following part as the payload of a CHUNK request
+ *     with the same msgid, with CHLA_MORE_FLAG set on all but the last.
+ *     The body of each part may be at most CHLA_CHUNK_MAX bytes long.
+ *   - Each of these requests is ACKed only once its part has been
+ *     delivered to the receiver, which provides flow control: a client
+ *     should keep only a few parts unacknowledged at a time.  A part is
+ *     NACKed if too many parts are already waiting in the receiver's
+ *     mailbox, in which case it may be sent again after the next ACK,
+ *     or if there is no such transfer or receiver.  Once all the parts
+ *     have been delivered, RCVD is sent as for any other message.
+ *   - The receiver gets MESG with CHLA_MORE_FLAG, whose payload is the
+ *     sender's username, \r\n, and the first part, followed by a CHUNK
+ *     with the same msgid and payload format for each following part.
+ *     If the sender goes away before the last part, the receiver gets a
+ *     CHUNK with CHLA_ABORT_FLAG and no body.
+ *
+ * A message sent in parts must be for a user at the same node, and a
+ * transfer does not survive a hot upgrade (see handoff.h).
+ *
+ * A client that cannot take messages as fast as they may come, such as
+ * one on a slow network, may ask for flow control with CREDIT requests:
+ *
+ *   - Each CREDIT grants the server the given number of messages, and of
+ *     bytes in their payloads, to deliver to the client in MESG and CHUNK
+ *     packets.  Grants add up.  A kind of credit that the client has
+ *     never granted is unlimited, which is how every session starts.
+ *   - The server sends a MESG or CHUNK only while at least one message
+ *     and one byte of credit are left; one larger than the byte credit
+ *     that is left is still sent, and the next waits until the client has
+ *     granted the difference.  Other packets need no credit.
+ *   - While the client is out of credit, messages for it wait at the
+ *     server, up to a bound (see mailbox.h), beyond which a SEND to it is
+ *     NACKed with CHLA_BUSY_FLAG.  A part of a message sent in parts for
+ *     which there is no room is NACKed in the same way.
+ *
+ * Credit belongs to the login session, and does not survive a logout or
+ * a hot upgrade.
  */
 
+/*
+ * The largest payload accepted by proto_recv_packet(), which is
+ * CHLA_MAX_PAYLOAD unless it is changed at startup.
+ */
+extern size_t proto_max_payload;
+
+#define CHLA_MAX_PAYLOAD (1024 * 1024)
+#define CHLA_CHUNK_MAX (64 * 1024)
+
 /*
  * Send a packet with a specified header and payload.
  *   fd - file descriptor on which packet is to be sent
@@ -121,8 +278,20 @@ int proto_send_packet(int fd, CHLA_PACKET_HEADER *hdr, void *payload);
  *
  * On success, 0 is returned.
  * On error, -1 is returned, payload and length are left unchanged,
- * and errno is set.
+ * and errno is set.  A packet whose payload would be longer than
+ * proto_max_payload is an error (EMSGSIZE), and its payload is not read,
+ * so the connection can no longer be used.
  */
 int proto_recv_packet(int fd, CHLA_PACKET_HEADER *hdr, void **payload);
 
+/*
+ * Get the name of the local user that owns the process at the other end
+ * of a Unix-domain connection, as reported by the kernel (SO_PEERCRED),
+ * for a LOGIN request with an empty payload.
+ *
+ * @return the name, which the caller must free, or NULL if the connection
+ * is not a Unix-domain connection or the user has no name.
+ */
+char *proto_peer_user(int fd);
+
 #endif
@@ -0,0 +1,69 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Rate limiting of SEND requests with token buckets.
+ *
+ * A bucket holds tokens for messages and for bytes, which are refilled
+ * continuously at the configured rates, up to what RL_BURST_SECONDS of
+ * traffic at those rates would use.  A request is admitted if neither
+ * kind of token has run out, and then takes one message token and one
+ * byte token per byte of payload, so the byte tokens may go negative for
+ * a message larger than the burst; that debt is paid off before the next
+ * request is admitted.
+ *
+ * Each SEND is checked against two buckets: one for the connection, and
+ * one for the handle of the sender, which is kept here so that a client
+ * cannot reset its budget by reconnecting.  A per-handle bucket is dropped
+ * once it has refilled completely, since it then carries no information.
+ * A request that is over either limit is refused (NACKed) and counted.
+ */
+
+#define RL_BURST_SECONDS 1
+
+/*
+ * The state of a bucket.  Its members are private to ratelimit.c; the
+ * structure is only exposed so that buckets can be embedded in other
+ * objects.  A bucket that is not shared need not be locked.
+ */
+typedef struct token_bucket {
+    double messages; // Message tokens available
+    double bytes; // Byte tokens available
+    uint64_t last; // Time of the last refill (see tw_now())
+} TOKEN_BUCKET;
+
+/*
+ * Set the rates at which buckets are refilled.  Must be called before
+ * any client connects.
+ *
+ * @param messages  Messages per second, or 0 for no limit.
+ * @param bytes  Payload bytes per second, or 0 for no limit.
+ */
+void rl_set_limits(double messages, double bytes);
+
+/*
+ * Initialize a bucket, which starts out full.
+ */
+void rl_init(TOKEN_BUCKET *bucket);
+
+/*
+ * Check whether a SEND request may proceed and, if so, take tokens for it
+ * from the connection bucket and from the bucket of the sender's handle.
+ *
+ * @param bucket  The bucket of the connection.
+ * @param handle  The interned handle of the sender (see intern.h).
+ * @param length  The length of the payload of the request.
+ * @return 0 if the request may proceed, or -1 if it is over a limit.
+ */
+int rl_admit(TOKEN_BUCKET *bucket, char *handle, size_t length);
+
+/*
+ * Print the number of requests refused by each kind of bucket.
+ */
+void rl_report(FILE *out);
+
+#endif
@@ -0,0 +1,106 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Full-text search over the history of messages.
+ *
+ * Each message sent whole (not in parts) is queued for indexing once it
+ * has been sent to its receiver, so that a message that bounces, expires
+ * or is discarded is never found.  A background thread adds it to an
+ * inverted index, which maps each term to the list of messages (postings)
+ * that contain it.  The index stores the messages themselves too, so it
+ * doubles as the message history.
+ *
+ * Terms are the words of a body (runs of letters, digits and non-ASCII
+ * bytes), lowercased and cut to SEARCH_MAX_TERM bytes, plus one term for
+ * each of the sender and the receiver.  A SEARCH request finds the
+ * messages that contain all the words of a query and that the caller sent
+ * or received, so a user can only ever see their own messages.  The most
+ * recent come first.
+ *
+ * The index is log-structured:
+ *
+ * - New messages go into an in-memory segment, which is searchable at
+ *   once.
+ * - When that segment holds SEARCH_FLUSH_DOCS messages, it is written to
+ *   an immutable segment file, which is then searched through mmap().
+ *   Within a file, each posting list is a sequence of varint-encoded gaps
+ *   between message numbers.
+ * - Whenever SEARCH_MERGE_FACTOR segment files of the same level are the
+ *   newest, they are merged into one file of the next level.  A search
+ *   therefore has to look at only a few segments per order of magnitude
+ *   of messages.
+ * - The list of live segment files is kept in a manifest, which is
+ *   replaced atomically after each flush or merge.  A file that is not in
+ *   the manifest is left over from an interrupted flush or merge, and is
+ *   deleted at startup.
+ * - The in-memory segment is written out at shutdown, and when the server
+ *   hands off to a new process in a hot upgrade.  The messages in it are
+ *   lost if the server crashes.  Only one process uses the index at a
+ *   time: another one waits in search_init() until the first has exited.
+ *
+ * A search stops as soon as it has found enough results, going from the
+ * newest segment to the oldest, and decodes only the posting lists of the
+ * terms in the query.  It intersects them starting from the rarest term;
+ * the caller's own term is one of them.
+ */
+
+#define SEARCH_MAX_TERM 64
+#define SEARCH_MAX_QUERY_TERMS 16
+#define SEARCH_FLUSH_DOCS 4096
+#define SEARCH_MERGE_FACTOR 8
+#define SEARCH_QUEUE_MAX 65536
+#define SEARCH_DEFAULT_RESULTS 20
+#define SEARCH_MAX_RESULTS 100
+#define SEARCH_SNIPPET 80
+
+/*
+ * Open the index kept in a directory, creating it if need be, and start
+ * the indexing thread.  Without this, nothing is indexed and every search
+ * fails.
+ *
+ * @param dir  The directory, which must exist.
+ * @return 0 on success, or -1 if the index could not be opened.
+ */
+int search_init(char *dir);
+
+/*
+ * Queue a message for indexing.  This waits if SEARCH_QUEUE_MAX messages
+ * are already waiting.
+ *
+ * @param sender  The handle of the sender.
+ * @param receiver  The handle of the receiver.
+ * @param msgid  The msgid of the SEND request.
+ * @param body  The body of the message (without the receiver's handle).
+ * @param length  The length of the body.
+ */
+void search_add(char *sender, char *receiver, uint32_t msgid, char *body, size_t length);
+
+/*
+ * Search for the messages that a user sent or received and that contain
+ * every word of a query.
+ *
+ * @param handle  The handle of the user.
+ * @param query  The query, as a NUL-terminated string.
+ * @param limit  The greatest number of results, which is capped at
+ * SEARCH_MAX_RESULTS, or 0 for SEARCH_DEFAULT_RESULTS.
+ * @param lengthp  Set to the length of the result.
+ * @return the results, newest first, one per line of the form
+ * "msgid\tsender\treceiver\ttime\tsnippet\r\n", where time is in seconds
+ * since the epoch and snippet is up to SEARCH_SNIPPET bytes of the body
+ * around the first word of the query, with control characters replaced by
+ * spaces; or NULL if there is no index or the query has no words or too
+ * many.  The result must be freed by the caller.
+ */
+char *search_query(char *handle, char *query, size_t limit, size_t *lengthp);
+
+/*
+ * Index the messages still queued, write out the in-memory segment, and
+ * stop the indexing thread.
+ */
+void search_fini(void);
+
+#endif
@@ -1,14 +1,82 @@
 #ifndef SERVER_H
 #define SERVER_H
 
+#include "client_registry.h"
+
+/*
+ * If nonzero, each logged-in client is served by a single thread, which
+ * waits with poll(2) both for requests on the connection and for entries
+ * in the mailbox (see mb_event_fd()), instead of by a client service
+ * thread and a separate mailbox service thread.  Must be set before any
+ * client connects.
+ */
+extern int chla_single_thread;
+
+/*
+ * If nonzero, a connection on which no request has been received for this
+ * many seconds is closed, so that the resources of a session whose peer
+ * has vanished are reclaimed.
+ */
+extern int chla_idle_timeout;
+
+/*
+ * If nonzero, a client that has sent no request for this many seconds is
+ * sent a PING packet, and again at the same interval while it stays idle.
+ * A client answers with a PING request to keep its session alive, and a
+ * dead peer is detected when the probe cannot be delivered.
+ */
+extern int chla_keepalive;
+
+/*
+ * If nonzero, each connection is set to busy poll for this many
+ * microseconds (SO_BUSY_POLL): a read that finds no data polls the device
+ * queue for that long before the thread sleeps, which spares the latency
+ * of an interrupt and a wakeup when the next packet is about to arrive.
+ * This needs a device driver that supports it, and raising the time above
+ * the net.core.busy_read sysctl needs CAP_NET_ADMIN; if the option cannot
+ * be set, connections are served without it.  Connections waited for with
+ * poll(2) (single-thread mode and coroutine sessions) busy poll according
+ * to the net.core.busy_poll sysctl instead.
+ */
+extern int chla_busy_poll;
+
+/*
+ * The number of requests from one client that may be processed at once.
+ * With more than one, a client may pipeline its requests: the server keeps
+ * reading requests while earlier ones are being processed, each request
+ * that does not change the state of the session is processed concurrently
+ * with others (on a coroutine of its own, if sessions are coroutines, or
+ * else on a thread of its own), and the ACK or NACK of each is sent as soon
+ * as it completes, so replies may arrive out of order.  Messages to the
+ * same receiver are still delivered in the order sent, and a request is
+ * held back while one with the same msgid is in flight.  Requests that do
+ * change the state of the session (LOGIN, LOGOUT, SUBSCRIBE, and the parts
+ * of a message sent in parts) wait for all those in flight and are then
+ * processed on their own.  At most CHLA_MAX_PIPELINE.  The default of 1
+ * processes requests strictly one at a time, in order.
+ */
+extern int chla_pipeline_depth;
+
+#define CHLA_MAX_PIPELINE 64
+
 /*
  * Thread function for the thread that handles client requests.
  *
- * The arg pointer points to the file descriptor of client connection.
- * This pointer must be freed after the file descriptor has been retrieved.
+ * The arg pointer is the file descriptor of the client connection, cast
+ * to a pointer.
  */
 void *chla_client_service(void *arg);
 
+/*
+ * Coroutine function that handles client requests (see coro.h), used
+ * instead of chla_client_service() when sessions run as coroutines.
+ * Coroutine sessions always run in single-thread mode.
+ *
+ * The arg pointer is the file descriptor of the client connection, cast
+ * to a pointer, which must be in non-blocking mode.
+ */
+void chla_client_coroutine(void *arg);
+
 /*
  * Function run by the thread servicing the mailbox of a logged-in client.
  * It repeatedly uses `mb_next_entry()` to wait for and retrieve the
@@ -21,4 +89,64 @@ void *chla_client_service(void *arg);
  */
 void *chla_mailbox_service(void *arg);
 
+/*
+ * Take back a client connection that was inherited from another server
+ * process (see handoff.h).  The connection is registered and logged in
+ * under the specified handle (if it is not NULL), but not yet served, so
+ * that the entries handed off with it can be queued in its mailbox before
+ * any new request is read.
+ *
+ * Returns the CLIENT, to be passed to chla_serve_client(), or NULL if the
+ * connection could not be taken back.
+ */
+CLIENT *chla_resume_client(int fd, char *handle);
+
+/*
+ * Start serving a client taken back by chla_resume_client(): a client
+ * service thread and, if it is logged in, a mailbox service thread are
+ * started for it.  The client does not see any interruption of its session.
+ */
+void chla_serve_client(CLIENT *client);
+
+/*
+ * Count a session that is about to be started for a new connection, or
+ * stop counting one that could not be started after all.  The sessions
+ * counted are those chla_quiesce() waits for, so a session is counted
+ * before its thread or coroutine is started, and chla_client_service()
+ * and chla_client_coroutine() stop counting theirs once they are done.
+ */
+void chla_session_opened(void);
+void chla_session_closed(void);
+
+/*
+ * Let the sessions be stopped for a hot upgrade (see handoff.h).  Must be
+ * called before any session is started.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int chla_quiesce_init(void);
+
+/*
+ * Stop the service of every client, so that the clients can be handed off
+ * to another process without this one going on using their connections:
+ * each session finishes the request it is reading or processing and then
+ * waits, without reading from its connection again, each mailbox stops
+ * giving up entries once the one being delivered has been, presence
+ * changes are held back (see presence.h), and nothing more is sent to any
+ * client.  Clients on a shared-memory transport,
+ * which are not handed off, are disconnected.  The caller must keep new
+ * sessions from being started meanwhile.
+ *
+ * @param timeout_ms  How long to wait for every client to have stopped.
+ * @return 0 once every client has stopped, or -1 if one had not within
+ * the timeout, in which case service has been resumed.
+ */
+int chla_quiesce(int timeout_ms);
+
+/*
+ * Resume the service of the clients stopped by chla_quiesce(), if the
+ * handoff failed.
+ */
+void chla_resume(void);
+
 #endif
@@ -0,0 +1,109 @@
+#ifndef SHM_H
+#define SHM_H
+
+#include <stdint.h>
+#include "protocol.h"
+
+/*
+ * Shared-memory transport for clients on the same host.
+ *
+ * A client connected to the server's Unix-domain socket may send an
+ * SHM request, to which the server replies with an ACK that carries
+ * (as SCM_RIGHTS ancillary data) a memfd holding an SHM_REGION.  From
+ * then on, the client writes its requests into the to_server ring of the
+ * region and reads the server's packets from the to_client ring, and no
+ * longer uses the socket for packets.  The socket stays open all the same:
+ * closing it ends the session, just as for any other connection, and it
+ * is how each side learns that the other has gone away.  A client must
+ * not send any other request between the SHM request and its ACK.
+ *
+ * Each ring is a single-producer, single-consumer byte queue carrying
+ * packets in the same framing as the socket (a CHLA_PACKET_HEADER
+ * followed by the payload).  The producer owns tail and the consumer owns
+ * head; both count bytes from zero and wrap around at 2^32, and the bytes
+ * in the ring are those from head up to tail, at offsets taken modulo
+ * SHM_RING_SIZE.  A packet may be larger than the ring, in which case it
+ * passes through in pieces.  Each side keeps its own copy of the counter
+ * it advances rather than reading it back from the shared memory, and
+ * the server ends the session of a client whose counter is ever more
+ * than SHM_RING_SIZE bytes ahead of, or behind, the server's own.
+ *
+ * Neither side makes a system call while the other keeps up.  A side that
+ * finds nothing to read (or no room to write) spins for a while, unless
+ * there is only one CPU, and then sets the waiters word next to the
+ * counter it is waiting on and sleeps on that counter with FUTEX_WAIT (the
+ * futex is not private, since the memory is shared).  After advancing a counter, a side must check the waiters
+ * word next to it and, if it is set, wake the other with FUTEX_WAKE.  The
+ * counters and waiters words must be accessed with sequentially consistent
+ * atomic operations so that a wakeup cannot be lost.
+ */
+
+#define SHM_MAGIC 0x43484c41 // "CHLA"
+#define SHM_RING_SIZE (1 << 20)
+
+/*
+ * One direction of the transport.  The counters are on cache lines of
+ * their own, so that the two sides do not contend for them.
+ */
+typedef struct shm_ring {
+    uint32_t head; // Bytes consumed, advanced by the consumer
+    uint32_t head_waiters; // Nonzero while the producer sleeps on head
+    char head_pad[56];
+    uint32_t tail; // Bytes produced, advanced by the producer
+    uint32_t tail_waiters; // Nonzero while the consumer sleeps on tail
+    char tail_pad[56];
+    char data[SHM_RING_SIZE];
+} SHM_RING;
+
+/*
+ * The contents of the shared memory, which is initialized by the server.
+ */
+typedef struct shm_region {
+    uint32_t magic; // SHM_MAGIC
+    uint32_t ring_size; // SHM_RING_SIZE
+    char pad[56];
+    SHM_RING to_server; // Requests from the client
+    SHM_RING to_client; // Packets from the server
+} SHM_REGION;
+
+/*
+ * The server side of a transport.
+ */
+typedef struct shm_transport SHM_TRANSPORT;
+
+/*
+ * Set up a transport for a client on a Unix-domain connection, and send
+ * the ACK of its SHM request, with the memfd attached, on the connection.
+ *
+ * @param fd  The connection.
+ * @param ack  The header of the ACK, with no payload.
+ * @return the transport, or NULL if it could not be set up or the
+ * connection is not a Unix-domain connection, in which case no ACK has
+ * been sent.
+ */
+SHM_TRANSPORT *shm_attach(int fd, CHLA_PACKET_HEADER *ack);
+
+/*
+ * Send a packet over a transport, as proto_send_packet() does over a
+ * connection.  Only one thread at a time may send.
+ *
+ * @return 0 on success, or -1 if the client has gone away or corrupted
+ * the ring.
+ */
+int shm_send_packet(SHM_TRANSPORT *shm, CHLA_PACKET_HEADER *hdr, void *payload);
+
+/*
+ * Receive a packet from a transport, as proto_recv_packet() does from a
+ * connection.  Only one thread at a time may receive.
+ *
+ * @return 0 on success, or -1 if the client has gone away or corrupted
+ * the ring, or the payload is too long.
+ */
+int shm_recv_packet(SHM_TRANSPORT *shm, CHLA_PACKET_HEADER *hdr, void **payload);
+
+/*
+ * Unmap the shared memory and free a transport.
+ */
+void shm_detach(SHM_TRANSPORT *shm);
+
+#endif
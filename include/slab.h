@@ -0,0 +1,104 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <pthread.h>
+
+/*
+ * Slab allocator for fixed-size objects.
+ *
+ * Objects that are allocated and freed on hot paths (CLIENT, USER,
+ * USER_REGISTRY_ENTRY, MAILBOX_ENTRY) come from typed pools rather than
+ * from malloc() and free().  A pool obtains memory from malloc() in slabs
+ * of SLAB_OBJECTS objects, which are never returned until the process
+ * exits, and hands out objects through a per-thread "magazine" of up to
+ * SLAB_MAGAZINE_SIZE free objects, so that most allocations and frees
+ * take no lock.  When a magazine is empty it is refilled from a shared
+ * depot of free objects, and when it is full half of it is flushed back
+ * to the depot.  An object may be freed by a different thread from the
+ * one that allocated it.
+ *
+ * Pools are defined with SLAB_POOL_DEFINE at file scope in the module
+ * that owns the type, and register themselves before main() runs, so
+ * that slab_init() can preallocate every pool at startup.
+ *
+ * Built with SLAB_MALLOC defined, each object is allocated and freed with
+ * malloc() and free() instead, and the pools only count them, so that the
+ * server can be measured both ways under the same load.
+ */
+
+#define SLAB_OBJECTS 64
+#define SLAB_MAGAZINE_SIZE 32
+
+/*
+ * The state of a pool.  Its members are private to slab.c; the structure
+ * is only exposed so that pools can be defined statically.
+ */
+typedef struct slab_pool {
+    char *name; // Name of the pooled type, for reporting
+    size_t object_size; // Size of each object, at least a pointer
+    pthread_mutex_t mutex; // Protects the depot and the slab list
+    pthread_key_t key; // Key of the per-thread magazine
+    int key_created;
+    void *depot; // List of free objects shared by all threads
+    size_t depot_count; // Number of objects in the depot
+    void *slabs; // List of slabs obtained from malloc()
+    size_t slab_count; // Number of slabs obtained from malloc()
+    unsigned long allocs; // Number of objects allocated
+    unsigned long frees; // Number of objects freed
+    struct slab_pool *next; // Next registered pool
+} SLAB_POOL;
+
+/*
+ * Define a static pool named "pool" for objects of a specified type.
+ */
+#define SLAB_POOL_DEFINE(pool, type)                                           \
+  static SLAB_POOL pool = {                                                    \
+      .name = #type,                                                           \
+      .object_size = sizeof(type) < sizeof(void *) ? sizeof(void *)            \
+                                                   : sizeof(type),             \
+      .mutex = PTHREAD_MUTEX_INITIALIZER};                                     \
+  __attribute__((constructor)) static void pool##_register(void) {             \
+    slab_register(&pool);                                                      \
+  }
+
+/*
+ * Register a pool, so that it is preallocated by slab_init() and
+ * included in slab_report().  Called by the pool definition.
+ */
+void slab_register(SLAB_POOL *pool);
+
+/*
+ * Preallocate objects in every registered pool.
+ *
+ * @param capacity  The number of objects to preallocate in each pool,
+ * or 0 to allocate slabs only on demand.
+ * @return 0 if successful, otherwise -1.
+ */
+int slab_init(size_t capacity);
+
+/*
+ * Allocate an object from a pool.  The object is not initialized.
+ *
+ * @param pool  The pool from which to allocate.
+ * @return the object, or NULL if memory is exhausted.
+ */
+void *slab_alloc(SLAB_POOL *pool);
+
+/*
+ * Return an object to the pool from which it was allocated.
+ *
+ * @param pool  The pool to which the object belongs.
+ * @param obj  The object, or NULL.
+ */
+void slab_free(SLAB_POOL *pool, void *obj);
+
+/*
+ * Print, for each registered pool, the number of objects allocated and
+ * freed, the number in use, and the number of slabs obtained from malloc()
+ * (none if built with SLAB_MALLOC).
+ */
+void slab_report(FILE *out);
+
+#endif
@@ -0,0 +1,77 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "mailbox.h"
+
+/*
+ * Snapshots of the users and their undelivered mailbox entries, so that
+ * queued mail survives a restart of the server.
+ *
+ * A snapshot is taken when the server shuts down cleanly, before the
+ * connections are closed, and optionally at a fixed interval while it
+ * runs.  It records each user in the user registry (that is, each user
+ * who is logged in), with the entries still queued in the user's
+ * mailbox, and the entries restored from the previous snapshot that no
+ * user has claimed yet.  It is written to a temporary file that then
+ * replaces the snapshot file, so a crash leaves the previous snapshot.
+ *
+ * The file is laid out to be used in place through mmap(): a header,
+ * then for each user the handle and the entries, each entry being a
+ * fixed-size record followed by the sender's handle and the body, and
+ * finally a table of the users sorted by handle.  Loading a snapshot at
+ * startup only maps it and checks the header, however many users and
+ * entries it holds.  A user's entries are copied into their mailbox
+ * only when that user next logs in, at which point the handle is
+ * interned and registered again.  The receipts for restored messages go
+ * to their senders if the senders are logged in by then.  A restored
+ * message with a lifetime (see mailbox.h) starts it again.
+ *
+ * A message being delivered at the instant a snapshot is taken may be
+ * delivered again after a restart, and after a crash the messages in the
+ * last periodic snapshot that have been delivered since are delivered
+ * again.  Messages being sent in parts are cut short: the recipient of
+ * the parts already queued gets an aborted part after them.  A snapshot
+ * with another SNAP_VERSION is ignored.
+ */
+
+#define SNAP_VERSION 1
+
+/*
+ * Load the snapshot at a path, if there is one, and start taking
+ * snapshots to it periodically, if requested.
+ *
+ * @param path  The snapshot file.
+ * @param interval  The interval between snapshots in seconds, or 0 to
+ * take one only at shutdown.
+ * @return 0 on success, or -1 if the periodic snapshots could not be
+ * started.
+ */
+int snap_init(char *path, int interval);
+
+/*
+ * Take a snapshot.  This does nothing if snap_init() has not been called.
+ *
+ * @param mailboxes  Nonzero to record the users who are logged in and
+ * their mailboxes, or zero to record only the entries that no user has
+ * claimed, as when the mailboxes are handed off to a new process (see
+ * handoff.h).  In the latter case, this process neither claims nor
+ * records entries from then on, so that the new process has them.
+ * @return 0 if the snapshot was written, otherwise -1.
+ */
+int snap_save(int mailboxes);
+
+/*
+ * Move the entries that a user left in the snapshot into the user's new
+ * mailbox, if this has not been done yet.  Called when a user logs in.
+ *
+ * @param handle  The handle of the user.
+ * @param mb  The mailbox of the user.
+ */
+void snap_claim(char *handle, MAILBOX *mb);
+
+/*
+ * Stop taking snapshots and release the loaded snapshot.
+ */
+void snap_fini(void);
+
+#endif
@@ -0,0 +1,89 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+
+/*
+ * Hierarchical timer wheel.
+ *
+ * Timers are kept in TW_LEVELS wheels of TW_SLOTS slots each.  The first
+ * wheel has one slot per tick of TW_TICK_MS milliseconds, and each slot of
+ * a higher wheel covers a whole revolution of the wheel below it.  A timer
+ * is placed in the slot of the lowest wheel that can hold its expiry time,
+ * and is moved down ("cascaded") when the lower wheels catch up with it,
+ * so scheduling and canceling a timer take constant time no matter how
+ * many timers are pending.  Expiry times are rounded up to whole ticks,
+ * and times beyond the range of the wheels are clamped to it.
+ *
+ * A single thread advances the wheels and runs the callbacks of expired
+ * timers, one at a time and without any lock held, so a callback may
+ * schedule or cancel timers (including its own).  Callbacks should be
+ * short, since they delay every other timer.
+ *
+ * A TIMER is embedded in the object it belongs to and is never allocated
+ * by this module.
+ */
+
+#define TW_TICK_MS 100
+#define TW_BITS 6
+#define TW_SLOTS (1 << TW_BITS)
+#define TW_LEVELS 4
+
+/*
+ * The state of a timer.  Its members are private to timer.c; the
+ * structure is only exposed so that timers can be embedded in other
+ * objects.
+ */
+typedef struct timer {
+    struct timer *next; // Next timer in the same slot
+    struct timer **pprev; // Link that points to this timer
+    uint64_t expires; // Tick at which the timer expires
+    int pending; // Nonzero while the timer is in the wheel
+    void (*fn)(void *); // Callback run when the timer expires
+    void *arg; // Argument for the callback
+} TIMER;
+
+/*
+ * Start the thread that runs the timer wheel.
+ *
+ * @return 0 if successful, otherwise -1.
+ */
+int tw_init(void);
+
+/*
+ * Stop the timer thread.  Timers that are still pending never expire.
+ */
+void tw_fini(void);
+
+/*
+ * Initialize a timer, which is not pending, with the callback to be run
+ * when it expires.
+ */
+void tw_timer_init(TIMER *timer, void (*fn)(void *), void *arg);
+
+/*
+ * Schedule a timer to expire after a specified interval.  If the timer
+ * is already pending, it is rescheduled.
+ *
+ * @param timer  The timer.
+ * @param ms  The interval in milliseconds.
+ */
+void tw_schedule(TIMER *timer, uint64_t ms);
+
+/*
+ * Cancel a timer.  If the callback of the timer is running on the timer
+ * thread, this waits for it to return, unless it is called from the
+ * callback itself, and cancels the timer again if the callback has
+ * rescheduled it, so that when it returns the object containing the
+ * timer may be freed.
+ *
+ * @return 1 if the timer was pending, otherwise 0.
+ */
+int tw_cancel(TIMER *timer);
+
+/*
+ * Get the current time in milliseconds, from a monotonic clock.
+ */
+uint64_t tw_now(void);
+
+#endif
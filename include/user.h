@@ -21,8 +21,9 @@
 typedef struct user USER;
 
 /*
- * Create a new USER with a specified handle.  A private copy is
- * made of the handle that is passed.  The newly created USER has
+ * Create a new USER with a specified handle.  The handle that is passed
+ * is interned (see intern.h), so the USER shares the one copy of it that
+ * exists for each distinct handle.  The newly created USER has
  * a reference count of one, corresponding to the reference that is
  * returned from this function.
  *
@@ -59,7 +60,7 @@ void user_unref(USER *user, char *why);
  * Get the handle of a user.
  *
  * @param user  The USER that is to be queried.
- * @return the handle of the user.
+ * @return the interned handle of the user.
  */
 char *user_get_handle(USER *user);
 
@@ -46,7 +46,7 @@ void ureg_fini(USER_REGISTRY *ureg);
  * the user registry and the other to the pointer that is returned.
  *
  * @param ureg  The user registry into which to register the user.
- * @param handle  The user's handle, which is copied by this function.
+ * @param handle  The user's handle, which is interned by this function.
  * @return A pointer to a USER object, in case of success, otherwise NULL.
  *
  */
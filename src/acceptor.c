@@ -0,0 +1,153 @@
+#define _GNU_SOURCE // For accept4()
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "acceptor.h"
+#include "server.h"
+#include "coro.h"
+#include "placement.h"
+#include "debug.h"
+
+static int use_coroutines;
+static int reserve_fd = -1; // Kept open to be given up when descriptors run out
+static int backoff_ms; // Current delay, or 0 while not backing off
+
+static unsigned long accepted; // Connections handed to a session
+static unsigned long shed; // Connections closed for lack of descriptors
+static unsigned long refused; // Connections closed for lack of other resources
+
+int acc_init(int coroutines) {
+    use_coroutines = coroutines;
+    reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    return reserve_fd < 0 ? -1 : 0;
+}
+
+int acc_listen(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        return -1;
+    }
+    // A packet is written as a header and then a payload, which Nagle's
+    // algorithm would hold up until the client's delayed ACK.  Accepted
+    // connections inherit the option; a Unix-domain socket has no use for it.
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return 0;
+}
+
+// Sleep for the current delay, and double it for the next failure
+static void back_off(void) {
+    backoff_ms = backoff_ms == 0 ? ACC_BACKOFF_MIN_MS : backoff_ms * 2;
+    if (backoff_ms > ACC_BACKOFF_MAX_MS) {
+        backoff_ms = ACC_BACKOFF_MAX_MS;
+    }
+    debug("Backing off from accepting for %d ms", backoff_ms);
+    struct timespec ts = { backoff_ms / 1000, (backoff_ms % 1000) * 1000000L };
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR) {
+    }
+}
+
+// Close up to a batch of the connections waiting on a listening socket,
+// using the reserve descriptor to accept them.  A flood of connections is
+// thus shed a batch at a time, with the caller backing off in between.
+static void shed_connections(int fd) {
+    if (reserve_fd < 0) {
+        return;
+    }
+    close(reserve_fd);
+    for (int i = 0; i < ACC_BATCH; i++) {
+        int connfd = accept(fd, NULL, NULL);
+        if (connfd >= 0) {
+            close(connfd);
+            shed++;
+        } else if (errno != ECONNABORTED && errno != EINTR) {
+            break;
+        }
+    }
+    reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+
+// Start a session for a connection, counting it before it can run
+static int start_session(int connfd) {
+    chla_session_opened();
+    int ret;
+    if (use_coroutines) {
+        ret = coro_spawn_near(chla_client_coroutine, (void *)(intptr_t)connfd,
+                              place_incoming_cpu(connfd));
+    } else {
+        pthread_t tid;
+        ret = pthread_create(&tid, NULL, chla_client_service, (void *)(intptr_t)connfd) ? -1 : 0;
+    }
+    if (ret) {
+        chla_session_closed();
+    }
+    return ret;
+}
+
+int acc_accept(int fd) {
+    // Get the reserve back if it could not be reopened after shedding
+    if (reserve_fd < 0) {
+        reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    }
+    for (int i = 0; i < ACC_BATCH; i++) {
+        int connfd = accept4(fd, NULL, NULL, use_coroutines ? SOCK_NONBLOCK : 0);
+        if (connfd >= 0) {
+            if (start_session(connfd)) {
+                error("Could not start a session for fd %d", connfd);
+                close(connfd);
+                refused++;
+                back_off();
+                return 0;
+            }
+            accepted++;
+            backoff_ms = 0;
+            continue;
+        }
+        switch (errno) {
+        case EAGAIN:
+#if EWOULDBLOCK != EAGAIN
+        case EWOULDBLOCK:
+#endif
+            return 0;
+        case EINTR:
+        case ECONNABORTED:
+        case EPERM:
+        case EPROTO:
+        case ENOPROTOOPT:
+        case ENETDOWN:
+        case ENETUNREACH:
+        case EHOSTDOWN:
+        case EHOSTUNREACH:
+        case ENONET:
+        case EOPNOTSUPP:
+            continue;
+        case EMFILE:
+        case ENFILE:
+            warn("Out of file descriptors: shedding connections");
+            shed_connections(fd);
+            back_off();
+            return 0;
+        case ENOBUFS:
+        case ENOMEM:
+            warn("Out of memory for connections");
+            back_off();
+            return 0;
+        default:
+            error("Listening socket %d is unusable", fd);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void acc_report(FILE *out) {
+    fprintf(out, "Connections: %lu accepted, %lu shed for lack of descriptors, "
+            "%lu closed for lack of resources\n", accepted, shed, refused);
+}
@@ -4,6 +4,11 @@
 #include "client_registry.h"
 #include "user_registry.h"
 #include "globals.h"
+#include "presence.h"
+#include "handle_index.h"
+#include "slab.h"
+#include "shm.h"
+#include "coro.h"
 #include "debug.h"
 
 struct client {
@@ -11,18 +16,29 @@ struct client {
     USER *user; // Reference to the user object (if logged in)
     MAILBOX *mailbox; // Reference to the mailbox object (if logged in)
     pthread_mutex_t lock; // Mutex for thread safety
+    CORO_LOCK send_lock; // Held while a packet is sent, which a coroutine may park in
     CLIENT_REGISTRY *creg; // Reference to the client registry
     int ref_count;
+    SHM_TRANSPORT *shm; // Shared-memory transport, if the client attached one;
+                        // set with both locks held
+    int suspended; // Nonzero while nothing may be sent (see client_suspend())
+    int node_link; // Nonzero once the peer has shown it is another node (see cluster.h)
 };
 
-// Internal function to send a packet to a client
+SLAB_POOL_DEFINE(client_pool, CLIENT)
+
+// Internal function to send a packet to a client; the send lock must be held
 int client_send_internal(CLIENT *client, CHLA_PACKET_HEADER *pkt, void *data) {
-    // Check if client is logged in and has a valid file descriptor
-    if (client->fd == -1 || client->user == NULL) {
+    // Check if client has a valid file descriptor.  A client that is not
+    // logged in must still be able to receive the ACK/NACK for its LOGIN.
+    if (client->fd == -1 || client->suspended) {
         return -1;
     }
 
-    // Send packet
+    // Send packet, over shared memory if the client has attached it
+    if (client->shm != NULL) {
+        return shm_send_packet(client->shm, pkt, data);
+    }
     if(proto_send_packet(client->fd, pkt, data)) {
         return -1;
     }
@@ -32,15 +48,19 @@ int client_send_internal(CLIENT *client, CHLA_PACKET_HEADER *pkt, void *data) {
 
 // Create a new CLIENT object
 CLIENT *client_create(CLIENT_REGISTRY *creg, int fd) {
-    CLIENT *client = malloc(sizeof(CLIENT));
+    CLIENT *client = slab_alloc(&client_pool);
     if (!client) return NULL;
 
     client->fd = fd;
     client->user = NULL;
     client->mailbox = NULL;
     pthread_mutex_init(&(client->lock), NULL);
+    coro_lock_init(&(client->send_lock));
     client->creg = creg;
     client->ref_count = 1; // Initial reference count is 1
+    client->shm = NULL;
+    client->suspended = 0;
+    client->node_link = 0;
 
     return client;
 }
@@ -63,7 +83,11 @@ void client_unref(CLIENT *client, char *why) {
         // If reference count reaches 0, free the client object
         pthread_mutex_unlock(&(client->lock));
         pthread_mutex_destroy(&(client->lock));
-        free(client);
+        coro_lock_destroy(&(client->send_lock));
+        if (client->shm != NULL) {
+            shm_detach(client->shm);
+        }
+        slab_free(&client_pool, client);
     } else {
         pthread_mutex_unlock(&(client->lock));
     }
@@ -71,28 +95,35 @@ void client_unref(CLIENT *client, char *why) {
 
 // Log this CLIENT in under a specified handle
 int client_login(CLIENT *client, char *handle) {
-    if (client->user != NULL) {
-        // Client already logged in
+    if (client->user != NULL || client->node_link) {
+        // Client already logged in, or a link from another node
         return -1;
     }
 
     // Register the user handle and create a new user object if necessary
-    client->user = ureg_register(user_registry, handle);
-    if (client->user == NULL) {
+    USER *user = ureg_register(user_registry, handle);
+    if (user == NULL) {
         // Failed to register user handle
         return -1;
     }
 
     // Create a new mailbox for the client
-    client->mailbox = mb_init(handle);
-    if (client->mailbox == NULL) {
+    MAILBOX *mailbox = mb_init(handle);
+    if (mailbox == NULL) {
         // Failed to create mailbox
         ureg_unregister(user_registry, handle); // Unregister user handle
-        client->user = NULL;
+        user_unref(user, "Client login failed");
         return -1;
     }
 
-    // Login successful
+    // Login successful; the lock is held so that other threads taking
+    // references to the user and mailbox see both or neither
+    pthread_mutex_lock(&(client->lock));
+    client->user = user;
+    client->mailbox = mailbox;
+    pthread_mutex_unlock(&(client->lock));
+    hidx_insert(handle);
+    presence_changed(handle, 1);
     return 0;
 }
 
@@ -103,47 +134,60 @@ int client_logout(CLIENT *client) {
         return -1;
     }
 
+    // Update client state first, so that no other thread takes a reference
+    // to the user or mailbox once they are being released
+    pthread_mutex_lock(&(client->lock));
+    USER *user = client->user;
+    MAILBOX *mailbox = client->mailbox;
+    client->user = NULL;
+    client->mailbox = NULL;
+    pthread_mutex_unlock(&(client->lock));
+
     // Get the user handle
-    char *handle = user_get_handle(client->user);
+    char *handle = user_get_handle(user);
+    presence_unsubscribe(client);
+    hidx_remove(handle);
 
     // Unregister user handle and free resources
-    user_unref(client->user, "Client logout");
     ureg_unregister(user_registry, handle);
-    mb_shutdown(client->mailbox);
-    mb_unref(client->mailbox, "Client logout");
-    // client_unref(client, "Client logout");
-    // mb_set_discard_hook(client->mailbox, NULL);
+    mb_shutdown(mailbox);
+    mb_unref(mailbox, "Client logout");
 
-
-    // Update client state
-    client->user = NULL;
-    client->mailbox = NULL;
+    // Only now that the client no longer shows up in a list of users may
+    // the change be sent, or a subscriber could see the list after it
+    presence_changed(handle, 0);
+    user_unref(user, "Client logout");
 
     return 0;
 }
 
 // Get the USER object for the specified logged-in CLIENT
 USER *client_get_user(CLIENT *client, int no_ref) {
-    if (client->user == NULL) {
-        return NULL;
-    }
     if (no_ref) {
         return client->user;
     }
-    return user_ref(client->user, "Client get user");
+    pthread_mutex_lock(&(client->lock));
+    USER *user = client->user;
+    if (user != NULL) {
+        user_ref(user, "Client get user");
+    }
+    pthread_mutex_unlock(&(client->lock));
+    return user;
 }
 
 
 // Get the MAILBOX for the specified logged-in CLIENT
 MAILBOX *client_get_mailbox(CLIENT *client, int no_ref) {
-    if (client->mailbox == NULL) {
-        return NULL;
-    }
     if (no_ref) {
         return client->mailbox;
     }
-    mb_ref(client->mailbox, "Client get mailbox");
-    return client->mailbox;
+    pthread_mutex_lock(&(client->lock));
+    MAILBOX *mailbox = client->mailbox;
+    if (mailbox != NULL) {
+        mb_ref(mailbox, "Client get mailbox");
+    }
+    pthread_mutex_unlock(&(client->lock));
+    return mailbox;
 }
 
 
@@ -154,15 +198,106 @@ int client_get_fd(CLIENT *client) {
 
 // Send a packet to a client
 int client_send_packet(CLIENT *client, CHLA_PACKET_HEADER *pkt, void *data) {
-    // Use client_send_internal to send packet
-    pthread_mutex_lock(&(client->lock));
+    // Use client_send_internal to send packet.  A coroutine may park while
+    // the packet is written, so the send lock is used rather than the mutex.
+    coro_lock(&(client->send_lock));
     if(client_send_internal(client, pkt, data)) {
+        coro_unlock(&(client->send_lock));
         return -1;
     }
+    coro_unlock(&(client->send_lock));
+    return 0;
+}
+
+// Send a packet whose payload is built while the send lock is held
+int client_send_built(CLIENT *client, CHLA_PACKET_HEADER *pkt,
+                      char *(*build)(void *arg, size_t *lengthp), void *arg) {
+    coro_lock(&(client->send_lock));
+    size_t length = 0;
+    char *payload = build(arg, &length);
+    if (payload == NULL) {
+        coro_unlock(&(client->send_lock));
+        return -1;
+    }
+    pkt->payload_length = htonl(length);
+    int ret = client_send_internal(client, pkt, payload);
+    coro_unlock(&(client->send_lock));
+    free(payload);
+    return ret;
+}
+
+// Receive a packet from a client, over shared memory if it has attached it
+int client_recv_packet(CLIENT *client, CHLA_PACKET_HEADER *pkt, void **data) {
+    if (client->shm != NULL) {
+        return shm_recv_packet(client->shm, pkt, data);
+    }
+    return proto_recv_packet(client->fd, pkt, data);
+}
+
+// Switch a client to a shared-memory transport
+int client_attach_shm(CLIENT *client, uint32_t msgid) {
+    CHLA_PACKET_HEADER pkt;
+    memset(&pkt, 0, sizeof(CHLA_PACKET_HEADER));
+    pkt.type = CHLA_ACK_PKT;
+    pkt.msgid = htonl(msgid);
+
+    // The ACK is the last packet sent on the connection itself
+    coro_lock(&(client->send_lock));
+    SHM_TRANSPORT *shm = client->shm;
+    if (shm == NULL) {
+        shm = shm_attach(client->fd, &pkt);
+        pthread_mutex_lock(&(client->lock));
+        client->shm = shm;
+        pthread_mutex_unlock(&(client->lock));
+    }
+    coro_unlock(&(client->send_lock));
+    return shm != NULL ? 0 : -1;
+}
+
+// Check whether a client has attached a shared-memory transport
+int client_has_shm(CLIENT *client) {
+    pthread_mutex_lock(&(client->lock));
+    int ret = client->shm != NULL;
     pthread_mutex_unlock(&(client->lock));
+    return ret;
+}
+
+// Mark a connection as a link from another node of the cluster
+int client_set_node_link(CLIENT *client) {
+    pthread_mutex_lock(&(client->lock));
+    int ret = client->user != NULL ? -1 : 0;
+    if (ret == 0) {
+        client->node_link = 1;
+    }
+    pthread_mutex_unlock(&(client->lock));
+    return ret;
+}
+
+// Check whether a connection is a link from another node
+int client_is_node_link(CLIENT *client) {
+    pthread_mutex_lock(&(client->lock));
+    int ret = client->node_link;
+    pthread_mutex_unlock(&(client->lock));
+    return ret;
+}
+
+// Stop sending packets to a client, once one being sent has been
+int client_suspend(CLIENT *client, const struct timespec *deadline) {
+    if (coro_lock_timed(&(client->send_lock), deadline)) {
+        return -1;
+    }
+    client->suspended = 1;
+    coro_unlock(&(client->send_lock));
     return 0;
 }
 
+// Let packets be sent to a client again
+void client_unsuspend(CLIENT *client) {
+    coro_lock(&(client->send_lock));
+    client->suspended = 0;
+    coro_unlock(&(client->send_lock));
+}
+
 // Send an ACK packet to a client
 int client_send_ack(CLIENT *client, uint32_t msgid, void *data, size_t datalen) {
     // Create and send ACK packet
@@ -170,7 +305,7 @@ int client_send_ack(CLIENT *client, uint32_t msgid, void *data, size_t datalen)
     memset(&pkt, 0, sizeof(CHLA_PACKET_HEADER));
     pkt.type = CHLA_ACK_PKT;
     pkt.msgid = htonl(msgid);
-    pkt.payload_length = datalen;
+    pkt.payload_length = htonl(datalen);
 
     // Convert multi-byte fields in the header to network byte order
     // pkt.type = htons(pkt.type);
@@ -3,6 +3,7 @@
 #include <pthread.h>
 #include <unistd.h>
 #include "client_registry.h"
+#include "intern.h"
 #include "csapp.h"
 #include "debug.h"
 
@@ -10,7 +11,8 @@
 struct client_registry {
     pthread_mutex_t mutex; // Mutex for thread safety
     int client_count;
-    CLIENT *clients[MAX_CLIENTS]; // Array to store pointers to registered clients
+    int capacity; // Number of pointers the array has room for
+    CLIENT **clients; // Array to store pointers to registered clients, grown as needed
     sem_t semaphore; // Semaphore to block until all clients are unregistered
 };
 
@@ -22,6 +24,14 @@ CLIENT_REGISTRY *creg_init() {
         return NULL;
     }
 
+    cr->capacity = CREG_INITIAL_CAPACITY;
+    cr->clients = malloc(cr->capacity * sizeof(CLIENT *));
+    if (cr->clients == NULL) {
+        perror("Error: Unable to allocate memory for client registry");
+        free(cr);
+        return NULL;
+    }
+
     // Initialize mutex and semaphore
     pthread_mutex_init(&cr->mutex, NULL);
     sem_init(&cr->semaphore, 0, 0);
@@ -47,6 +57,7 @@ void creg_fini(CLIENT_REGISTRY *cr) {
     sem_destroy(&cr->semaphore);
 
     // Free the client registry itself
+    free(cr->clients);
     free(cr);
     debug("Client registry finalized\n");
 }
@@ -60,16 +71,25 @@ CLIENT *creg_register(CLIENT_REGISTRY *cr, int fd) {
 
     pthread_mutex_lock(&cr->mutex);
 
+    // Make room for the client if the registry is full
+    if (cr->client_count == cr->capacity) {
+        CLIENT **grown = realloc(cr->clients, 2 * cr->capacity * sizeof(CLIENT *));
+        if (grown != NULL) {
+            cr->clients = grown;
+            cr->capacity *= 2;
+        }
+    }
+
     // Add the client to the registry if there's space
-    if (cr->client_count < MAX_CLIENTS) {
+    if (cr->client_count < cr->capacity) {
         cr->clients[cr->client_count++] = client;
         client_ref(client, "Registering client");
         debug("Client registered\n");
     } else {
-        // If the registry is full, free the client and return NULL
-        client_unref(client, "Max clients reached");
+        // If the registry could not grow, free the client and return NULL
+        client_unref(client, "Registry full");
         client = NULL;
-        debug("Client registration failed: Maximum clients reached\n");
+        debug("Client registration failed: Registry could not grow\n");
     }
 
     pthread_mutex_unlock(&cr->mutex);
@@ -140,6 +160,33 @@ CLIENT **creg_all_clients(CLIENT_REGISTRY *cr) {
     return client_list;
 }
 
+CLIENT *creg_lookup(CLIENT_REGISTRY *cr, char *handle) {
+    if (cr == NULL || handle == NULL) return NULL;
+
+    // A handle that is not interned is not in use by any client
+    char *key = intern_lookup(handle);
+    if (key == NULL) return NULL;
+
+    // Lock the mutex before accessing shared data
+    pthread_mutex_lock(&cr->mutex);
+
+    // Search for a logged-in client with the same interned handle
+    CLIENT *found = NULL;
+    for (int i = 0; i < cr->client_count; i++) {
+        USER *user = client_get_user(cr->clients[i], 1);
+        if (user != NULL && user_get_handle(user) == key) {
+            found = client_ref(cr->clients[i], "Looking up client by handle");
+            break;
+        }
+    }
+
+    // Unlock the mutex
+    pthread_mutex_unlock(&cr->mutex);
+    intern_unref(key);
+
+    return found;
+}
+
 void creg_shutdown_all(CLIENT_REGISTRY *cr) {
     if (cr == NULL) return;
 
@@ -151,10 +198,14 @@ void creg_shutdown_all(CLIENT_REGISTRY *cr) {
         shutdown(client_get_fd(cr->clients[i]), SHUT_RDWR);
     }
 
-    // Unlock the mutex
+    // Wait until all clients are unregistered.  The semaphore is posted
+    // each time the registry empties, so it may have been posted by
+    // clients that came and went before: check the count again each time.
+    while (cr->client_count > 0) {
+        pthread_mutex_unlock(&cr->mutex);
+        P(&cr->semaphore); // sem_wait
+        pthread_mutex_lock(&cr->mutex);
+    }
     pthread_mutex_unlock(&cr->mutex);
-
-    // Wait until all clients are unregistered
-    P(&cr->semaphore); // sem_wait
     debug("All clients shutdown\n");
 }
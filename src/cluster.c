@@ -0,0 +1,340 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <poll.h>
+#include <errno.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/tcp.h>
+#include "cluster.h"
+#include "coro.h"
+#include "protocol.h"
+#include "csapp.h"
+#include "debug.h"
+
+// State of a node in the cluster, and of the link to it
+typedef struct node {
+    char *host;
+    char *port;
+    int fd; // Connection to the node, non-blocking, or -1 if not connected
+    CORO_LOCK lock; // Serializes requests on the link; held across coro_poll()
+} NODE;
+
+// The cluster state; nnodes is zero when not in cluster mode
+static struct cluster {
+    int nnodes;
+    int self;
+    NODE nodes[MAX_NODES];
+    char secret[MAX_SECRET]; // Shown by a link to prove it comes from a node
+    size_t secret_length;
+} cluster;
+
+// FNV-1a hash of a handle
+static uint32_t hash_handle(char *handle) {
+    uint32_t hash = 2166136261u;
+    for (unsigned char *p = (unsigned char *)handle; *p != '\0'; p++) {
+        hash ^= *p;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Read the cluster secret from a file
+static int read_secret(char *path) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return -1;
+    }
+    size_t length = fread(cluster.secret, 1, MAX_SECRET, f);
+    int more = fgetc(f) != EOF;
+    fclose(f);
+    if (length > 0 && cluster.secret[length - 1] == '\n') {
+        length--;
+    }
+    if (length == 0 || more) {
+        return -1;
+    }
+    cluster.secret_length = length;
+    return 0;
+}
+
+int cluster_init(char *nodes, int self, char *secret_path) {
+    if (secret_path == NULL || read_secret(secret_path)) {
+        return -1;
+    }
+    char *list = strdup(nodes);
+    if (list == NULL) {
+        return -1;
+    }
+    int n = 0;
+    char *saveptr;
+    for (char *tok = strtok_r(list, ",", &saveptr); tok != NULL; tok = strtok_r(NULL, ",", &saveptr)) {
+        char *colon = strrchr(tok, ':');
+        if (n == MAX_NODES || colon == NULL) {
+            free(list);
+            cluster_fini();
+            return -1;
+        }
+        *colon = '\0';
+        cluster.nodes[n].host = strdup(tok);
+        cluster.nodes[n].port = strdup(colon + 1);
+        cluster.nodes[n].fd = -1;
+        coro_lock_init(&cluster.nodes[n].lock);
+        cluster.nnodes = ++n;
+    }
+    free(list);
+    if (self < 0 || self >= n) {
+        cluster_fini();
+        return -1;
+    }
+    cluster.self = self;
+    debug("Cluster initialized: node %d of %d", self, n);
+    return 0;
+}
+
+void cluster_fini(void) {
+    for (int i = 0; i < cluster.nnodes; i++) {
+        NODE *node = &cluster.nodes[i];
+        if (node->fd >= 0) {
+            close(node->fd);
+        }
+        coro_lock_destroy(&node->lock);
+        free(node->host);
+        free(node->port);
+    }
+    cluster.nnodes = 0;
+    memset(cluster.secret, 0, sizeof(cluster.secret));
+    cluster.secret_length = 0;
+}
+
+int cluster_check_secret(void *payload, size_t length) {
+    if (cluster.nnodes == 0 || payload == NULL || length != cluster.secret_length) {
+        return -1;
+    }
+    // Take as long whatever the bytes are, so as not to give the secret away
+    unsigned char diff = 0;
+    for (size_t i = 0; i < length; i++) {
+        diff |= ((unsigned char *)payload)[i] ^ (unsigned char)cluster.secret[i];
+    }
+    return diff == 0 ? 0 : -1;
+}
+
+int cluster_owner(char *handle) {
+    if (cluster.nnodes == 0) {
+        return 0;
+    }
+    return hash_handle(handle) % cluster.nnodes;
+}
+
+int cluster_is_local(char *handle) {
+    return cluster.nnodes == 0 || cluster_owner(handle) == cluster.self;
+}
+
+// Fill in the header of a request on a link
+static void init_header(CHLA_PACKET_HEADER *hdr, CHLA_PACKET_TYPE type, uint8_t flags,
+                        uint32_t msgid, size_t length) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    memset(hdr, 0, sizeof(CHLA_PACKET_HEADER));
+    hdr->type = type;
+    hdr->flags = flags;
+    hdr->payload_length = htonl(length);
+    hdr->msgid = htonl(msgid);
+    hdr->timestamp_sec = htonl(ts.tv_sec);
+    hdr->timestamp_nsec = htonl(ts.tv_nsec);
+}
+
+// Wait on a link for the ACK or NACK of the request with a msgid, skipping
+// anything else, such as the keepalive probes of the peer.  Returns the
+// type of the reply, or -1 if the link failed.  The node must be locked.
+static int await_reply(NODE *node, uint32_t msgid, void **replyp, size_t *reply_lengthp) {
+    while (1) {
+        CHLA_PACKET_HEADER reply;
+        void *payload = NULL;
+        if (proto_recv_packet(node->fd, &reply, &payload)) {
+            return -1;
+        }
+        if ((reply.type == CHLA_ACK_PKT || reply.type == CHLA_NACK_PKT)
+            && ntohl(reply.msgid) == msgid) {
+            if (replyp != NULL) {
+                *replyp = payload;
+                *reply_lengthp = ntohl(reply.payload_length);
+            } else {
+                free(payload);
+            }
+            return reply.type;
+        }
+        free(payload);
+    }
+}
+
+// Check whether an open link can still carry a request.  Whatever the peer
+// has sent while the link was idle can only be keepalive probes, which are
+// discarded; an end of file means that the peer has closed the link, such
+// as for being idle.  The node must be locked.
+static int link_alive(NODE *node) {
+    struct pollfd pfd = { .fd = node->fd, .events = POLLIN };
+    while (poll(&pfd, 1, 0) == 1) {
+        if (pfd.revents & (POLLHUP | POLLERR | POLLNVAL)) {
+            return 0;
+        }
+        CHLA_PACKET_HEADER hdr;
+        void *payload = NULL;
+        if (proto_recv_packet(node->fd, &hdr, &payload)) {
+            return 0;
+        }
+        free(payload);
+    }
+    return 1;
+}
+
+// Connect to a node without blocking: the socket is non-blocking, so that
+// a session running as a coroutine (see coro.h) parks in coro_poll() while
+// the connection is made and while it waits for a reply, rather than
+// blocking the other sessions of its scheduler thread, one of which may be
+// serving a request from that very node
+static int link_connect(NODE *node) {
+    struct addrinfo hints, *list;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+    if (getaddrinfo(node->host, node->port, &hints, &list)) {
+        return -1;
+    }
+    int fd = -1;
+    for (struct addrinfo *p = list; p != NULL && fd < 0; p = p->ai_next) {
+        fd = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, p->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+        if (connect(fd, p->ai_addr, p->ai_addrlen) < 0) {
+            struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+            int err = -1;
+            socklen_t len = sizeof(err);
+            if (errno != EINPROGRESS || coro_poll(&pfd, 1) < 0
+                || getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+                close(fd);
+                fd = -1;
+            }
+        }
+    }
+    freeaddrinfo(list);
+    return fd;
+}
+
+// Open the link to a node, if it is not open or no longer usable, and
+// show the peer the cluster secret.  The node must be locked.
+static int link_open(NODE *node) {
+    if (node->fd >= 0) {
+        if (link_alive(node)) {
+            return 0;
+        }
+        debug("Link to %s:%s was closed by the peer", node->host, node->port);
+        close(node->fd);
+    }
+    node->fd = link_connect(node);
+    if (node->fd < 0) {
+        return -1;
+    }
+    // A request is written as a header and a payload and then waited for,
+    // which Nagle's algorithm would hold up until the peer's delayed ACK
+    int one = 1;
+    setsockopt(node->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    CHLA_PACKET_HEADER hdr;
+    init_header(&hdr, CHLA_LINK_PKT, 0, 0, cluster.secret_length);
+    if (proto_send_packet(node->fd, &hdr, cluster.secret) || await_reply(node, 0, NULL, NULL) != CHLA_ACK_PKT) {
+        debug("Link to %s:%s was refused", node->host, node->port);
+        close(node->fd);
+        node->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+// Send one request over the link to a node and wait for the ACK or NACK.
+// The request is never sent twice, since the peer may have acted on it
+// even if the link failed before the reply came back.
+static int link_request(NODE *node, CHLA_PACKET_TYPE type, uint8_t flags, uint32_t msgid,
+                        void *payload, size_t length, void **replyp, size_t *reply_lengthp) {
+    CHLA_PACKET_HEADER hdr;
+    init_header(&hdr, type, flags, msgid, length);
+
+    coro_lock(&node->lock);
+    if (link_open(node)) {
+        coro_unlock(&node->lock);
+        return -1;
+    }
+    int ret = -1;
+    if (proto_send_packet(node->fd, &hdr, payload) == 0) {
+        ret = await_reply(node, msgid, replyp, reply_lengthp);
+    }
+    if (ret < 0) {
+        debug("Link to %s:%s failed", node->host, node->port);
+        close(node->fd);
+        node->fd = -1;
+    }
+    coro_unlock(&node->lock);
+    return ret == CHLA_ACK_PKT ? 0 : -1;
+}
+
+int cluster_forward_send(char *sender, char *receiver, uint32_t msgid,
+                         uint8_t flags, void *body, size_t length) {
+    if (cluster.nnodes == 0) {
+        return -1;
+    }
+    // The forwarded payload is "sender\r\nreceiver\r\nbody"
+    size_t slen = strlen(sender), rlen = strlen(receiver);
+    size_t fwd_length = slen + 2 + rlen + 2 + length;
+    char *fwd = malloc(fwd_length);
+    if (fwd == NULL) {
+        return -1;
+    }
+    memcpy(fwd, sender, slen);
+    memcpy(fwd + slen, "\r\n", 2);
+    memcpy(fwd + slen + 2, receiver, rlen);
+    memcpy(fwd + slen + 2 + rlen, "\r\n", 2);
+    memcpy(fwd + slen + 2 + rlen + 2, body, length);
+
+    int ret = link_request(&cluster.nodes[cluster_owner(receiver)], CHLA_FWD_SEND_PKT,
+                           flags, msgid, fwd, fwd_length, NULL, NULL);
+    free(fwd);
+    return ret;
+}
+
+// Send a request to all the other nodes, and join their replies together
+static char *gather_users(CHLA_PACKET_TYPE type, void *payload, size_t payload_length, size_t *lengthp) {
+    char *list = NULL;
+    size_t length = 0;
+    for (int i = 0; i < cluster.nnodes; i++) {
+        if (i == cluster.self) {
+            continue;
+        }
+        void *reply = NULL;
+        size_t reply_length = 0;
+        if (link_request(&cluster.nodes[i], type, 0, 0, payload, payload_length, &reply, &reply_length)
+            || reply == NULL) {
+            free(reply);
+            continue;
+        }
+        char *grown = realloc(list, length + reply_length);
+        if (grown != NULL) {
+            list = grown;
+            memcpy(list + length, reply, reply_length);
+            length += reply_length;
+        }
+        free(reply);
+    }
+    *lengthp = length;
+    return list;
+}
+
+char *cluster_users(size_t *lengthp) {
+    return gather_users(CHLA_FWD_USERS_PKT, NULL, 0, lengthp);
+}
+
+char *cluster_users_query(void *query, size_t length, size_t *lengthp) {
+    return gather_users(CHLA_FWD_USERS_QUERY_PKT, query, length, lengthp);
+}
@@ -0,0 +1,470 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <ucontext.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "coro.h"
+#include "placement.h"
+#include "debug.h"
+
+#define CORO_EVENTS 64
+#define CORO_WATCH_BUCKETS 256
+
+typedef struct scheduler SCHEDULER;
+typedef struct watch WATCH;
+
+// A coroutine
+typedef struct coro {
+    ucontext_t ctx; // Saved context while the coroutine is suspended
+    void *stack; // Base of the mapping holding the guard page and the stack
+    void (*fn)(void *);
+    void *arg;
+    int done; // Set when fn has returned
+    int parked; // Set while waiting in coro_poll()
+    SCHEDULER *sched; // The scheduler thread the coroutine runs on
+    struct coro *next; // Next in a run queue, inbox or lock queue
+} CORO;
+
+// A coroutine waiting in coro_poll() for a descriptor
+typedef struct waiter {
+    CORO *co;
+    short events; // Events it waits for
+    struct waiter *next;
+} WAITER;
+
+// A descriptor that a scheduler watches for the coroutines waiting on it.
+// A descriptor is added to the epoll set of the scheduler once, however
+// many of its coroutines wait on it, with the union of their events.
+struct watch {
+    int fd;
+    uint32_t events; // Events registered with epoll
+    WAITER *waiters;
+    WATCH *next; // Next in the hash chain
+};
+
+// A scheduler thread
+struct scheduler {
+    pthread_t tid;
+    int epfd; // Readiness of descriptors awaited by parked coroutines
+    int wakefd; // Event fd signaled when coroutines arrive in the inbox
+    ucontext_t ctx; // Context of the scheduler loop
+    CORO *ready; // Coroutines ready to run (touched only by this thread)
+    CORO *ready_tail;
+    pthread_mutex_t mutex; // Protects the inbox and the stack pool
+    CORO *inbox; // Coroutines spawned by other threads
+    void *stack_pool; // Free stacks, which stay on the node of the thread
+    int cpu; // CPU the thread is pinned to, or -1
+    int node; // NUMA node of that CPU, or -1
+    WATCH *watches[CORO_WATCH_BUCKETS]; // Watched descriptors (touched only by this thread)
+};
+
+static SCHEDULER *schedulers;
+static int nschedulers;
+static unsigned int next_scheduler;
+
+// The coroutine running on this thread, if any
+static __thread CORO *current;
+
+// Get a stack from the pool of a scheduler, or map a new one with a guard
+// page below it on the node of the scheduler
+static void *stack_alloc(SCHEDULER *sched) {
+    pthread_mutex_lock(&sched->mutex);
+    void *stack = sched->stack_pool;
+    if (stack != NULL) {
+        sched->stack_pool = *(void **)((char *)stack + getpagesize());
+    }
+    pthread_mutex_unlock(&sched->mutex);
+    if (stack != NULL) {
+        return stack;
+    }
+    size_t page = getpagesize();
+    stack = mmap(NULL, page + CORO_STACK_SIZE, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (stack == MAP_FAILED) {
+        return NULL;
+    }
+    mprotect(stack, page, PROT_NONE);
+    if (sched->node >= 0) {
+        place_bind((char *)stack + page, CORO_STACK_SIZE, sched->node);
+    }
+    return stack;
+}
+
+// Return a stack to the pool of a scheduler; the link is kept in its
+// lowest usable word
+static void stack_free(SCHEDULER *sched, void *stack) {
+    pthread_mutex_lock(&sched->mutex);
+    *(void **)((char *)stack + getpagesize()) = sched->stack_pool;
+    sched->stack_pool = stack;
+    pthread_mutex_unlock(&sched->mutex);
+}
+
+// Append a coroutine to the run queue of its scheduler
+static void make_ready(CORO *co) {
+    SCHEDULER *sched = co->sched;
+    co->next = NULL;
+    if (sched->ready_tail == NULL) {
+        sched->ready = co;
+    } else {
+        sched->ready_tail->next = co;
+    }
+    sched->ready_tail = co;
+}
+
+// Entry point of every coroutine
+static void trampoline(void) {
+    CORO *co = current;
+    co->fn(co->arg);
+    co->done = 1;
+    // Returning resumes the scheduler through uc_link
+}
+
+// Run a coroutine until it parks or terminates
+static void run(SCHEDULER *sched, CORO *co) {
+    current = co;
+    swapcontext(&sched->ctx, &co->ctx);
+    current = NULL;
+    if (co->done) {
+        stack_free(sched, co->stack);
+        free(co);
+    }
+}
+
+// The loop run by each scheduler thread
+static void *scheduler_loop(void *arg) {
+    SCHEDULER *sched = arg;
+    struct epoll_event events[CORO_EVENTS];
+    if (sched->cpu >= 0) {
+        place_pin(sched->cpu);
+    }
+    while (1) {
+        // Run everything that is ready
+        while (sched->ready != NULL) {
+            CORO *co = sched->ready;
+            sched->ready = co->next;
+            if (sched->ready == NULL) {
+                sched->ready_tail = NULL;
+            }
+            run(sched, co);
+        }
+
+        int n = epoll_wait(sched->epfd, events, CORO_EVENTS, -1);
+        for (int i = 0; i < n; i++) {
+            WATCH *watch = events[i].data.ptr;
+            if (watch != NULL) {
+                // Wake every coroutine waiting on the descriptor; one may
+                // wait on several descriptors that are ready at once
+                for (WAITER *w = watch->waiters; w != NULL; w = w->next) {
+                    if (w->co->parked) {
+                        w->co->parked = 0;
+                        make_ready(w->co);
+                    }
+                }
+                continue;
+            }
+            // New coroutines have been spawned for this thread, or
+            // coroutines waiting for a lock have been given it
+            uint64_t count;
+            if (read(sched->wakefd, &count, sizeof(count)) < 0) {
+                debug("Scheduler wakeup read failed");
+            }
+            pthread_mutex_lock(&sched->mutex);
+            CORO *inbox = sched->inbox;
+            sched->inbox = NULL;
+            pthread_mutex_unlock(&sched->mutex);
+            while (inbox != NULL) {
+                CORO *next = inbox->next;
+                make_ready(inbox);
+                inbox = next;
+            }
+        }
+    }
+    return NULL;
+}
+
+int coro_init(int nthreads) {
+    schedulers = calloc(nthreads, sizeof(SCHEDULER));
+    if (schedulers == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < nthreads; i++) {
+        SCHEDULER *sched = &schedulers[i];
+        pthread_mutex_init(&sched->mutex, NULL);
+        sched->cpu = place_cpu(PLACE_IO, i);
+        sched->node = sched->cpu >= 0 ? place_node(sched->cpu) : -1;
+        sched->epfd = epoll_create1(EPOLL_CLOEXEC);
+        sched->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (sched->epfd < 0 || sched->wakefd < 0) {
+            return -1;
+        }
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+        if (epoll_ctl(sched->epfd, EPOLL_CTL_ADD, sched->wakefd, &ev) < 0
+            || pthread_create(&sched->tid, NULL, scheduler_loop, sched)) {
+            return -1;
+        }
+        nschedulers = i + 1;
+    }
+    debug("Started %d coroutine schedulers", nthreads);
+    return 0;
+}
+
+// Choose the scheduler for a new coroutine: the one pinned to a CPU, or
+// else one on the same node, or else the next in rotation
+static SCHEDULER *choose_scheduler(int cpu) {
+    if (cpu >= 0) {
+        SCHEDULER *near = NULL;
+        int node = place_node(cpu);
+        for (int i = 0; i < nschedulers; i++) {
+            if (schedulers[i].cpu == cpu) {
+                return &schedulers[i];
+            }
+            if (near == NULL && schedulers[i].node == node) {
+                near = &schedulers[i];
+            }
+        }
+        if (near != NULL) {
+            return near;
+        }
+    }
+    return &schedulers[__atomic_fetch_add(&next_scheduler, 1, __ATOMIC_RELAXED) % nschedulers];
+}
+
+// Make a coroutine parked outside coro_poll() ready to run again; this
+// may be called from any thread
+static void wake(CORO *co) {
+    SCHEDULER *sched = co->sched;
+    pthread_mutex_lock(&sched->mutex);
+    co->next = sched->inbox;
+    sched->inbox = co;
+    pthread_mutex_unlock(&sched->mutex);
+    uint64_t one = 1;
+    if (write(sched->wakefd, &one, sizeof(one)) < 0) {
+        debug("Scheduler wakeup write failed");
+    }
+}
+
+int coro_spawn(void (*fn)(void *), void *arg) {
+    return coro_spawn_near(fn, arg, -1);
+}
+
+int coro_spawn_near(void (*fn)(void *), void *arg, int cpu) {
+    if (nschedulers == 0) {
+        return -1;
+    }
+    CORO *co = calloc(1, sizeof(CORO));
+    if (co == NULL) {
+        return -1;
+    }
+    co->sched = choose_scheduler(cpu);
+    co->stack = stack_alloc(co->sched);
+    if (co->stack == NULL) {
+        free(co);
+        return -1;
+    }
+    co->fn = fn;
+    co->arg = arg;
+    getcontext(&co->ctx);
+    co->ctx.uc_stack.ss_sp = (char *)co->stack + getpagesize();
+    co->ctx.uc_stack.ss_size = CORO_STACK_SIZE;
+    co->ctx.uc_link = &co->sched->ctx;
+    makecontext(&co->ctx, trampoline, 0);
+
+    // Hand the coroutine to its scheduler thread
+    wake(co);
+    return 0;
+}
+
+// Find the watch of a descriptor, or NULL
+static WATCH **find_watch(SCHEDULER *sched, int fd) {
+    WATCH **wp = &sched->watches[(unsigned int)fd % CORO_WATCH_BUCKETS];
+    while (*wp != NULL && (*wp)->fd != fd) {
+        wp = &(*wp)->next;
+    }
+    return wp;
+}
+
+// Bring the events registered for a watched descriptor in line with those
+// its waiters wait for, and stop watching it once none is left
+static void update_watch(SCHEDULER *sched, WATCH **wp) {
+    WATCH *watch = *wp;
+    if (watch->waiters == NULL) {
+        epoll_ctl(sched->epfd, EPOLL_CTL_DEL, watch->fd, NULL);
+        *wp = watch->next;
+        free(watch);
+        return;
+    }
+    uint32_t events = 0;
+    for (WAITER *w = watch->waiters; w != NULL; w = w->next) {
+        events |= w->events;
+    }
+    if (events != watch->events) {
+        struct epoll_event ev = { .events = events, .data.ptr = watch };
+        if (epoll_ctl(sched->epfd, EPOLL_CTL_MOD, watch->fd, &ev) == 0) {
+            watch->events = events;
+        }
+    }
+}
+
+// Add a coroutine to the waiters on a descriptor.  Returns -1 if the
+// descriptor cannot be watched.
+static int add_waiter(CORO *co, struct pollfd *pfd) {
+    SCHEDULER *sched = co->sched;
+    WAITER *w = malloc(sizeof(WAITER));
+    if (w == NULL) {
+        return -1;
+    }
+    w->co = co;
+    w->events = pfd->events;
+    WATCH **wp = find_watch(sched, pfd->fd);
+    if (*wp == NULL) {
+        WATCH *watch = malloc(sizeof(WATCH));
+        struct epoll_event ev = { .events = pfd->events, .data.ptr = watch };
+        if (watch == NULL || epoll_ctl(sched->epfd, EPOLL_CTL_ADD, pfd->fd, &ev) < 0) {
+            free(watch);
+            free(w);
+            return -1;
+        }
+        watch->fd = pfd->fd;
+        watch->events = pfd->events;
+        watch->waiters = NULL;
+        watch->next = NULL;
+        *wp = watch;
+    }
+    w->next = (*wp)->waiters;
+    (*wp)->waiters = w;
+    update_watch(sched, wp);
+    return 0;
+}
+
+// Remove a coroutine from the waiters on a descriptor, if it is one
+static void remove_waiter(CORO *co, int fd) {
+    WATCH **wp = find_watch(co->sched, fd);
+    if (*wp == NULL) {
+        return;
+    }
+    for (WAITER **pw = &(*wp)->waiters; *pw != NULL; pw = &(*pw)->next) {
+        if ((*pw)->co == co) {
+            WAITER *w = *pw;
+            *pw = w->next;
+            free(w);
+            update_watch(co->sched, wp);
+            return;
+        }
+    }
+}
+
+int coro_poll(struct pollfd *pfds, nfds_t nfds) {
+    CORO *co = current;
+    if (co == NULL) {
+        return poll(pfds, nfds, -1);
+    }
+    while (1) {
+        // Check first, so that a coroutine that need not wait does not park
+        int n = poll(pfds, nfds, 0);
+        if (n != 0) {
+            return n;
+        }
+
+        // Park until one of the descriptors is ready
+        int registered = 0;
+        for (nfds_t i = 0; i < nfds; i++) {
+            if (pfds[i].fd >= 0 && add_waiter(co, &pfds[i]) == 0) {
+                registered++;
+            } else {
+                pfds[i].revents = 0;
+            }
+        }
+        if (registered == 0) {
+            errno = EINVAL;
+            return -1;
+        }
+        co->parked = 1;
+        swapcontext(&co->ctx, &co->sched->ctx);
+
+        // Resumed by the scheduler: stop waiting on the descriptors
+        for (nfds_t i = 0; i < nfds; i++) {
+            if (pfds[i].fd >= 0) {
+                remove_waiter(co, pfds[i].fd);
+            }
+        }
+    }
+}
+
+void coro_lock_init(CORO_LOCK *lock) {
+    pthread_mutex_init(&lock->mutex, NULL);
+    pthread_cond_init(&lock->cond, NULL);
+    lock->locked = 0;
+    lock->thread_waiters = 0;
+    lock->head = lock->tail = NULL;
+}
+
+void coro_lock_destroy(CORO_LOCK *lock) {
+    pthread_mutex_destroy(&lock->mutex);
+    pthread_cond_destroy(&lock->cond);
+}
+
+int coro_lock_timed(CORO_LOCK *lock, const struct timespec *deadline) {
+    CORO *co = current;
+    pthread_mutex_lock(&lock->mutex);
+    if (!lock->locked) {
+        lock->locked = 1;
+        pthread_mutex_unlock(&lock->mutex);
+        return 0;
+    }
+    if (co != NULL) {
+        // Queue up and park; the lock is handed over on wakeup
+        co->next = NULL;
+        if (lock->tail == NULL) {
+            lock->head = co;
+        } else {
+            lock->tail->next = co;
+        }
+        lock->tail = co;
+        pthread_mutex_unlock(&lock->mutex);
+        swapcontext(&co->ctx, &co->sched->ctx);
+        return 0;
+    }
+    int err = 0;
+    lock->thread_waiters++;
+    while (lock->locked && err == 0) {
+        err = deadline != NULL ? pthread_cond_timedwait(&lock->cond, &lock->mutex, deadline)
+            : pthread_cond_wait(&lock->cond, &lock->mutex);
+    }
+    lock->thread_waiters--;
+    int ret = -1;
+    if (!lock->locked) {
+        lock->locked = 1;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&lock->mutex);
+    return ret;
+}
+
+void coro_lock(CORO_LOCK *lock) {
+    coro_lock_timed(lock, NULL);
+}
+
+void coro_unlock(CORO_LOCK *lock) {
+    pthread_mutex_lock(&lock->mutex);
+    CORO *co = lock->head;
+    if (co != NULL) {
+        // Hand the lock to the first coroutine in line
+        lock->head = co->next;
+        if (lock->head == NULL) {
+            lock->tail = NULL;
+        }
+        pthread_mutex_unlock(&lock->mutex);
+        wake(co);
+        return;
+    }
+    lock->locked = 0;
+    if (lock->thread_waiters > 0) {
+        pthread_cond_signal(&lock->cond);
+    }
+    pthread_mutex_unlock(&lock->mutex);
+}
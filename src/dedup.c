@@ -0,0 +1,154 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include "dedup.h"
+#include "intern.h"
+#include "timer.h"
+#include "debug.h"
+
+#define DEDUP_SENDERS 256 // Buckets of the table of senders
+#define DEDUP_BUCKETS 64 // Hash chains of the msgids of one sender
+
+// A recorded msgid
+typedef struct dedup_record {
+    uint32_t msgid;
+    int next; // Next record in the same hash chain, or -1
+    uint64_t time; // Time it was recorded (see tw_now())
+} DEDUP_RECORD;
+
+// The recent msgids of one sender, in a ring ordered by age and hashed
+typedef struct sender {
+    char *handle; // Interned handle, for which a reference is held
+    struct sender *next; // Next sender in the same bucket
+    int oldest; // Index of the oldest record in the ring
+    int count; // Number of records in the ring
+    int chains[DEDUP_BUCKETS]; // First record in each hash chain, or -1
+    DEDUP_RECORD records[DEDUP_CAPACITY];
+} SENDER;
+
+static uint64_t window;
+
+static struct sender_table {
+    pthread_mutex_t mutex; // Protects all senders
+    SENDER *buckets[DEDUP_SENDERS];
+} table = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+void dedup_set_window(int ms) {
+    window = ms;
+}
+
+// Check whether the newest record of a sender has aged out of the window
+static int stale(SENDER *sender, uint64_t now) {
+    if (sender->count == 0) {
+        return 1;
+    }
+    DEDUP_RECORD *newest = &sender->records[(sender->oldest + sender->count - 1) % DEDUP_CAPACITY];
+    return newest->time + window <= now;
+}
+
+// Find the records of a sender, creating them if requested, and drop the
+// stale records of other senders found on the way.  The table must be locked.
+static SENDER *find_sender(char *handle, uint64_t now, int create) {
+    SENDER **link = &table.buckets[intern_hash(handle) % DEDUP_SENDERS];
+    SENDER *found = NULL;
+    while (*link != NULL) {
+        SENDER *sender = *link;
+        if (sender->handle == handle) {
+            found = sender;
+        } else if (stale(sender, now)) {
+            *link = sender->next;
+            intern_unref(sender->handle);
+            free(sender);
+            continue;
+        }
+        link = &sender->next;
+    }
+    if (found != NULL || !create) {
+        return found;
+    }
+    SENDER *sender = malloc(sizeof(SENDER));
+    if (sender == NULL) {
+        return NULL;
+    }
+    sender->handle = intern_ref(handle);
+    sender->next = NULL;
+    sender->oldest = 0;
+    sender->count = 0;
+    for (int i = 0; i < DEDUP_BUCKETS; i++) {
+        sender->chains[i] = -1;
+    }
+    *link = sender;
+    return sender;
+}
+
+// Forget the oldest record of a sender
+static void evict_oldest(SENDER *sender) {
+    int index = sender->oldest;
+    int *link = &sender->chains[sender->records[index].msgid % DEDUP_BUCKETS];
+    while (*link != index) {
+        link = &sender->records[*link].next;
+    }
+    *link = sender->records[index].next;
+    sender->oldest = (index + 1) % DEDUP_CAPACITY;
+    sender->count--;
+}
+
+int dedup_check(char *handle, uint32_t msgid) {
+    if (window == 0 || msgid == 0) {
+        return 0;
+    }
+    uint64_t now = tw_now();
+    int seen = 0;
+    pthread_mutex_lock(&table.mutex);
+    SENDER *sender = find_sender(handle, now, 0);
+    if (sender != NULL) {
+        for (int i = sender->chains[msgid % DEDUP_BUCKETS]; i >= 0; i = sender->records[i].next) {
+            if (sender->records[i].msgid == msgid) {
+                seen = sender->records[i].time + window > now;
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&table.mutex);
+    if (seen) {
+        debug("Duplicate SEND %u from %s", msgid, handle);
+    }
+    return seen;
+}
+
+void dedup_record(char *handle, uint32_t msgid) {
+    if (window == 0 || msgid == 0) {
+        return;
+    }
+    uint64_t now = tw_now();
+    pthread_mutex_lock(&table.mutex);
+    SENDER *sender = find_sender(handle, now, 1);
+    if (sender != NULL) {
+        // Make room by forgetting what is too old, or else the oldest
+        while (sender->count > 0
+               && (sender->count == DEDUP_CAPACITY
+                   || sender->records[sender->oldest].time + window <= now)) {
+            evict_oldest(sender);
+        }
+        int index = (sender->oldest + sender->count) % DEDUP_CAPACITY;
+        int *chain = &sender->chains[msgid % DEDUP_BUCKETS];
+        sender->records[index].msgid = msgid;
+        sender->records[index].time = now;
+        sender->records[index].next = *chain;
+        *chain = index;
+        sender->count++;
+    }
+    pthread_mutex_unlock(&table.mutex);
+}
+
+void dedup_fini(void) {
+    pthread_mutex_lock(&table.mutex);
+    for (int i = 0; i < DEDUP_SENDERS; i++) {
+        while (table.buckets[i] != NULL) {
+            SENDER *sender = table.buckets[i];
+            table.buckets[i] = sender->next;
+            intern_unref(sender->handle);
+            free(sender);
+        }
+    }
+    pthread_mutex_unlock(&table.mutex);
+}
@@ -0,0 +1,271 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "handle_index.h"
+#include "debug.h"
+
+// A node of the trie; its children are kept sorted by byte
+typedef struct hidx_node {
+    unsigned char byte; // Last byte of the handle prefix this node represents
+    int count; // Number of times the handle ending here has been added
+    struct hidx_node *children; // First child
+    struct hidx_node *next; // Next sibling
+} HIDX_NODE;
+
+static struct handle_index {
+    pthread_rwlock_t lock; // Readers query, writers update
+    HIDX_NODE root; // Represents the empty prefix
+} hidx = { .lock = PTHREAD_RWLOCK_INITIALIZER };
+
+// Growable buffer used to build the reply to a query
+typedef struct hidx_buffer {
+    char *data;
+    size_t length;
+    size_t size;
+    size_t emitted; // Number of handles in the buffer
+    size_t limit; // Maximum number of handles, or 0 for no limit
+    int err; // Set if allocation failed
+} HIDX_BUFFER;
+
+// Find the child of a node for a byte, or NULL if there is none
+static HIDX_NODE *find_child(HIDX_NODE *node, unsigned char byte) {
+    for (HIDX_NODE *c = node->children; c != NULL && c->byte <= byte; c = c->next) {
+        if (c->byte == byte) {
+            return c;
+        }
+    }
+    return NULL;
+}
+
+int hidx_insert(char *handle) {
+    pthread_rwlock_wrlock(&hidx.lock);
+    HIDX_NODE *node = &hidx.root;
+    for (unsigned char *p = (unsigned char *)handle; *p != '\0'; p++) {
+        // Find the child, or insert it in sorted position
+        HIDX_NODE **link = &node->children;
+        while (*link != NULL && (*link)->byte < *p) {
+            link = &(*link)->next;
+        }
+        if (*link == NULL || (*link)->byte != *p) {
+            HIDX_NODE *child = calloc(1, sizeof(HIDX_NODE));
+            if (child == NULL) {
+                pthread_rwlock_unlock(&hidx.lock);
+                return -1;
+            }
+            child->byte = *p;
+            child->next = *link;
+            *link = child;
+        }
+        node = *link;
+    }
+    node->count++;
+    pthread_rwlock_unlock(&hidx.lock);
+    return 0;
+}
+
+void hidx_remove(char *handle) {
+    pthread_rwlock_wrlock(&hidx.lock);
+    // Walk down to the node where the handle ends, remembering the link to the
+    // top of the chain of nodes below which nothing but this handle hangs.
+    // Handles may be long, so this is a loop rather than a recursion.
+    HIDX_NODE *node = &hidx.root;
+    HIDX_NODE **prune = NULL;
+    for (unsigned char *p = (unsigned char *)handle; *p != '\0'; p++) {
+        HIDX_NODE **link = &node->children;
+        while (*link != NULL && (*link)->byte < *p) {
+            link = &(*link)->next;
+        }
+        if (*link == NULL || (*link)->byte != *p) {
+            pthread_rwlock_unlock(&hidx.lock);
+            return;
+        }
+        if (node == &hidx.root || node->count > 0 || node->children->next != NULL) {
+            prune = link;
+        }
+        node = *link;
+    }
+    if (node->count > 0) {
+        node->count--;
+    }
+    if (prune != NULL && node->count == 0 && node->children == NULL) {
+        // Unlink the chain, and free it down to the node
+        HIDX_NODE *c = *prune;
+        *prune = c->next;
+        while (c != NULL) {
+            HIDX_NODE *child = c->children;
+            free(c);
+            c = child;
+        }
+    }
+    pthread_rwlock_unlock(&hidx.lock);
+}
+
+// Append a handle, followed by a newline, to the reply
+static void emit(HIDX_BUFFER *buf, char *handle, size_t length) {
+    if (buf->length + length + 1 > buf->size) {
+        size_t size = 2 * (buf->length + length + 1);
+        char *data = realloc(buf->data, size);
+        if (data == NULL) {
+            buf->err = 1;
+            return;
+        }
+        buf->data = data;
+        buf->size = size;
+    }
+    memcpy(buf->data + buf->length, handle, length);
+    buf->data[buf->length + length] = '\n';
+    buf->length += length + 1;
+    buf->emitted++;
+}
+
+// Make room in the path for a byte at a depth
+static int grow_path(char **pathp, size_t *path_size, size_t depth) {
+    if (depth + 1 >= *path_size) {
+        char *path = realloc(*pathp, 2 * (depth + 1));
+        if (path == NULL) {
+            return -1;
+        }
+        *pathp = path;
+        *path_size = 2 * (depth + 1);
+    }
+    return 0;
+}
+
+// List the handles below a node in sorted order.  The path holds the prefix
+// represented by the node.  If bound is not NULL, the path equals the cursor
+// up to depth, and only handles after the cursor are to be listed.  The walk
+// keeps its own stack of ancestors, as handles may be too long to recurse on.
+static void list_below(HIDX_NODE *top, char **pathp, size_t *path_size, size_t depth,
+                       HIDX_BUFFER *buf, unsigned char *bound) {
+    size_t base = depth;
+    size_t stack_size = 16;
+    HIDX_NODE **stack = malloc(stack_size * sizeof(HIDX_NODE *)); // Ancestors, by depth - base
+    if (stack == NULL) {
+        buf->err = 1;
+        return;
+    }
+    HIDX_NODE *node = top;
+    int bounded = bound != NULL; // Whether the path equals the cursor up to depth
+    while (!buf->err && (buf->limit == 0 || buf->emitted < buf->limit)) {
+        // The handle ending here is the cursor or a prefix of it, so it is skipped if bounded
+        if (node->count > 0 && !bounded) {
+            emit(buf, *pathp, depth);
+        }
+        if (grow_path(pathp, path_size, depth)) {
+            buf->err = 1;
+            break;
+        }
+        if (depth - base >= stack_size) {
+            HIDX_NODE **grown = realloc(stack, 2 * stack_size * sizeof(HIDX_NODE *));
+            if (grown == NULL) {
+                buf->err = 1;
+                break;
+            }
+            stack = grown;
+            stack_size *= 2;
+        }
+
+        // Descend to the first child to be listed
+        HIDX_NODE *c = node->children;
+        int child_bounded = 0;
+        if (bounded && bound[depth] != '\0') {
+            while (c != NULL && c->byte < bound[depth]) {
+                c = c->next;
+            }
+            child_bounded = c != NULL && c->byte == bound[depth];
+        }
+        if (c != NULL) {
+            stack[depth - base] = node;
+            (*pathp)[depth++] = c->byte;
+            node = c;
+            bounded = child_bounded;
+            continue;
+        }
+
+        // Otherwise go on to the next sibling of the nearest node that has one.
+        // Siblings come after the cursor byte, so they are never bounded.
+        while (depth > base && node->next == NULL) {
+            node = stack[--depth - base];
+        }
+        if (depth == base) {
+            break;
+        }
+        node = node->next;
+        (*pathp)[depth - 1] = node->byte;
+        bounded = 0;
+    }
+    free(stack);
+}
+
+char *hidx_query(char *prefix, char *cursor, size_t limit, size_t *lengthp) {
+    HIDX_BUFFER buf = { NULL, 0, 0, 0, limit, 0 };
+    size_t plen = strlen(prefix);
+    size_t path_size = plen + 16;
+    char *path = malloc(path_size);
+    if (path == NULL) {
+        return NULL;
+    }
+    memcpy(path, prefix, plen);
+
+    // Decide how the cursor restricts the handles that start with the prefix
+    unsigned char *bound = NULL;
+    int skip = 0;
+    if (cursor != NULL && *cursor != '\0') {
+        int cmp = strncmp(cursor, prefix, plen);
+        if (cmp == 0) {
+            bound = (unsigned char *)cursor;
+        } else if (cmp > 0) {
+            skip = 1;
+        }
+    }
+
+    pthread_rwlock_rdlock(&hidx.lock);
+    HIDX_NODE *node = &hidx.root;
+    for (size_t i = 0; node != NULL && i < plen; i++) {
+        node = find_child(node, (unsigned char)prefix[i]);
+    }
+    if (node != NULL && !skip) {
+        list_below(node, &path, &path_size, plen, &buf, bound);
+    }
+    pthread_rwlock_unlock(&hidx.lock);
+    free(path);
+
+    if (buf.err) {
+        free(buf.data);
+        return NULL;
+    }
+    if (buf.data == NULL) {
+        // Return an empty reply
+        buf.data = malloc(1);
+    }
+    *lengthp = buf.length;
+    return buf.data;
+}
+
+// Free the children of a node, splicing grandchildren into the list being
+// freed instead of recursing
+static void free_below(HIDX_NODE *node) {
+    HIDX_NODE *list = node->children;
+    while (list != NULL) {
+        HIDX_NODE *c = list;
+        list = c->next;
+        if (c->children != NULL) {
+            HIDX_NODE *last = c->children;
+            while (last->next != NULL) {
+                last = last->next;
+            }
+            last->next = list;
+            list = c->children;
+        }
+        free(c);
+    }
+    node->children = NULL;
+}
+
+void hidx_fini(void) {
+    pthread_rwlock_wrlock(&hidx.lock);
+    free_below(&hidx.root);
+    hidx.root.count = 0;
+    pthread_rwlock_unlock(&hidx.lock);
+    debug("Handle index finalized");
+}
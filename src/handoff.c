@@ -0,0 +1,460 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "handoff.h"
+#include "server.h"
+#include "globals.h"
+#include "presence.h"
+#include "csapp.h"
+#include "debug.h"
+
+#define HANDOFF_MAGIC 0x43484c41 // "CHLA"
+
+// The most descriptors sent in one message, below the kernel's limit of
+// SCM_MAX_FD (253); more clients than this are passed in several messages
+#define HANDOFF_FDS_PER_MESSAGE 250
+
+// Flags sent with the handle of each client
+#define HANDOFF_SUBSCRIBED 0x1 // Subscribed to presence changes
+#define HANDOFF_BATCH_RECEIPTS 0x2 // Takes batched return receipts
+
+// Sent along with the first of the file descriptors: fds[0] is the
+// listening socket
+typedef struct handoff_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t nclients; // Number of client file descriptors following fds[0]
+} HANDOFF_HEADER;
+
+// Types of the records in the snapshot of mailbox entries
+typedef enum {
+    HANDOFF_MESSAGE_RECORD, HANDOFF_NOTICE_RECORD, HANDOFF_PRESENCE_RECORD, HANDOFF_END_RECORD
+} HANDOFF_RECORD_TYPE;
+
+// A snapshot record, followed by the recipient handle, sender handle and
+// body; a presence change has only the handle that changed state, as the
+// recipient
+typedef struct handoff_record {
+    uint32_t type;
+    int32_t msgid;
+    uint32_t notice_type;
+    uint32_t urgent; // Nonzero for an urgent message
+    uint32_t part; // Place of the message in a message sent in parts
+    uint32_t ttl; // Lifetime of a message of its own in milliseconds, or 0
+    uint32_t online; // Nonzero for a presence change that is a login
+    uint32_t listed; // Nonzero for a presence change a list of users reflects
+    uint32_t to_length;
+    uint32_t from_length;
+    uint32_t body_length;
+} HANDOFF_RECORD;
+
+// State passed to write_entry() while taking a snapshot of a mailbox
+typedef struct handoff_context {
+    int fd; // Connection to the new process
+    char *to; // Handle of the owner of the mailbox
+    int err; // Set if any write failed
+} HANDOFF_CONTEXT;
+
+// Connect to or bind a Unix-domain socket at a path
+static int handoff_socket(char *path, struct sockaddr_un *addr) {
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        return -1;
+    }
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, path);
+    return socket(AF_UNIX, SOCK_STREAM, 0);
+}
+
+// Write a length-prefixed string
+static int write_string(int fd, char *s) {
+    uint32_t length = s == NULL ? 0 : strlen(s);
+    if (rio_writen(fd, &length, sizeof(length)) != sizeof(length)) {
+        return -1;
+    }
+    if (length > 0 && rio_writen(fd, s, length) != length) {
+        return -1;
+    }
+    return 0;
+}
+
+// Read a length-prefixed string; an empty string is returned as NULL
+static int read_string(int fd, char **sp, uint32_t length) {
+    *sp = NULL;
+    if (length == 0) {
+        return 0;
+    }
+    *sp = malloc(length + 1);
+    if (*sp == NULL || rio_readn(fd, *sp, length) != length) {
+        free(*sp);
+        *sp = NULL;
+        return -1;
+    }
+    (*sp)[length] = '\0';
+    return 0;
+}
+
+// Write one mailbox entry into the snapshot
+static void write_entry(MAILBOX_ENTRY *entry, void *arg) {
+    HANDOFF_CONTEXT *ctx = arg;
+    if (ctx->err) {
+        return;
+    }
+    HANDOFF_RECORD rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.to_length = strlen(ctx->to);
+    char *from = NULL;
+    void *body = NULL;
+    if (entry->type == MESSAGE_ENTRY_TYPE) {
+        MESSAGE *msg = &entry->content.message;
+        rec.type = HANDOFF_MESSAGE_RECORD;
+        rec.msgid = msg->msgid;
+        rec.urgent = msg->urgent;
+        rec.part = msg->part;
+        rec.ttl = msg->ttl;
+        from = msg->from != NULL ? mb_get_handle(msg->from) : NULL;
+        rec.from_length = from != NULL ? strlen(from) : 0;
+        body = msg->body;
+        rec.body_length = body != NULL ? msg->length : 0;
+    } else {
+        rec.type = HANDOFF_NOTICE_RECORD;
+        rec.msgid = entry->content.notice.msgid;
+        rec.notice_type = entry->content.notice.type;
+        // The msgids of a batch of receipts are sent as the body
+        body = entry->content.notice.msgids;
+        rec.body_length = entry->content.notice.count * sizeof(int);
+    }
+
+    if (rio_writen(ctx->fd, &rec, sizeof(rec)) != sizeof(rec)
+        || rio_writen(ctx->fd, ctx->to, rec.to_length) != rec.to_length
+        || (rec.from_length > 0 && rio_writen(ctx->fd, from, rec.from_length) != rec.from_length)
+        || (rec.body_length > 0 && rio_writen(ctx->fd, body, rec.body_length) != rec.body_length)) {
+        ctx->err = 1;
+    }
+}
+
+// Write one presence change not yet sent into the snapshot
+static void write_change(char *handle, int online, int listed, void *arg) {
+    HANDOFF_CONTEXT *ctx = arg;
+    if (ctx->err) {
+        return;
+    }
+    HANDOFF_RECORD rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.type = HANDOFF_PRESENCE_RECORD;
+    rec.online = online;
+    rec.listed = listed;
+    rec.to_length = strlen(handle);
+    if (rio_writen(ctx->fd, &rec, sizeof(rec)) != sizeof(rec)
+        || rio_writen(ctx->fd, handle, rec.to_length) != rec.to_length) {
+        ctx->err = 1;
+    }
+}
+
+// Send some data and up to HANDOFF_FDS_PER_MESSAGE file descriptors in a
+// single message
+static int send_fds(int fd, void *data, size_t length, int *fds, int nfds) {
+    struct iovec iov = { .iov_base = data, .iov_len = length };
+    size_t cmsg_space = CMSG_SPACE(nfds * sizeof(int));
+    char *cbuf = calloc(1, cmsg_space);
+    if (cbuf == NULL) {
+        return -1;
+    }
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = cmsg_space;
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+
+    ssize_t ret = sendmsg(fd, &msg, 0);
+    free(cbuf);
+    return ret == (ssize_t)length ? 0 : -1;
+}
+
+// Receive some data and up to maxfds file descriptors
+static int recv_fds(int fd, void *data, size_t length, int *fds, int maxfds) {
+    struct iovec iov = { .iov_base = data, .iov_len = length };
+    size_t cmsg_space = CMSG_SPACE(maxfds * sizeof(int));
+    char *cbuf = calloc(1, cmsg_space);
+    if (cbuf == NULL) {
+        return -1;
+    }
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = cmsg_space;
+
+    int nfds = -1;
+    if (recvmsg(fd, &msg, MSG_CMSG_CLOEXEC) == (ssize_t)length) {
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), nfds * sizeof(int));
+        } else {
+            nfds = 0;
+        }
+    }
+    free(cbuf);
+    return nfds;
+}
+
+int handoff_send(char *path, int listenfd, CLIENT_REGISTRY *cr) {
+    struct sockaddr_un addr;
+    int fd = handoff_socket(path, &addr);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, (SA *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    CLIENT **clients = creg_all_clients(cr);
+    if (clients == NULL) {
+        close(fd);
+        return -1;
+    }
+    // Clients on shared memory are left behind, to be disconnected, and so
+    // are links from other nodes, which open new ones to show the secret again
+    int nclients = 0;
+    for (CLIENT **cp = clients; *cp != NULL; cp++) {
+        if (client_has_shm(*cp) || client_is_node_link(*cp)) {
+            client_unref(*cp, "Not handed off");
+        } else {
+            clients[nclients++] = *cp;
+        }
+    }
+    clients[nclients] = NULL;
+
+    // Pass the listening socket and the client connections, the header
+    // with the first batch of them and a byte with each further batch
+    int *fds = Malloc((nclients + 1) * sizeof(int));
+    fds[0] = listenfd;
+    for (int i = 0; i < nclients; i++) {
+        fds[i + 1] = client_get_fd(clients[i]);
+    }
+    HANDOFF_HEADER hdr = { HANDOFF_MAGIC, HANDOFF_VERSION, nclients };
+    int nfds = nclients + 1 < HANDOFF_FDS_PER_MESSAGE ? nclients + 1 : HANDOFF_FDS_PER_MESSAGE;
+    int err = send_fds(fd, &hdr, sizeof(hdr), fds, nfds);
+    for (int sent = nfds; !err && sent < nclients + 1; sent += nfds) {
+        char more = 0;
+        nfds = nclients + 1 - sent < HANDOFF_FDS_PER_MESSAGE ? nclients + 1 - sent : HANDOFF_FDS_PER_MESSAGE;
+        err = send_fds(fd, &more, 1, fds + sent, nfds);
+    }
+    free(fds);
+
+    // Pass the handle under which each client is logged in, if any,
+    // whether it is subscribed to presence changes, and whether it takes
+    // batched receipts
+    for (int i = 0; !err && i < nclients; i++) {
+        USER *user = client_get_user(clients[i], 1);
+        MAILBOX *mb = client_get_mailbox(clients[i], 1);
+        uint32_t flags = presence_subscribed(clients[i]) ? HANDOFF_SUBSCRIBED : 0;
+        if (mb != NULL && mb_batches_receipts(mb)) {
+            flags |= HANDOFF_BATCH_RECEIPTS;
+        }
+        err = write_string(fd, user != NULL ? user_get_handle(user) : NULL)
+            || rio_writen(fd, &flags, sizeof(flags)) != sizeof(flags);
+    }
+
+    // Pass the undelivered entries in each mailbox
+    for (int i = 0; !err && i < nclients; i++) {
+        MAILBOX *mb = client_get_mailbox(clients[i], 0);
+        if (mb != NULL) {
+            HANDOFF_CONTEXT ctx = { fd, mb_get_handle(mb), 0 };
+            mb_foreach(mb, write_entry, &ctx);
+            err = ctx.err;
+            mb_unref(mb, "Handoff snapshot taken");
+        }
+    }
+
+    // Pass the presence changes the subscribers have not been sent yet
+    if (!err) {
+        HANDOFF_CONTEXT ctx = { fd, NULL, 0 };
+        presence_foreach_pending(write_change, &ctx);
+        err = ctx.err;
+    }
+    HANDOFF_RECORD end;
+    memset(&end, 0, sizeof(end));
+    end.type = HANDOFF_END_RECORD;
+    if (!err && rio_writen(fd, &end, sizeof(end)) != sizeof(end)) {
+        err = -1;
+    }
+
+    for (int i = 0; i < nclients; i++) {
+        client_unref(clients[i], "Handoff complete");
+    }
+    free(clients);
+    close(fd);
+    debug("Handoff of %d clients %s", nclients, err ? "failed" : "completed");
+    return err ? -1 : 0;
+}
+
+// Restore one entry from the snapshot into the mailbox of its recipient
+static void restore_entry(HANDOFF_RECORD *rec, char *to, char *from, void *body) {
+    CLIENT *recipient = creg_lookup(client_registry, to);
+    MAILBOX *mb = recipient != NULL ? client_get_mailbox(recipient, 0) : NULL;
+    if (mb == NULL) {
+        free(body);
+    } else if (rec->type == HANDOFF_MESSAGE_RECORD) {
+        CLIENT *sender = from != NULL ? creg_lookup(client_registry, from) : NULL;
+        MAILBOX *from_mb = sender != NULL ? client_get_mailbox(sender, 0) : NULL;
+        if (rec->part != WHOLE_MESSAGE) {
+            mb_add_part(mb, rec->msgid, from_mb, body, rec->body_length, rec->part, rec->urgent);
+        } else {
+            mb_add_timed_message(mb, rec->msgid, from_mb, body, rec->body_length,
+                                 rec->urgent, rec->ttl <= INT_MAX ? rec->ttl : 0);
+        }
+        if (from_mb != NULL) {
+            mb_unref(from_mb, "Restored message");
+        }
+        if (sender != NULL) {
+            client_unref(sender, "Restored message");
+        }
+    } else if (rec->body_length > 0) {
+        int *msgids = body;
+        for (size_t i = 0; i < rec->body_length / sizeof(int); i++) {
+            mb_add_notice(mb, rec->notice_type, msgids[i]);
+        }
+        free(body);
+    } else {
+        mb_add_notice(mb, rec->notice_type, rec->msgid);
+    }
+    if (mb != NULL) {
+        mb_unref(mb, "Restored entry");
+    }
+    if (recipient != NULL) {
+        client_unref(recipient, "Restored entry");
+    }
+}
+
+int handoff_recv(char *path) {
+    struct sockaddr_un addr;
+    int sfd = handoff_socket(path, &addr);
+    if (sfd < 0) {
+        return -1;
+    }
+    unlink(path);
+    if (bind(sfd, (SA *)&addr, sizeof(addr)) < 0 || listen(sfd, 1) < 0) {
+        close(sfd);
+        return -1;
+    }
+    debug("Waiting for handoff at %s", path);
+    int fd = accept(sfd, NULL, NULL);
+    close(sfd);
+    unlink(path);
+    if (fd < 0) {
+        return -1;
+    }
+
+    // Receive the listening socket and the client connections, which come
+    // in batches after the first, with the header
+    HANDOFF_HEADER hdr;
+    int batch[HANDOFF_FDS_PER_MESSAGE];
+    int nbatch = recv_fds(fd, &hdr, sizeof(hdr), batch, HANDOFF_FDS_PER_MESSAGE);
+    if (nbatch < 1 || hdr.magic != HANDOFF_MAGIC || hdr.version != HANDOFF_VERSION
+        || hdr.nclients > INT_MAX - 1 || (uint32_t)nbatch > hdr.nclients + 1) {
+        for (int i = 0; i < nbatch; i++) {
+            close(batch[i]);
+        }
+        close(fd);
+        return -1;
+    }
+    int nfds = hdr.nclients + 1;
+    int *fds = Malloc(nfds * sizeof(int));
+    memcpy(fds, batch, nbatch * sizeof(int));
+    for (int received = nbatch; received < nfds; received += nbatch) {
+        char more;
+        nbatch = recv_fds(fd, &more, 1, fds + received, nfds - received < HANDOFF_FDS_PER_MESSAGE
+                          ? nfds - received : HANDOFF_FDS_PER_MESSAGE);
+        if (nbatch < 1) {
+            for (int i = 0; i < received; i++) {
+                close(fds[i]);
+            }
+            free(fds);
+            close(fd);
+            return -1;
+        }
+    }
+
+    // Take back each client, logged in under its previous handle
+    CLIENT **clients = Malloc(nfds * sizeof(CLIENT *));
+    uint32_t *flags = Malloc(nfds * sizeof(uint32_t));
+    for (int i = 1; i < nfds; i++) {
+        uint32_t length;
+        char *handle = NULL;
+        clients[i] = NULL;
+        if (rio_readn(fd, &length, sizeof(length)) != sizeof(length)
+            || read_string(fd, &handle, length)
+            || rio_readn(fd, &flags[i], sizeof(flags[i])) != sizeof(flags[i])
+            || (clients[i] = chla_resume_client(fds[i], handle)) == NULL) {
+            close(fds[i]);
+        } else if ((flags[i] & HANDOFF_BATCH_RECEIPTS) && client_get_mailbox(clients[i], 1) != NULL) {
+            mb_set_batch_receipts(client_get_mailbox(clients[i], 1), 1);
+        }
+        free(handle);
+    }
+
+    // Only once every client is logged in again are the subscriptions
+    // restored, so that their logins here are not sent as changes
+    for (int i = 1; i < nfds; i++) {
+        if (clients[i] != NULL && (flags[i] & HANDOFF_SUBSCRIBED)
+            && client_get_user(clients[i], 1) != NULL) {
+            presence_resubscribe(clients[i]);
+        }
+    }
+    free(flags);
+
+    // Restore the undelivered mailbox entries
+    HANDOFF_RECORD rec;
+    while (rio_readn(fd, &rec, sizeof(rec)) == sizeof(rec) && rec.type != HANDOFF_END_RECORD) {
+        char *to, *from;
+        void *body = NULL;
+        if (read_string(fd, &to, rec.to_length)) {
+            break;
+        }
+        if (rec.type == HANDOFF_PRESENCE_RECORD) {
+            if (to != NULL) {
+                presence_restore(to, rec.online, rec.listed);
+            }
+            free(to);
+            continue;
+        }
+        if (read_string(fd, &from, rec.from_length)
+            || read_string(fd, (char **)&body, rec.body_length)) {
+            free(to);
+            free(from);
+            break;
+        }
+        restore_entry(&rec, to, from, body);
+        free(to);
+        free(from);
+    }
+
+    close(fd);
+
+    // Serve the clients only now, so that no request of theirs can overtake
+    // the entries handed off
+    for (int i = 1; i < nfds; i++) {
+        if (clients[i] != NULL) {
+            chla_serve_client(clients[i]);
+        }
+    }
+    free(clients);
+    int listenfd = fds[0];
+    free(fds);
+    debug("Handoff of %d clients received", nfds - 1);
+    return listenfd;
+}
@@ -0,0 +1,132 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <pthread.h>
+#include "intern.h"
+#include "debug.h"
+
+#define INTERN_BUCKETS 1024
+
+// An interned handle; the string itself follows the header
+typedef struct interned {
+    struct interned *next; // Next in the hash bucket
+    uint32_t hash;
+    size_t length;
+    int ref_count;
+    char str[];
+} INTERNED;
+
+static struct intern_table {
+    pthread_mutex_t mutex; // Protects the buckets and all reference counts
+    INTERNED *buckets[INTERN_BUCKETS];
+} table = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+// Get the header of an interned handle
+static INTERNED *header(char *handle) {
+    return (INTERNED *)(handle - offsetof(INTERNED, str));
+}
+
+// FNV-1a hash of a string, also computing its length
+static uint32_t hash_string(char *s, size_t *lengthp) {
+    uint32_t hash = 2166136261u;
+    unsigned char *p = (unsigned char *)s;
+    for (; *p != '\0'; p++) {
+        hash ^= *p;
+        hash *= 16777619u;
+    }
+    *lengthp = p - (unsigned char *)s;
+    return hash;
+}
+
+// Find an interned handle; the table must be locked
+static INTERNED *find(char *handle, uint32_t hash, size_t length) {
+    for (INTERNED *in = table.buckets[hash % INTERN_BUCKETS]; in != NULL; in = in->next) {
+        if (in->hash == hash && in->length == length && memcmp(in->str, handle, length) == 0) {
+            return in;
+        }
+    }
+    return NULL;
+}
+
+char *intern_handle(char *handle) {
+    if (handle == NULL) {
+        return NULL;
+    }
+    size_t length;
+    uint32_t hash = hash_string(handle, &length);
+
+    pthread_mutex_lock(&table.mutex);
+    INTERNED *in = find(handle, hash, length);
+    if (in != NULL) {
+        in->ref_count++;
+        pthread_mutex_unlock(&table.mutex);
+        return in->str;
+    }
+
+    // Make the one copy of this handle
+    in = malloc(sizeof(INTERNED) + length + 1);
+    if (in == NULL) {
+        pthread_mutex_unlock(&table.mutex);
+        return NULL;
+    }
+    in->hash = hash;
+    in->length = length;
+    in->ref_count = 1;
+    memcpy(in->str, handle, length + 1);
+    in->next = table.buckets[hash % INTERN_BUCKETS];
+    table.buckets[hash % INTERN_BUCKETS] = in;
+    pthread_mutex_unlock(&table.mutex);
+    debug("Interned handle %s", in->str);
+    return in->str;
+}
+
+char *intern_lookup(char *handle) {
+    if (handle == NULL) {
+        return NULL;
+    }
+    size_t length;
+    uint32_t hash = hash_string(handle, &length);
+    pthread_mutex_lock(&table.mutex);
+    INTERNED *in = find(handle, hash, length);
+    if (in != NULL) {
+        in->ref_count++;
+    }
+    pthread_mutex_unlock(&table.mutex);
+    return in != NULL ? in->str : NULL;
+}
+
+char *intern_ref(char *handle) {
+    pthread_mutex_lock(&table.mutex);
+    header(handle)->ref_count++;
+    pthread_mutex_unlock(&table.mutex);
+    return handle;
+}
+
+void intern_unref(char *handle) {
+    if (handle == NULL) {
+        return;
+    }
+    INTERNED *in = header(handle);
+    pthread_mutex_lock(&table.mutex);
+    if (--in->ref_count > 0) {
+        pthread_mutex_unlock(&table.mutex);
+        return;
+    }
+    // Unlink from the bucket
+    INTERNED **link = &table.buckets[in->hash % INTERN_BUCKETS];
+    while (*link != in) {
+        link = &(*link)->next;
+    }
+    *link = in->next;
+    pthread_mutex_unlock(&table.mutex);
+    debug("Free interned handle");
+    free(in);
+}
+
+uint32_t intern_hash(char *handle) {
+    return header(handle)->hash;
+}
+
+size_t intern_length(char *handle) {
+    return header(handle)->length;
+}
@@ -0,0 +1,388 @@
+#define _GNU_SOURCE // For syscall()
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include "log.h"
+#include "debug.h"
+
+#define LOG_RING_RECORDS 256 // Records in the ring of each thread
+#define LOG_DRAIN_MS 5 // Interval at which the rings are drained
+
+// The records of one thread.  The thread owns tail, busy and dropped, and
+// the logging thread owns head, limit and reported.
+typedef struct log_ring {
+    uint32_t head; // Records consumed
+    char head_pad[60];
+    uint32_t tail; // Records published
+    int busy; // Nonzero while a record is being filled in
+    uint64_t dropped; // Records dropped because the ring was full
+    uint64_t reported; // Dropped records already reported
+    uint32_t limit; // Records to be consumed in the current pass
+    uint32_t tid;
+    int dead; // Set when the thread has exited
+    struct log_ring *next;
+    LOG_RECORD records[LOG_RING_RECORDS];
+} LOG_RING;
+
+int log_threshold = LOG_DEBUG;
+
+static struct logger {
+    pthread_mutex_t mutex; // Protects the list of rings and the output
+    pthread_cond_t cond; // Signaled when a ring fills up or on shutdown
+    pthread_t tid;
+    int started;
+    int stop;
+    LOG_RING *rings;
+    FILE *out;
+    int binary; // Whether out is a binary log file
+    uint32_t sites; // Number of sites written to the binary log
+} logger = { .mutex = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+static __thread LOG_RING *ring;
+static pthread_key_t ring_key;
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+
+static const char *level_names[] = { "debug", "info", "success", "warn", "error", "off" };
+static const char *level_labels[] = { "DEBUG", "INFO", "SUCCESS", "WARN", "ERROR" };
+static const char *level_colors[] = { KMAG, KBLU, KGRN, KYEL, KRED };
+
+// Called when a thread exits: leave its ring for the logging thread to free
+static void ring_destructor(void *arg) {
+    LOG_RING *r = arg;
+    ring = NULL;
+    __atomic_store_n(&r->dead, 1, __ATOMIC_RELEASE);
+}
+
+static void create_key(void) {
+    pthread_key_create(&ring_key, ring_destructor);
+}
+
+// Create the ring of the calling thread
+static LOG_RING *new_ring(void) {
+    LOG_RING *r = calloc(1, sizeof(LOG_RING));
+    if (r == NULL) {
+        return NULL;
+    }
+    r->tid = syscall(SYS_gettid);
+    pthread_once(&ring_once, create_key);
+    pthread_setspecific(ring_key, r);
+    pthread_mutex_lock(&logger.mutex);
+    r->next = logger.rings;
+    logger.rings = r;
+    pthread_mutex_unlock(&logger.mutex);
+    return ring = r;
+}
+
+LOG_RECORD *log_begin(LOG_SITE *site) {
+    LOG_RING *r = ring;
+    if (r == NULL && (r = new_ring()) == NULL) {
+        return NULL;
+    }
+    // A signal handler that logs while the thread is doing so drops its record
+    if (r->busy) {
+        __atomic_fetch_add(&r->dropped, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    r->busy = 1;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    uint32_t tail = r->tail;
+    if (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == LOG_RING_RECORDS) {
+        __atomic_fetch_add(&r->dropped, 1, __ATOMIC_RELAXED);
+        r->busy = 0;
+        return NULL;
+    }
+    LOG_RECORD *rec = &r->records[tail % LOG_RING_RECORDS];
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    rec->site = site;
+    rec->time = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    rec->tid = r->tid;
+    rec->nargs = 0;
+    rec->used = 0;
+    return rec;
+}
+
+void log_commit(LOG_RECORD *rec) {
+    (void)rec; // It is the slot at the tail of this thread's ring
+    LOG_RING *r = ring;
+    uint32_t tail = r->tail + 1;
+    __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    r->busy = 0;
+    // Have the ring drained early once it is half full
+    if (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == LOG_RING_RECORDS / 2) {
+        pthread_cond_signal(&logger.cond);
+    }
+}
+
+// Format the message of a record, one conversion at a time
+static void print_message(FILE *out, LOG_RECORD *rec) {
+    const char *p = rec->site->format;
+    int arg = 0;
+    while (*p != '\0') {
+        const char *percent = strchr(p, '%');
+        if (percent == NULL) {
+            fputs(p, out);
+            return;
+        }
+        fwrite(p, 1, percent - p, out);
+        if (percent[1] == '%') {
+            fputc('%', out);
+            p = percent + 2;
+            continue;
+        }
+        // Keep the flags, width and precision, and drop the length modifier
+        const char *q = percent + 1 + strspn(percent + 1, "-+ #0123456789.");
+        size_t prefix = q - percent;
+        q += strspn(q, "hlLqjzt");
+        char conv = *q;
+        p = conv != '\0' ? q + 1 : q;
+        char spec[32];
+        if (prefix > sizeof(spec) - 4 || arg >= rec->nargs) {
+            fwrite(percent, 1, p - percent, out);
+            continue;
+        }
+        memcpy(spec, percent, prefix);
+        uint64_t value = rec->args[arg];
+        int type = rec->types[arg++];
+        double d;
+        switch (conv) {
+        case 'd': case 'i':
+            strcpy(spec + prefix, (char[]){ 'l', 'l', conv, '\0' });
+            fprintf(out, spec, (long long)value);
+            break;
+        case 'u': case 'o': case 'x': case 'X':
+            strcpy(spec + prefix, (char[]){ 'l', 'l', conv, '\0' });
+            fprintf(out, spec, (unsigned long long)value);
+            break;
+        case 'c':
+            strcpy(spec + prefix, "c");
+            fprintf(out, spec, (int)value);
+            break;
+        case 'p':
+            strcpy(spec + prefix, "p");
+            fprintf(out, spec, (void *)(uintptr_t)value);
+            break;
+        case 's':
+            strcpy(spec + prefix, "s");
+            fprintf(out, spec, type == LOG_ARG_STR && value < LOG_STRINGS ? rec->strings + value : "<?>");
+            break;
+        case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+            if (type != LOG_ARG_DOUBLE) {
+                fputs("<?>", out);
+                break;
+            }
+            memcpy(&d, &value, sizeof(double));
+            strcpy(spec + prefix, (char[]){ conv, '\0' });
+            fprintf(out, spec, d);
+            break;
+        default:
+            fwrite(percent, 1, p - percent, out);
+            break;
+        }
+    }
+}
+
+void log_print(FILE *out, LOG_RECORD *rec) {
+    LOG_SITE *site = rec->site;
+    int level = site->level >= LOG_DEBUG && site->level < LOG_OFF ? site->level : LOG_ERROR;
+    time_t sec = rec->time / 1000000000;
+    struct tm tm;
+    localtime_r(&sec, &tm);
+    fprintf(out, "%02d:%02d:%02d.%06u [%u] %s%s: %s:%s:%d " KNRM, tm.tm_hour, tm.tm_min,
+            tm.tm_sec, (unsigned)(rec->time % 1000000000 / 1000), rec->tid,
+            level_colors[level], level_labels[level], site->file, site->func, site->line);
+    print_message(out, rec);
+    fputc('\n', out);
+}
+
+// Write an entry of the binary log
+static void write_entry(int kind, int level, const void *body, size_t length,
+                        const void *extra, size_t extra_length) {
+    LOG_ENTRY_HEADER hdr = { kind, level, 0, length + extra_length };
+    fwrite(&hdr, sizeof(hdr), 1, logger.out);
+    fwrite(body, length, 1, logger.out);
+    if (extra_length > 0) {
+        fwrite(extra, extra_length, 1, logger.out);
+    }
+}
+
+// Write a record to the output, preceded in a binary log by its site if
+// the site has not been written yet
+static void write_record(LOG_RECORD *rec) {
+    if (!logger.binary) {
+        log_print(logger.out, rec);
+        return;
+    }
+    LOG_SITE *site = rec->site;
+    if (site->id == 0) {
+        site->id = ++logger.sites;
+        size_t file = strlen(site->file) + 1, func = strlen(site->func) + 1;
+        size_t format = strlen(site->format) + 1;
+        char *body = malloc(8 + file + func + format);
+        if (body == NULL) {
+            site->id = 0;
+            logger.sites--;
+            return;
+        }
+        uint32_t fields[2] = { site->id, site->line };
+        memcpy(body, fields, 8);
+        memcpy(body + 8, site->file, file);
+        memcpy(body + 8 + file, site->func, func);
+        memcpy(body + 8 + file + func, site->format, format);
+        write_entry(LOG_ENTRY_SITE, site->level, body, 8 + file + func + format, NULL, 0);
+        free(body);
+    }
+    LOG_EVENT event;
+    memset(&event, 0, sizeof(event));
+    event.site = site->id;
+    event.tid = rec->tid;
+    event.time = rec->time;
+    event.nargs = rec->nargs;
+    memcpy(event.types, rec->types, sizeof(event.types));
+    memcpy(event.args, rec->args, sizeof(event.args));
+    write_entry(LOG_ENTRY_EVENT, site->level, &event, sizeof(event), rec->strings, rec->used);
+}
+
+// Report the records a ring has dropped since the last report
+static void report_dropped(LOG_RING *r) {
+    uint64_t dropped = __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+    if (dropped == r->reported) {
+        return;
+    }
+    LOG_DROPPED report = { r->tid, 0, dropped - r->reported };
+    r->reported = dropped;
+    if (logger.binary) {
+        write_entry(LOG_ENTRY_DROPPED, 0, &report, sizeof(report), NULL, 0);
+    } else {
+        fprintf(logger.out, "[%u] %lu log records dropped\n", report.tid, (unsigned long)report.count);
+    }
+}
+
+// Write out the records published so far, merged by time, and free the
+// rings of threads that have exited; the logger must be locked
+static void drain(void) {
+    for (LOG_RING *r = logger.rings; r != NULL; r = r->next) {
+        r->limit = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+        report_dropped(r);
+    }
+    while (1) {
+        LOG_RING *first = NULL;
+        for (LOG_RING *r = logger.rings; r != NULL; r = r->next) {
+            if (r->head != r->limit
+                && (first == NULL || r->records[r->head % LOG_RING_RECORDS].time
+                                     < first->records[first->head % LOG_RING_RECORDS].time)) {
+                first = r;
+            }
+        }
+        if (first == NULL) {
+            break;
+        }
+        write_record(&first->records[first->head % LOG_RING_RECORDS]);
+        __atomic_store_n(&first->head, first->head + 1, __ATOMIC_RELEASE);
+    }
+    LOG_RING **link = &logger.rings;
+    while (*link != NULL) {
+        LOG_RING *r = *link;
+        if (__atomic_load_n(&r->dead, __ATOMIC_ACQUIRE)
+            && r->head == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE)) {
+            report_dropped(r);
+            *link = r->next;
+            free(r);
+            continue;
+        }
+        link = &r->next;
+    }
+    fflush(logger.out);
+}
+
+// Thread that drains the rings
+static void *logger_thread(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&logger.mutex);
+    while (1) {
+        drain();
+        if (logger.stop) {
+            break;
+        }
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += LOG_DRAIN_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&logger.cond, &logger.mutex, &deadline);
+    }
+    pthread_mutex_unlock(&logger.mutex);
+    return NULL;
+}
+
+int log_init(char *path) {
+    pthread_mutex_lock(&logger.mutex);
+    if (logger.started) {
+        pthread_mutex_unlock(&logger.mutex);
+        return 0;
+    }
+    if (path != NULL) {
+        logger.out = fopen(path, "w");
+        logger.binary = 1;
+        if (logger.out != NULL) {
+            fwrite(LOG_FILE_MAGIC, 1, strlen(LOG_FILE_MAGIC), logger.out);
+        }
+    } else {
+        // A stream of our own, so as to buffer a whole pass at a time
+        int fd = dup(STDERR_FILENO);
+        logger.out = fd >= 0 ? fdopen(fd, "w") : NULL;
+        if (logger.out == NULL && fd >= 0) {
+            close(fd);
+        }
+    }
+    if (logger.out == NULL) {
+        pthread_mutex_unlock(&logger.mutex);
+        return -1;
+    }
+    if (pthread_create(&logger.tid, NULL, logger_thread, NULL)) {
+        fclose(logger.out);
+        logger.out = NULL;
+        pthread_mutex_unlock(&logger.mutex);
+        return -1;
+    }
+    logger.started = 1;
+    pthread_mutex_unlock(&logger.mutex);
+    atexit(log_fini);
+    return 0;
+}
+
+void log_set_level(int level) {
+    __atomic_store_n(&log_threshold, level, __ATOMIC_RELAXED);
+}
+
+int log_parse_level(const char *name) {
+    for (int level = LOG_DEBUG; level <= LOG_OFF; level++) {
+        if (strcmp(name, level_names[level]) == 0) {
+            return level;
+        }
+    }
+    return -1;
+}
+
+void log_fini(void) {
+    pthread_mutex_lock(&logger.mutex);
+    if (!logger.started) {
+        pthread_mutex_unlock(&logger.mutex);
+        return;
+    }
+    logger.stop = 1;
+    pthread_cond_signal(&logger.cond);
+    pthread_mutex_unlock(&logger.mutex);
+    pthread_join(logger.tid, NULL);
+    pthread_mutex_lock(&logger.mutex);
+    fclose(logger.out);
+    logger.out = NULL;
+    logger.started = 0;
+    pthread_mutex_unlock(&logger.mutex);
+}
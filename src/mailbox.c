@@ -0,0 +1,760 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include "mailbox.h"
+#include "intern.h"
+#include "slab.h"
+#include "timer.h"
+#include "debug.h"
+
+// Queue node holding one mailbox entry
+typedef struct mailbox_node {
+    MAILBOX_ENTRY *entry;
+    struct mailbox_node *next;
+    struct mailbox_node *prev;
+    MAILBOX *mailbox; // Mailbox in whose queue the node is
+    MAILBOX_PRIORITY priority; // Class of the entry, which selects its lane
+    int queued; // Nonzero while the node is in the queue
+    int timed; // Nonzero if the expiry timer has been scheduled
+    uint64_t expires; // When the message expires (see tw_now()), if timed
+    TIMER expiry; // Expires a message that has not been delivered in time
+} MAILBOX_NODE;
+
+static void signal_event(MAILBOX *mb);
+static void expire_node(void *arg);
+static void free_node(MAILBOX_NODE *node);
+static void release_receipts(void *arg);
+
+// Lifetime of undelivered messages in milliseconds, or 0 for no limit
+static int message_ttl;
+
+// Window for batching return receipts in milliseconds, or 0 for no batching
+static int receipt_window;
+
+// Longest spin for an entry before parking in nanoseconds, or 0 to park at once
+static long spin_limit;
+
+// Credit of a kind that the client has never limited
+#define UNLIMITED LONG_MAX
+
+// Number of entries taken from each lane in its turn, in priority order
+static const int lane_weight[MB_PRIORITIES] = { 8, 4, 1 };
+
+// The queue of entries of one priority class
+typedef struct lane {
+    MAILBOX_NODE *head; // First entry in the lane
+    MAILBOX_NODE *tail; // Last entry in the lane
+} LANE;
+
+SLAB_POOL_DEFINE(entry_pool, MAILBOX_ENTRY)
+SLAB_POOL_DEFINE(node_pool, MAILBOX_NODE)
+
+struct mailbox {
+    char *handle; // Interned handle of the owner
+    int ref_count; // Reference count for the mailbox
+    int defunct; // Nonzero once mb_shutdown() has been called
+    LANE lanes[MB_PRIORITIES]; // Queued entries, by priority class
+    int count; // Number of queued entries in all lanes
+    int turn; // Lane whose turn it is to have entries removed
+    int served; // Number of entries removed from that lane in this turn
+    int part_bytes; // Bytes in the bodies of queued parts of messages
+    int message_bytes; // Bytes in the bodies of queued whole messages
+    long credit_messages; // Messages the client will take, or UNLIMITED
+    long credit_bytes; // Bytes of messages it will take, or UNLIMITED; may be overdrawn
+    int batch_receipts; // Nonzero if the client takes batched return receipts
+    MAILBOX_ENTRY *receipts; // Open batch of return receipts, or NULL
+    TIMER receipt_timer; // Adds the open batch to the queue when it fires
+    MAILBOX_DISCARD_HOOK *discard_hook; // Hook called on discarded entries
+    pthread_mutex_t lock; // Mutex for thread safety
+    pthread_cond_t not_empty; // Signaled when an entry is added or on shutdown
+    int event_fd; // Readable while entries are queued, or -1 if not yet created
+    long spin; // Current spin budget in nanoseconds (see spin_wait())
+    int held; // Nonzero while no entry may be removed (see mb_hold())
+    int taken; // Nonzero from the removal of an entry until the next attempt
+    pthread_cond_t idle; // Signaled when a held mailbox has no entry taken
+};
+
+MAILBOX *mb_init(char *handle) {
+    if (handle == NULL) {
+        return NULL;
+    }
+    // Allocate memory for the mailbox
+    MAILBOX *mb = malloc(sizeof(MAILBOX));
+    if (mb == NULL) {
+        return NULL;
+    }
+    // Share the interned copy of the handle
+    mb->handle = intern_handle(handle);
+    if (mb->handle == NULL) {
+        free(mb);
+        return NULL;
+    }
+
+    mb->ref_count = 1;
+    mb->defunct = 0;
+    memset(mb->lanes, 0, sizeof(mb->lanes));
+    mb->count = 0;
+    mb->turn = 0;
+    mb->served = 0;
+    mb->part_bytes = 0;
+    mb->message_bytes = 0;
+    mb->credit_messages = UNLIMITED;
+    mb->credit_bytes = UNLIMITED;
+    mb->batch_receipts = 0;
+    mb->receipts = NULL;
+    tw_timer_init(&mb->receipt_timer, release_receipts, mb);
+    mb->discard_hook = NULL;
+    mb->event_fd = -1;
+    mb->spin = spin_limit;
+    mb->held = 0;
+    mb->taken = 0;
+    pthread_mutex_init(&mb->lock, NULL);
+    pthread_cond_init(&mb->not_empty, NULL);
+    pthread_cond_init(&mb->idle, NULL);
+
+    debug("Mailbox initialized for %s", mb->handle);
+    return mb;
+}
+
+void mb_set_discard_hook(MAILBOX *mb, MAILBOX_DISCARD_HOOK *hook) {
+    pthread_mutex_lock(&mb->lock);
+    mb->discard_hook = hook;
+    pthread_mutex_unlock(&mb->lock);
+}
+
+void mb_ref(MAILBOX *mb, char *why) {
+    (void)why;
+    pthread_mutex_lock(&mb->lock);
+    mb->ref_count++;
+    debug("Mailbox ref count: (%d -> %d)", mb->ref_count - 1, mb->ref_count);
+    pthread_mutex_unlock(&mb->lock);
+}
+
+void mb_unref(MAILBOX *mb, char *why) {
+    (void)why;
+    pthread_mutex_lock(&mb->lock);
+    mb->ref_count--;
+    debug("Mailbox ref count: (%d -> %d)", mb->ref_count + 1, mb->ref_count);
+    if (mb->ref_count > 0) {
+        pthread_mutex_unlock(&mb->lock);
+        return;
+    }
+    pthread_mutex_unlock(&mb->lock);
+
+    // Nothing else can open a batch now, so once the timer is canceled the
+    // open batch, if any, stays put
+    tw_cancel(&mb->receipt_timer);
+    if (mb->receipts != NULL) {
+        mb_free_entry(mb->receipts);
+    }
+
+    // Detach any entries that were never removed, so that their expiry
+    // timers will leave them alone
+    pthread_mutex_lock(&mb->lock);
+    for (int i = 0; i < MB_PRIORITIES; i++) {
+        for (MAILBOX_NODE *n = mb->lanes[i].head; n != NULL; n = n->next) {
+            n->queued = 0;
+        }
+    }
+    pthread_mutex_unlock(&mb->lock);
+
+    // Free the detached entries
+    for (int i = 0; i < MB_PRIORITIES; i++) {
+        MAILBOX_NODE *node = mb->lanes[i].head;
+        mb->lanes[i].head = mb->lanes[i].tail = NULL;
+        while (node != NULL) {
+            MAILBOX_NODE *next = node->next;
+            MAILBOX_ENTRY *entry = node->entry;
+            if (entry->type == MESSAGE_ENTRY_TYPE) {
+                if (entry->content.message.from != NULL && entry->content.message.from != mb) {
+                    mb_unref(entry->content.message.from, "Finalizing mailbox");
+                }
+                free(entry->content.message.body);
+            }
+            mb_free_entry(entry);
+            free_node(node);
+            node = next;
+        }
+    }
+
+    debug("Free Mailbox");
+    if (mb->event_fd >= 0) {
+        close(mb->event_fd);
+    }
+    pthread_mutex_destroy(&mb->lock);
+    pthread_cond_destroy(&mb->not_empty);
+    pthread_cond_destroy(&mb->idle);
+    intern_unref(mb->handle);
+    free(mb);
+}
+
+void mb_shutdown(MAILBOX *mb) {
+    pthread_mutex_lock(&mb->lock);
+    mb->defunct = 1;
+    // Wake up any thread waiting in mb_next_entry() or polling the event fd
+    pthread_cond_broadcast(&mb->not_empty);
+    signal_event(mb);
+    pthread_mutex_unlock(&mb->lock);
+    debug("Mailbox shut down");
+}
+
+char *mb_get_handle(MAILBOX *mb) {
+    return mb->handle;
+}
+
+// Make the event fd readable; the mailbox must be locked
+static void signal_event(MAILBOX *mb) {
+    if (mb->event_fd >= 0) {
+        uint64_t one = 1;
+        if (write(mb->event_fd, &one, sizeof(one)) < 0) {
+            debug("Mailbox event write failed");
+        }
+    }
+}
+
+// Unlink a node from its lane; the mailbox must be locked
+static void unlink_node(MAILBOX *mb, MAILBOX_NODE *node) {
+    LANE *lane = &mb->lanes[node->priority];
+    if (node->prev == NULL) {
+        lane->head = node->next;
+    } else {
+        node->prev->next = node->next;
+    }
+    if (node->next == NULL) {
+        lane->tail = node->prev;
+    } else {
+        node->next->prev = node->prev;
+    }
+    node->queued = 0;
+    mb->count--;
+    MAILBOX_ENTRY *entry = node->entry;
+    if (entry->type == MESSAGE_ENTRY_TYPE) {
+        if (entry->content.message.part != WHOLE_MESSAGE) {
+            mb->part_bytes -= entry->content.message.length;
+        } else {
+            mb->message_bytes -= entry->content.message.length;
+        }
+    }
+}
+
+// Whether the client has limited the credit of either kind; the mailbox
+// must be locked
+static int credited(MAILBOX *mb) {
+    return mb->credit_messages != UNLIMITED || mb->credit_bytes != UNLIMITED;
+}
+
+// Whether messages may be removed: within the credit of the client, or
+// at any time once the mailbox is defunct, since they are then discarded.
+// The mailbox must be locked.
+static int has_credit(MAILBOX *mb) {
+    return mb->defunct || (mb->credit_messages > 0 && mb->credit_bytes > 0);
+}
+
+// Whether an entry may be removed now: none while the mailbox is held,
+// unless it is defunct.  The mailbox must be locked.
+static int ready(MAILBOX *mb) {
+    if (mb->held && !mb->defunct) {
+        return 0;
+    }
+    return mb->lanes[CONTROL_PRIORITY].head != NULL || (mb->count > 0 && has_credit(mb));
+}
+
+// Choose the next entry to remove by weighted round robin over the lanes:
+// each lane in turn may have up to its weight in entries removed before the
+// next lane gets its turn, so control notices overtake queued messages but
+// no lane is starved.  Only the control lane takes its turns while the
+// client is out of credit.  The mailbox must be locked and ready().
+static MAILBOX_NODE *next_node(MAILBOX *mb) {
+    int messages = has_credit(mb);
+    while (1) {
+        LANE *lane = &mb->lanes[mb->turn];
+        if (lane->head != NULL && mb->served < lane_weight[mb->turn]
+            && (messages || mb->turn == CONTROL_PRIORITY)) {
+            mb->served++;
+            return lane->head;
+        }
+        mb->turn = (mb->turn + 1) % MB_PRIORITIES;
+        mb->served = 0;
+    }
+}
+
+// Free a node that has been unlinked, once its expiry timer cannot fire.
+// The mailbox must not be locked, since the timer callback may be waiting
+// for the lock.
+static void free_node(MAILBOX_NODE *node) {
+    if (node->timed) {
+        tw_cancel(&node->expiry);
+    }
+    slab_free(&node_pool, node);
+}
+
+// Dispose of an entry that will not be delivered, after passing it to
+// the discard hook
+static void discard_entry(MAILBOX *mb, MAILBOX_ENTRY *entry, MAILBOX_DISCARD_HOOK *hook) {
+    if (entry->type == MESSAGE_ENTRY_TYPE && entry->content.message.from == mb) {
+        entry->content.message.from = NULL;
+    }
+    if (hook != NULL) {
+        hook(entry);
+    }
+    if (entry->type == MESSAGE_ENTRY_TYPE) {
+        if (entry->content.message.from != NULL) {
+            mb_unref(entry->content.message.from, "Discarding message");
+        }
+        free(entry->content.message.body);
+    }
+    mb_free_entry(entry);
+}
+
+// Timer callback: discard a message that has waited too long for delivery,
+// along with the messages at the heads of the lanes that have expired by
+// now, so that a backlog that expires together is reaped under one lock
+// rather than one timer at a time
+static void expire_node(void *arg) {
+    MAILBOX_NODE *node = arg;
+    MAILBOX *mb = node->mailbox;
+    pthread_mutex_lock(&mb->lock);
+    if (!node->queued) {
+        // Removed in the meantime; whoever removed it frees it
+        pthread_mutex_unlock(&mb->lock);
+        return;
+    }
+    unlink_node(mb, node);
+    node->next = NULL;
+    MAILBOX_NODE *reaped = node;
+    uint64_t now = tw_now();
+    for (int i = URGENT_PRIORITY; i < MB_PRIORITIES; i++) {
+        MAILBOX_NODE *head;
+        while ((head = mb->lanes[i].head) != NULL && head->timed && head->expires <= now) {
+            unlink_node(mb, head);
+            head->next = reaped;
+            reaped = head;
+        }
+    }
+    MAILBOX_DISCARD_HOOK *hook = mb->discard_hook;
+    pthread_mutex_unlock(&mb->lock);
+
+    while (reaped != NULL) {
+        MAILBOX_NODE *next = reaped->next;
+        debug("Message %d expired in mailbox of %s", reaped->entry->content.message.msgid, mb->handle);
+        discard_entry(mb, reaped->entry, hook);
+        if (reaped == node) {
+            slab_free(&node_pool, reaped);
+        } else {
+            free_node(reaped);
+        }
+        reaped = next;
+    }
+}
+
+// Append an entry to the lane for its priority.  Returns -1 if the mailbox
+// is defunct, or 1 if the entry is a message and the messages of its kind
+// (parts, or whole messages under credit) already waiting leave no room
+// for it.
+static int mb_enqueue(MAILBOX *mb, MAILBOX_ENTRY *entry) {
+    MAILBOX_NODE *node = slab_alloc(&node_pool);
+    if (node == NULL) {
+        return -1;
+    }
+    node->entry = entry;
+    node->next = NULL;
+    node->mailbox = mb;
+    node->queued = 1;
+    node->timed = 0;
+    MESSAGE *msg = &entry->content.message;
+    int part = 0;
+    if (entry->type == NOTICE_ENTRY_TYPE) {
+        node->priority = CONTROL_PRIORITY;
+    } else {
+        node->priority = msg->urgent ? URGENT_PRIORITY : NORMAL_PRIORITY;
+        part = msg->part != WHOLE_MESSAGE;
+    }
+
+    pthread_mutex_lock(&mb->lock);
+    if (mb->defunct) {
+        pthread_mutex_unlock(&mb->lock);
+        slab_free(&node_pool, node);
+        return -1;
+    }
+    if (part) {
+        if (msg->part != ABORTED_PART && mb->part_bytes > 0
+            && mb->part_bytes + msg->length > MB_PART_BUFFER) {
+            pthread_mutex_unlock(&mb->lock);
+            slab_free(&node_pool, node);
+            return 1;
+        }
+        mb->part_bytes += msg->length;
+    } else if (entry->type == MESSAGE_ENTRY_TYPE) {
+        if (credited(mb) && mb->message_bytes > 0
+            && mb->message_bytes + msg->length > MB_CREDIT_BACKLOG) {
+            pthread_mutex_unlock(&mb->lock);
+            slab_free(&node_pool, node);
+            return 1;
+        }
+        mb->message_bytes += msg->length;
+    }
+    LANE *lane = &mb->lanes[node->priority];
+    node->prev = lane->tail;
+    if (lane->tail == NULL) {
+        lane->head = node;
+    } else {
+        lane->tail->next = node;
+    }
+    lane->tail = node;
+    mb->count++;
+    int ttl = entry->type == MESSAGE_ENTRY_TYPE && !part ? msg->ttl : 0;
+    if (message_ttl > 0 && (ttl == 0 || ttl > message_ttl)) {
+        ttl = message_ttl;
+    }
+    if (ttl > 0 && entry->type == MESSAGE_ENTRY_TYPE && !part) {
+        node->timed = 1;
+        node->expires = tw_now() + ttl;
+        tw_timer_init(&node->expiry, expire_node, node);
+        tw_schedule(&node->expiry, ttl);
+    }
+    pthread_cond_signal(&mb->not_empty);
+    signal_event(mb);
+    pthread_mutex_unlock(&mb->lock);
+    return 0;
+}
+
+// Add a message or part of either priority.  Returns the result of
+// mb_enqueue(), or -1 if no entry could be allocated.
+static int add_message(MAILBOX *mb, int msgid, MAILBOX *from, void *body, int length,
+                       MESSAGE_PART part, int urgent, int ttl) {
+    MAILBOX_ENTRY *entry = slab_alloc(&entry_pool);
+    if (entry == NULL) {
+        free(body);
+        return -1;
+    }
+    entry->type = MESSAGE_ENTRY_TYPE;
+    entry->content.message.msgid = msgid;
+    entry->content.message.from = from;
+    entry->content.message.body = body;
+    entry->content.message.length = length;
+    entry->content.message.urgent = urgent;
+    entry->content.message.part = part;
+    entry->content.message.ttl = ttl;
+
+    // Hold a reference to the sender's mailbox so that it can be notified
+    if (from != NULL && from != mb) {
+        mb_ref(from, "Message added to mailbox");
+    }
+
+    int ret = mb_enqueue(mb, entry);
+    if (ret) {
+        // Mailbox is defunct or out of room: the message is ignored
+        if (from != NULL && from != mb) {
+            mb_unref(from, "Message rejected by mailbox");
+        }
+        free(body);
+        mb_free_entry(entry);
+    }
+    return ret;
+}
+
+int mb_add_message(MAILBOX *mb, int msgid, MAILBOX *from, void *body, int length) {
+    return add_message(mb, msgid, from, body, length, WHOLE_MESSAGE, 0, 0);
+}
+
+int mb_add_urgent_message(MAILBOX *mb, int msgid, MAILBOX *from, void *body, int length) {
+    return add_message(mb, msgid, from, body, length, WHOLE_MESSAGE, 1, 0);
+}
+
+int mb_add_timed_message(MAILBOX *mb, int msgid, MAILBOX *from, void *body, int length,
+                         int urgent, int ttl) {
+    return add_message(mb, msgid, from, body, length, WHOLE_MESSAGE, urgent, ttl);
+}
+
+int mb_add_part(MAILBOX *mb, int msgid, MAILBOX *from, void *body, int length,
+                MESSAGE_PART part, int urgent) {
+    return add_message(mb, msgid, from, body, length, part, urgent, 0);
+}
+
+// Timer callback: add the open batch of receipts to the queue
+static void release_receipts(void *arg) {
+    MAILBOX *mb = arg;
+    pthread_mutex_lock(&mb->lock);
+    MAILBOX_ENTRY *batch = mb->receipts;
+    mb->receipts = NULL;
+    pthread_mutex_unlock(&mb->lock);
+    if (batch != NULL && mb_enqueue(mb, batch)) {
+        mb_free_entry(batch);
+    }
+}
+
+// Add a return receipt to the open batch, opening one if necessary
+static void add_receipt(MAILBOX *mb, int msgid) {
+    pthread_mutex_lock(&mb->lock);
+    if (mb->defunct) {
+        pthread_mutex_unlock(&mb->lock);
+        return;
+    }
+    MAILBOX_ENTRY *batch = mb->receipts;
+    if (batch == NULL) {
+        batch = slab_alloc(&entry_pool);
+        if (batch == NULL) {
+            pthread_mutex_unlock(&mb->lock);
+            return;
+        }
+        batch->type = NOTICE_ENTRY_TYPE;
+        batch->content.notice.type = RRCPT_NOTICE_TYPE;
+        batch->content.notice.msgid = msgid;
+        batch->content.notice.count = 0;
+        batch->content.notice.msgids = NULL;
+        mb->receipts = batch;
+        tw_schedule(&mb->receipt_timer, receipt_window);
+    }
+    NOTICE *notice = &batch->content.notice;
+    // The array is grown whenever the count reaches a power of two
+    if ((notice->count & (notice->count - 1)) == 0) {
+        int *msgids = realloc(notice->msgids, (notice->count ? notice->count * 2 : 8) * sizeof(int));
+        if (msgids == NULL) {
+            pthread_mutex_unlock(&mb->lock);
+            return;
+        }
+        notice->msgids = msgids;
+    }
+    notice->msgids[notice->count++] = msgid;
+    int full = notice->count == MB_RECEIPT_BATCH;
+    if (full) {
+        // Release it now; the timer finds no batch, or the next one, when it fires
+        mb->receipts = NULL;
+    }
+    pthread_mutex_unlock(&mb->lock);
+    if (full && mb_enqueue(mb, batch)) {
+        mb_free_entry(batch);
+    }
+}
+
+void mb_add_notice(MAILBOX *mb, NOTICE_TYPE ntype, int msgid) {
+    if (ntype == RRCPT_NOTICE_TYPE && receipt_window > 0 && mb_batches_receipts(mb)) {
+        add_receipt(mb, msgid);
+        return;
+    }
+    MAILBOX_ENTRY *entry = slab_alloc(&entry_pool);
+    if (entry == NULL) {
+        return;
+    }
+    entry->type = NOTICE_ENTRY_TYPE;
+    entry->content.notice.type = ntype;
+    entry->content.notice.msgid = msgid;
+    entry->content.notice.count = 0;
+    entry->content.notice.msgids = NULL;
+
+    if (mb_enqueue(mb, entry)) {
+        // Mailbox is defunct: the notice is ignored
+        mb_free_entry(entry);
+    }
+}
+
+// Let a spinning CPU yield its pipeline to the other hyperthread
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+// Spin with the mailbox unlocked between checks, so that entries can be
+// added, until an entry may be removed or the mailbox becomes defunct or the
+// budget runs out, and adapt the budget to the outcome.  The check is the
+// one next_entry() makes, so entries held back for want of credit do not
+// count.  The mailbox must be locked.
+static void spin_wait(MAILBOX *mb) {
+    long budget = mb->spin;
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int woken;
+    do {
+        pthread_mutex_unlock(&mb->lock);
+        cpu_relax();
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        pthread_mutex_lock(&mb->lock);
+        woken = ready(mb) || mb->defunct;
+    } while (!woken && (now.tv_sec - start.tv_sec) * 1000000000L
+             + (now.tv_nsec - start.tv_nsec) < budget);
+    if (woken) {
+        mb->spin = budget * 2 < spin_limit ? budget * 2 : spin_limit;
+    } else {
+        mb->spin = budget / 2 > spin_limit / MB_SPIN_FLOOR ? budget / 2 : spin_limit / MB_SPIN_FLOOR;
+    }
+}
+
+// Remove the next entry, discarding entries of a defunct mailbox.  If block
+// is zero, NULL is returned instead of waiting for an entry to arrive.
+static MAILBOX_ENTRY *next_entry(MAILBOX *mb, int block) {
+    pthread_mutex_lock(&mb->lock);
+    // The caller is done with the entry it removed last
+    if (mb->taken) {
+        mb->taken = 0;
+        if (mb->held) {
+            pthread_cond_broadcast(&mb->idle);
+        }
+    }
+    while (1) {
+        // Block until there is an entry that may be removed or the mailbox
+        // becomes defunct, spinning for a while first if allowed
+        int spun = 0;
+        while (block && !ready(mb) && !mb->defunct) {
+            if (!spun && mb->spin > 0) {
+                spin_wait(mb);
+                spun = 1;
+                continue;
+            }
+            pthread_cond_wait(&mb->not_empty, &mb->lock);
+        }
+        if (!ready(mb)) {
+            // Defunct and drained, or nothing to remove and not to block
+            pthread_mutex_unlock(&mb->lock);
+            return NULL;
+        }
+
+        // Unlink the next entry in priority order, charging a message to
+        // the credit of the client
+        MAILBOX_NODE *node = next_node(mb);
+        unlink_node(mb, node);
+        MAILBOX_ENTRY *entry = node->entry;
+        int defunct = mb->defunct;
+        if (!defunct && entry->type == MESSAGE_ENTRY_TYPE) {
+            if (mb->credit_messages != UNLIMITED) {
+                mb->credit_messages--;
+            }
+            if (mb->credit_bytes != UNLIMITED) {
+                mb->credit_bytes -= entry->content.message.length;
+            }
+        }
+        MAILBOX_DISCARD_HOOK *hook = mb->discard_hook;
+        mb->taken = !defunct;
+        pthread_mutex_unlock(&mb->lock);
+        free_node(node);
+
+        if (!defunct) {
+            return entry;
+        }
+
+        // Mailbox is defunct: discard the entry
+        discard_entry(mb, entry, hook);
+        pthread_mutex_lock(&mb->lock);
+    }
+}
+
+MAILBOX_ENTRY *mb_next_entry(MAILBOX *mb) {
+    return next_entry(mb, 1);
+}
+
+MAILBOX_ENTRY *mb_try_next_entry(MAILBOX *mb) {
+    return next_entry(mb, 0);
+}
+
+// Add to the credit of one kind, limiting it if it was not; a negative
+// amount leaves it as it is
+static void add_credit(long *credit, long amount) {
+    if (amount < 0) {
+        return;
+    }
+    if (*credit == UNLIMITED) {
+        *credit = amount;
+    } else {
+        *credit = *credit < UNLIMITED - 1 - amount ? *credit + amount : UNLIMITED - 1;
+    }
+}
+
+void mb_grant_credit(MAILBOX *mb, long messages, long bytes) {
+    pthread_mutex_lock(&mb->lock);
+    add_credit(&mb->credit_messages, messages);
+    add_credit(&mb->credit_bytes, bytes);
+    if (ready(mb)) {
+        pthread_cond_signal(&mb->not_empty);
+        signal_event(mb);
+    }
+    pthread_mutex_unlock(&mb->lock);
+}
+
+int mb_event_fd(MAILBOX *mb) {
+    pthread_mutex_lock(&mb->lock);
+    if (mb->event_fd < 0) {
+        mb->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        // Entries may already be waiting
+        if (mb->count > 0 || mb->defunct) {
+            signal_event(mb);
+        }
+    }
+    int fd = mb->event_fd;
+    pthread_mutex_unlock(&mb->lock);
+    return fd;
+}
+
+int mb_hold(MAILBOX *mb, const struct timespec *deadline) {
+    pthread_mutex_lock(&mb->lock);
+    mb->held = 1;
+    int ret = 0;
+    while (mb->taken && ret == 0) {
+        ret = pthread_cond_timedwait(&mb->idle, &mb->lock, deadline);
+    }
+    ret = mb->taken ? -1 : 0;
+    pthread_mutex_unlock(&mb->lock);
+    return ret;
+}
+
+void mb_release(MAILBOX *mb) {
+    pthread_mutex_lock(&mb->lock);
+    mb->held = 0;
+    if (ready(mb)) {
+        pthread_cond_signal(&mb->not_empty);
+        signal_event(mb);
+    }
+    pthread_mutex_unlock(&mb->lock);
+}
+
+void mb_foreach(MAILBOX *mb, void (*fn)(MAILBOX_ENTRY *, void *), void *arg) {
+    pthread_mutex_lock(&mb->lock);
+    for (int i = 0; i < MB_PRIORITIES; i++) {
+        for (MAILBOX_NODE *node = mb->lanes[i].head; node != NULL; node = node->next) {
+            fn(node->entry, arg);
+        }
+    }
+    if (mb->receipts != NULL) {
+        fn(mb->receipts, arg);
+    }
+    pthread_mutex_unlock(&mb->lock);
+}
+
+void mb_set_message_ttl(int ms) {
+    message_ttl = ms;
+}
+
+void mb_set_batch_receipts(MAILBOX *mb, int on) {
+    pthread_mutex_lock(&mb->lock);
+    mb->batch_receipts = on;
+    pthread_mutex_unlock(&mb->lock);
+}
+
+int mb_batches_receipts(MAILBOX *mb) {
+    pthread_mutex_lock(&mb->lock);
+    int on = mb->batch_receipts;
+    pthread_mutex_unlock(&mb->lock);
+    return on;
+}
+
+void mb_set_receipt_window(int ms) {
+    receipt_window = ms;
+}
+
+void mb_set_spin(int us) {
+    // On a single CPU the thread that would add the entry is kept waiting
+    spin_limit = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? us * 1000L : 0;
+}
+
+void mb_free_entry(MAILBOX_ENTRY *entry) {
+    if (entry->type == NOTICE_ENTRY_TYPE) {
+        free(entry->content.notice.msgids);
+    }
+    slab_free(&entry_pool, entry);
+}
@@ -2,59 +2,543 @@
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <pthread.h>
 #include <errno.h>
+#include <limits.h>
 #include <signal.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <poll.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/resource.h>
 
 #include "debug.h"
 #include "server.h"
 #include "globals.h"
 #include "csapp.h"
+#include "handoff.h"
+#include "cluster.h"
+#include "presence.h"
+#include "handle_index.h"
+#include "slab.h"
+#include "coro.h"
+#include "timer.h"
+#include "ratelimit.h"
+#include "dedup.h"
+#include "protocol.h"
+#include "log.h"
+#include "acceptor.h"
+#include "placement.h"
+#include "search.h"
+#include "snapshot.h"
 
 static void terminate(int);
 
 /*
  * "Charla" chat server.
  *
- * Usage: charla <port>
+ * Usage: charla -p <port> [-u <path> [-r]] [-c <nodes> -n <index> -K <path>]
+ *               [-s <count>] [-m] [-C <threads>] [-i <seconds>] [-k <seconds>]
+ *               [-e <seconds>] [-R <messages>] [-B <bytes>] [-D <seconds>]
+ *               [-P <bytes>] [-W <milliseconds>] [-Q <requests>] [-L <path>]
+ *               [-l <level>] [-o <path>] [-a <placement>] [-S] [-X <dir>]
+ *               [-f <path> [-t <seconds>]] [-b <microseconds>] [-z <path>]
+ *
+ * The optional '-u <path>' specifies the Unix-domain socket used for a
+ * hot upgrade: upon SIGUSR2, the server stops serving its clients, hands
+ * its listening socket and client connections to the process waiting at
+ * that path, and exits (see handoff.h).
+ * With '-r', the server is that new process: instead of opening its own
+ * listening socket it waits for the handoff and resumes service.
+ *
+ * The optional '-c <nodes> -n <index>' run the server as node <index> of
+ * a cluster whose nodes are given as a comma-separated list of host:port
+ * (see cluster.h).  '-K <path>' names the file holding the cluster secret,
+ * which every node must share: a node only accepts forwarded requests on a
+ * link that has shown it.
+ *
+ * The optional '-s <count>' preallocates room for <count> objects of each
+ * pooled type (CLIENT, USER, MAILBOX_ENTRY, ...) at startup (see slab.h).
+ *
+ * The optional '-m' serves each client and its mailbox from a single
+ * thread instead of two (see server.h).
+ *
+ * The optional '-C <threads>' runs each client session as a coroutine on
+ * one of <threads> scheduler threads, rather than on threads of its own
+ * (see coro.h).  This implies '-m'.
+ *
+ * The optional '-i <seconds>' closes connections on which no request has
+ * been received for that long, and '-k <seconds>' sends a keepalive probe
+ * to clients that have been idle for that long (see server.h).  The
+ * optional '-e <seconds>' bounces messages that have not been delivered
+ * within that time (see mailbox.h).
+ *
+ * The optional '-R <messages>' and '-B <bytes>' limit the rate at which
+ * each connection, and each handle, may send messages, in messages and
+ * payload bytes per second (see ratelimit.h).
+ *
+ * The optional '-D <seconds>' ACKs, without delivering it again, a SEND
+ * whose msgid the same sender used within that time (see dedup.h).
+ *
+ * The optional '-P <bytes>' closes the connection of a client that sends
+ * a packet with a payload longer than that, instead of the default of
+ * CHLA_MAX_PAYLOAD; longer messages must be sent in parts (see protocol.h).
+ *
+ * The optional '-W <milliseconds>' batches the return receipts for each
+ * sender within that window into a single RCVD packet (see mailbox.h),
+ * for the clients that log in asking for it (see protocol.h); others
+ * still get one RCVD packet for each message.
+ *
+ * The optional '-Q <requests>' lets each client have up to that many
+ * requests in flight at once, which may complete out of order (see
+ * server.h).
+ *
+ * The optional '-L <path>' also listens for clients on a Unix-domain
+ * socket at that path, which spares clients on the same host the TCP/IP
+ * stack, and on which a client may log in as its local user without
+ * naming a handle (see protocol.h) and may switch to a shared-memory
+ * transport (see shm.h).  A process resuming after a hot upgrade replaces
+ * the socket with its own.
+ *
+ * The optional '-l <level>' records only diagnostics at or above that
+ * level (debug, info, success, warn, error or off), and '-o <path>'
+ * writes them to a binary log file at that path, to be decoded with
+ * tools/logdecode.c, rather than formatting them to stderr (see log.h).
+ * Each SIGUSR1 makes logging one level more verbose, wrapping around from
+ * debug to off.  Only the levels compiled in (see debug.h) are available.
+ *
+ * The optional '-a <placement>' pins the acceptor, the threads serving
+ * connections and the worker threads to sets of CPUs, given as in
+ * "acceptor=0:io=2-7:worker=8,9", and '-S' serves each connection near
+ * the CPU that receives its packets (see placement.h).
+ *
+ * The optional '-X <dir>' keeps the messages delivered by this server in
+ * a full-text index in that directory, which clients may query with
+ * SEARCH requests (see search.h).
+ *
+ * The optional '-f <path>' saves the users and their undelivered mail to
+ * a snapshot file at that path on a clean shutdown, and restores each
+ * user's mail from it when they next log in, after a restart; '-t
+ * <seconds>' also saves a snapshot at that interval (see snapshot.h).
+ *
+ * The optional '-b <microseconds>' trades CPU time for latency: a mailbox
+ * service thread spins for up to that long waiting for an entry before it
+ * sleeps (see mailbox.h), and each connection busy polls its device queue
+ * for that long before a read sleeps (see server.h).  It is meant to be
+ * used with '-a', so that the io threads, which spin, have CPUs of their
+ * own.
+ *
+ * The optional '-z <path>' writes statistics to a file at that path when
+ * the server shuts down: for each object pool, the objects allocated and
+ * freed and the memory taken from malloc() (see slab.h), the requests
+ * refused by rate limits, the connections accepted and shed, and the peak
+ * resident set size of the process.  Servers built with INFO also print
+ * them to stderr.
  */
 
-// Function to handle SIGHUP signal
+// Listening sockets and rendezvous path for hot upgrade
+static int listenfd = -1;
+static int unixfd = -1;
+static char *handoff_path = NULL;
+
+// File to which statistics are written on shutdown, if any
+static char *stats_path = NULL;
+
+// How long a hot upgrade waits for the clients to stop
+#define UPGRADE_TIMEOUT_MS 5000
+
+// Written by the SIGUSR2 handler to wake the upgrade thread
+static int upgrade_pipe[2] = { -1, -1 };
+
+// Written by the SIGHUP handler to wake the shutdown thread
+static int shutdown_pipe[2] = { -1, -1 };
+
+// Held by the acceptor while it accepts connections, and by the upgrade
+// thread while it hands them off
+static pthread_mutex_t accept_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Function to handle SIGHUP signal: have the shutdown thread shut down the
+// server, which takes locks, allocates and joins threads, none of which can
+// be done in a signal handler
 void sighup_handler(int signal) {
+    (void)signal;
+    int saved_errno = errno;
+    if (shutdown_pipe[1] >= 0 && write(shutdown_pipe[1], "", 1) < 0) {
+        // The pipe is full, so the shutdown thread has been woken already
+    }
+    errno = saved_errno;
+}
+
+// Thread function that shuts down the server upon SIGHUP
+static void *shutdown_thread(void *arg) {
+    pthread_detach(pthread_self());
+    char c;
+    while (read(shutdown_pipe[0], &c, 1) < 0 && errno == EINTR)
+        ;
     terminate(EXIT_SUCCESS);
+    return arg;
+}
+
+// Function to handle SIGUSR1 signal: lower the logging threshold by a level
+void sigusr1_handler(int signal) {
+    (void)signal;
+    int level = __atomic_load_n(&log_threshold, __ATOMIC_RELAXED);
+    log_set_level(level == LOG_DEBUG ? LOG_OFF : level - 1);
+}
+
+// Function to handle SIGUSR2 signal: have the upgrade thread hand off to
+// a new server process, which cannot be done in a signal handler
+void sigusr2_handler(int signal) {
+    (void)signal;
+    int saved_errno = errno;
+    if (upgrade_pipe[1] >= 0 && write(upgrade_pipe[1], "", 1) < 0) {
+        // The pipe is full, so the upgrade thread has been woken already
+    }
+    errno = saved_errno;
+}
+
+// Thread function that hands off to a new server process upon SIGUSR2
+static void *upgrade_thread(void *arg) {
+    pthread_detach(pthread_self());
+    char c;
+    while (1) {
+        if (read(upgrade_pipe[0], &c, 1) <= 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        // Stop accepting and serving clients, so that nothing is read from
+        // or written to a connection once the new process has it
+        pthread_mutex_lock(&accept_lock);
+        if (chla_quiesce(UPGRADE_TIMEOUT_MS)) {
+            debug("Clients did not stop, continuing service");
+            pthread_mutex_unlock(&accept_lock);
+            continue;
+        }
+        // The new process gets the mailboxes, and the mail nobody has claimed
+        snap_save(0);
+        if (handoff_send(handoff_path, listenfd, client_registry)) {
+            debug("Handoff failed, continuing service");
+            chla_resume();
+            pthread_mutex_unlock(&accept_lock);
+            continue;
+        }
+        // The connections now belong to the new process: exit without shutting
+        // them down, once the new process can have the messages indexed so far
+        search_fini();
+        debug("%ld: Server handed off, exiting", pthread_self());
+        _exit(EXIT_SUCCESS);
+    }
+    return arg;
+}
+
+// Open a Unix-domain listening socket at a path, replacing any socket
+// that is already there
+static int open_unix_listenfd(char *path) {
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (bind(fd, (SA *)&addr, sizeof(addr)) < 0 || listen(fd, LISTENQ) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
 }
 
 int main(int argc, char* argv[]){
     // Option processing should be performed here.
     // Option '-p <port>' is required in order to specify the port number
     // on which the server should listen.
-
-    // Check if args are valid
-    if (argv[1] && argv[2]){
-        if (argc != 3 || strcmp(argv[1], "-p") != 0) {
+    char *port_str = NULL;
+    char *nodes = NULL;
+    char *node_str = NULL;
+    char *secret_path = NULL;
+    char *capacity_str = NULL;
+    char *coro_str = NULL;
+    char *idle_str = NULL;
+    char *keepalive_str = NULL;
+    char *ttl_str = NULL;
+    char *msg_rate_str = NULL;
+    char *byte_rate_str = NULL;
+    char *dedup_str = NULL;
+    char *max_payload_str = NULL;
+    char *receipt_str = NULL;
+    char *pipeline_str = NULL;
+    char *unix_path = NULL;
+    char *level_str = NULL;
+    char *log_path = NULL;
+    char *placement = NULL;
+    char *index_dir = NULL;
+    char *snap_path = NULL;
+    char *snap_str = NULL;
+    char *busy_str = NULL;
+    int steer = 0;
+    int resume = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "p:u:rc:n:K:s:mC:i:k:e:R:B:D:P:W:Q:L:l:o:a:SX:f:t:b:z:")) != -1) {
+        switch (opt) {
+        case 'p':
+            port_str = optarg;
+            break;
+        case 'u':
+            handoff_path = optarg;
+            break;
+        case 'r':
+            resume = 1;
+            break;
+        case 'c':
+            nodes = optarg;
+            break;
+        case 'n':
+            node_str = optarg;
+            break;
+        case 'K':
+            secret_path = optarg;
+            break;
+        case 's':
+            capacity_str = optarg;
+            break;
+        case 'm':
+            chla_single_thread = 1;
+            break;
+        case 'C':
+            coro_str = optarg;
+            chla_single_thread = 1;
+            break;
+        case 'i':
+            idle_str = optarg;
+            break;
+        case 'k':
+            keepalive_str = optarg;
+            break;
+        case 'e':
+            ttl_str = optarg;
+            break;
+        case 'R':
+            msg_rate_str = optarg;
+            break;
+        case 'B':
+            byte_rate_str = optarg;
+            break;
+        case 'D':
+            dedup_str = optarg;
+            break;
+        case 'P':
+            max_payload_str = optarg;
+            break;
+        case 'W':
+            receipt_str = optarg;
+            break;
+        case 'Q':
+            pipeline_str = optarg;
+            break;
+        case 'L':
+            unix_path = optarg;
+            break;
+        case 'l':
+            level_str = optarg;
+            break;
+        case 'o':
+            log_path = optarg;
+            break;
+        case 'a':
+            placement = optarg;
+            break;
+        case 'S':
+            steer = 1;
+            break;
+        case 'X':
+            index_dir = optarg;
+            break;
+        case 'f':
+            snap_path = optarg;
+            break;
+        case 't':
+            snap_str = optarg;
+            break;
+        case 'b':
+            busy_str = optarg;
+            break;
+        case 'z':
+            stats_path = optarg;
+            break;
+        default:
             fprintf(stderr, "Invalid combination of args.\n");
             exit(EXIT_SUCCESS);
         }
+    }
+    if (port_str == NULL || optind != argc || (resume && handoff_path == NULL)
+        || (nodes == NULL) != (node_str == NULL) || (nodes == NULL) != (secret_path == NULL)
+        || (snap_str != NULL && snap_path == NULL)) {
+        fprintf(stderr, "Invalid combination of args.\n");
+        exit(EXIT_SUCCESS);
+    }
+
+    // Check if port number is valid
+    char *endptr;
+    long port = strtol(port_str, &endptr, 10);
+    if (*endptr != '\0' || port <= 0 || port > 65535 || errno == ERANGE) {
+        fprintf(stderr, "Invalid port number.\n");
+        exit(EXIT_SUCCESS);
+    }
 
-        // Check if port number is valid
-        char *endptr;
-        long port = strtol(argv[2], &endptr, 10);
-        if (*endptr != '\0' || port <= 0 || port > 65535 || errno == ERANGE) {
-            fprintf(stderr, "Invalid port number.\n");
+    // Set the level of logging before anything is recorded
+    if (level_str != NULL) {
+        int level = log_parse_level(level_str);
+        if (level < 0) {
+            fprintf(stderr, "Invalid log level.\n");
             exit(EXIT_SUCCESS);
         }
+        log_set_level(level);
     }
-    else{
+
+    // Set up the placement of threads, before any is started
+    if (place_init(placement, steer)) {
+        fprintf(stderr, "Invalid thread placement.\n");
         exit(EXIT_SUCCESS);
     }
 
+    // Start logging
+#if defined(DEBUG) || defined(INFO) || defined(WARN) || defined(SUCCESS) || defined(ERROR)
+    int logging = 1;
+#else
+    int logging = log_path != NULL; // There is nothing to format otherwise
+#endif
+    if (logging && log_init(log_path)) {
+        fprintf(stderr, "Error starting logging.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Preallocate the object pools, if requested
+    if (capacity_str != NULL) {
+        long capacity = strtol(capacity_str, &endptr, 10);
+        if (*endptr != '\0' || capacity < 0 || slab_init(capacity)) {
+            fprintf(stderr, "Invalid pool capacity.\n");
+            exit(EXIT_SUCCESS);
+        }
+    }
+
+    // Start the coroutine schedulers, if requested
+    if (coro_str != NULL) {
+        long nthreads = strtol(coro_str, &endptr, 10);
+        if (*endptr != '\0' || nthreads <= 0 || coro_init(nthreads)) {
+            fprintf(stderr, "Invalid number of coroutine threads.\n");
+            exit(EXIT_SUCCESS);
+        }
+    }
+
+    // Set up the timeouts, which are checked on the timer wheel
+    long idle = idle_str != NULL ? strtol(idle_str, &endptr, 10) : 0;
+    if ((idle_str != NULL && *endptr != '\0') || idle < 0 || idle > INT_MAX / 1000) {
+        fprintf(stderr, "Invalid idle timeout.\n");
+        exit(EXIT_SUCCESS);
+    }
+    long keepalive = keepalive_str != NULL ? strtol(keepalive_str, &endptr, 10) : 0;
+    if ((keepalive_str != NULL && *endptr != '\0') || keepalive < 0 || keepalive > INT_MAX / 1000) {
+        fprintf(stderr, "Invalid keepalive interval.\n");
+        exit(EXIT_SUCCESS);
+    }
+    long ttl = ttl_str != NULL ? strtol(ttl_str, &endptr, 10) : 0;
+    if ((ttl_str != NULL && *endptr != '\0') || ttl < 0 || ttl > INT_MAX / 1000) {
+        fprintf(stderr, "Invalid message lifetime.\n");
+        exit(EXIT_SUCCESS);
+    }
+    long receipt_window = receipt_str != NULL ? strtol(receipt_str, &endptr, 10) : 0;
+    if ((receipt_str != NULL && *endptr != '\0') || receipt_window < 0 || receipt_window > INT_MAX) {
+        fprintf(stderr, "Invalid receipt window.\n");
+        exit(EXIT_SUCCESS);
+    }
+    chla_idle_timeout = idle;
+    chla_keepalive = keepalive;
+    mb_set_message_ttl(ttl * 1000);
+    mb_set_receipt_window(receipt_window);
+
+    // Set up the low-latency mode, before any mailbox is created
+    long busy = busy_str != NULL ? strtol(busy_str, &endptr, 10) : 0;
+    if ((busy_str != NULL && *endptr != '\0') || busy < 0 || busy > INT_MAX / 1000) {
+        fprintf(stderr, "Invalid busy-poll time.\n");
+        exit(EXIT_SUCCESS);
+    }
+    chla_busy_poll = busy;
+    mb_set_spin(busy);
+    if (tw_init()) {
+        fprintf(stderr, "Error starting timer wheel.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Set up the limits on the rate of SEND requests
+    double msg_rate = msg_rate_str != NULL ? strtod(msg_rate_str, &endptr) : 0;
+    if ((msg_rate_str != NULL && *endptr != '\0') || !(msg_rate >= 0)) {
+        fprintf(stderr, "Invalid message rate.\n");
+        exit(EXIT_SUCCESS);
+    }
+    double byte_rate = byte_rate_str != NULL ? strtod(byte_rate_str, &endptr) : 0;
+    if ((byte_rate_str != NULL && *endptr != '\0') || !(byte_rate >= 0)) {
+        fprintf(stderr, "Invalid byte rate.\n");
+        exit(EXIT_SUCCESS);
+    }
+    rl_set_limits(msg_rate, byte_rate);
+
+    // Set up the deduplication of retried SEND requests
+    long dedup = dedup_str != NULL ? strtol(dedup_str, &endptr, 10) : 0;
+    if ((dedup_str != NULL && *endptr != '\0') || dedup < 0 || dedup > INT_MAX / 1000) {
+        fprintf(stderr, "Invalid deduplication window.\n");
+        exit(EXIT_SUCCESS);
+    }
+    dedup_set_window(dedup * 1000);
+
+    // Set up the limit on the size of a packet payload
+    if (max_payload_str != NULL) {
+        long max_payload = strtol(max_payload_str, &endptr, 10);
+        if (*endptr != '\0' || max_payload <= 0 || max_payload > UINT32_MAX) {
+            fprintf(stderr, "Invalid maximum payload size.\n");
+            exit(EXIT_SUCCESS);
+        }
+        proto_max_payload = max_payload;
+    }
+
+    // Set up the number of requests each client may have in flight
+    if (pipeline_str != NULL) {
+        long depth = strtol(pipeline_str, &endptr, 10);
+        if (*endptr != '\0' || depth < 1 || depth > CHLA_MAX_PIPELINE) {
+            fprintf(stderr, "Invalid pipeline depth.\n");
+            exit(EXIT_SUCCESS);
+        }
+        chla_pipeline_depth = depth;
+    }
+
+    // Join the cluster, if one was specified
+    if (nodes != NULL) {
+        long node = strtol(node_str, &endptr, 10);
+        if (*endptr != '\0' || cluster_init(nodes, node, secret_path)) {
+            fprintf(stderr, "Invalid cluster configuration.\n");
+            exit(EXIT_SUCCESS);
+        }
+    }
+
     // Perform required initializations of the client_registry and
     // player_registry.
     user_registry = ureg_init();
     client_registry = creg_init();
+    if (presence_init()) {
+        fprintf(stderr, "Error starting presence service.\n");
+        terminate(EXIT_FAILURE);
+    }
 
     // TODO: Set up the server socket and enter a loop to accept connections
     // on this socket.  For each connection, a thread should be started to
@@ -62,7 +546,16 @@ int main(int argc, char* argv[]){
     // a SIGHUP handler, so that receipt of SIGHUP will perform a clean
     // shutdown of the server.
 
-    // Set up SIGHUP handler
+    // Set up SIGHUP handler, and the thread it wakes
+    pthread_t shutdown_tid;
+    if (pipe(shutdown_pipe) < 0
+        || fcntl(shutdown_pipe[0], F_SETFD, FD_CLOEXEC) < 0
+        || fcntl(shutdown_pipe[1], F_SETFD, FD_CLOEXEC) < 0
+        || fcntl(shutdown_pipe[1], F_SETFL, O_NONBLOCK) < 0
+        || pthread_create(&shutdown_tid, NULL, shutdown_thread, NULL)) {
+        fprintf(stderr, "Error setting up shutdown.\n");
+        terminate(EXIT_FAILURE);
+    }
     struct sigaction sa;
     sa.sa_handler = sighup_handler;
     sigemptyset(&sa.sa_mask);
@@ -72,35 +565,154 @@ int main(int argc, char* argv[]){
         terminate(EXIT_FAILURE);
     }
 
-    // Set up socket
-    int *connfdp;
-    socklen_t clientlen;
-    struct sockaddr_storage clientaddr;
-    pthread_t tid;
-    int listenfd = open_listenfd(argv[2]);
+    // Set up SIGUSR1 handler for adjusting the logging level
+    sa.sa_handler = sigusr1_handler;
+    if (sigaction(SIGUSR1, &sa, NULL) == -1) {
+        fprintf(stderr, "Error installing SIGUSR1 handler");
+        terminate(EXIT_FAILURE);
+    }
+
+    // Set up SIGUSR2 handler for hot upgrade
+    sa.sa_handler = sigusr2_handler;
+    if (sigaction(SIGUSR2, &sa, NULL) == -1) {
+        fprintf(stderr, "Error installing SIGUSR2 handler");
+        terminate(EXIT_FAILURE);
+    }
+
+    // A client that goes away while deliveries are being written to it must
+    // only fail those writes, not kill the server
+    sa.sa_handler = SIG_IGN;
+    if (sigaction(SIGPIPE, &sa, NULL) == -1) {
+        fprintf(stderr, "Error ignoring SIGPIPE");
+        terminate(EXIT_FAILURE);
+    }
+
+    // Set up the hot upgrade, before any session is started
+    if (handoff_path != NULL) {
+        pthread_t tid;
+        if (chla_quiesce_init() || pipe(upgrade_pipe) < 0
+            || fcntl(upgrade_pipe[0], F_SETFD, FD_CLOEXEC) < 0
+            || fcntl(upgrade_pipe[1], F_SETFD, FD_CLOEXEC) < 0
+            || fcntl(upgrade_pipe[1], F_SETFL, O_NONBLOCK) < 0
+            || pthread_create(&tid, NULL, upgrade_thread, NULL)) {
+            fprintf(stderr, "Error setting up hot upgrade.\n");
+            terminate(EXIT_FAILURE);
+        }
+    }
+
+    // Set up socket, or inherit it together with the clients of the old server
+    if (resume) {
+        listenfd = handoff_recv(handoff_path);
+    } else {
+        listenfd = open_listenfd(port_str);
+    }
+    if (listenfd < 0) {
+        fprintf(stderr, "Error setting up listening socket.\n");
+        terminate(EXIT_FAILURE);
+    }
+    if (unix_path != NULL && (unixfd = open_unix_listenfd(unix_path)) < 0) {
+        fprintf(stderr, "Error setting up Unix-domain listening socket.\n");
+        terminate(EXIT_FAILURE);
+    }
+
+    // Open the search index; after a handoff, this waits for the old
+    // server to have written out its part
+    if (index_dir != NULL && search_init(index_dir)) {
+        fprintf(stderr, "Error opening search index.\n");
+        terminate(EXIT_FAILURE);
+    }
+
+    // Load the snapshot of undelivered mail, which after a handoff the old
+    // server has just written
+    if (snap_path != NULL) {
+        long interval = 0;
+        if (snap_str != NULL) {
+            interval = strtol(snap_str, &endptr, 10);
+            if (*endptr != '\0' || interval < 1 || interval > INT_MAX) {
+                fprintf(stderr, "Invalid snapshot interval.\n");
+                terminate(EXIT_FAILURE);
+            }
+        }
+        if (snap_init(snap_path, interval)) {
+            fprintf(stderr, "Error starting snapshots.\n");
+            terminate(EXIT_FAILURE);
+        }
+    }
+
+    if (acc_init(coro_str != NULL) || acc_listen(listenfd) || (unixfd >= 0 && acc_listen(unixfd))) {
+        fprintf(stderr, "Error setting up acceptor.\n");
+        terminate(EXIT_FAILURE);
+    }
+
+    place_thread(PLACE_ACCEPTOR);
+
+    // Accept connections on whichever listening socket has some waiting
+    // (poll() ignores the Unix-domain socket if there is none)
+    struct pollfd listeners[2] = {
+        { .fd = listenfd, .events = POLLIN },
+        { .fd = unixfd, .events = POLLIN }
+    };
     while (1) {
-        clientlen = sizeof(struct sockaddr_storage);
-        connfdp = Malloc(sizeof(int));
-        *connfdp = Accept(listenfd, (SA *) &clientaddr, &clientlen);
-        Pthread_create(&tid, NULL, chla_client_service, connfdp);
+        if (poll(listeners, 2, -1) < 0) {
+            continue;
+        }
+        pthread_mutex_lock(&accept_lock);
+        for (int i = 0; i < 2; i++) {
+            if (listeners[i].revents != 0 && acc_accept(listeners[i].fd)) {
+                fprintf(stderr, "Error accepting connections.\n");
+                terminate(EXIT_FAILURE);
+            }
+        }
+        pthread_mutex_unlock(&accept_lock);
     }
 
 
     terminate(EXIT_SUCCESS);
 }
 
+// Print the statistics kept by the modules, and the peak memory use
+static void report_stats(FILE *out) {
+    slab_report(out);
+    rl_report(out);
+    acc_report(out);
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        fprintf(out, "Peak resident set size: %ld KiB\n", usage.ru_maxrss);
+    }
+}
+
 /*
  * Function called to cleanly shut down the server.
  */
 static void terminate(int status) {
+    // Save the undelivered mail while the mailboxes still hold it
+    snap_save(1);
+
     // Shut down all existing client connections.
     // This will trigger the eventual termination of service threads.
     creg_shutdown_all(client_registry);
+    presence_fini();
 
     // Finalize modules.
     creg_fini(client_registry);
     ureg_fini(user_registry);
+    tw_fini();
+    dedup_fini();
+    cluster_fini();
+    hidx_fini();
+    search_fini();
+    snap_fini();
 
+    if (stats_path != NULL) {
+        FILE *out = fopen(stats_path, "w");
+        if (out != NULL) {
+            report_stats(out);
+            fclose(out);
+        }
+    }
+#ifdef INFO
+    report_stats(stderr);
+#endif
     debug("%ld: Server terminating", pthread_self());
     exit(status);
 }
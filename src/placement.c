@@ -0,0 +1,233 @@
+#define _GNU_SOURCE // For the CPU affinity calls
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sched.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include "placement.h"
+#include "debug.h"
+
+#define PLACE_MAX_NODES 64
+
+static const char *role_names[PLACE_ROLES] = { "acceptor", "io", "worker" };
+
+static cpu_set_t allowed; // CPUs the process may run on
+static cpu_set_t sets[PLACE_ROLES];
+static int given[PLACE_ROLES]; // Whether each role has a set
+static int steering;
+static unsigned char cpu_nodes[CPU_SETSIZE];
+static int nnodes = 1;
+
+// Parse a list of CPUs and ranges, such as "0-3,8"
+static int parse_cpus(char *list, cpu_set_t *set) {
+    CPU_ZERO(set);
+    char *p = list;
+    while (1) {
+        char *end;
+        long first = strtol(p, &end, 10);
+        if (end == p || first < 0) {
+            return -1;
+        }
+        long last = first;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first) {
+                return -1;
+            }
+        }
+        if (last >= CPU_SETSIZE) {
+            return -1;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            CPU_SET(cpu, set);
+        }
+        if (*end == '\0') {
+            return 0;
+        }
+        if (*end != ',') {
+            return -1;
+        }
+        p = end + 1;
+    }
+}
+
+// Find out which node each CPU is on
+static void read_topology(void) {
+    DIR *dir = opendir("/sys/devices/system/node");
+    if (dir == NULL) {
+        return;
+    }
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        int node;
+        char extra;
+        if (sscanf(ent->d_name, "node%d%c", &node, &extra) != 1 || node < 0 || node >= PLACE_MAX_NODES) {
+            continue;
+        }
+        char path[300];
+        char buf[4096];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/%s/cpulist", ent->d_name);
+        FILE *f = fopen(path, "r");
+        if (f == NULL) {
+            continue;
+        }
+        cpu_set_t set;
+        if (fgets(buf, sizeof(buf), f) != NULL) {
+            buf[strcspn(buf, "\n")] = '\0';
+            // A node with memory but no CPUs has an empty list
+            if (parse_cpus(buf, &set) == 0) {
+                for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+                    if (CPU_ISSET(cpu, &set)) {
+                        cpu_nodes[cpu] = node;
+                    }
+                }
+            }
+        }
+        fclose(f);
+        if (node >= nnodes) {
+            nnodes = node + 1;
+        }
+    }
+    closedir(dir);
+}
+
+int place_init(char *spec, int steer) {
+    if (sched_getaffinity(0, sizeof(allowed), &allowed)) {
+        return -1;
+    }
+    read_topology();
+    if (spec != NULL) {
+        char *copy = strdup(spec);
+        if (copy == NULL) {
+            return -1;
+        }
+        char *save;
+        for (char *item = strtok_r(copy, ":", &save); item != NULL; item = strtok_r(NULL, ":", &save)) {
+            char *eq = strchr(item, '=');
+            int role = 0;
+            if (eq != NULL) {
+                *eq = '\0';
+                while (role < PLACE_ROLES && strcmp(item, role_names[role]) != 0) {
+                    role++;
+                }
+            }
+            if (eq == NULL || role == PLACE_ROLES || parse_cpus(eq + 1, &sets[role])) {
+                free(copy);
+                return -1;
+            }
+            CPU_AND(&sets[role], &sets[role], &allowed);
+            if (CPU_COUNT(&sets[role]) == 0) {
+                free(copy);
+                return -1;
+            }
+            given[role] = 1;
+        }
+        free(copy);
+    }
+    // Steering needs CPUs to steer to
+    steering = steer;
+    if (steering && !given[PLACE_IO]) {
+        sets[PLACE_IO] = allowed;
+        given[PLACE_IO] = 1;
+    }
+    debug("Placement over %d CPUs on %d nodes%s", CPU_COUNT(&allowed), nnodes,
+          steering ? ", steering connections" : "");
+    return 0;
+}
+
+void place_thread(PLACE_ROLE role) {
+    if (given[role]) {
+        pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &sets[role]);
+    } else if (role == PLACE_IO && given[PLACE_ACCEPTOR]) {
+        // Do not keep the placement inherited from the acceptor
+        pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &allowed);
+    }
+}
+
+int place_pin(int cpu) {
+    if (cpu < 0 || cpu >= CPU_SETSIZE) {
+        return -1;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set) ? -1 : 0;
+}
+
+int place_cpu(PLACE_ROLE role, int index) {
+    if (!given[role]) {
+        return -1;
+    }
+    int n = index % CPU_COUNT(&sets[role]);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &sets[role]) && n-- == 0) {
+            return cpu;
+        }
+    }
+    return -1;
+}
+
+int place_node(int cpu) {
+    if (cpu < 0) {
+        cpu = sched_getcpu();
+    }
+    return cpu >= 0 && cpu < CPU_SETSIZE ? cpu_nodes[cpu] : 0;
+}
+
+int place_incoming_cpu(int fd) {
+    if (!steering) {
+        return -1;
+    }
+    int cpu;
+    socklen_t len = sizeof(cpu);
+    if (getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) < 0
+        || cpu < 0 || cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, &allowed)) {
+        return -1;
+    }
+    return cpu;
+}
+
+void place_session(int fd) {
+    int cpu = place_incoming_cpu(fd);
+    if (cpu >= 0) {
+        if (CPU_ISSET(cpu, &sets[PLACE_IO])) {
+            place_pin(cpu);
+            debug("Connection on fd %d served on CPU %d", fd, cpu);
+            return;
+        }
+        cpu_set_t near;
+        CPU_ZERO(&near);
+        for (int c = 0; c < CPU_SETSIZE; c++) {
+            if (CPU_ISSET(c, &sets[PLACE_IO]) && cpu_nodes[c] == cpu_nodes[cpu]) {
+                CPU_SET(c, &near);
+            }
+        }
+        if (CPU_COUNT(&near) > 0) {
+            pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &near);
+            debug("Connection on fd %d served on node %d", fd, cpu_nodes[cpu]);
+            return;
+        }
+    }
+    place_thread(PLACE_IO);
+}
+
+void place_bind(void *addr, size_t length, int node) {
+    if (nnodes <= 1) {
+        return;
+    }
+    if (node < 0) {
+        node = place_node(-1);
+    }
+    unsigned long mask[PLACE_MAX_NODES / (8 * sizeof(unsigned long))] = { 0 };
+    mask[node / (8 * sizeof(unsigned long))] = 1UL << (node % (8 * sizeof(unsigned long)));
+    // The kernel takes one bit fewer than maxnode says
+    if (syscall(SYS_mbind, addr, length, MPOL_PREFERRED, mask, PLACE_MAX_NODES + 1, 0) < 0) {
+        debug("Could not bind memory to node %d", node);
+    }
+}
@@ -0,0 +1,366 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "presence.h"
+#include "client_registry.h"
+#include "protocol.h"
+#include "placement.h"
+#include "debug.h"
+
+// A change of state of a handle that has not yet been sent
+typedef struct presence_delta {
+    char *handle;
+    int online;
+    int listed; // Nonzero if a list of users taken since reflects it
+    struct presence_delta *next;
+} PRESENCE_DELTA;
+
+static struct presence {
+    pthread_mutex_t mutex; // Mutex for thread safety
+    pthread_cond_t changed; // Signaled when a delta is added or on shutdown
+    int running; // Nonzero while the sending thread is running
+    int held; // Nonzero while no batch may be taken (see presence_hold())
+    int sending; // Nonzero while a batch is being sent
+    pthread_t tid; // The sending thread
+    CLIENT **subscribers; // Subscribed clients, in an array grown as needed
+    int subscriber_count;
+    int subscriber_capacity;
+    PRESENCE_DELTA *head; // Pending deltas, oldest first
+    PRESENCE_DELTA *tail;
+} presence = { .mutex = PTHREAD_MUTEX_INITIALIZER, .changed = PTHREAD_COND_INITIALIZER };
+
+// Make room for one more subscriber; the mutex must be held
+static int grow_subscribers(void) {
+    if (presence.subscriber_count < presence.subscriber_capacity) {
+        return 0;
+    }
+    int capacity = presence.subscriber_capacity > 0 ? 2 * presence.subscriber_capacity : 16;
+    CLIENT **grown = realloc(presence.subscribers, capacity * sizeof(CLIENT *));
+    if (grown == NULL) {
+        return -1;
+    }
+    presence.subscribers = grown;
+    presence.subscriber_capacity = capacity;
+    return 0;
+}
+
+// Free a list of deltas
+static void free_deltas(PRESENCE_DELTA *delta) {
+    while (delta != NULL) {
+        PRESENCE_DELTA *next = delta->next;
+        free(delta->handle);
+        free(delta);
+        delta = next;
+    }
+}
+
+// Send a batch of deltas to the subscribers there were when it was taken,
+// dropping the references to them
+static void send_deltas(PRESENCE_DELTA *deltas, CLIENT **subscribers, int count) {
+    size_t length = 0;
+    for (PRESENCE_DELTA *d = deltas; d != NULL; d = d->next) {
+        length += strlen(d->handle) + 2;
+    }
+    char *payload = malloc(length);
+    if (payload == NULL) {
+        for (int i = 0; i < count; i++) {
+            client_unref(subscribers[i], "Presence changes not sent");
+        }
+        return;
+    }
+    char *p = payload;
+    for (PRESENCE_DELTA *d = deltas; d != NULL; d = d->next) {
+        size_t hlen = strlen(d->handle);
+        *p++ = d->online ? '+' : '-';
+        memcpy(p, d->handle, hlen);
+        p += hlen;
+        *p++ = '\n';
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    CHLA_PACKET_HEADER hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.type = CHLA_PRESENCE_PKT;
+    hdr.payload_length = htonl(length);
+    hdr.timestamp_sec = htonl(ts.tv_sec);
+    hdr.timestamp_nsec = htonl(ts.tv_nsec);
+    for (int i = 0; i < count; i++) {
+        client_send_packet(subscribers[i], &hdr, payload);
+        client_unref(subscribers[i], "Presence changes sent");
+    }
+    free(payload);
+    debug("Presence changes sent to %d subscribers", count);
+}
+
+// Thread function that sends the deltas collected over each window
+static void *presence_service(void *arg) {
+    (void)arg;
+    place_thread(PLACE_WORKER);
+    pthread_mutex_lock(&presence.mutex);
+    while (presence.running) {
+        // Wait for the first change of a window
+        while (presence.running && (presence.head == NULL || presence.held)) {
+            pthread_cond_wait(&presence.changed, &presence.mutex);
+        }
+        if (!presence.running) {
+            break;
+        }
+
+        // Collect further changes until the window closes
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += PRESENCE_WINDOW_MS * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        while (presence.running
+               && pthread_cond_timedwait(&presence.changed, &presence.mutex, &deadline) == 0)
+            ;
+        if (presence.held) {
+            continue;
+        }
+
+        // The deltas go to the subscribers there are when they are taken,
+        // whose lists of users cannot reflect any later change, and with
+        // references so that they can be sent without holding the lock
+        PRESENCE_DELTA *deltas = presence.head;
+        presence.head = presence.tail = NULL;
+        int count = presence.subscriber_count;
+        CLIENT **subscribers = malloc((count + 1) * sizeof(CLIENT *));
+        if (subscribers == NULL) {
+            debug("Presence changes dropped for lack of memory");
+            count = 0;
+        }
+        for (int i = 0; i < count; i++) {
+            subscribers[i] = client_ref(presence.subscribers[i], "Sending presence changes");
+        }
+        presence.sending = 1;
+        pthread_mutex_unlock(&presence.mutex);
+        if (deltas != NULL) {
+            send_deltas(deltas, subscribers, count);
+            free_deltas(deltas);
+        } else {
+            for (int i = 0; i < count; i++) {
+                client_unref(subscribers[i], "Presence changes not sent");
+            }
+        }
+        free(subscribers);
+        pthread_mutex_lock(&presence.mutex);
+        presence.sending = 0;
+        pthread_cond_broadcast(&presence.changed);
+    }
+    pthread_mutex_unlock(&presence.mutex);
+    return NULL;
+}
+
+int presence_init(void) {
+    pthread_mutex_lock(&presence.mutex);
+    presence.running = 1;
+    pthread_mutex_unlock(&presence.mutex);
+    if (pthread_create(&presence.tid, NULL, presence_service, NULL)) {
+        presence.running = 0;
+        return -1;
+    }
+    debug("Presence subscriptions initialized");
+    return 0;
+}
+
+void presence_fini(void) {
+    pthread_mutex_lock(&presence.mutex);
+    int running = presence.running;
+    presence.running = 0;
+    pthread_cond_broadcast(&presence.changed);
+    pthread_mutex_unlock(&presence.mutex);
+    if (running) {
+        pthread_join(presence.tid, NULL);
+    }
+
+    pthread_mutex_lock(&presence.mutex);
+    for (int i = 0; i < presence.subscriber_count; i++) {
+        client_unref(presence.subscribers[i], "Finalizing presence subscriptions");
+    }
+    presence.subscriber_count = 0;
+    free(presence.subscribers);
+    presence.subscribers = NULL;
+    presence.subscriber_capacity = 0;
+    free_deltas(presence.head);
+    presence.head = presence.tail = NULL;
+    pthread_mutex_unlock(&presence.mutex);
+}
+
+// What a subscription needs to build the list of users it is ACKed with
+struct subscription {
+    CLIENT *client;
+    char *(*snapshot)(void *arg, size_t *lengthp);
+    void *arg;
+    int added; // Nonzero if the client was not subscribed already
+};
+
+// Subscribe a client and take the list of users in the same moment, so
+// that every change after the list goes to the client in a later batch.
+// Called with the connection to the client held, so that any batch to it
+// is sent after the list.
+static char *subscribe_with_snapshot(void *arg, size_t *lengthp) {
+    struct subscription *sub = arg;
+    pthread_mutex_lock(&presence.mutex);
+    int found = 0;
+    for (int i = 0; i < presence.subscriber_count && !found; i++) {
+        found = presence.subscribers[i] == sub->client;
+    }
+    if (!found && grow_subscribers()) {
+        pthread_mutex_unlock(&presence.mutex);
+        return NULL;
+    }
+    char *list = sub->snapshot(sub->arg, lengthp);
+    if (list != NULL) {
+        // The list already reflects the pending changes, so an opposite
+        // change must not cancel one of them out: the client would never
+        // learn of it
+        for (PRESENCE_DELTA *d = presence.head; d != NULL; d = d->next) {
+            d->listed = 1;
+        }
+        if (!found) {
+            presence.subscribers[presence.subscriber_count++] = client_ref(sub->client, "Presence subscription");
+            sub->added = 1;
+        }
+    }
+    pthread_mutex_unlock(&presence.mutex);
+    return list;
+}
+
+int presence_subscribe(CLIENT *client, uint32_t msgid,
+                       char *(*snapshot)(void *arg, size_t *lengthp), void *arg) {
+    struct subscription sub = { client, snapshot, arg, 0 };
+    CHLA_PACKET_HEADER hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.type = CHLA_ACK_PKT;
+    hdr.msgid = htonl(msgid);
+    if (client_send_built(client, &hdr, subscribe_with_snapshot, &sub)) {
+        if (sub.added) {
+            presence_unsubscribe(client);
+        }
+        return -1;
+    }
+    return 0;
+}
+
+int presence_subscribed(CLIENT *client) {
+    pthread_mutex_lock(&presence.mutex);
+    int found = 0;
+    for (int i = 0; i < presence.subscriber_count && !found; i++) {
+        found = presence.subscribers[i] == client;
+    }
+    pthread_mutex_unlock(&presence.mutex);
+    return found;
+}
+
+int presence_resubscribe(CLIENT *client) {
+    pthread_mutex_lock(&presence.mutex);
+    if (grow_subscribers()) {
+        pthread_mutex_unlock(&presence.mutex);
+        return -1;
+    }
+    presence.subscribers[presence.subscriber_count++] = client_ref(client, "Presence subscription handed off");
+    pthread_mutex_unlock(&presence.mutex);
+    return 0;
+}
+
+void presence_unsubscribe(CLIENT *client) {
+    pthread_mutex_lock(&presence.mutex);
+    for (int i = 0; i < presence.subscriber_count; i++) {
+        if (presence.subscribers[i] == client) {
+            presence.subscribers[i] = presence.subscribers[--presence.subscriber_count];
+            pthread_mutex_unlock(&presence.mutex);
+            client_unref(client, "Presence unsubscribed");
+            return;
+        }
+    }
+    pthread_mutex_unlock(&presence.mutex);
+}
+
+// Append a delta to the pending ones; the mutex must be held
+static void add_delta(char *handle, int online, int listed) {
+    PRESENCE_DELTA *delta = malloc(sizeof(PRESENCE_DELTA));
+    if (delta == NULL || (delta->handle = strdup(handle)) == NULL) {
+        free(delta);
+        return;
+    }
+    delta->online = online;
+    delta->listed = listed;
+    delta->next = NULL;
+    if (presence.tail == NULL) {
+        presence.head = delta;
+    } else {
+        presence.tail->next = delta;
+    }
+    presence.tail = delta;
+    pthread_cond_signal(&presence.changed);
+}
+
+void presence_changed(char *handle, int online) {
+    pthread_mutex_lock(&presence.mutex);
+    if (!presence.running || presence.subscriber_count == 0) {
+        // Nobody to tell
+        pthread_mutex_unlock(&presence.mutex);
+        return;
+    }
+
+    // An opposite change of the same handle in this window cancels out,
+    // unless a subscriber has been given a list of users that reflects it
+    PRESENCE_DELTA *prev = NULL;
+    for (PRESENCE_DELTA *d = presence.head; d != NULL; prev = d, d = d->next) {
+        if (!d->listed && d->online != online && strcmp(d->handle, handle) == 0) {
+            if (prev == NULL) {
+                presence.head = d->next;
+            } else {
+                prev->next = d->next;
+            }
+            if (presence.tail == d) {
+                presence.tail = prev;
+            }
+            free(d->handle);
+            free(d);
+            pthread_mutex_unlock(&presence.mutex);
+            return;
+        }
+    }
+
+    add_delta(handle, online, 0);
+    pthread_mutex_unlock(&presence.mutex);
+}
+
+void presence_foreach_pending(void (*func)(char *handle, int online, int listed, void *arg), void *arg) {
+    pthread_mutex_lock(&presence.mutex);
+    for (PRESENCE_DELTA *d = presence.head; d != NULL; d = d->next) {
+        func(d->handle, d->online, d->listed, arg);
+    }
+    pthread_mutex_unlock(&presence.mutex);
+}
+
+void presence_restore(char *handle, int online, int listed) {
+    pthread_mutex_lock(&presence.mutex);
+    if (presence.running && presence.subscriber_count > 0) {
+        add_delta(handle, online, listed);
+    }
+    pthread_mutex_unlock(&presence.mutex);
+}
+
+int presence_hold(const struct timespec *deadline) {
+    pthread_mutex_lock(&presence.mutex);
+    presence.held = 1;
+    int err = 0;
+    while (presence.sending && err == 0) {
+        err = pthread_cond_timedwait(&presence.changed, &presence.mutex, deadline);
+    }
+    int ret = presence.sending ? -1 : 0;
+    pthread_mutex_unlock(&presence.mutex);
+    return ret;
+}
+
+void presence_release(void) {
+    pthread_mutex_lock(&presence.mutex);
+    presence.held = 0;
+    pthread_cond_broadcast(&presence.changed);
+    pthread_mutex_unlock(&presence.mutex);
+}
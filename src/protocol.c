@@ -1,12 +1,28 @@
+#define _GNU_SOURCE // For struct ucred
 #include "protocol.h"
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <pwd.h>
+#include <sys/socket.h>
+#include "coro.h"
 #include "debug.h"
 
+size_t proto_max_payload = CHLA_MAX_PAYLOAD;
+
 int write_all(int fd, const void *buf, size_t count) {
     size_t bytes_written = 0;
     while (bytes_written < count) {
         ssize_t ret = write(fd, (const char *)buf + bytes_written, count - bytes_written);
+        if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            // Non-blocking socket: wait (as a coroutine, if in one) until writable
+            struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+            if (coro_poll(&pfd, 1) < 0) {
+                return -1;
+            }
+            continue;
+        }
         if (ret <= 0) {
             return ret; // Error or EOF
         }
@@ -19,6 +35,14 @@ int read_all(int fd, void *buf, size_t count) {
     size_t bytes_read = 0;
     while (bytes_read < count) {
         ssize_t ret = read(fd, (char *)buf + bytes_read, count - bytes_read);
+        if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            // Non-blocking socket: wait (as a coroutine, if in one) until readable
+            struct pollfd pfd = { .fd = fd, .events = POLLIN };
+            if (coro_poll(&pfd, 1) < 0) {
+                return -1;
+            }
+            continue;
+        }
         if (ret <= 0) {
             return ret; // Error or EOF
         }
@@ -103,6 +127,13 @@ int proto_recv_packet(int fd, CHLA_PACKET_HEADER *hdr, void **payload) {
 	// hdr->timestamp_sec = ntohl(hdr->timestamp_sec);
 	// hdr->timestamp_nsec = ntohl(hdr->timestamp_nsec);
 
+    // Refuse to allocate for a payload beyond the limit
+    if (hdr->payload_length > proto_max_payload) {
+        debug("Payload of %u bytes exceeds the limit", hdr->payload_length);
+        errno = EMSGSIZE;
+        return -1;
+    }
+
     // Allocate memory for payload if necessary
     if (hdr->payload_length > 0) {
         *payload = malloc(hdr->payload_length);
@@ -114,6 +145,8 @@ int proto_recv_packet(int fd, CHLA_PACKET_HEADER *hdr, void **payload) {
         // Check short count
         if (payload_bytes_read != hdr->payload_length) {
             debug("SHORT COUNT ERROR RETURN -1");
+            free(*payload);
+            *payload = NULL;
             return -1;
         }
     }
@@ -125,4 +158,24 @@ int proto_recv_packet(int fd, CHLA_PACKET_HEADER *hdr, void **payload) {
     hdr->payload_length = htonl(hdr->payload_length);
 
     return 0;
-}
\ No newline at end of file
+}
+
+char *proto_peer_user(int fd) {
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    if (getsockname(fd, (struct sockaddr *)&addr, &addrlen) || addr.ss_family != AF_UNIX) {
+        return NULL;
+    }
+    struct ucred cred;
+    socklen_t credlen = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &credlen)) {
+        return NULL;
+    }
+    struct passwd pw, *result;
+    char buf[1024];
+    if (getpwuid_r(cred.uid, &pw, buf, sizeof(buf), &result) || result == NULL) {
+        debug("No user name for uid %d", (int)cred.uid);
+        return NULL;
+    }
+    return strdup(pw.pw_name);
+}
@@ -0,0 +1,142 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include "ratelimit.h"
+#include "intern.h"
+#include "timer.h"
+#include "debug.h"
+
+#define RL_BUCKETS 256
+
+// Bucket of one handle
+typedef struct handle_bucket {
+    char *handle; // Interned handle, for which a reference is held
+    TOKEN_BUCKET bucket;
+    struct handle_bucket *next;
+} HANDLE_BUCKET;
+
+// Refill rates, and the capacities that follow from them
+static double message_rate;
+static double byte_rate;
+static double message_burst;
+static double byte_burst;
+
+static struct handle_table {
+    pthread_mutex_t mutex; // Protects the buckets of all handles
+    HANDLE_BUCKET *buckets[RL_BUCKETS];
+} table = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+// Requests refused by connection buckets and by handle buckets
+static unsigned long connection_refused;
+static unsigned long handle_refused;
+
+void rl_set_limits(double messages, double bytes) {
+    message_rate = messages;
+    byte_rate = bytes;
+    message_burst = messages * RL_BURST_SECONDS;
+    if (message_burst < 1) {
+        message_burst = 1;
+    }
+    byte_burst = bytes * RL_BURST_SECONDS;
+}
+
+void rl_init(TOKEN_BUCKET *bucket) {
+    bucket->messages = message_burst;
+    bucket->bytes = byte_burst;
+    bucket->last = tw_now();
+}
+
+// Add the tokens earned since the last refill
+static void refill(TOKEN_BUCKET *bucket, uint64_t now) {
+    double elapsed = (now - bucket->last) / 1000.0;
+    bucket->last = now;
+    bucket->messages += elapsed * message_rate;
+    if (bucket->messages > message_burst) {
+        bucket->messages = message_burst;
+    }
+    bucket->bytes += elapsed * byte_rate;
+    if (bucket->bytes > byte_burst) {
+        bucket->bytes = byte_burst;
+    }
+}
+
+// Check whether a request may take tokens from a bucket
+static int admissible(TOKEN_BUCKET *bucket) {
+    return (message_rate == 0 || bucket->messages >= 1)
+        && (byte_rate == 0 || bucket->bytes > 0);
+}
+
+// Take the tokens for a request; kinds that are not limited are left full
+static void take(TOKEN_BUCKET *bucket, size_t length) {
+    if (message_rate > 0) {
+        bucket->messages -= 1;
+    }
+    if (byte_rate > 0) {
+        bucket->bytes -= length;
+    }
+}
+
+// Find the bucket of a handle, creating it if necessary, and drop the full
+// buckets of other handles found on the way.  The table must be locked.
+static TOKEN_BUCKET *handle_bucket(char *handle, uint64_t now) {
+    HANDLE_BUCKET **link = &table.buckets[intern_hash(handle) % RL_BUCKETS];
+    TOKEN_BUCKET *found = NULL;
+    while (*link != NULL) {
+        HANDLE_BUCKET *hb = *link;
+        refill(&hb->bucket, now);
+        if (hb->handle == handle) {
+            found = &hb->bucket;
+        } else if (hb->bucket.messages >= message_burst && hb->bucket.bytes >= byte_burst) {
+            *link = hb->next;
+            intern_unref(hb->handle);
+            free(hb);
+            continue;
+        }
+        link = &hb->next;
+    }
+    if (found != NULL) {
+        return found;
+    }
+    HANDLE_BUCKET *hb = malloc(sizeof(HANDLE_BUCKET));
+    if (hb == NULL) {
+        return NULL;
+    }
+    hb->handle = intern_ref(handle);
+    rl_init(&hb->bucket);
+    hb->next = NULL;
+    *link = hb;
+    return &hb->bucket;
+}
+
+int rl_admit(TOKEN_BUCKET *bucket, char *handle, size_t length) {
+    if (message_rate == 0 && byte_rate == 0) {
+        return 0;
+    }
+    uint64_t now = tw_now();
+    refill(bucket, now);
+    if (!admissible(bucket)) {
+        __atomic_fetch_add(&connection_refused, 1, __ATOMIC_RELAXED);
+        debug("SEND from %s over the connection limit", handle);
+        return -1;
+    }
+
+    pthread_mutex_lock(&table.mutex);
+    TOKEN_BUCKET *shared = handle_bucket(handle, now);
+    if (shared != NULL) {
+        if (!admissible(shared)) {
+            pthread_mutex_unlock(&table.mutex);
+            __atomic_fetch_add(&handle_refused, 1, __ATOMIC_RELAXED);
+            debug("SEND from %s over the handle limit", handle);
+            return -1;
+        }
+        take(shared, length);
+    }
+    pthread_mutex_unlock(&table.mutex);
+    take(bucket, length);
+    return 0;
+}
+
+void rl_report(FILE *out) {
+    fprintf(out, "SEND requests refused: %lu by connection limit, %lu by handle limit\n",
+            __atomic_load_n(&connection_refused, __ATOMIC_RELAXED),
+            __atomic_load_n(&handle_refused, __ATOMIC_RELAXED));
+}
@@ -0,0 +1,1181 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include "search.h"
+#include "placement.h"
+#include "debug.h"
+
+#define SEARCH_MAGIC "CHLAIDX1"
+#define SEARCH_MANIFEST "segments"
+#define SEARCH_LOCK "lock"
+#define SEARCH_USER_TERM '\001' // Starts the term of a participant, which no word can
+#define MEMSEG_BUCKETS 4096
+
+// A message, as stored in a segment file after its header
+typedef struct doc_record {
+    uint32_t msgid;
+    uint32_t time;
+    uint16_t sender_length;
+    uint16_t receiver_length;
+    uint32_t body_length;
+    // Followed by the sender, receiver and body
+} DOC_RECORD;
+
+// A message waiting to be indexed, or in the in-memory segment
+typedef struct search_doc {
+    struct search_doc *next; // In the queue
+    DOC_RECORD rec;
+    char data[];
+} SEARCH_DOC;
+
+// A term and the messages that contain it, in the in-memory segment
+typedef struct postings {
+    struct postings *next; // In the bucket
+    uint32_t *docs; // Ascending
+    uint32_t count;
+    uint32_t capacity;
+    uint16_t length;
+    char term[];
+} POSTINGS;
+
+typedef struct memseg {
+    SEARCH_DOC **docs;
+    uint32_t ndocs;
+    uint32_t capacity;
+    uint32_t nterms;
+    POSTINGS *buckets[MEMSEG_BUCKETS];
+} MEMSEG;
+
+/*
+ * A segment file holds, after this header: the doc records, each padded
+ * to 4 bytes; the posting lists; the offsets of the doc records; the
+ * bytes of the terms; and the dictionary, sorted by term.
+ */
+typedef struct segment_header {
+    char magic[8];
+    uint32_t level;
+    uint32_t ndocs;
+    uint32_t nterms;
+    uint32_t reserved;
+    uint64_t docs; // Offset of the doc record offsets
+    uint64_t terms;
+    uint64_t dict;
+    uint64_t size;
+} SEGMENT_HEADER;
+
+typedef struct dict_entry {
+    uint64_t postings; // Offset of the posting list
+    uint32_t postings_length;
+    uint32_t count; // Of messages in the list
+    uint32_t term; // Offset of the term from the start of the terms
+    uint16_t term_length;
+    uint16_t reserved;
+} DICT_ENTRY;
+
+typedef struct segment {
+    uint32_t id;
+    int refs; // One for the list of segments, and one for each search
+    int obsolete; // Merged into another, so the file goes with the last ref
+    char *map;
+    size_t size;
+    SEGMENT_HEADER *hdr;
+    uint64_t *docs;
+    char *terms;
+    DICT_ENTRY *dict;
+} SEGMENT;
+
+static char *index_dir;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work = PTHREAD_COND_INITIALIZER; // For the indexing thread
+static pthread_cond_t room = PTHREAD_COND_INITIALIZER; // For the callers of search_add()
+static pthread_t indexer;
+static int running;
+static int stopping;
+
+static SEARCH_DOC *queue_head;
+static SEARCH_DOC **queue_tail = &queue_head;
+static size_t queued;
+
+static MEMSEG *current; // Taking new messages
+static MEMSEG *flushing; // Being written to a file, still searchable
+static SEGMENT **segments; // Oldest first
+static int nsegments;
+static uint32_t next_id = 1;
+
+/*
+ * Terms.
+ */
+
+static int is_word(unsigned char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c >= 0x80;
+}
+
+// Get the next word of a text, lowercased, into term
+static size_t next_term(const char *text, size_t length, size_t *pos, char *term) {
+    while (*pos < length && !is_word(text[*pos])) {
+        (*pos)++;
+    }
+    size_t len = 0;
+    while (*pos < length && is_word(text[*pos])) {
+        char c = text[*pos];
+        if (len < SEARCH_MAX_TERM) {
+            term[len++] = c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+        }
+        (*pos)++;
+    }
+    return len;
+}
+
+// The term of a participant is the whole handle, so that no two users
+// share one
+static char *user_term(const char *handle, size_t length, size_t *lengthp) {
+    char *term = malloc(length + 1);
+    if (term != NULL) {
+        term[0] = SEARCH_USER_TERM;
+        memcpy(term + 1, handle, length);
+        *lengthp = length + 1;
+    }
+    return term;
+}
+
+static int compare_terms(const char *a, size_t alen, const char *b, size_t blen) {
+    int c = memcmp(a, b, alen < blen ? alen : blen);
+    if (c != 0) {
+        return c;
+    }
+    return alen < blen ? -1 : alen > blen;
+}
+
+static uint32_t hash_term(const char *term, size_t length) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        h = (h ^ (unsigned char)term[i]) * 16777619u;
+    }
+    return h;
+}
+
+/*
+ * The in-memory segment.
+ */
+
+static MEMSEG *memseg_create(void) {
+    return calloc(1, sizeof(MEMSEG));
+}
+
+static void memseg_free(MEMSEG *seg) {
+    for (int i = 0; i < MEMSEG_BUCKETS; i++) {
+        POSTINGS *p = seg->buckets[i];
+        while (p != NULL) {
+            POSTINGS *next = p->next;
+            free(p->docs);
+            free(p);
+            p = next;
+        }
+    }
+    for (uint32_t i = 0; i < seg->ndocs; i++) {
+        free(seg->docs[i]);
+    }
+    free(seg->docs);
+    free(seg);
+}
+
+static POSTINGS *memseg_find(MEMSEG *seg, const char *term, size_t length) {
+    POSTINGS *p = seg->buckets[hash_term(term, length) % MEMSEG_BUCKETS];
+    while (p != NULL && (p->length != length || memcmp(p->term, term, length) != 0)) {
+        p = p->next;
+    }
+    return p;
+}
+
+static int memseg_post(MEMSEG *seg, const char *term, size_t length, uint32_t doc) {
+    POSTINGS *p = memseg_find(seg, term, length);
+    if (p == NULL) {
+        if ((p = calloc(1, sizeof(POSTINGS) + length)) == NULL) {
+            return -1;
+        }
+        memcpy(p->term, term, length);
+        p->length = length;
+        uint32_t b = hash_term(term, length) % MEMSEG_BUCKETS;
+        p->next = seg->buckets[b];
+        seg->buckets[b] = p;
+        seg->nterms++;
+    } else if (p->docs[p->count - 1] == doc) {
+        return 0; // A repeated word
+    }
+    if (p->count == p->capacity) {
+        uint32_t capacity = p->capacity == 0 ? 2 : p->capacity * 2;
+        uint32_t *docs = realloc(p->docs, capacity * sizeof(uint32_t));
+        if (docs == NULL) {
+            return -1;
+        }
+        p->docs = docs;
+        p->capacity = capacity;
+    }
+    p->docs[p->count++] = doc;
+    return 0;
+}
+
+static int memseg_add(MEMSEG *seg, SEARCH_DOC *doc) {
+    if (seg->ndocs == seg->capacity) {
+        uint32_t capacity = seg->capacity == 0 ? 64 : seg->capacity * 2;
+        SEARCH_DOC **docs = realloc(seg->docs, capacity * sizeof(SEARCH_DOC *));
+        if (docs == NULL) {
+            return -1;
+        }
+        seg->docs = docs;
+        seg->capacity = capacity;
+    }
+    uint32_t id = seg->ndocs++;
+    seg->docs[id] = doc;
+    size_t length;
+    char *term = user_term(doc->data, doc->rec.sender_length, &length);
+    if (term == NULL || memseg_post(seg, term, length, id)) {
+        free(term);
+        return -1;
+    }
+    free(term);
+    term = user_term(doc->data + doc->rec.sender_length, doc->rec.receiver_length, &length);
+    if (term == NULL || memseg_post(seg, term, length, id)) {
+        free(term);
+        return -1;
+    }
+    free(term);
+    char word[SEARCH_MAX_TERM];
+    char *body = doc->data + doc->rec.sender_length + doc->rec.receiver_length;
+    size_t pos = 0;
+    while ((length = next_term(body, doc->rec.body_length, &pos, word)) > 0) {
+        if (memseg_post(seg, word, length, id)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Segment files.
+ */
+
+static void segment_path(char *path, uint32_t id, const char *suffix) {
+    snprintf(path, PATH_MAX, "%s/seg-%08u%s", index_dir, id, suffix);
+}
+
+static SEGMENT *segment_open(uint32_t id) {
+    char path[PATH_MAX];
+    segment_path(path, id, "");
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(SEGMENT_HEADER)) {
+        close(fd);
+        return NULL;
+    }
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+    SEGMENT_HEADER *hdr = (SEGMENT_HEADER *)map;
+    size_t size = st.st_size;
+    if (memcmp(hdr->magic, SEARCH_MAGIC, 8) != 0 || hdr->size != size
+        || hdr->docs > size || (size - hdr->docs) / sizeof(uint64_t) < hdr->ndocs
+        || hdr->terms > hdr->dict || hdr->dict > size
+        || (size - hdr->dict) / sizeof(DICT_ENTRY) < hdr->nterms) {
+        munmap(map, size);
+        return NULL;
+    }
+    SEGMENT *seg = malloc(sizeof(SEGMENT));
+    if (seg == NULL) {
+        munmap(map, size);
+        return NULL;
+    }
+    seg->id = id;
+    seg->refs = 1;
+    seg->obsolete = 0;
+    seg->map = map;
+    seg->size = size;
+    seg->hdr = hdr;
+    seg->docs = (uint64_t *)(map + hdr->docs);
+    seg->terms = map + hdr->terms;
+    seg->dict = (DICT_ENTRY *)(map + hdr->dict);
+    return seg;
+}
+
+// Drop a reference to a segment.  Called with the mutex held.
+static void segment_unref(SEGMENT *seg) {
+    if (--seg->refs > 0) {
+        return;
+    }
+    munmap(seg->map, seg->size);
+    if (seg->obsolete) {
+        char path[PATH_MAX];
+        segment_path(path, seg->id, "");
+        unlink(path);
+        debug("Deleted segment %u", seg->id);
+    }
+    free(seg);
+}
+
+// Get a message of a segment, or NULL if the file is corrupt
+static DOC_RECORD *segment_doc(SEGMENT *seg, uint32_t doc) {
+    uint64_t offset = seg->docs[doc];
+    if (offset > seg->size || seg->size - offset < sizeof(DOC_RECORD)) {
+        return NULL;
+    }
+    DOC_RECORD *rec = (DOC_RECORD *)(seg->map + offset);
+    if (seg->size - offset - sizeof(DOC_RECORD)
+        < (uint64_t)rec->sender_length + rec->receiver_length + rec->body_length) {
+        return NULL;
+    }
+    return rec;
+}
+
+static DICT_ENTRY *segment_find(SEGMENT *seg, const char *term, size_t length) {
+    uint32_t lo = 0;
+    uint32_t hi = seg->hdr->nterms;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        DICT_ENTRY *e = &seg->dict[mid];
+        int c = compare_terms(seg->terms + e->term, e->term_length, term, length);
+        if (c == 0) {
+            return e;
+        }
+        if (c < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return NULL;
+}
+
+// Decode a posting list into docs, which must have room for e->count
+// entries, adding base to each
+static int segment_postings(SEGMENT *seg, DICT_ENTRY *e, uint32_t *docs, uint32_t base) {
+    if (e->postings > seg->size || seg->size - e->postings < e->postings_length) {
+        return -1;
+    }
+    const unsigned char *p = (unsigned char *)seg->map + e->postings;
+    const unsigned char *end = p + e->postings_length;
+    uint32_t doc = (uint32_t)-1;
+    for (uint32_t i = 0; i < e->count; i++) {
+        uint32_t gap = 0;
+        int shift = 0;
+        do {
+            if (p == end || shift > 28) {
+                return -1;
+            }
+            gap |= (uint32_t)(*p & 0x7f) << shift;
+            shift += 7;
+        } while (*p++ & 0x80);
+        doc += gap + 1;
+        if (doc >= seg->hdr->ndocs) {
+            return -1;
+        }
+        docs[i] = doc + base;
+    }
+    return 0;
+}
+
+/*
+ * Writing a segment file: first each doc record, then each term in order
+ * with its posting list, then the rest.
+ */
+
+typedef struct seg_writer {
+    FILE *f;
+    uint32_t id;
+    uint64_t offset;
+    int failed;
+    SEGMENT_HEADER hdr;
+    uint64_t *docs;
+    uint32_t docs_capacity;
+    DICT_ENTRY *dict;
+    uint32_t dict_capacity;
+    char *terms;
+    size_t terms_length;
+    size_t terms_capacity;
+    unsigned char *buf; // For encoding posting lists
+    size_t buf_capacity;
+} SEG_WRITER;
+
+static void writer_write(SEG_WRITER *w, const void *data, size_t length) {
+    if (!w->failed && fwrite(data, 1, length, w->f) != length) {
+        w->failed = 1;
+    }
+    w->offset += length;
+}
+
+static void *writer_grow(SEG_WRITER *w, void *array, size_t size, uint32_t *capacity, uint32_t count) {
+    if (count < *capacity) {
+        return array;
+    }
+    uint32_t n = *capacity == 0 ? 256 : *capacity * 2;
+    void *p = realloc(array, n * size);
+    if (p == NULL) {
+        w->failed = 1;
+        return array;
+    }
+    *capacity = n;
+    return p;
+}
+
+static int writer_open(SEG_WRITER *w, uint32_t level) {
+    memset(w, 0, sizeof(*w));
+    w->id = next_id++;
+    char path[PATH_MAX];
+    segment_path(path, w->id, ".tmp");
+    if ((w->f = fopen(path, "w")) == NULL) {
+        return -1;
+    }
+    memcpy(w->hdr.magic, SEARCH_MAGIC, 8);
+    w->hdr.level = level;
+    writer_write(w, &w->hdr, sizeof(w->hdr));
+    return 0;
+}
+
+static void writer_doc(SEG_WRITER *w, DOC_RECORD *rec, const char *data) {
+    w->docs = writer_grow(w, w->docs, sizeof(uint64_t), &w->docs_capacity, w->hdr.ndocs);
+    if (w->failed) {
+        return;
+    }
+    w->docs[w->hdr.ndocs++] = w->offset;
+    size_t length = (size_t)rec->sender_length + rec->receiver_length + rec->body_length;
+    static const char pad[4];
+    writer_write(w, rec, sizeof(DOC_RECORD));
+    writer_write(w, data, length);
+    writer_write(w, pad, -length & 3);
+}
+
+static void writer_term(SEG_WRITER *w, const char *term, size_t length, uint32_t *docs, uint32_t count) {
+    w->dict = writer_grow(w, w->dict, sizeof(DICT_ENTRY), &w->dict_capacity, w->hdr.nterms);
+    if (w->failed) {
+        return;
+    }
+    if (w->buf_capacity < (size_t)count * 5) {
+        free(w->buf);
+        w->buf_capacity = (size_t)count * 5;
+        if ((w->buf = malloc(w->buf_capacity)) == NULL) {
+            w->buf_capacity = 0;
+            w->failed = 1;
+            return;
+        }
+    }
+    while (w->terms_capacity < w->terms_length + length) {
+        size_t n = w->terms_capacity == 0 ? 65536 : w->terms_capacity * 2;
+        char *p = realloc(w->terms, n);
+        if (p == NULL) {
+            w->failed = 1;
+            return;
+        }
+        w->terms = p;
+        w->terms_capacity = n;
+    }
+    size_t n = 0;
+    uint32_t prev = (uint32_t)-1;
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t gap = docs[i] - prev - 1;
+        prev = docs[i];
+        while (gap >= 0x80) {
+            w->buf[n++] = (gap & 0x7f) | 0x80;
+            gap >>= 7;
+        }
+        w->buf[n++] = gap;
+    }
+    DICT_ENTRY *e = &w->dict[w->hdr.nterms++];
+    memset(e, 0, sizeof(*e));
+    e->postings = w->offset;
+    e->postings_length = n;
+    e->count = count;
+    e->term = w->terms_length;
+    e->term_length = length;
+    memcpy(w->terms + w->terms_length, term, length);
+    w->terms_length += length;
+    writer_write(w, w->buf, n);
+}
+
+static void writer_free(SEG_WRITER *w) {
+    free(w->docs);
+    free(w->dict);
+    free(w->terms);
+    free(w->buf);
+}
+
+// Finish a segment file and open it
+static SEGMENT *writer_close(SEG_WRITER *w) {
+    char tmp[PATH_MAX];
+    char path[PATH_MAX];
+    segment_path(tmp, w->id, ".tmp");
+    segment_path(path, w->id, "");
+    static const char pad[8];
+    writer_write(w, pad, -w->offset & 7);
+    w->hdr.docs = w->offset;
+    writer_write(w, w->docs, w->hdr.ndocs * sizeof(uint64_t));
+    w->hdr.terms = w->offset;
+    writer_write(w, w->terms, w->terms_length);
+    writer_write(w, pad, -w->offset & 7);
+    w->hdr.dict = w->offset;
+    writer_write(w, w->dict, w->hdr.nterms * sizeof(DICT_ENTRY));
+    w->hdr.size = w->offset;
+    if (!w->failed && (fseek(w->f, 0, SEEK_SET) || fwrite(&w->hdr, sizeof(w->hdr), 1, w->f) != 1
+                       || fflush(w->f) || fsync(fileno(w->f)))) {
+        w->failed = 1;
+    }
+    if (fclose(w->f) || w->failed || rename(tmp, path)) {
+        unlink(tmp);
+        writer_free(w);
+        return NULL;
+    }
+    writer_free(w);
+    return segment_open(w->id);
+}
+
+static int compare_postings(const void *a, const void *b) {
+    const POSTINGS *p = *(POSTINGS *const *)a;
+    const POSTINGS *q = *(POSTINGS *const *)b;
+    return compare_terms(p->term, p->length, q->term, q->length);
+}
+
+static SEGMENT *memseg_write(MEMSEG *seg) {
+    POSTINGS **terms = malloc((seg->nterms + 1) * sizeof(POSTINGS *));
+    if (terms == NULL) {
+        return NULL;
+    }
+    uint32_t n = 0;
+    for (int i = 0; i < MEMSEG_BUCKETS; i++) {
+        for (POSTINGS *p = seg->buckets[i]; p != NULL; p = p->next) {
+            terms[n++] = p;
+        }
+    }
+    qsort(terms, n, sizeof(POSTINGS *), compare_postings);
+    SEG_WRITER w;
+    if (writer_open(&w, 0)) {
+        free(terms);
+        return NULL;
+    }
+    for (uint32_t i = 0; i < seg->ndocs; i++) {
+        writer_doc(&w, &seg->docs[i]->rec, seg->docs[i]->data);
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        writer_term(&w, terms[i]->term, terms[i]->length, terms[i]->docs, terms[i]->count);
+    }
+    free(terms);
+    return writer_close(&w);
+}
+
+// Merge segments, whose messages are renumbered consecutively
+static SEGMENT *segments_merge(SEGMENT **segs, int n) {
+    SEG_WRITER w;
+    if (writer_open(&w, segs[0]->hdr->level + 1)) {
+        return NULL;
+    }
+    uint32_t base[SEARCH_MERGE_FACTOR];
+    uint32_t cursor[SEARCH_MERGE_FACTOR];
+    uint32_t total = 0;
+    for (int i = 0; i < n; i++) {
+        base[i] = total;
+        cursor[i] = 0;
+        total += segs[i]->hdr->ndocs;
+        for (uint32_t d = 0; d < segs[i]->hdr->ndocs; d++) {
+            DOC_RECORD *rec = segment_doc(segs[i], d);
+            if (rec == NULL) {
+                w.failed = 1;
+                break;
+            }
+            writer_doc(&w, rec, (char *)(rec + 1));
+        }
+    }
+    uint32_t *docs = malloc((total + 1) * sizeof(uint32_t));
+    if (docs == NULL) {
+        w.failed = 1;
+    }
+    while (!w.failed) {
+        // Take the least term that any segment has left, from each segment
+        // that has it
+        DICT_ENTRY *least = NULL;
+        SEGMENT *owner = NULL;
+        for (int i = 0; i < n; i++) {
+            if (cursor[i] < segs[i]->hdr->nterms) {
+                DICT_ENTRY *e = &segs[i]->dict[cursor[i]];
+                if (least == NULL || compare_terms(segs[i]->terms + e->term, e->term_length,
+                                                   owner->terms + least->term, least->term_length) < 0) {
+                    least = e;
+                    owner = segs[i];
+                }
+            }
+        }
+        if (least == NULL) {
+            break;
+        }
+        char *term = owner->terms + least->term;
+        size_t length = least->term_length;
+        uint32_t count = 0;
+        for (int i = 0; i < n; i++) {
+            if (cursor[i] < segs[i]->hdr->nterms) {
+                DICT_ENTRY *e = &segs[i]->dict[cursor[i]];
+                if (compare_terms(segs[i]->terms + e->term, e->term_length, term, length) == 0) {
+                    if (e->count > total - count || segment_postings(segs[i], e, docs + count, base[i])) {
+                        w.failed = 1;
+                        break;
+                    }
+                    count += e->count;
+                    cursor[i]++;
+                }
+            }
+        }
+        writer_term(&w, term, length, docs, count);
+    }
+    free(docs);
+    return writer_close(&w);
+}
+
+// Replace the manifest with the list of segments.  Called with the mutex
+// held.
+static int write_manifest(void) {
+    char tmp[PATH_MAX];
+    char path[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s/%s.tmp", index_dir, SEARCH_MANIFEST);
+    snprintf(path, sizeof(path), "%s/%s", index_dir, SEARCH_MANIFEST);
+    FILE *f = fopen(tmp, "w");
+    if (f == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < nsegments; i++) {
+        fprintf(f, "%u\n", segments[i]->id);
+    }
+    if (fflush(f) || fsync(fileno(f)) || fclose(f)) {
+        unlink(tmp);
+        return -1;
+    }
+    return rename(tmp, path);
+}
+
+// Merge the newest segments while enough of them are of the same level
+static void merge_segments(void) {
+    while (1) {
+        pthread_mutex_lock(&mutex);
+        int n = 0;
+        while (n < nsegments
+               && segments[nsegments - 1 - n]->hdr->level == segments[nsegments - 1]->hdr->level) {
+            n++;
+        }
+        if (n < SEARCH_MERGE_FACTOR) {
+            pthread_mutex_unlock(&mutex);
+            return;
+        }
+        // Only this thread changes the list, so these stay the newest
+        SEGMENT **segs = segments + nsegments - SEARCH_MERGE_FACTOR;
+        pthread_mutex_unlock(&mutex);
+        SEGMENT *merged = segments_merge(segs, SEARCH_MERGE_FACTOR);
+        if (merged == NULL) {
+            error("Could not merge index segments");
+            return;
+        }
+        pthread_mutex_lock(&mutex);
+        SEGMENT *old[SEARCH_MERGE_FACTOR];
+        memcpy(old, segs, sizeof(old));
+        nsegments -= SEARCH_MERGE_FACTOR - 1;
+        segments[nsegments - 1] = merged;
+        if (write_manifest()) {
+            error("Could not write the index manifest");
+        }
+        for (int i = 0; i < SEARCH_MERGE_FACTOR; i++) {
+            old[i]->obsolete = 1;
+            segment_unref(old[i]);
+        }
+        debug("Merged %d segments into segment %u of level %u with %u messages",
+              SEARCH_MERGE_FACTOR, merged->id, merged->hdr->level, merged->hdr->ndocs);
+        pthread_mutex_unlock(&mutex);
+    }
+}
+
+// Write the in-memory segment set aside for flushing to a file
+static void flush_segment(void) {
+    SEGMENT *seg = memseg_write(flushing);
+    pthread_mutex_lock(&mutex);
+    if (seg == NULL) {
+        // Keep the messages searchable in memory until the next flush
+        error("Could not write an index segment");
+        for (uint32_t i = 0; i < flushing->ndocs; i++) {
+            SEARCH_DOC *doc = flushing->docs[i];
+            flushing->docs[i] = NULL;
+            memseg_add(current, doc);
+        }
+        flushing->ndocs = 0;
+    } else {
+        SEGMENT **segs = realloc(segments, (nsegments + 1) * sizeof(SEGMENT *));
+        if (segs == NULL) {
+            segment_unref(seg);
+            pthread_mutex_unlock(&mutex);
+            return;
+        }
+        segments = segs;
+        segments[nsegments++] = seg;
+        if (write_manifest()) {
+            error("Could not write the index manifest");
+        }
+        debug("Wrote segment %u with %u messages", seg->id, seg->hdr->ndocs);
+    }
+    MEMSEG *old = flushing;
+    flushing = NULL;
+    pthread_mutex_unlock(&mutex);
+    memseg_free(old);
+    if (seg != NULL) {
+        merge_segments();
+    }
+}
+
+static void *indexer_thread(void *arg) {
+    (void)arg;
+    place_thread(PLACE_WORKER);
+    pthread_mutex_lock(&mutex);
+    while (1) {
+        while (queue_head == NULL && !stopping) {
+            pthread_cond_wait(&work, &mutex);
+        }
+        if (queue_head == NULL) {
+            break;
+        }
+        SEARCH_DOC *doc = queue_head;
+        queue_head = NULL;
+        queue_tail = &queue_head;
+        queued = 0;
+        pthread_cond_broadcast(&room);
+        while (doc != NULL) {
+            SEARCH_DOC *next = doc->next;
+            if (memseg_add(current, doc)) {
+                error("Out of memory for the search index");
+            }
+            doc = next;
+            if (current->ndocs >= SEARCH_FLUSH_DOCS) {
+                flushing = current;
+                current = memseg_create();
+                pthread_mutex_unlock(&mutex);
+                flush_segment();
+                pthread_mutex_lock(&mutex);
+            }
+        }
+    }
+    if (current->ndocs > 0) {
+        flushing = current;
+        current = memseg_create();
+        pthread_mutex_unlock(&mutex);
+        flush_segment();
+    } else {
+        pthread_mutex_unlock(&mutex);
+    }
+    return NULL;
+}
+
+/*
+ * Setup.
+ */
+
+// Load the segments in the manifest, and delete any other file
+static int load_segments(void) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", index_dir, SEARCH_MANIFEST);
+    FILE *f = fopen(path, "r");
+    if (f == NULL && errno != ENOENT) {
+        return -1;
+    }
+    unsigned int id;
+    while (f != NULL && fscanf(f, "%u", &id) == 1) {
+        SEGMENT *seg = segment_open(id);
+        SEGMENT **segs = realloc(segments, (nsegments + 1) * sizeof(SEGMENT *));
+        if (seg == NULL || segs == NULL) {
+            error("Index segment %u is missing or corrupt", id);
+            if (seg != NULL) {
+                segment_unref(seg);
+            }
+            fclose(f);
+            return -1;
+        }
+        segments = segs;
+        segments[nsegments++] = seg;
+        if (id >= next_id) {
+            next_id = id + 1;
+        }
+    }
+    if (f != NULL) {
+        fclose(f);
+    }
+    DIR *dir = opendir(index_dir);
+    if (dir == NULL) {
+        return -1;
+    }
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        if (sscanf(ent->d_name, "seg-%u", &id) != 1) {
+            continue;
+        }
+        int live = 0;
+        for (int i = 0; i < nsegments && !live; i++) {
+            char name[32];
+            snprintf(name, sizeof(name), "seg-%08u", segments[i]->id);
+            live = strcmp(ent->d_name, name) == 0;
+        }
+        if (!live) {
+            snprintf(path, sizeof(path), "%s/%s", index_dir, ent->d_name);
+            unlink(path);
+            debug("Deleted stray index file %s", ent->d_name);
+        }
+        if (id >= next_id) {
+            next_id = id + 1;
+        }
+    }
+    closedir(dir);
+    return 0;
+}
+
+int search_init(char *dir) {
+    if ((index_dir = strdup(dir)) == NULL || (current = memseg_create()) == NULL) {
+        return -1;
+    }
+    // Held until exit, so that a new process waits for the old one to flush
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", index_dir, SEARCH_LOCK);
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return -1;
+    }
+    while (flock(fd, LOCK_EX) < 0) {
+        if (errno != EINTR) {
+            close(fd);
+            return -1;
+        }
+    }
+    if (load_segments()) {
+        return -1;
+    }
+    if (pthread_create(&indexer, NULL, indexer_thread, NULL)) {
+        return -1;
+    }
+    running = 1;
+    info("Search index in %s has %d segments", dir, nsegments);
+    return 0;
+}
+
+void search_add(char *sender, char *receiver, uint32_t msgid, char *body, size_t length) {
+    if (!running) {
+        return;
+    }
+    size_t sender_length = strlen(sender);
+    size_t receiver_length = strlen(receiver);
+    if (sender_length > UINT16_MAX || receiver_length > UINT16_MAX || length > UINT32_MAX) {
+        return;
+    }
+    SEARCH_DOC *doc = malloc(sizeof(SEARCH_DOC) + sender_length + receiver_length + length);
+    if (doc == NULL) {
+        error("Out of memory for the search index");
+        return;
+    }
+    doc->next = NULL;
+    doc->rec.msgid = msgid;
+    doc->rec.time = time(NULL);
+    doc->rec.sender_length = sender_length;
+    doc->rec.receiver_length = receiver_length;
+    doc->rec.body_length = length;
+    memcpy(doc->data, sender, sender_length);
+    memcpy(doc->data + sender_length, receiver, receiver_length);
+    memcpy(doc->data + sender_length + receiver_length, body, length);
+    pthread_mutex_lock(&mutex);
+    while (queued >= SEARCH_QUEUE_MAX && !stopping) {
+        pthread_cond_wait(&room, &mutex);
+    }
+    *queue_tail = doc;
+    queue_tail = &doc->next;
+    if (queued++ == 0) {
+        pthread_cond_signal(&work);
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+/*
+ * Searching.
+ */
+
+typedef struct query {
+    char *handle;
+    size_t handle_length;
+    char *terms[SEARCH_MAX_QUERY_TERMS + 1]; // The caller's term last
+    size_t lengths[SEARCH_MAX_QUERY_TERMS + 1];
+    int nterms;
+    char words[SEARCH_MAX_QUERY_TERMS][SEARCH_MAX_TERM];
+    size_t limit;
+    size_t found;
+    char *out;
+    size_t length;
+    size_t capacity;
+    int failed;
+} QUERY;
+
+static void out_append(QUERY *q, const char *data, size_t length) {
+    if (q->length + length > q->capacity) {
+        size_t n = q->capacity == 0 ? 4096 : q->capacity;
+        while (n < q->length + length) {
+            n *= 2;
+        }
+        char *p = realloc(q->out, n);
+        if (p == NULL) {
+            q->failed = 1;
+            return;
+        }
+        q->out = p;
+        q->capacity = n;
+    }
+    memcpy(q->out + q->length, data, length);
+    q->length += length;
+}
+
+// Append a handle or snippet, with control characters replaced
+static void out_text(QUERY *q, const char *text, size_t length) {
+    size_t start = q->length;
+    out_append(q, text, length);
+    if (!q->failed) {
+        for (size_t i = start; i < q->length; i++) {
+            if ((unsigned char)q->out[i] < 0x20 || q->out[i] == 0x7f) {
+                q->out[i] = ' ';
+            }
+        }
+    }
+}
+
+// Add a message to the results, as long as the caller took part in it
+static void emit(QUERY *q, DOC_RECORD *rec, const char *data) {
+    const char *sender = data;
+    const char *receiver = data + rec->sender_length;
+    const char *body = receiver + rec->receiver_length;
+    if (!(rec->sender_length == q->handle_length && memcmp(sender, q->handle, q->handle_length) == 0)
+        && !(rec->receiver_length == q->handle_length && memcmp(receiver, q->handle, q->handle_length) == 0)) {
+        return;
+    }
+    // Start the snippet a little before the first word of the query
+    size_t at = 0;
+    size_t pos = 0;
+    size_t start;
+    size_t length;
+    char word[SEARCH_MAX_TERM];
+    while (1) {
+        start = pos;
+        while (start < rec->body_length && !is_word(body[start])) {
+            start++;
+        }
+        if ((length = next_term(body, rec->body_length, &pos, word)) == 0) {
+            break;
+        }
+        int match = 0;
+        for (int i = 0; i < q->nterms - 1 && !match; i++) {
+            match = length == q->lengths[i] && memcmp(word, q->terms[i], length) == 0;
+        }
+        if (match) {
+            at = start > SEARCH_SNIPPET / 4 ? start - SEARCH_SNIPPET / 4 : 0;
+            break;
+        }
+    }
+    length = rec->body_length - at < SEARCH_SNIPPET ? rec->body_length - at : SEARCH_SNIPPET;
+    char num[32];
+    out_append(q, num, snprintf(num, sizeof(num), "%u\t", rec->msgid));
+    out_text(q, sender, rec->sender_length);
+    out_append(q, "\t", 1);
+    out_text(q, receiver, rec->receiver_length);
+    out_append(q, num, snprintf(num, sizeof(num), "\t%u\t", rec->time));
+    out_text(q, body + at, length);
+    out_append(q, "\r\n", 2);
+    q->found++;
+}
+
+static int find_doc(uint32_t *docs, uint32_t count, uint32_t doc) {
+    uint32_t lo = 0;
+    uint32_t hi = count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (docs[mid] == doc) {
+            return 1;
+        }
+        if (docs[mid] < doc) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return 0;
+}
+
+// Search an in-memory segment.  Called with the mutex held.
+static void search_memseg(QUERY *q, MEMSEG *seg) {
+    POSTINGS *lists[SEARCH_MAX_QUERY_TERMS + 1];
+    int rarest = 0;
+    for (int i = 0; i < q->nterms; i++) {
+        if ((lists[i] = memseg_find(seg, q->terms[i], q->lengths[i])) == NULL) {
+            return;
+        }
+        if (lists[i]->count < lists[rarest]->count) {
+            rarest = i;
+        }
+    }
+    POSTINGS *first = lists[rarest];
+    for (uint32_t k = first->count; k-- > 0 && q->found < q->limit;) {
+        uint32_t doc = first->docs[k];
+        int all = 1;
+        for (int i = 0; i < q->nterms && all; i++) {
+            all = i == rarest || find_doc(lists[i]->docs, lists[i]->count, doc);
+        }
+        if (all) {
+            emit(q, &seg->docs[doc]->rec, seg->docs[doc]->data);
+        }
+    }
+}
+
+// Search a segment file
+static void search_segment(QUERY *q, SEGMENT *seg) {
+    DICT_ENTRY *entries[SEARCH_MAX_QUERY_TERMS + 1];
+    int rarest = 0;
+    for (int i = 0; i < q->nterms; i++) {
+        if ((entries[i] = segment_find(seg, q->terms[i], q->lengths[i])) == NULL) {
+            return;
+        }
+        if (entries[i]->count < entries[rarest]->count) {
+            rarest = i;
+        }
+    }
+    uint32_t *docs = malloc((entries[rarest]->count + 1) * sizeof(uint32_t));
+    uint32_t *other = NULL;
+    uint32_t count = entries[rarest]->count;
+    if (docs == NULL || segment_postings(seg, entries[rarest], docs, 0)) {
+        free(docs);
+        return;
+    }
+    // Intersect the lists by merging, from the rarest to the commonest
+    for (int i = 0; i < q->nterms && count > 0; i++) {
+        if (i == rarest) {
+            continue;
+        }
+        uint32_t *p = realloc(other, (entries[i]->count + 1) * sizeof(uint32_t));
+        if (p == NULL || segment_postings(seg, entries[i], p, 0)) {
+            free(p != NULL ? p : other);
+            free(docs);
+            return;
+        }
+        other = p;
+        uint32_t n = 0;
+        uint32_t j = 0;
+        for (uint32_t k = 0; k < count && j < entries[i]->count; k++) {
+            while (j < entries[i]->count && other[j] < docs[k]) {
+                j++;
+            }
+            if (j < entries[i]->count && other[j] == docs[k]) {
+                docs[n++] = docs[k];
+            }
+        }
+        count = n;
+    }
+    for (uint32_t k = count; k-- > 0 && q->found < q->limit;) {
+        DOC_RECORD *rec = segment_doc(seg, docs[k]);
+        if (rec != NULL) {
+            emit(q, rec, (char *)(rec + 1));
+        }
+    }
+    free(other);
+    free(docs);
+}
+
+char *search_query(char *handle, char *query, size_t limit, size_t *lengthp) {
+    if (!running) {
+        return NULL;
+    }
+    QUERY *q = calloc(1, sizeof(QUERY));
+    if (q == NULL) {
+        return NULL;
+    }
+    q->handle = handle;
+    q->handle_length = strlen(handle);
+    q->limit = limit == 0 ? SEARCH_DEFAULT_RESULTS : limit > SEARCH_MAX_RESULTS ? SEARCH_MAX_RESULTS : limit;
+    size_t pos = 0;
+    size_t length;
+    char word[SEARCH_MAX_TERM];
+    while ((length = next_term(query, strlen(query), &pos, word)) > 0) {
+        int seen = 0;
+        for (int i = 0; i < q->nterms && !seen; i++) {
+            seen = q->lengths[i] == length && memcmp(q->terms[i], word, length) == 0;
+        }
+        if (seen) {
+            continue;
+        }
+        if (q->nterms == SEARCH_MAX_QUERY_TERMS) {
+            free(q);
+            return NULL;
+        }
+        memcpy(q->words[q->nterms], word, length);
+        q->terms[q->nterms] = q->words[q->nterms];
+        q->lengths[q->nterms++] = length;
+    }
+    if (q->nterms == 0 || (q->terms[q->nterms] = user_term(handle, q->handle_length,
+                                                          &q->lengths[q->nterms])) == NULL) {
+        free(q);
+        return NULL;
+    }
+    q->nterms++;
+    // Search the newest messages first: those in memory, then the files,
+    // which are held so that they are not deleted after a merge
+    pthread_mutex_lock(&mutex);
+    search_memseg(q, current);
+    if (flushing != NULL) {
+        search_memseg(q, flushing);
+    }
+    int n = nsegments;
+    SEGMENT **segs = NULL;
+    if (q->found < q->limit && n > 0 && (segs = malloc(n * sizeof(SEGMENT *))) != NULL) {
+        for (int i = 0; i < n; i++) {
+            segs[i] = segments[i];
+            segs[i]->refs++;
+        }
+    }
+    pthread_mutex_unlock(&mutex);
+    if (segs != NULL) {
+        for (int i = n - 1; i >= 0 && q->found < q->limit; i--) {
+            search_segment(q, segs[i]);
+        }
+        pthread_mutex_lock(&mutex);
+        for (int i = 0; i < n; i++) {
+            segment_unref(segs[i]);
+        }
+        pthread_mutex_unlock(&mutex);
+        free(segs);
+    }
+    char *out = q->out;
+    *lengthp = q->length;
+    if (q->failed) {
+        free(out);
+        out = NULL;
+    } else if (out == NULL) {
+        out = malloc(1);
+    }
+    free(q->terms[q->nterms - 1]);
+    free(q);
+    return out;
+}
+
+void search_fini(void) {
+    if (!running) {
+        return;
+    }
+    pthread_mutex_lock(&mutex);
+    stopping = 1;
+    pthread_cond_signal(&work);
+    pthread_cond_broadcast(&room);
+    pthread_mutex_unlock(&mutex);
+    pthread_join(indexer, NULL);
+    running = 0;
+}
@@ -0,0 +1,1427 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include "server.h"
+#include "globals.h"
+#include "protocol.h"
+#include "cluster.h"
+#include "presence.h"
+#include "handle_index.h"
+#include "coro.h"
+#include "timer.h"
+#include "ratelimit.h"
+#include "dedup.h"
+#include "placement.h"
+#include "search.h"
+#include "snapshot.h"
+#include "csapp.h"
+#include "debug.h"
+
+int chla_single_thread = 0;
+int chla_idle_timeout = 0;
+int chla_keepalive = 0;
+int chla_busy_poll = 0;
+int chla_pipeline_depth = 1;
+
+// Returned by a request handler that has already sent its own ACK, or
+// whose ACK will be sent later
+#define REPLIED 1
+
+// Returned by a request handler whose message the receiver cannot take
+// yet, to be NACKed with CHLA_BUSY_FLAG
+#define BUSY 2
+
+// Number of messages a client may be sending in parts at once
+#define MAX_TRANSFERS 4
+
+// Arguments passed to a mailbox service thread
+typedef struct mailbox_service_args {
+    CLIENT *client; // Reference to the client being served
+    MAILBOX *mailbox; // Reference to the mailbox of the client
+} MAILBOX_SERVICE_ARGS;
+
+// A request being processed concurrently with others from the same client
+typedef struct inflight {
+    int busy; // Nonzero while the slot is in use
+    uint32_t msgid;
+    char *key; // Receiver of a message, whose messages must stay in order, or NULL
+    size_t key_length;
+} INFLIGHT;
+
+// A message being received from the client in parts
+typedef struct transfer {
+    uint32_t msgid;
+    int urgent; // Nonzero if the parts go in the urgent lane
+    MAILBOX *to; // Reference to the receiver's mailbox, or NULL if unused
+} TRANSFER;
+
+// Liveness of a connection, checked by a timer while it is served
+typedef struct session {
+    CLIENT *client;
+    int fd;
+    uint64_t last_input; // Time the last request was received (see tw_now())
+    TIMER timer; // Fires when the next probe or the idle timeout is due
+    TOKEN_BUCKET bucket; // Limits the rate of SEND requests
+    TRANSFER transfers[MAX_TRANSFERS]; // Messages being sent in parts
+    pthread_mutex_t lock; // Protects the bucket and the pipelined requests
+    int event_fd; // Readable when a pipelined request completes
+    int in_flight; // Number of pipelined requests being processed
+    INFLIGHT slots[CHLA_MAX_PIPELINE]; // The pipelined requests
+} SESSION;
+
+// A pipelined request handed to a coroutine or thread of its own
+typedef struct request_job {
+    SESSION *session;
+    INFLIGHT *slot;
+    CHLA_PACKET_HEADER hdr;
+    void *payload;
+} REQUEST_JOB;
+
+// The sessions, and whether they are to stop for a hot upgrade.  While
+// they are to stop, stop_fd is readable and resume_fd is not; otherwise
+// it is the other way around.  Both are -1 if sessions are never stopped.
+static struct quiesce {
+    pthread_mutex_t lock; // Protects the counts
+    pthread_cond_t changed; // Signaled when a session stops or ends
+    int stop_fd;
+    int resume_fd;
+    int sessions; // Number of sessions started and not yet ended
+    int stopped; // Number of sessions waiting to resume
+} quiesce = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, -1, -1, 0, 0 };
+
+// Held from the check that a handle is not logged in to the login itself,
+// so that two sessions logging in under the same handle cannot both pass
+static pthread_mutex_t login_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Fill in the header of a packet to be sent by the server
+static void init_header(CHLA_PACKET_HEADER *hdr, CHLA_PACKET_TYPE type, int msgid, size_t length) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    memset(hdr, 0, sizeof(CHLA_PACKET_HEADER));
+    hdr->type = type;
+    hdr->payload_length = htonl(length);
+    hdr->msgid = htonl(msgid);
+    hdr->timestamp_sec = htonl(ts.tv_sec);
+    hdr->timestamp_nsec = htonl(ts.tv_nsec);
+}
+
+// Discard hook: let the sender of an undelivered message know it bounced
+static void bounce_discarded(MAILBOX_ENTRY *entry) {
+    if (entry->type == MESSAGE_ENTRY_TYPE && entry->content.message.from != NULL
+        && entry->content.message.part != ABORTED_PART) {
+        mb_add_notice(entry->content.message.from, BOUNCE_NOTICE_TYPE,
+                      entry->content.message.msgid);
+    }
+}
+
+// Let the sender of a message or part know what became of it
+static void notify_sender(MESSAGE *msg, int err) {
+    if (msg->part == ABORTED_PART) {
+        return;
+    }
+    if (err) {
+        mb_add_notice(msg->from, BOUNCE_NOTICE_TYPE, msg->msgid);
+        return;
+    }
+    // Each part is acknowledged once delivered, and the whole message receipted
+    if (msg->part != WHOLE_MESSAGE) {
+        mb_add_notice(msg->from, ACK_NOTICE_TYPE, msg->msgid);
+    }
+    if (msg->part == WHOLE_MESSAGE || msg->part == LAST_PART) {
+        mb_add_notice(msg->from, RRCPT_NOTICE_TYPE, msg->msgid);
+    }
+}
+
+// Find the end of the first line of a payload, or return -1 if there is none
+static ssize_t find_crlf(char *payload, size_t length) {
+    if (payload == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i + 1 < length; i++) {
+        if (payload[i] == '\r' && payload[i + 1] == '\n') {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Queue a message that has reached its receiver for indexing, so that only
+// messages the receiver has been sent can be found (see search.h).  The
+// body is "sender\r\nbody".
+static void index_delivered(MAILBOX *mb, MESSAGE *msg) {
+    ssize_t i = find_crlf(msg->body, msg->length);
+    if (i < 0) {
+        return;
+    }
+    char *sender = Malloc(i + 1);
+    memcpy(sender, msg->body, i);
+    sender[i] = '\0';
+    search_add(sender, mb_get_handle(mb), msg->msgid, (char *)msg->body + i + 2, msg->length - (i + 2));
+    free(sender);
+}
+
+// Send one mailbox entry to the client
+static void deliver_entry(CLIENT *client, MAILBOX *mb, MAILBOX_ENTRY *entry) {
+    CHLA_PACKET_HEADER hdr;
+    if (entry->type == MESSAGE_ENTRY_TYPE) {
+        MESSAGE *msg = &entry->content.message;
+        CHLA_PACKET_TYPE type = msg->part == WHOLE_MESSAGE || msg->part == FIRST_PART
+            ? CHLA_MESG_PKT : CHLA_CHUNK_PKT;
+        init_header(&hdr, type, msg->msgid, msg->length);
+        if (msg->part == FIRST_PART || msg->part == NEXT_PART) {
+            hdr.flags = CHLA_MORE_FLAG;
+        } else if (msg->part == ABORTED_PART) {
+            hdr.flags = CHLA_ABORT_FLAG;
+        }
+        int err = client_send_packet(client, &hdr, msg->body);
+        if (!err && msg->part == WHOLE_MESSAGE) {
+            index_delivered(mb, msg);
+        }
+        if (msg->from != NULL) {
+            notify_sender(msg, err);
+            if (msg->from != mb) {
+                mb_unref(msg->from, "Message delivered");
+            }
+        }
+        free(msg->body);
+    } else {
+        NOTICE *notice = &entry->content.notice;
+        CHLA_PACKET_TYPE type;
+        switch (notice->type) {
+        case BOUNCE_NOTICE_TYPE:
+            type = CHLA_BOUNCE_PKT;
+            break;
+        case ACK_NOTICE_TYPE:
+            type = CHLA_ACK_PKT;
+            break;
+        case NACK_NOTICE_TYPE:
+            type = CHLA_NACK_PKT;
+            break;
+        default:
+            type = CHLA_RCVD_PKT;
+            break;
+        }
+        if (notice->count > 0) {
+            // A batch of receipts lists its msgids in the payload
+            uint32_t *msgids = Malloc(notice->count * sizeof(uint32_t));
+            for (int i = 0; i < notice->count; i++) {
+                msgids[i] = htonl(notice->msgids[i]);
+            }
+            init_header(&hdr, type, notice->msgid, notice->count * sizeof(uint32_t));
+            client_send_packet(client, &hdr, msgids);
+            free(msgids);
+        } else {
+            init_header(&hdr, type, notice->msgid, 0);
+            client_send_packet(client, &hdr, NULL);
+        }
+    }
+    mb_free_entry(entry);
+}
+
+void *chla_mailbox_service(void *arg) {
+    MAILBOX_SERVICE_ARGS *args = arg;
+    CLIENT *client = args->client;
+    MAILBOX *mb = args->mailbox;
+    free(args);
+    pthread_detach(pthread_self());
+    debug("%ld: Mailbox service started", pthread_self());
+
+    mb_set_discard_hook(mb, bounce_discarded);
+
+    MAILBOX_ENTRY *entry;
+    while ((entry = mb_next_entry(mb)) != NULL) {
+        deliver_entry(client, mb, entry);
+    }
+
+    debug("%ld: Mailbox service terminating", pthread_self());
+    mb_unref(mb, "Mailbox service terminating");
+    client_unref(client, "Mailbox service terminating");
+    return NULL;
+}
+
+// Start the mailbox service thread for a client that has just logged in.
+// In single-thread mode, the client service thread serves the mailbox itself.
+static void start_mailbox_service(CLIENT *client) {
+    if (chla_single_thread) {
+        return;
+    }
+    MAILBOX_SERVICE_ARGS *args = Malloc(sizeof(MAILBOX_SERVICE_ARGS));
+    args->client = client_ref(client, "Starting mailbox service");
+    args->mailbox = client_get_mailbox(client, 0);
+    pthread_t tid;
+    Pthread_create(&tid, NULL, chla_mailbox_service, args);
+}
+
+// Handle a LOGIN request.  An empty one asks to log in under the name of
+// the peer of a Unix-domain connection.  The ACK goes out before anything
+// is delivered, so that mail restored from a snapshot, or sent by others
+// the moment the handle is registered, does not overtake it.
+static int do_login(CLIENT *client, uint32_t msgid, int flags, void *payload, size_t length) {
+    char *handle;
+    if (payload == NULL || length == 0) {
+        handle = proto_peer_user(client_get_fd(client));
+        if (handle == NULL) {
+            return -1;
+        }
+    } else {
+        handle = Malloc(length + 1);
+        memcpy(handle, payload, length);
+        handle[length] = '\0';
+    }
+
+    // In cluster mode, a handle may only log in at the node that owns it
+    if (!cluster_is_local(handle)) {
+        free(handle);
+        return -1;
+    }
+
+    // A handle may only be logged in once at a time
+    pthread_mutex_lock(&login_lock);
+    CLIENT *other = creg_lookup(client_registry, handle);
+    if (other != NULL) {
+        pthread_mutex_unlock(&login_lock);
+        client_unref(other, "Handle already logged in");
+        free(handle);
+        return -1;
+    }
+    if (client_login(client, handle)) {
+        pthread_mutex_unlock(&login_lock);
+        free(handle);
+        return -1;
+    }
+    pthread_mutex_unlock(&login_lock);
+    MAILBOX *mb = client_get_mailbox(client, 1);
+    // Batch its receipts before any of its messages can be delivered
+    mb_set_batch_receipts(mb, (flags & CHLA_BATCH_FLAG) != 0);
+    // Queue the mail left for this user when the server last stopped
+    snap_claim(handle, mb);
+    free(handle);
+    int ret = client_send_ack(client, msgid, NULL, 0);
+    start_mailbox_service(client);
+    return ret ? ret : REPLIED;
+}
+
+// Build the list of users logged in at this node, one handle per line.
+// It is built in a single pass, with a reference to each user held while
+// its handle is copied, since clients may log in and out meanwhile.
+static char *local_users(size_t *lengthp) {
+    CLIENT **clients = creg_all_clients(client_registry);
+    if (clients == NULL) {
+        return NULL;
+    }
+    size_t length = 0, size = 64;
+    char *list = Malloc(size);
+    for (CLIENT **cp = clients; *cp != NULL; cp++) {
+        USER *user = client_get_user(*cp, 0);
+        if (user != NULL) {
+            char *handle = user_get_handle(user);
+            size_t hlen = strlen(handle);
+            while (length + hlen + 1 > size) {
+                size *= 2;
+                list = Realloc(list, size);
+            }
+            memcpy(list + length, handle, hlen);
+            list[length + hlen] = '\n';
+            length += hlen + 1;
+            user_unref(user, "Listed user");
+        }
+        client_unref(*cp, "Done with client list");
+    }
+    free(clients);
+    *lengthp = length;
+    return list;
+}
+
+// Handle a USERS request: reply with the users at all the nodes
+static int do_users(CLIENT *client, uint32_t msgid) {
+    size_t length;
+    char *list = local_users(&length);
+    if (list == NULL) {
+        return -1;
+    }
+    size_t remote_length = 0;
+    char *remote = cluster_users(&remote_length);
+    if (remote != NULL) {
+        list = Realloc(list, length + remote_length);
+        memcpy(list + length, remote, remote_length);
+        length += remote_length;
+        free(remote);
+    }
+
+    int ret = client_send_ack(client, msgid, list, length);
+    free(list);
+    return ret ? ret : REPLIED;
+}
+
+// Handle a FWD_USERS request from another node: reply with local users only
+static int do_fwd_users(CLIENT *client, uint32_t msgid) {
+    size_t length;
+    char *list = local_users(&length);
+    if (list == NULL) {
+        return -1;
+    }
+    int ret = client_send_ack(client, msgid, list, length);
+    free(list);
+    return ret ? ret : REPLIED;
+}
+
+// Order handles for qsort()
+static int compare_handles(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Merge pages of handles from several nodes, one handle per line, into a
+// page of the first limit of them in sorted order, or all if limit is 0
+static char *merge_pages(char *pages, size_t length, unsigned long limit, size_t *lengthp) {
+    size_t count = 0;
+    for (size_t i = 0; i < length; i++) {
+        count += pages[i] == '\n';
+    }
+    char **handles = Malloc((count + 1) * sizeof(char *));
+    size_t n = 0;
+    for (size_t i = 0, start = 0; i < length; i++) {
+        if (pages[i] == '\n') {
+            pages[i] = '\0';
+            handles[n++] = pages + start;
+            start = i + 1;
+        }
+    }
+    qsort(handles, n, sizeof(char *), compare_handles);
+    if (limit > 0 && n > limit) {
+        n = limit;
+    }
+    char *page = Malloc(length + 1);
+    size_t page_length = 0;
+    for (size_t i = 0; i < n; i++) {
+        size_t len = strlen(handles[i]);
+        memcpy(page + page_length, handles[i], len);
+        page[page_length + len] = '\n';
+        page_length += len + 1;
+    }
+    free(handles);
+    *lengthp = page_length;
+    return page;
+}
+
+// Handle a USERS_QUERY request whose payload is "prefix\r\nlimit\r\ncursor".
+// In cluster mode, the same query goes to the other nodes, unless it came
+// from one of them, and the page returned is the first of the merged pages.
+static int do_users_query(CLIENT *client, uint32_t msgid, char *payload, size_t length,
+                          int forwarded) {
+    // Split the payload into its three fields
+    char *fields[3] = { NULL, NULL, NULL };
+    char *args = Malloc(length + 1);
+    if (length > 0) {
+        memcpy(args, payload, length);
+    }
+    args[length] = '\0';
+    char *p = args;
+    for (int i = 0; i < 3; i++) {
+        fields[i] = p;
+        char *crlf = strstr(p, "\r\n");
+        if (crlf == NULL) {
+            break;
+        }
+        *crlf = '\0';
+        p = crlf + 2;
+    }
+    if (fields[1] == NULL) {
+        free(args);
+        return -1;
+    }
+    char *endptr;
+    unsigned long limit = strtoul(fields[1], &endptr, 10);
+    if (endptr == fields[1] || *endptr != '\0') {
+        free(args);
+        return -1;
+    }
+
+    size_t reply_length;
+    char *reply = hidx_query(fields[0], fields[2], limit, &reply_length);
+    free(args);
+    if (reply == NULL) {
+        return -1;
+    }
+    size_t remote_length = 0;
+    char *remote = forwarded ? NULL : cluster_users_query(payload, length, &remote_length);
+    if (remote != NULL) {
+        reply = Realloc(reply, reply_length + remote_length);
+        memcpy(reply + reply_length, remote, remote_length);
+        free(remote);
+        char *pages = reply;
+        reply = merge_pages(pages, reply_length + remote_length, limit, &reply_length);
+        free(pages);
+    }
+    int ret = client_send_ack(client, msgid, reply, reply_length);
+    free(reply);
+    return ret ? ret : REPLIED;
+}
+
+// Handle a SEARCH request whose payload is "query" or "query\r\nlimit"
+static int do_search(CLIENT *client, uint32_t msgid, char *payload, size_t length) {
+    char *args = Malloc(length + 1);
+    if (length > 0) {
+        memcpy(args, payload, length);
+    }
+    args[length] = '\0';
+    unsigned long limit = 0;
+    char *crlf = strstr(args, "\r\n");
+    if (crlf != NULL) {
+        *crlf = '\0';
+        char *endptr;
+        limit = strtoul(crlf + 2, &endptr, 10);
+        if (endptr == crlf + 2 || *endptr != '\0') {
+            free(args);
+            return -1;
+        }
+    }
+
+    size_t reply_length;
+    char *reply = search_query(user_get_handle(client_get_user(client, 1)), args, limit, &reply_length);
+    free(args);
+    if (reply == NULL) {
+        return -1;
+    }
+    int ret = client_send_ack(client, msgid, reply, reply_length);
+    free(reply);
+    return ret ? ret : REPLIED;
+}
+
+// Handle a CREDIT request whose payload is "messages\r\nbytes", either of
+// which may be empty
+static int do_credit(CLIENT *client, char *payload, size_t length) {
+    char *args = Malloc(length + 1);
+    if (length > 0) {
+        memcpy(args, payload, length);
+    }
+    args[length] = '\0';
+    char *fields[2] = { args, "" };
+    char *crlf = strstr(args, "\r\n");
+    if (crlf != NULL) {
+        *crlf = '\0';
+        fields[1] = crlf + 2;
+    }
+    long grants[2];
+    for (int i = 0; i < 2; i++) {
+        grants[i] = -1;
+        if (*fields[i] != '\0') {
+            char *endptr;
+            unsigned long grant = strtoul(fields[i], &endptr, 10);
+            if (*endptr != '\0' || grant > UINT32_MAX || !isdigit((unsigned char)*fields[i])) {
+                free(args);
+                return -1;
+            }
+            grants[i] = grant;
+        }
+    }
+    free(args);
+    mb_grant_credit(client_get_mailbox(client, 1), grants[0], grants[1]);
+    return 0;
+}
+
+// Build the list of users a subscription is ACKed with: the local users as
+// of the moment it starts
+static char *subscribe_snapshot(void *arg, size_t *lengthp) {
+    (void)arg;
+    return local_users(lengthp);
+}
+
+// Handle a SUBSCRIBE request.  The list of users is taken together with
+// the start of the subscription, rather than by a separate USERS, so that
+// it cannot be older than the changes the client is sent after it.  Only
+// the local users are listed: changes at other nodes of a cluster are not
+// sent, so a list of them would go stale.
+static int do_subscribe(CLIENT *client, uint32_t msgid) {
+    int ret = presence_subscribe(client, msgid, subscribe_snapshot, NULL);
+    return ret ? -1 : REPLIED;
+}
+
+// Build the payload "sender\r\nbody" of a message to be delivered
+static char *delivered_body(char *sender, char *body, size_t length, size_t *lengthp) {
+    size_t slen = strlen(sender);
+    char *mesg = Malloc(slen + 2 + length);
+    memcpy(mesg, sender, slen);
+    memcpy(mesg + slen, "\r\n", 2);
+    if (length > 0) {
+        memcpy(mesg + slen + 2, body, length);
+    }
+    *lengthp = slen + 2 + length;
+    return mesg;
+}
+
+// Deliver a message to a local recipient.  The payload is "receiver\r\nbody",
+// or "receiver\r\nlifetime\r\nbody" with CHLA_EXPIRE_FLAG; the delivered
+// message is "sender\r\nbody".  The from mailbox may be NULL.  The flags are
+// those of the SEND request.
+static int deliver(char *sender, MAILBOX *from, uint32_t msgid, uint8_t flags,
+                   char *payload, size_t length) {
+    ssize_t i = find_crlf(payload, length);
+    if (i < 0) {
+        return -1;
+    }
+    char *receiver = Malloc(i + 1);
+    memcpy(receiver, payload, i);
+    receiver[i] = '\0';
+    size_t body_length = length - (i + 2);
+
+    // Forward to the owning node if the receiver is not local
+    if (!cluster_is_local(receiver)) {
+        int ret = cluster_forward_send(sender, receiver, msgid, flags, payload + i + 2, body_length);
+        free(receiver);
+        return ret;
+    }
+
+    // Take the lifetime of the message off the front of the body
+    char *body = payload + i + 2;
+    long ttl = 0;
+    if (flags & CHLA_EXPIRE_FLAG) {
+        ssize_t j = find_crlf(body, body_length);
+        for (ssize_t k = 0; k < j && ttl <= INT_MAX; k++) {
+            if (!isdigit((unsigned char)body[k])) {
+                ttl = 0;
+                break;
+            }
+            ttl = ttl * 10 + (body[k] - '0');
+        }
+        if (ttl <= 0 || ttl > INT_MAX) {
+            free(receiver);
+            return -1;
+        }
+        body += j + 2;
+        body_length -= j + 2;
+    }
+
+    CLIENT *to = creg_lookup(client_registry, receiver);
+    if (to == NULL) {
+        free(receiver);
+        return -1;
+    }
+    MAILBOX *mb = client_get_mailbox(to, 0);
+    client_unref(to, "Done with recipient");
+    if (mb == NULL) {
+        free(receiver);
+        return -1;
+    }
+
+    size_t mesg_length;
+    char *mesg = delivered_body(sender, body, body_length, &mesg_length);
+
+    int ret = mb_add_timed_message(mb, msgid, from, mesg, mesg_length,
+                                   (flags & CHLA_URGENT_FLAG) != 0, ttl);
+    mb_unref(mb, "Message sent");
+    free(receiver);
+    // A message for a receiver that has just logged out is dropped, as before
+    return ret > 0 ? BUSY : 0;
+}
+
+// Check a request against the rate limits; the bucket of the connection
+// is shared by the pipelined requests of the session
+static int admit(SESSION *session, char *sender, size_t length) {
+    pthread_mutex_lock(&session->lock);
+    int ret = rl_admit(&session->bucket, sender, length);
+    pthread_mutex_unlock(&session->lock);
+    return ret;
+}
+
+// Find the transfer of the message with a given msgid
+static TRANSFER *find_transfer(SESSION *session, uint32_t msgid) {
+    for (int i = 0; i < MAX_TRANSFERS; i++) {
+        if (session->transfers[i].to != NULL && session->transfers[i].msgid == msgid) {
+            return &session->transfers[i];
+        }
+    }
+    return NULL;
+}
+
+// Queue one part of a transfer for the receiver.  Returns the result of
+// mb_add_part().
+static int send_part(MAILBOX *from, TRANSFER *transfer, char *body, size_t length,
+                     MESSAGE_PART part) {
+    size_t mesg_length;
+    char *mesg = delivered_body(mb_get_handle(from), body, length, &mesg_length);
+    return mb_add_part(transfer->to, transfer->msgid, from, mesg, mesg_length,
+                       part, transfer->urgent);
+}
+
+// Forget a transfer that has ended
+static void end_transfer(TRANSFER *transfer) {
+    mb_unref(transfer->to, "Transfer ended");
+    transfer->to = NULL;
+}
+
+// Start a transfer with the first part of a message sent in parts, whose
+// payload is "receiver\r\nbody".  The ACK is sent once the part has been
+// delivered.
+static int start_transfer(SESSION *session, MAILBOX *from, uint32_t msgid, uint8_t flags,
+                          char *payload, size_t length) {
+    ssize_t i = find_crlf(payload, length);
+    if (i < 0 || length - (i + 2) > CHLA_CHUNK_MAX || find_transfer(session, msgid) != NULL) {
+        return -1;
+    }
+    TRANSFER *transfer = NULL;
+    for (int j = 0; j < MAX_TRANSFERS && transfer == NULL; j++) {
+        if (session->transfers[j].to == NULL) {
+            transfer = &session->transfers[j];
+        }
+    }
+    if (transfer == NULL) {
+        return -1;
+    }
+
+    // Parts are relayed only to a receiver at this node
+    char *receiver = Malloc(i + 1);
+    memcpy(receiver, payload, i);
+    receiver[i] = '\0';
+    CLIENT *to = cluster_is_local(receiver) ? creg_lookup(client_registry, receiver) : NULL;
+    free(receiver);
+    if (to == NULL) {
+        return -1;
+    }
+    transfer->to = client_get_mailbox(to, 0);
+    client_unref(to, "Done with recipient");
+    if (transfer->to == NULL) {
+        return -1;
+    }
+    transfer->msgid = msgid;
+    transfer->urgent = (flags & CHLA_URGENT_FLAG) != 0;
+
+    int ret = send_part(from, transfer, payload + i + 2, length - (i + 2), FIRST_PART);
+    if (ret) {
+        end_transfer(transfer);
+        return ret > 0 ? BUSY : -1;
+    }
+    return REPLIED;
+}
+
+// Handle a CHUNK request carrying the next part of a message sent in parts.
+// The ACK is sent once the part has been delivered; a part for which there
+// is no room yet is NACKed, and may be sent again.
+static int do_chunk(SESSION *session, uint32_t msgid, uint8_t flags, char *payload, size_t length) {
+    MAILBOX *from = client_get_mailbox(session->client, 1);
+    TRANSFER *transfer = find_transfer(session, msgid);
+    if (from == NULL || transfer == NULL || length > CHLA_CHUNK_MAX) {
+        return -1;
+    }
+    if (admit(session, mb_get_handle(from), length)) {
+        return -1;
+    }
+    MESSAGE_PART part = (flags & CHLA_MORE_FLAG) ? NEXT_PART : LAST_PART;
+    int ret = send_part(from, transfer, payload, length, part);
+    if (ret < 0 || (ret == 0 && part == LAST_PART)) {
+        // Receiver gone, or last part sent
+        end_transfer(transfer);
+    }
+    return ret > 0 ? BUSY : ret < 0 ? -1 : REPLIED;
+}
+
+// Let the receivers of unfinished transfers know that no more parts will
+// come.  This must be done while the client is still logged in.
+static void abort_transfers(SESSION *session) {
+    MAILBOX *from = client_get_mailbox(session->client, 1);
+    for (int i = 0; i < MAX_TRANSFERS; i++) {
+        TRANSFER *transfer = &session->transfers[i];
+        if (transfer->to == NULL) {
+            continue;
+        }
+        if (from != NULL) {
+            debug("Aborting transfer of message %u", transfer->msgid);
+            send_part(from, transfer, NULL, 0, ABORTED_PART);
+        }
+        end_transfer(transfer);
+    }
+}
+
+// Handle a SEND request whose payload is "receiver\r\nbody"
+static int do_send(SESSION *session, uint32_t msgid, uint8_t flags, char *payload, size_t length) {
+    MAILBOX *from = client_get_mailbox(session->client, 1);
+    if (from == NULL) {
+        return -1;
+    }
+    char *sender = mb_get_handle(from);
+    if ((flags & CHLA_MORE_FLAG) && (flags & CHLA_EXPIRE_FLAG)) {
+        return -1;
+    }
+    if (flags & CHLA_MORE_FLAG) {
+        // Parts are acknowledged one by one, so retries need no deduplication
+        if (admit(session, sender, length)) {
+            return -1;
+        }
+        return start_transfer(session, from, msgid, flags, payload, length);
+    }
+    // A retry of a message that was already accepted is only ACKed
+    if (dedup_check(sender, msgid)) {
+        return 0;
+    }
+    if (admit(session, sender, length)) {
+        return -1;
+    }
+    int ret = deliver(sender, from, msgid, flags, payload, length);
+    if (ret == 0) {
+        dedup_record(sender, msgid);
+    }
+    return ret;
+}
+
+// Handle a FWD_SEND request whose payload is "sender\r\nreceiver\r\nbody"
+static int do_fwd_send(uint32_t msgid, uint8_t flags, char *payload, size_t length) {
+    ssize_t i = find_crlf(payload, length);
+    if (i < 0) {
+        return -1;
+    }
+    char *sender = Malloc(i + 1);
+    memcpy(sender, payload, i);
+    sender[i] = '\0';
+    char *rest = payload + i + 2;
+    size_t rest_length = length - (i + 2);
+
+    // Only deliver locally: a misrouted message is not forwarded again
+    int ret = -1;
+    ssize_t j = find_crlf(rest, rest_length);
+    if (j >= 0) {
+        char *receiver = Malloc(j + 1);
+        memcpy(receiver, rest, j);
+        receiver[j] = '\0';
+        if (cluster_is_local(receiver)) {
+            ret = deliver(sender, NULL, msgid, flags, rest, rest_length);
+        }
+        free(receiver);
+    }
+    free(sender);
+    return ret;
+}
+
+// Handle one request and send the ACK or NACK
+static void dispatch(SESSION *session, CHLA_PACKET_HEADER *hdr, void *payload) {
+    CLIENT *client = session->client;
+    uint32_t msgid = ntohl(hdr->msgid);
+    size_t length = ntohl(hdr->payload_length);
+    int logged_in = client_get_user(client, 1) != NULL;
+    int err = -1;
+    switch (hdr->type) {
+    case CHLA_LOGIN_PKT:
+        err = do_login(client, msgid, hdr->flags, payload, length);
+        break;
+    case CHLA_LOGOUT_PKT:
+        abort_transfers(session);
+        err = client_logout(client);
+        break;
+    case CHLA_USERS_PKT:
+        if (logged_in) {
+            err = do_users(client, msgid);
+        }
+        break;
+    case CHLA_SEND_PKT:
+        err = do_send(session, msgid, hdr->flags, payload, length);
+        break;
+    case CHLA_CHUNK_PKT:
+        err = do_chunk(session, msgid, hdr->flags, payload, length);
+        break;
+    case CHLA_SHM_PKT:
+        // A thread that serves other clients too must not sleep on the rings
+        if (!chla_single_thread) {
+            err = client_attach_shm(client, msgid) ? -1 : REPLIED;
+        }
+        break;
+    case CHLA_USERS_QUERY_PKT:
+        if (logged_in) {
+            err = do_users_query(client, msgid, payload, length, 0);
+        }
+        break;
+    case CHLA_SUBSCRIBE_PKT:
+        if (logged_in) {
+            err = do_subscribe(client, msgid);
+        }
+        break;
+    case CHLA_SEARCH_PKT:
+        if (logged_in) {
+            err = do_search(client, msgid, payload, length);
+        }
+        break;
+    case CHLA_CREDIT_PKT:
+        if (logged_in) {
+            err = do_credit(client, payload, length);
+        }
+        break;
+    case CHLA_PING_PKT:
+        err = 0;
+        break;
+    case CHLA_LINK_PKT:
+        if (!logged_in && cluster_check_secret(payload, length) == 0) {
+            err = client_set_node_link(client);
+        }
+        break;
+    case CHLA_FWD_USERS_PKT:
+        if (client_is_node_link(client)) {
+            err = do_fwd_users(client, msgid);
+        }
+        break;
+    case CHLA_FWD_USERS_QUERY_PKT:
+        if (client_is_node_link(client)) {
+            err = do_users_query(client, msgid, payload, length, 1);
+        }
+        break;
+    case CHLA_FWD_SEND_PKT:
+        if (client_is_node_link(client)) {
+            err = do_fwd_send(msgid, hdr->flags, payload, length);
+        }
+        break;
+    default:
+        debug("%ld: Unexpected packet type %d", pthread_self(), hdr->type);
+        break;
+    }
+    if (err == BUSY) {
+        CHLA_PACKET_HEADER nack;
+        init_header(&nack, CHLA_NACK_PKT, msgid, 0);
+        nack.flags = CHLA_BUSY_FLAG;
+        client_send_packet(client, &nack, NULL);
+    } else if (err < 0) {
+        client_send_nack(client, msgid);
+    } else if (err != REPLIED) {
+        client_send_ack(client, msgid, NULL, 0);
+    }
+}
+
+// Decide whether a request may be processed concurrently with others from
+// the same client.  Requests that change the state of the session may not.
+// For a message, the receiver is returned as the key of the request, since
+// messages to the same receiver must be delivered in the order sent.
+static int pipelinable(CHLA_PACKET_HEADER *hdr, char *payload, char **keyp, size_t *lengthp) {
+    size_t length = ntohl(hdr->payload_length);
+    ssize_t i;
+    *keyp = NULL;
+    *lengthp = 0;
+    switch (hdr->type) {
+    case CHLA_SEND_PKT:
+        if (hdr->flags & CHLA_MORE_FLAG) {
+            return 0;
+        }
+        i = find_crlf(payload, length);
+        break;
+    case CHLA_FWD_SEND_PKT:
+        // The receiver is on the second line
+        i = find_crlf(payload, length);
+        if (i >= 0) {
+            payload += i + 2;
+            i = find_crlf(payload, length - (i + 2));
+        }
+        break;
+    case CHLA_USERS_PKT:
+    case CHLA_USERS_QUERY_PKT:
+    case CHLA_PING_PKT:
+    case CHLA_FWD_USERS_PKT:
+    case CHLA_FWD_USERS_QUERY_PKT:
+    case CHLA_SEARCH_PKT:
+        return 1;
+    default:
+        return 0;
+    }
+    if (i >= 0) {
+        *keyp = payload;
+        *lengthp = i;
+    }
+    return 1;
+}
+
+// Check whether a request must wait for one in flight with the same msgid,
+// which the client could not tell apart, or with the same key.  The session
+// must be locked.
+static int conflicts(SESSION *session, uint32_t msgid, char *key, size_t length) {
+    for (int i = 0; i < CHLA_MAX_PIPELINE; i++) {
+        INFLIGHT *slot = &session->slots[i];
+        if (slot->busy && (slot->msgid == msgid
+                           || (key != NULL && slot->key != NULL && slot->key_length == length
+                               && memcmp(slot->key, key, length) == 0))) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Wait until a pipelined request has completed
+static void wait_completion(SESSION *session) {
+    struct pollfd pfd = { .fd = session->event_fd, .events = POLLIN };
+    if (coro_poll(&pfd, 1) > 0) {
+        uint64_t count;
+        if (read(session->event_fd, &count, sizeof(count)) < 0) {
+            debug("%ld: Completion event read failed", pthread_self());
+        }
+    }
+}
+
+// Wait until no pipelined request is in flight
+static void drain_pipeline(SESSION *session) {
+    while (1) {
+        pthread_mutex_lock(&session->lock);
+        int idle = session->in_flight == 0;
+        pthread_mutex_unlock(&session->lock);
+        if (idle) {
+            return;
+        }
+        wait_completion(session);
+    }
+}
+
+// Wait for room to process a request concurrently, and claim a slot for it
+static INFLIGHT *reserve_slot(SESSION *session, uint32_t msgid, char *key, size_t length) {
+    while (1) {
+        pthread_mutex_lock(&session->lock);
+        if (session->in_flight < chla_pipeline_depth
+            && !conflicts(session, msgid, key, length)) {
+            INFLIGHT *slot = session->slots;
+            while (slot->busy) {
+                slot++;
+            }
+            slot->busy = 1;
+            slot->msgid = msgid;
+            slot->key = key;
+            slot->key_length = length;
+            session->in_flight++;
+            pthread_mutex_unlock(&session->lock);
+            return slot;
+        }
+        pthread_mutex_unlock(&session->lock);
+        wait_completion(session);
+    }
+}
+
+// Process a pipelined request, then release its slot.  The completion is
+// signaled with the session locked, since the session may go away as soon
+// as the last request in flight has completed.
+static void run_request(void *arg) {
+    REQUEST_JOB *job = arg;
+    SESSION *session = job->session;
+    dispatch(session, &job->hdr, job->payload);
+    pthread_mutex_lock(&session->lock);
+    job->slot->busy = 0;
+    session->in_flight--;
+    uint64_t one = 1;
+    if (write(session->event_fd, &one, sizeof(one)) < 0) {
+        debug("%ld: Completion event write failed", pthread_self());
+    }
+    pthread_mutex_unlock(&session->lock);
+    // The key of the slot pointed into the payload
+    free(job->payload);
+    free(job);
+}
+
+// Thread function for a pipelined request when sessions are not coroutines
+static void *request_thread(void *arg) {
+    pthread_detach(pthread_self());
+    place_thread(PLACE_WORKER);
+    run_request(arg);
+    return NULL;
+}
+
+// Handle one request, concurrently with others if that is safe.  The
+// payload becomes the responsibility of this function.
+static void pipeline(SESSION *session, CHLA_PACKET_HEADER *hdr, void *payload) {
+    char *key;
+    size_t length;
+    if (chla_pipeline_depth <= 1 || session->event_fd < 0
+        || !pipelinable(hdr, payload, &key, &length)) {
+        // One at a time, after those already in flight
+        drain_pipeline(session);
+        dispatch(session, hdr, payload);
+        free(payload);
+        return;
+    }
+    REQUEST_JOB *job = Malloc(sizeof(REQUEST_JOB));
+    job->session = session;
+    job->hdr = *hdr;
+    job->payload = payload;
+    job->slot = reserve_slot(session, ntohl(hdr->msgid), key, length);
+    if (coro_spawn(run_request, job)) {
+        pthread_t tid;
+        Pthread_create(&tid, NULL, request_thread, job);
+    }
+}
+
+// In single-thread mode, keep the mailbox served by this thread in step
+// with the login state of the client.  Returns the mailbox now served.
+static MAILBOX *sync_mailbox(CLIENT *client, MAILBOX *mb) {
+    if (client_get_mailbox(client, 1) == mb) {
+        return mb;
+    }
+    if (mb != NULL) {
+        // Logged out: the mailbox is defunct, so this discards what is left
+        while (mb_try_next_entry(mb) != NULL)
+            ;
+        mb_unref(mb, "Client logged out");
+    }
+    mb = client_get_mailbox(client, 0);
+    if (mb != NULL) {
+        mb_set_discard_hook(mb, bounce_discarded);
+    }
+    return mb;
+}
+
+// In single-thread mode, deliver mailbox entries until the connection
+// has input.  Returns -1 if the connection can no longer be used, or 1 if
+// the session is to stop (see chla_quiesce()).
+static int wait_for_input(CLIENT *client, int fd, MAILBOX *mb) {
+    struct pollfd pfds[3];
+    pfds[0].fd = fd;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = mb != NULL ? mb_event_fd(mb) : -1;
+    pfds[1].events = POLLIN;
+    pfds[2].fd = quiesce.stop_fd;
+    pfds[2].events = POLLIN;
+    while (1) {
+        if (coro_poll(pfds, 3) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (pfds[1].revents & POLLIN) {
+            uint64_t count;
+            if (read(pfds[1].fd, &count, sizeof(count)) < 0) {
+                debug("%ld: Mailbox event read failed", pthread_self());
+            }
+            MAILBOX_ENTRY *entry;
+            while ((entry = mb_try_next_entry(mb)) != NULL) {
+                deliver_entry(client, mb, entry);
+            }
+        }
+        if (pfds[2].revents & POLLIN) {
+            return 1;
+        }
+        if (pfds[0].revents) {
+            return 0;
+        }
+    }
+}
+
+// In threaded mode, wait for the connection to have input, unless the
+// session is to stop first.  Returns -1 if the connection can no longer be
+// used, or 1 if the session is to stop.  A client on shared memory reads
+// from its ring instead, and is disconnected rather than stopped.
+static int wait_for_request(CLIENT *client, int fd) {
+    if (quiesce.stop_fd < 0 || client_has_shm(client)) {
+        return 0;
+    }
+    struct pollfd pfds[2] = {
+        { .fd = fd, .events = POLLIN },
+        { .fd = quiesce.stop_fd, .events = POLLIN }
+    };
+    while (poll(pfds, 2, -1) < 0) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    return (pfds[1].revents & POLLIN) ? 1 : 0;
+}
+
+// Send a keepalive probe, unless the connection cannot take it right now,
+// in which case the peer has unacknowledged data to answer anyway.  A client
+// on shared memory is not probed, since a probe could wait for room in its
+// ring; its connection shows whether it is still there.
+static void send_probe(SESSION *session) {
+    if (client_has_shm(session->client)) {
+        return;
+    }
+    struct pollfd pfd = { .fd = session->fd, .events = POLLOUT };
+    if (poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLOUT)) {
+        CHLA_PACKET_HEADER hdr;
+        init_header(&hdr, CHLA_PING_PKT, 0, 0);
+        client_send_packet(session->client, &hdr, NULL);
+    }
+}
+
+// Timer callback: probe an idle connection, or shut it down once it has
+// been idle for too long, which ends its service loop
+static void check_idle(void *arg) {
+    SESSION *session = arg;
+    uint64_t idle = tw_now() - __atomic_load_n(&session->last_input, __ATOMIC_RELAXED);
+    uint64_t timeout = chla_idle_timeout * 1000ULL;
+    uint64_t interval = chla_keepalive * 1000ULL;
+    uint64_t wait = UINT64_MAX;
+    if (timeout > 0) {
+        if (idle >= timeout) {
+            debug("Connection on fd %d idle for %lu ms", session->fd, (unsigned long)idle);
+            shutdown(session->fd, SHUT_RDWR);
+            return;
+        }
+        wait = timeout - idle;
+    }
+    if (interval > 0) {
+        if (idle >= interval) {
+            send_probe(session);
+            idle = 0; // Probe again after another interval
+        }
+        if (interval - idle < wait) {
+            wait = interval - idle;
+        }
+    }
+    tw_schedule(&session->timer, wait);
+}
+
+// Keep a session stopped while the sessions are to stop, once its
+// pipelined requests have completed, and then carry on where it left off
+// if they are resumed instead of handed off
+static void stop_session(SESSION *session) {
+    drain_pipeline(session);
+    tw_cancel(&session->timer);
+    pthread_mutex_lock(&quiesce.lock);
+    quiesce.stopped++;
+    pthread_cond_broadcast(&quiesce.changed);
+    pthread_mutex_unlock(&quiesce.lock);
+
+    struct pollfd pfd = { .fd = quiesce.resume_fd, .events = POLLIN };
+    while (coro_poll(&pfd, 1) < 0 && errno == EINTR)
+        ;
+
+    pthread_mutex_lock(&quiesce.lock);
+    quiesce.stopped--;
+    pthread_mutex_unlock(&quiesce.lock);
+    if (chla_idle_timeout > 0 || chla_keepalive > 0) {
+        check_idle(session);
+    }
+}
+
+// Read and dispatch requests until the connection is closed
+static void client_service_loop(CLIENT *client) {
+    int fd = client_get_fd(client);
+    CHLA_PACKET_HEADER hdr;
+    void *payload = NULL;
+    MAILBOX *mb = NULL;
+
+    SESSION session = { .client = client, .fd = fd, .last_input = tw_now() };
+    tw_timer_init(&session.timer, check_idle, &session);
+    rl_init(&session.bucket);
+    pthread_mutex_init(&session.lock, NULL);
+    session.event_fd = chla_pipeline_depth > 1 ? eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC) : -1;
+    if (chla_idle_timeout > 0 || chla_keepalive > 0) {
+        check_idle(&session);
+    }
+
+    while (1) {
+        int ret = 0;
+        if (chla_single_thread) {
+            mb = sync_mailbox(client, mb);
+            ret = wait_for_input(client, fd, mb);
+        } else {
+            ret = wait_for_request(client, fd);
+        }
+        if (ret > 0) {
+            stop_session(&session);
+            continue;
+        }
+        if (ret < 0 || client_recv_packet(client, &hdr, &payload)) {
+            break;
+        }
+        __atomic_store_n(&session.last_input, tw_now(), __ATOMIC_RELAXED);
+        pipeline(&session, &hdr, payload);
+        payload = NULL;
+    }
+
+    // Connection closed: log out and unregister
+    debug("%ld: Client service terminating", pthread_self());
+    drain_pipeline(&session);
+    if (session.event_fd >= 0) {
+        close(session.event_fd);
+    }
+    pthread_mutex_destroy(&session.lock);
+    tw_cancel(&session.timer);
+    abort_transfers(&session);
+    if (client_get_user(client, 1) != NULL) {
+        client_logout(client);
+    }
+    if (mb != NULL) {
+        sync_mailbox(client, mb);
+    }
+    creg_unregister(client_registry, client);
+    close(fd);
+    client_unref(client, "Client service terminating");
+    chla_session_closed();
+}
+
+// Set a connection to busy poll, if requested; failure is reported once
+static void set_busy_poll(int fd) {
+    static int warned;
+    if (chla_busy_poll > 0
+        && setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &chla_busy_poll, sizeof(chla_busy_poll)) < 0
+        && !__atomic_exchange_n(&warned, 1, __ATOMIC_RELAXED)) {
+        warn("Could not set busy polling on connections: %s", strerror(errno));
+    }
+}
+
+// Register a new connection and serve it until it is closed
+static void serve_connection(int fd) {
+    set_busy_poll(fd);
+    CLIENT *client = creg_register(client_registry, fd);
+    if (client == NULL) {
+        close(fd);
+        chla_session_closed();
+        return;
+    }
+    client_service_loop(client);
+}
+
+void *chla_client_service(void *arg) {
+    int fd = (int)(intptr_t)arg;
+    pthread_detach(pthread_self());
+    place_session(fd);
+    debug("%ld: Client service started for fd %d", pthread_self(), fd);
+    serve_connection(fd);
+    return NULL;
+}
+
+void chla_client_coroutine(void *arg) {
+    int fd = (int)(intptr_t)arg;
+    debug("%ld: Client coroutine started for fd %d", pthread_self(), fd);
+    serve_connection(fd);
+}
+
+// Thread function for a resumed client: the CLIENT is already registered
+static void *resumed_client_service(void *arg) {
+    CLIENT *client = arg;
+    pthread_detach(pthread_self());
+    place_session(client_get_fd(client));
+    debug("%ld: Resumed client service started for fd %d", pthread_self(), client_get_fd(client));
+    client_service_loop(client);
+    return NULL;
+}
+
+CLIENT *chla_resume_client(int fd, char *handle) {
+    set_busy_poll(fd);
+    CLIENT *client = creg_register(client_registry, fd);
+    if (client == NULL) {
+        return NULL;
+    }
+    if (handle != NULL && client_login(client, handle)) {
+        creg_unregister(client_registry, client);
+        client_unref(client, "Resume failed");
+        return NULL;
+    }
+    return client;
+}
+
+void chla_serve_client(CLIENT *client) {
+    if (client_get_user(client, 1) != NULL) {
+        start_mailbox_service(client);
+    }
+    chla_session_opened();
+    pthread_t tid;
+    Pthread_create(&tid, NULL, resumed_client_service, client);
+}
+
+void chla_session_opened(void) {
+    pthread_mutex_lock(&quiesce.lock);
+    quiesce.sessions++;
+    pthread_mutex_unlock(&quiesce.lock);
+}
+
+void chla_session_closed(void) {
+    pthread_mutex_lock(&quiesce.lock);
+    quiesce.sessions--;
+    pthread_cond_broadcast(&quiesce.changed);
+    pthread_mutex_unlock(&quiesce.lock);
+}
+
+int chla_quiesce_init(void) {
+    quiesce.stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    quiesce.resume_fd = eventfd(1, EFD_NONBLOCK | EFD_CLOEXEC);
+    return quiesce.stop_fd < 0 || quiesce.resume_fd < 0 ? -1 : 0;
+}
+
+// Make one of the two events of the sessions readable, and the other not
+static void switch_event(int on_fd, int off_fd) {
+    uint64_t count;
+    if (read(off_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        debug("Quiesce event read failed");
+    }
+    count = 1;
+    if (write(on_fd, &count, sizeof(count)) < 0) {
+        debug("Quiesce event write failed");
+    }
+}
+
+int chla_quiesce(int timeout_ms) {
+    if (quiesce.stop_fd < 0) {
+        return -1;
+    }
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    switch_event(quiesce.stop_fd, quiesce.resume_fd);
+
+    // Clients on shared memory do not read their connections, so they are
+    // disconnected, which ends their sessions
+    CLIENT **clients = creg_all_clients(client_registry);
+    if (clients == NULL) {
+        chla_resume();
+        return -1;
+    }
+    for (CLIENT **cp = clients; *cp != NULL; cp++) {
+        if (client_has_shm(*cp)) {
+            shutdown(client_get_fd(*cp), SHUT_RDWR);
+        }
+    }
+
+    // Wait for every session to have stopped or ended
+    int err = 0;
+    pthread_mutex_lock(&quiesce.lock);
+    while (quiesce.stopped < quiesce.sessions && err == 0) {
+        err = pthread_cond_timedwait(&quiesce.changed, &quiesce.lock, &deadline);
+    }
+    int ret = quiesce.stopped < quiesce.sessions ? -1 : 0;
+    pthread_mutex_unlock(&quiesce.lock);
+
+    // Then for the mailbox entries, the presence changes and the packets
+    // on their way out
+    if (ret == 0 && presence_hold(&deadline)) {
+        ret = -1;
+    }
+    for (CLIENT **cp = clients; *cp != NULL; cp++) {
+        MAILBOX *mb = client_get_mailbox(*cp, 0);
+        if (mb != NULL) {
+            if (ret == 0 && mb_hold(mb, &deadline)) {
+                ret = -1;
+            }
+            mb_unref(mb, "Mailbox held");
+        }
+        if (ret == 0 && client_suspend(*cp, &deadline)) {
+            ret = -1;
+        }
+        client_unref(*cp, "Client stopped");
+    }
+    free(clients);
+    if (ret) {
+        debug("Sessions did not stop in time");
+        chla_resume();
+    }
+    return ret;
+}
+
+void chla_resume(void) {
+    presence_release();
+    CLIENT **clients = creg_all_clients(client_registry);
+    if (clients != NULL) {
+        for (CLIENT **cp = clients; *cp != NULL; cp++) {
+            MAILBOX *mb = client_get_mailbox(*cp, 0);
+            if (mb != NULL) {
+                mb_release(mb);
+                mb_unref(mb, "Mailbox released");
+            }
+            client_unsuspend(*cp);
+            client_unref(*cp, "Client resumed");
+        }
+        free(clients);
+    }
+    switch_event(quiesce.resume_fd, quiesce.stop_fd);
+}
@@ -0,0 +1,264 @@
+#define _GNU_SOURCE // For memfd_create() and POLLRDHUP
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include "shm.h"
+#include "placement.h"
+#include "debug.h"
+
+#define SHM_SPIN 4000 // Polls of a counter before sleeping on it
+#define SHM_CHECK_MS 100 // Interval at which a sleeper checks the connection
+
+struct shm_transport {
+    int fd; // The connection, whose closing ends the session
+    int spins; // Polls of a counter before sleeping on it
+    SHM_REGION *region;
+    // The counters this side advances, which the client could overwrite
+    // in the region, and so are never read back from it
+    uint32_t to_client_tail;
+    uint32_t to_server_head;
+};
+
+static void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+// Check whether the connection has been closed, by either side
+static int peer_gone(int fd) {
+    struct pollfd pfd = { .fd = fd, .events = POLLRDHUP };
+    return poll(&pfd, 1, 0) < 0 || (pfd.revents & (POLLRDHUP | POLLHUP | POLLERR | POLLNVAL));
+}
+
+// Wait until a counter differs from the value seen: spin for a while, then
+// sleep on it.  Returns -1 if the connection is closed in the meantime.
+static int wait_change(SHM_TRANSPORT *shm, uint32_t *counter, uint32_t seen, uint32_t *waiters) {
+    for (int i = 0; i < shm->spins; i++) {
+        if (__atomic_load_n(counter, __ATOMIC_SEQ_CST) != seen) {
+            return 0;
+        }
+        cpu_relax();
+    }
+    __atomic_store_n(waiters, 1, __ATOMIC_SEQ_CST);
+    int ret = 0;
+    while (__atomic_load_n(counter, __ATOMIC_SEQ_CST) == seen) {
+        struct timespec ts = { 0, SHM_CHECK_MS * 1000000L };
+        syscall(SYS_futex, counter, FUTEX_WAIT, seen, &ts, NULL, 0);
+        if (peer_gone(shm->fd)) {
+            ret = -1;
+            break;
+        }
+    }
+    __atomic_store_n(waiters, 0, __ATOMIC_SEQ_CST);
+    return ret;
+}
+
+// Advance a counter, and wake the other side if it sleeps on it
+static void advance(uint32_t *counter, uint32_t value, uint32_t *waiters) {
+    __atomic_store_n(counter, value, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiters, __ATOMIC_SEQ_CST)) {
+        syscall(SYS_futex, counter, FUTEX_WAKE, 1, NULL, NULL, 0);
+    }
+}
+
+// Check the counter read from the client against this side's own: there
+// can never be more than a ring's worth of bytes between them.  If there
+// are, the connection is shut down, which ends the session whichever of
+// its threads finds out.
+static int check_counters(SHM_TRANSPORT *shm, uint32_t head, uint32_t tail) {
+    if ((uint32_t)(tail - head) > SHM_RING_SIZE) {
+        debug("Ring counters %u and %u on fd %d are inconsistent", head, tail, shm->fd);
+        shutdown(shm->fd, SHUT_RDWR);
+        errno = EPROTO;
+        return -1;
+    }
+    return 0;
+}
+
+// Copy two buffers into a ring, one after the other, publishing as much
+// as fits at a time, from the tail kept at tailp
+static int ring_put(SHM_TRANSPORT *shm, SHM_RING *ring, uint32_t *tailp,
+                    const void *buf1, size_t len1, const void *buf2, size_t len2) {
+    const char *bufs[2] = { buf1, buf2 };
+    size_t lens[2] = { len1, len2 };
+    int i = 0;
+    uint32_t tail = *tailp;
+    while (i < 2) {
+        uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST);
+        if (check_counters(shm, head, tail)) {
+            return -1;
+        }
+        size_t space = SHM_RING_SIZE - (tail - head);
+        if (space == 0) {
+            if (wait_change(shm, &ring->head, head, &ring->head_waiters)) {
+                return -1;
+            }
+            continue;
+        }
+        while (i < 2 && space > 0) {
+            size_t n = lens[i] < space ? lens[i] : space;
+            size_t offset = tail % SHM_RING_SIZE;
+            size_t first = n < SHM_RING_SIZE - offset ? n : SHM_RING_SIZE - offset;
+            memcpy(ring->data + offset, bufs[i], first);
+            memcpy(ring->data, bufs[i] + first, n - first);
+            tail += n;
+            space -= n;
+            bufs[i] += n;
+            lens[i] -= n;
+            if (lens[i] == 0) {
+                i++;
+            }
+        }
+        *tailp = tail;
+        advance(&ring->tail, tail, &ring->tail_waiters);
+    }
+    return 0;
+}
+
+// Copy bytes out of a ring, waiting for them as needed, from the head kept
+// at headp
+static int ring_get(SHM_TRANSPORT *shm, SHM_RING *ring, uint32_t *headp, void *buf, size_t len) {
+    char *p = buf;
+    uint32_t head = *headp;
+    while (len > 0) {
+        uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST);
+        if (check_counters(shm, head, tail)) {
+            return -1;
+        }
+        size_t avail = tail - head;
+        if (avail == 0) {
+            if (wait_change(shm, &ring->tail, tail, &ring->tail_waiters)) {
+                return -1;
+            }
+            continue;
+        }
+        size_t n = len < avail ? len : avail;
+        size_t offset = head % SHM_RING_SIZE;
+        size_t first = n < SHM_RING_SIZE - offset ? n : SHM_RING_SIZE - offset;
+        memcpy(p, ring->data + offset, first);
+        memcpy(p + first, ring->data, n - first);
+        head += n;
+        p += n;
+        len -= n;
+        *headp = head;
+        advance(&ring->head, head, &ring->head_waiters);
+    }
+    return 0;
+}
+
+// Send the ACK of an SHM request with the memfd attached
+static int send_ack(int fd, CHLA_PACKET_HEADER *ack, int memfd) {
+    struct iovec iov = { .iov_base = ack, .iov_len = sizeof(CHLA_PACKET_HEADER) };
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct msghdr msg = {
+        .msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = control.buf, .msg_controllen = sizeof(control.buf)
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &memfd, sizeof(int));
+    while (1) {
+        ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (n == sizeof(CHLA_PACKET_HEADER)) {
+            return 0;
+        }
+        if (n >= 0 || errno != EINTR) {
+            return -1;
+        }
+    }
+}
+
+SHM_TRANSPORT *shm_attach(int fd, CHLA_PACKET_HEADER *ack) {
+    // Descriptors can only be passed over a Unix-domain connection
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    if (getsockname(fd, (struct sockaddr *)&addr, &addrlen) || addr.ss_family != AF_UNIX) {
+        return NULL;
+    }
+    SHM_TRANSPORT *shm = malloc(sizeof(SHM_TRANSPORT));
+    if (shm == NULL) {
+        return NULL;
+    }
+    int memfd = memfd_create("charla", MFD_CLOEXEC);
+    if (memfd < 0 || ftruncate(memfd, sizeof(SHM_REGION)) < 0) {
+        goto fail;
+    }
+    shm->region = mmap(NULL, sizeof(SHM_REGION), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (shm->region == MAP_FAILED) {
+        goto fail;
+    }
+    // Keep the rings on the node of the thread serving the client
+    place_bind(shm->region, sizeof(SHM_REGION), -1);
+    // The memfd starts out zeroed, so only the identification is filled in
+    shm->region->magic = SHM_MAGIC;
+    shm->region->ring_size = SHM_RING_SIZE;
+    shm->to_client_tail = 0;
+    shm->to_server_head = 0;
+    shm->fd = fd;
+    // Spinning only helps if the other side can run at the same time
+    shm->spins = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SHM_SPIN : 0;
+    if (send_ack(fd, ack, memfd)) {
+        munmap(shm->region, sizeof(SHM_REGION));
+        goto fail;
+    }
+    close(memfd);
+    debug("Shared-memory transport attached on fd %d", fd);
+    return shm;
+
+fail:
+    if (memfd >= 0) {
+        close(memfd);
+    }
+    free(shm);
+    return NULL;
+}
+
+int shm_send_packet(SHM_TRANSPORT *shm, CHLA_PACKET_HEADER *hdr, void *payload) {
+    size_t length = ntohl(hdr->payload_length);
+    return ring_put(shm, &shm->region->to_client, &shm->to_client_tail,
+                    hdr, sizeof(CHLA_PACKET_HEADER), payload, payload != NULL ? length : 0);
+}
+
+int shm_recv_packet(SHM_TRANSPORT *shm, CHLA_PACKET_HEADER *hdr, void **payload) {
+    SHM_RING *ring = &shm->region->to_server;
+    if (ring_get(shm, ring, &shm->to_server_head, hdr, sizeof(CHLA_PACKET_HEADER))) {
+        return -1;
+    }
+    size_t length = ntohl(hdr->payload_length);
+    if (length > proto_max_payload) {
+        debug("Payload of %zu bytes exceeds the limit", length);
+        errno = EMSGSIZE;
+        return -1;
+    }
+    if (length > 0) {
+        *payload = malloc(length);
+        if (*payload == NULL) {
+            return -1;
+        }
+        if (ring_get(shm, ring, &shm->to_server_head, *payload, length)) {
+            free(*payload);
+            *payload = NULL;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void shm_detach(SHM_TRANSPORT *shm) {
+    munmap(shm->region, sizeof(SHM_REGION));
+    free(shm);
+}
@@ -0,0 +1,193 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include "slab.h"
+#include "debug.h"
+
+// Objects are aligned for any type
+#define SLAB_ALIGN 16
+
+// A per-thread cache of free objects
+typedef struct slab_magazine {
+    SLAB_POOL *pool;
+    int count;
+    void *objects[SLAB_MAGAZINE_SIZE];
+} SLAB_MAGAZINE;
+
+// List of registered pools
+static SLAB_POOL *pools;
+static pthread_mutex_t pools_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Link field stored in the first word of a free object
+#define NEXT(obj) (*(void **)(obj))
+
+void slab_register(SLAB_POOL *pool) {
+    pool->object_size = (pool->object_size + SLAB_ALIGN - 1) & ~(size_t)(SLAB_ALIGN - 1);
+    pthread_mutex_lock(&pools_mutex);
+    pool->next = pools;
+    pools = pool;
+    pthread_mutex_unlock(&pools_mutex);
+}
+
+// Obtain a new slab from malloc() and add its objects to the depot.
+// The pool must be locked.
+static int grow(SLAB_POOL *pool) {
+    char *slab = malloc(SLAB_ALIGN + SLAB_OBJECTS * pool->object_size);
+    if (slab == NULL) {
+        return -1;
+    }
+    NEXT(slab) = pool->slabs;
+    pool->slabs = slab;
+    pool->slab_count++;
+    for (int i = 0; i < SLAB_OBJECTS; i++) {
+        void *obj = slab + SLAB_ALIGN + i * pool->object_size;
+        NEXT(obj) = pool->depot;
+        pool->depot = obj;
+    }
+    pool->depot_count += SLAB_OBJECTS;
+    return 0;
+}
+
+int slab_init(size_t capacity) {
+    pthread_mutex_lock(&pools_mutex);
+    for (SLAB_POOL *pool = pools; pool != NULL; pool = pool->next) {
+        pthread_mutex_lock(&pool->mutex);
+        while (pool->depot_count < capacity) {
+            if (grow(pool)) {
+                pthread_mutex_unlock(&pool->mutex);
+                pthread_mutex_unlock(&pools_mutex);
+                return -1;
+            }
+        }
+        pthread_mutex_unlock(&pool->mutex);
+        debug("Preallocated %zu %s objects", pool->depot_count, pool->name);
+    }
+    pthread_mutex_unlock(&pools_mutex);
+    return 0;
+}
+
+#ifdef SLAB_MALLOC
+
+// Built to compare with malloc(): the pools only count their objects
+void *slab_alloc(SLAB_POOL *pool) {
+    void *obj = malloc(pool->object_size);
+    if (obj != NULL) {
+        __atomic_fetch_add(&pool->allocs, 1, __ATOMIC_RELAXED);
+    }
+    return obj;
+}
+
+void slab_free(SLAB_POOL *pool, void *obj) {
+    if (obj == NULL) {
+        return;
+    }
+    free(obj);
+    __atomic_fetch_add(&pool->frees, 1, __ATOMIC_RELAXED);
+}
+
+#else
+
+// Move the objects of a magazine back to the depot
+static void flush(SLAB_MAGAZINE *mag, int count) {
+    SLAB_POOL *pool = mag->pool;
+    pthread_mutex_lock(&pool->mutex);
+    while (count-- > 0 && mag->count > 0) {
+        void *obj = mag->objects[--mag->count];
+        NEXT(obj) = pool->depot;
+        pool->depot = obj;
+        pool->depot_count++;
+    }
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+// Called when a thread exits: give its cached objects back
+static void magazine_destructor(void *arg) {
+    SLAB_MAGAZINE *mag = arg;
+    flush(mag, mag->count);
+    free(mag);
+}
+
+// Get the calling thread's magazine for a pool, creating it if necessary
+static SLAB_MAGAZINE *get_magazine(SLAB_POOL *pool) {
+    if (!__atomic_load_n(&pool->key_created, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&pool->mutex);
+        if (!pool->key_created) {
+            if (pthread_key_create(&pool->key, magazine_destructor)) {
+                pthread_mutex_unlock(&pool->mutex);
+                return NULL;
+            }
+            __atomic_store_n(&pool->key_created, 1, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&pool->mutex);
+    }
+    SLAB_MAGAZINE *mag = pthread_getspecific(pool->key);
+    if (mag == NULL) {
+        mag = malloc(sizeof(SLAB_MAGAZINE));
+        if (mag == NULL) {
+            return NULL;
+        }
+        mag->pool = pool;
+        mag->count = 0;
+        pthread_setspecific(pool->key, mag);
+    }
+    return mag;
+}
+
+void *slab_alloc(SLAB_POOL *pool) {
+    SLAB_MAGAZINE *mag = get_magazine(pool);
+    if (mag == NULL) {
+        return NULL;
+    }
+    if (mag->count == 0) {
+        // Refill half the magazine from the depot, growing it if empty
+        pthread_mutex_lock(&pool->mutex);
+        if (pool->depot == NULL && grow(pool)) {
+            pthread_mutex_unlock(&pool->mutex);
+            return NULL;
+        }
+        while (mag->count < SLAB_MAGAZINE_SIZE / 2 && pool->depot != NULL) {
+            void *obj = pool->depot;
+            pool->depot = NEXT(obj);
+            pool->depot_count--;
+            mag->objects[mag->count++] = obj;
+        }
+        pthread_mutex_unlock(&pool->mutex);
+    }
+    __atomic_fetch_add(&pool->allocs, 1, __ATOMIC_RELAXED);
+    return mag->objects[--mag->count];
+}
+
+void slab_free(SLAB_POOL *pool, void *obj) {
+    if (obj == NULL) {
+        return;
+    }
+    SLAB_MAGAZINE *mag = get_magazine(pool);
+    if (mag == NULL) {
+        // Without a magazine, return the object straight to the depot
+        pthread_mutex_lock(&pool->mutex);
+        NEXT(obj) = pool->depot;
+        pool->depot = obj;
+        pool->depot_count++;
+        pthread_mutex_unlock(&pool->mutex);
+    } else {
+        if (mag->count == SLAB_MAGAZINE_SIZE) {
+            flush(mag, SLAB_MAGAZINE_SIZE / 2);
+        }
+        mag->objects[mag->count++] = obj;
+    }
+    __atomic_fetch_add(&pool->frees, 1, __ATOMIC_RELAXED);
+}
+
+#endif
+
+void slab_report(FILE *out) {
+    pthread_mutex_lock(&pools_mutex);
+    for (SLAB_POOL *pool = pools; pool != NULL; pool = pool->next) {
+        unsigned long allocs = __atomic_load_n(&pool->allocs, __ATOMIC_RELAXED);
+        unsigned long frees = __atomic_load_n(&pool->frees, __ATOMIC_RELAXED);
+        fprintf(out, "%s: %lu allocs, %lu frees, %lu in use, %zu slabs (%zu bytes)\n",
+                pool->name, allocs, frees, allocs - frees, pool->slab_count,
+                pool->slab_count * (SLAB_ALIGN + SLAB_OBJECTS * pool->object_size));
+    }
+    pthread_mutex_unlock(&pools_mutex);
+}
@@ -0,0 +1,536 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "snapshot.h"
+#include "globals.h"
+#include "placement.h"
+#include "debug.h"
+
+#define SNAP_MAGIC "CHLASNP1"
+
+typedef struct snap_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t nusers;
+    uint64_t users; // Offset of the user table
+    uint64_t size;
+    uint64_t time; // When the snapshot was taken, in seconds since the epoch
+} SNAP_HEADER;
+
+// A user in the table, whose handle and entries are elsewhere in the file
+typedef struct snap_user {
+    uint64_t handle;
+    uint64_t entries;
+    uint64_t entries_length;
+    uint32_t handle_length;
+    uint32_t nentries;
+} SNAP_USER;
+
+// An entry, followed by the sender's handle and the body, padded to 8 bytes
+typedef struct snap_entry {
+    uint32_t type;
+    int32_t msgid;
+    uint32_t notice_type;
+    uint32_t urgent; // Nonzero for an urgent message
+    uint32_t part; // Place of the message in a message sent in parts
+    uint32_t from_length;
+    uint32_t body_length;
+    uint32_t ttl; // Lifetime of a message of its own in milliseconds, or 0
+} SNAP_ENTRY;
+
+#define PAD8(n) (-(n) & 7)
+
+static char *snap_path;
+static int snap_interval;
+static int handed_off; // The entries belong to a new process now
+
+// The loaded snapshot, which is only read
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static char *map;
+static size_t map_size;
+static SNAP_USER *table;
+static uint32_t nusers;
+static unsigned char *claimed; // Whether each user has claimed their entries
+
+// Saving, by one thread at a time
+static pthread_mutex_t save_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// The thread that takes periodic snapshots
+static pthread_mutex_t run_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t run_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t snap_tid;
+static int running;
+
+static int compare_handles(const char *a, size_t alen, const char *b, size_t blen) {
+    int c = memcmp(a, b, alen < blen ? alen : blen);
+    if (c != 0) {
+        return c;
+    }
+    return alen < blen ? -1 : alen > blen;
+}
+
+// Check that a range lies within the loaded snapshot
+static int in_map(uint64_t offset, uint64_t length) {
+    return offset <= map_size && length <= map_size - offset;
+}
+
+/*
+ * Loading.
+ */
+
+static void load(void) {
+    int fd = open(snap_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno != ENOENT) {
+            warn("Could not open snapshot %s", snap_path);
+        }
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(SNAP_HEADER)) {
+        warn("Snapshot %s is truncated", snap_path);
+        close(fd);
+        return;
+    }
+    char *m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED) {
+        return;
+    }
+    SNAP_HEADER *hdr = (SNAP_HEADER *)m;
+    size_t size = st.st_size;
+    if (memcmp(hdr->magic, SNAP_MAGIC, 8) != 0 || hdr->version != SNAP_VERSION || hdr->size != size
+        || hdr->users > size || (size - hdr->users) / sizeof(SNAP_USER) < hdr->nusers
+        || (claimed = calloc(hdr->nusers + 1, 1)) == NULL) {
+        warn("Snapshot %s is corrupt or of another version: ignored", snap_path);
+        munmap(m, size);
+        return;
+    }
+    map = m;
+    map_size = size;
+    table = (SNAP_USER *)(m + hdr->users);
+    nusers = hdr->nusers;
+    info("Loaded snapshot of %u users taken at %lu", nusers, (unsigned long)hdr->time);
+}
+
+// Find a user in the loaded snapshot
+static int find_user(const char *handle, size_t length) {
+    uint32_t lo = 0;
+    uint32_t hi = nusers;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        SNAP_USER *u = &table[mid];
+        if (!in_map(u->handle, u->handle_length)) {
+            return -1;
+        }
+        int c = compare_handles(map + u->handle, u->handle_length, handle, length);
+        if (c == 0) {
+            return mid;
+        }
+        if (c < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Restoring.
+ */
+
+// A message sent in parts whose last part has not been seen
+typedef struct open_part {
+    int32_t msgid;
+    uint32_t urgent;
+} OPEN_PART;
+
+static void *copy(const char *data, size_t length) {
+    void *p = malloc(length + 1);
+    if (p != NULL) {
+        memcpy(p, data, length);
+        ((char *)p)[length] = '\0';
+    }
+    return p;
+}
+
+// Restore one entry into the mailbox of its recipient
+static void restore_entry(MAILBOX *mb, SNAP_ENTRY *rec, const char *from, const char *body) {
+    if (rec->type == MESSAGE_ENTRY_TYPE) {
+        char *sender_handle = rec->from_length > 0 ? copy(from, rec->from_length) : NULL;
+        CLIENT *sender = sender_handle != NULL ? creg_lookup(client_registry, sender_handle) : NULL;
+        MAILBOX *from_mb = sender != NULL ? client_get_mailbox(sender, 0) : NULL;
+        void *data = rec->body_length > 0 ? copy(body, rec->body_length) : NULL;
+        if (rec->part != WHOLE_MESSAGE) {
+            mb_add_part(mb, rec->msgid, from_mb, data, rec->body_length, rec->part, rec->urgent);
+        } else {
+            mb_add_timed_message(mb, rec->msgid, from_mb, data, rec->body_length,
+                                 rec->urgent, rec->ttl <= INT_MAX ? rec->ttl : 0);
+        }
+        if (from_mb != NULL) {
+            mb_unref(from_mb, "Restored message");
+        }
+        if (sender != NULL) {
+            client_unref(sender, "Restored message");
+        }
+        free(sender_handle);
+    } else if (rec->body_length > 0) {
+        // A batch of receipts, whose msgids are the body
+        for (size_t i = 0; i + sizeof(int) <= rec->body_length; i += sizeof(int)) {
+            int msgid;
+            memcpy(&msgid, body + i, sizeof(int));
+            mb_add_notice(mb, rec->notice_type, msgid);
+        }
+    } else {
+        mb_add_notice(mb, rec->notice_type, rec->msgid);
+    }
+}
+
+void snap_claim(char *handle, MAILBOX *mb) {
+    pthread_mutex_lock(&mutex);
+    int i = map == NULL || handed_off ? -1 : find_user(handle, strlen(handle));
+    if (i < 0 || claimed[i]) {
+        pthread_mutex_unlock(&mutex);
+        return;
+    }
+    claimed[i] = 1;
+    SNAP_USER *u = &table[i];
+    OPEN_PART *open = NULL;
+    int nopen = 0;
+    uint64_t offset = u->entries;
+    uint32_t n = 0;
+    if (in_map(u->entries, u->entries_length)) {
+        uint64_t end = u->entries + u->entries_length;
+        for (; n < u->nentries && end - offset >= sizeof(SNAP_ENTRY); n++) {
+            SNAP_ENTRY *rec = (SNAP_ENTRY *)(map + offset);
+            uint64_t length = (uint64_t)rec->from_length + rec->body_length;
+            if (end - offset - sizeof(SNAP_ENTRY) < length || rec->type > NOTICE_ENTRY_TYPE
+                || rec->part > ABORTED_PART) {
+                break;
+            }
+            char *from = (char *)(rec + 1);
+            restore_entry(mb, rec, from, from + rec->from_length);
+            offset += sizeof(SNAP_ENTRY) + length + PAD8(length);
+            if (rec->type != MESSAGE_ENTRY_TYPE || rec->part == WHOLE_MESSAGE) {
+                continue;
+            }
+            // Keep track of the messages in parts that are not complete
+            int k = 0;
+            while (k < nopen && open[k].msgid != rec->msgid) {
+                k++;
+            }
+            if (rec->part == LAST_PART || rec->part == ABORTED_PART) {
+                if (k < nopen) {
+                    open[k] = open[--nopen];
+                }
+            } else if (k == nopen) {
+                OPEN_PART *p = realloc(open, (nopen + 1) * sizeof(OPEN_PART));
+                if (p != NULL) {
+                    open = p;
+                    open[nopen].msgid = rec->msgid;
+                    open[nopen++].urgent = rec->urgent;
+                }
+            }
+        }
+    }
+    // The rest of those messages will never arrive
+    for (int k = 0; k < nopen; k++) {
+        mb_add_part(mb, open[k].msgid, NULL, NULL, 0, ABORTED_PART, open[k].urgent);
+    }
+    free(open);
+    pthread_mutex_unlock(&mutex);
+    debug("Restored %u entries for %s from the snapshot", n, handle);
+}
+
+/*
+ * Saving.
+ */
+
+// A user being written, with the handle for sorting the table
+typedef struct snap_slot {
+    SNAP_USER user;
+    const char *name;
+} SNAP_SLOT;
+
+typedef struct snap_writer {
+    FILE *f;
+    uint64_t offset;
+    int err;
+    SNAP_SLOT *slots;
+    int nusers;
+    int capacity;
+    unsigned long nentries;
+} SNAP_WRITER;
+
+static void write_bytes(SNAP_WRITER *w, const void *data, size_t length) {
+    if (!w->err && length > 0 && fwrite(data, 1, length, w->f) != length) {
+        w->err = 1;
+    }
+    w->offset += length;
+}
+
+static void write_pad(SNAP_WRITER *w) {
+    static const char zeros[8];
+    write_bytes(w, zeros, PAD8(w->offset));
+}
+
+// Start the record of a user, whose entries are to follow
+static int begin_user(SNAP_WRITER *w, const char *handle, size_t length) {
+    if (w->nusers == w->capacity) {
+        int capacity = w->capacity == 0 ? 64 : w->capacity * 2;
+        SNAP_SLOT *slots = realloc(w->slots, capacity * sizeof(SNAP_SLOT));
+        if (slots == NULL) {
+            w->err = 1;
+            return -1;
+        }
+        w->slots = slots;
+        w->capacity = capacity;
+    }
+    SNAP_SLOT *slot = &w->slots[w->nusers++];
+    memset(slot, 0, sizeof(*slot));
+    slot->name = handle;
+    slot->user.handle = w->offset;
+    slot->user.handle_length = length;
+    write_bytes(w, handle, length);
+    write_pad(w);
+    slot->user.entries = w->offset;
+    return 0;
+}
+
+static void end_user(SNAP_WRITER *w) {
+    SNAP_USER *u = &w->slots[w->nusers - 1].user;
+    u->entries_length = w->offset - u->entries;
+    w->nentries += u->nentries;
+}
+
+// Write one mailbox entry of the last user begun
+static void write_entry(MAILBOX_ENTRY *entry, void *arg) {
+    SNAP_WRITER *w = arg;
+    SNAP_ENTRY rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.type = entry->type;
+    char *from = NULL;
+    void *body = NULL;
+    if (entry->type == MESSAGE_ENTRY_TYPE) {
+        MESSAGE *msg = &entry->content.message;
+        rec.msgid = msg->msgid;
+        rec.urgent = msg->urgent;
+        rec.part = msg->part;
+        rec.ttl = msg->ttl;
+        from = msg->from != NULL ? mb_get_handle(msg->from) : NULL;
+        rec.from_length = from != NULL ? strlen(from) : 0;
+        body = msg->body;
+        rec.body_length = body != NULL ? msg->length : 0;
+    } else {
+        // The msgids of a batch of receipts are the body
+        rec.msgid = entry->content.notice.msgid;
+        rec.notice_type = entry->content.notice.type;
+        body = entry->content.notice.msgids;
+        rec.body_length = entry->content.notice.count * sizeof(int);
+    }
+    write_bytes(w, &rec, sizeof(rec));
+    write_bytes(w, from, rec.from_length);
+    write_bytes(w, body, rec.body_length);
+    write_pad(w);
+    w->slots[w->nusers - 1].user.nentries++;
+}
+
+static int compare_slots(const void *a, const void *b) {
+    const SNAP_SLOT *x = a;
+    const SNAP_SLOT *y = b;
+    return compare_handles(x->name, x->user.handle_length, y->name, y->user.handle_length);
+}
+
+// Check whether a handle is among the first users written, once sorted
+static int written(SNAP_WRITER *w, int count, const char *handle, size_t length) {
+    SNAP_SLOT key;
+    key.name = handle;
+    key.user.handle_length = length;
+    return bsearch(&key, w->slots, count, sizeof(SNAP_SLOT), compare_slots) != NULL;
+}
+
+// Write the users who are logged in, with their mailboxes
+static CLIENT **write_mailboxes(SNAP_WRITER *w) {
+    CLIENT **clients = creg_all_clients(client_registry);
+    if (clients == NULL) {
+        w->err = 1;
+        return NULL;
+    }
+    for (CLIENT **cp = clients; *cp != NULL && !w->err; cp++) {
+        MAILBOX *mb = client_get_mailbox(*cp, 0);
+        if (mb == NULL) {
+            continue;
+        }
+        // The handle lives as long as the mailbox is held
+        char *handle = mb_get_handle(mb);
+        if (begin_user(w, handle, strlen(handle)) == 0) {
+            mb_foreach(mb, write_entry, w);
+            end_user(w);
+        }
+        mb_unref(mb, "Snapshot taken");
+    }
+    return clients;
+}
+
+// Write the users of the loaded snapshot who have not claimed their
+// entries and are not among those already written.  Called with the
+// mutex held.
+static void write_unclaimed(SNAP_WRITER *w) {
+    int count = w->nusers;
+    qsort(w->slots, count, sizeof(SNAP_SLOT), compare_slots);
+    for (uint32_t i = 0; i < nusers && !w->err; i++) {
+        SNAP_USER *old = &table[i];
+        if (claimed[i] || !in_map(old->handle, old->handle_length)
+            || !in_map(old->entries, old->entries_length)
+            || written(w, count, map + old->handle, old->handle_length)) {
+            continue;
+        }
+        if (begin_user(w, map + old->handle, old->handle_length) == 0) {
+            write_bytes(w, map + old->entries, old->entries_length);
+            w->slots[w->nusers - 1].user.nentries = old->nentries;
+            end_user(w);
+        }
+    }
+}
+
+int snap_save(int mailboxes) {
+    if (snap_path == NULL) {
+        return -1;
+    }
+    pthread_mutex_lock(&save_mutex);
+    if (handed_off) {
+        pthread_mutex_unlock(&save_mutex);
+        return -1;
+    }
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", snap_path);
+    SNAP_WRITER w;
+    memset(&w, 0, sizeof(w));
+    if ((w.f = fopen(tmp, "w")) == NULL) {
+        pthread_mutex_unlock(&save_mutex);
+        error("Could not create snapshot %s", tmp);
+        return -1;
+    }
+    SNAP_HEADER hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, SNAP_MAGIC, 8);
+    hdr.version = SNAP_VERSION;
+    hdr.time = time(NULL);
+    write_bytes(&w, &hdr, sizeof(hdr));
+
+    CLIENT **clients = mailboxes ? write_mailboxes(&w) : NULL;
+    pthread_mutex_lock(&mutex);
+    if (map != NULL) {
+        write_unclaimed(&w);
+    }
+    if (!mailboxes) {
+        handed_off = 1;
+    }
+    qsort(w.slots, w.nusers, sizeof(SNAP_SLOT), compare_slots);
+    write_pad(&w);
+    hdr.users = w.offset;
+    hdr.nusers = w.nusers;
+    for (int i = 0; i < w.nusers; i++) {
+        write_bytes(&w, &w.slots[i].user, sizeof(SNAP_USER));
+    }
+    pthread_mutex_unlock(&mutex);
+    if (clients != NULL) {
+        for (CLIENT **cp = clients; *cp != NULL; cp++) {
+            client_unref(*cp, "Snapshot taken");
+        }
+        free(clients);
+    }
+
+    hdr.size = w.offset;
+    if (!w.err && (fseek(w.f, 0, SEEK_SET) || fwrite(&hdr, sizeof(hdr), 1, w.f) != 1
+                   || fflush(w.f) || fsync(fileno(w.f)))) {
+        w.err = 1;
+    }
+    if (fclose(w.f) || w.err || rename(tmp, snap_path)) {
+        unlink(tmp);
+        w.err = 1;
+    }
+    free(w.slots);
+    pthread_mutex_unlock(&save_mutex);
+    if (w.err) {
+        error("Could not write snapshot %s", snap_path);
+        return -1;
+    }
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    info("Snapshot of %u users and %lu entries written in %ld us", hdr.nusers, w.nentries,
+         (long)((end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000));
+    return 0;
+}
+
+/*
+ * Periodic snapshots.
+ */
+
+static void *snap_thread(void *arg) {
+    (void)arg;
+    place_thread(PLACE_WORKER);
+    pthread_mutex_lock(&run_mutex);
+    while (running) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += snap_interval;
+        while (running && pthread_cond_timedwait(&run_cond, &run_mutex, &ts) != ETIMEDOUT) {
+        }
+        if (!running) {
+            break;
+        }
+        pthread_mutex_unlock(&run_mutex);
+        snap_save(1);
+        pthread_mutex_lock(&run_mutex);
+    }
+    pthread_mutex_unlock(&run_mutex);
+    return NULL;
+}
+
+int snap_init(char *path, int interval) {
+    if ((snap_path = strdup(path)) == NULL) {
+        return -1;
+    }
+    load();
+    snap_interval = interval;
+    if (interval > 0) {
+        running = 1;
+        if (pthread_create(&snap_tid, NULL, snap_thread, NULL)) {
+            running = 0;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void snap_fini(void) {
+    pthread_mutex_lock(&run_mutex);
+    int was_running = running;
+    running = 0;
+    pthread_cond_broadcast(&run_cond);
+    pthread_mutex_unlock(&run_mutex);
+    if (was_running) {
+        pthread_join(snap_tid, NULL);
+    }
+    pthread_mutex_lock(&mutex);
+    if (map != NULL) {
+        munmap(map, map_size);
+        map = NULL;
+    }
+    free(claimed);
+    claimed = NULL;
+    nusers = 0;
+    pthread_mutex_unlock(&mutex);
+}
@@ -0,0 +1,205 @@
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include "timer.h"
+#include "placement.h"
+#include "debug.h"
+
+#define TW_MASK (TW_SLOTS - 1)
+#define TW_RANGE (1ULL << (TW_BITS * TW_LEVELS)) // Ticks covered by all wheels
+
+static struct wheel {
+    pthread_mutex_t mutex; // Protects everything below and every TIMER
+    pthread_cond_t cond; // Signaled when a timer is added, a callback
+                         // returns, or the thread is asked to stop
+    pthread_t tid;
+    int started;
+    int stop;
+    uint64_t jiffies; // Last tick processed
+    size_t count; // Number of pending timers
+    TIMER *running; // Timer whose callback is running, if any
+    TIMER *slots[TW_LEVELS][TW_SLOTS];
+} wheel = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+uint64_t tw_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// The current tick, from the monotonic clock
+static uint64_t current_tick(void) {
+    return tw_now() / TW_TICK_MS;
+}
+
+// Put a timer in the slot that matches its expiry; the wheel must be locked
+static void enqueue(TIMER *timer) {
+    uint64_t delta = timer->expires - wheel.jiffies;
+    if (delta >= TW_RANGE) {
+        timer->expires = wheel.jiffies + TW_RANGE - 1;
+        delta = TW_RANGE - 1;
+    }
+    int level = 0;
+    while (delta >= 1ULL << (TW_BITS * (level + 1))) {
+        level++;
+    }
+    TIMER **slot = &wheel.slots[level][(timer->expires >> (TW_BITS * level)) & TW_MASK];
+    timer->next = *slot;
+    if (*slot != NULL) {
+        (*slot)->pprev = &timer->next;
+    }
+    timer->pprev = slot;
+    *slot = timer;
+}
+
+// Take a timer out of its slot; the wheel must be locked
+static void dequeue(TIMER *timer) {
+    *timer->pprev = timer->next;
+    if (timer->next != NULL) {
+        timer->next->pprev = timer->pprev;
+    }
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+// Move the timers of a slot in a higher wheel down to the lower wheels
+static void cascade(int level, int index) {
+    TIMER *timer = wheel.slots[level][index];
+    wheel.slots[level][index] = NULL;
+    while (timer != NULL) {
+        TIMER *next = timer->next;
+        enqueue(timer);
+        timer = next;
+    }
+}
+
+// Advance the wheels by one tick and run the timers that expire
+static void advance(void) {
+    uint64_t tick = ++wheel.jiffies;
+    // Higher wheels first, so that their timers can cascade further down
+    for (int level = TW_LEVELS - 1; level > 0; level--) {
+        if ((tick & ((1ULL << (TW_BITS * level)) - 1)) == 0) {
+            cascade(level, (tick >> (TW_BITS * level)) & TW_MASK);
+        }
+    }
+
+    // Timers scheduled by callbacks never land in the current slot
+    TIMER **slot = &wheel.slots[0][tick & TW_MASK];
+    while (*slot != NULL) {
+        TIMER *timer = *slot;
+        dequeue(timer);
+        timer->pending = 0;
+        wheel.count--;
+        wheel.running = timer;
+        pthread_mutex_unlock(&wheel.mutex);
+        timer->fn(timer->arg);
+        pthread_mutex_lock(&wheel.mutex);
+        wheel.running = NULL;
+        pthread_cond_broadcast(&wheel.cond);
+    }
+}
+
+// Thread function that runs the timer wheel
+static void *wheel_thread(void *arg) {
+    (void)arg;
+    place_thread(PLACE_WORKER);
+    pthread_mutex_lock(&wheel.mutex);
+    while (!wheel.stop) {
+        if (wheel.count == 0) {
+            // Nothing to do until a timer is scheduled
+            pthread_cond_wait(&wheel.cond, &wheel.mutex);
+            continue;
+        }
+        uint64_t now = current_tick();
+        while (wheel.jiffies < now) {
+            advance();
+        }
+
+        // Sleep until the next tick
+        uint64_t next = (wheel.jiffies + 1) * TW_TICK_MS;
+        struct timespec ts = { next / 1000, (next % 1000) * 1000000 };
+        pthread_cond_timedwait(&wheel.cond, &wheel.mutex, &ts);
+    }
+    pthread_mutex_unlock(&wheel.mutex);
+    return NULL;
+}
+
+int tw_init(void) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&wheel.cond, &attr);
+    pthread_condattr_destroy(&attr);
+    wheel.jiffies = current_tick();
+    if (pthread_create(&wheel.tid, NULL, wheel_thread, NULL)) {
+        return -1;
+    }
+    wheel.started = 1;
+    debug("Timer wheel started");
+    return 0;
+}
+
+void tw_fini(void) {
+    if (!wheel.started) {
+        return;
+    }
+    pthread_mutex_lock(&wheel.mutex);
+    wheel.stop = 1;
+    pthread_cond_broadcast(&wheel.cond);
+    pthread_mutex_unlock(&wheel.mutex);
+    pthread_join(wheel.tid, NULL);
+    wheel.started = 0;
+}
+
+void tw_timer_init(TIMER *timer, void (*fn)(void *), void *arg) {
+    timer->next = NULL;
+    timer->pprev = NULL;
+    timer->expires = 0;
+    timer->pending = 0;
+    timer->fn = fn;
+    timer->arg = arg;
+}
+
+void tw_schedule(TIMER *timer, uint64_t ms) {
+    uint64_t ticks = (ms + TW_TICK_MS - 1) / TW_TICK_MS;
+    uint64_t now = current_tick();
+    pthread_mutex_lock(&wheel.mutex);
+    if (timer->pending) {
+        dequeue(timer);
+    } else {
+        timer->pending = 1;
+        if (wheel.count++ == 0) {
+            // The wheel was empty, so it can skip the ticks it slept through
+            if (now > wheel.jiffies && wheel.running == NULL) {
+                wheel.jiffies = now;
+            }
+            pthread_cond_signal(&wheel.cond);
+        }
+    }
+    // The wheel may lag behind the clock, but never runs ahead of it.  The
+    // current tick has partly elapsed, so count from the next one.
+    timer->expires = (now > wheel.jiffies ? now : wheel.jiffies) + ticks + 1;
+    enqueue(timer);
+    pthread_mutex_unlock(&wheel.mutex);
+}
+
+int tw_cancel(TIMER *timer) {
+    int pending = 0;
+    pthread_mutex_lock(&wheel.mutex);
+    while (1) {
+        if (timer->pending) {
+            dequeue(timer);
+            timer->pending = 0;
+            wheel.count--;
+            pending = 1;
+        }
+        // Wait for a running callback, unless this is that callback, and
+        // then cancel the timer again in case the callback rescheduled it
+        if (wheel.running != timer || pthread_equal(pthread_self(), wheel.tid)) {
+            break;
+        }
+        pthread_cond_wait(&wheel.cond, &wheel.mutex);
+    }
+    pthread_mutex_unlock(&wheel.mutex);
+    return pending;
+}
@@ -1,27 +1,30 @@
 #include <stdlib.h>
 #include <string.h>
 #include "user.h"
+#include "intern.h"
+#include "slab.h"
 #include <debug.h>
 
 struct user {
-    char *handle;  // The handle of the user
+    char *handle;  // The interned handle of the user
     int ref_count; // Reference count for the user object
 };
 
+SLAB_POOL_DEFINE(user_pool, USER)
+
 USER *user_create(char *handle) {
     if (handle == NULL) {
         return NULL;
     }
     // Allocate memory for the user object
-    USER *user = (USER *)malloc(sizeof(USER));
+    USER *user = slab_alloc(&user_pool);
     if (user == NULL) {
         return NULL;
     }
-    // Allocate memory for the handle and copy it
-    user->handle = strdup(handle);
+    // Share the interned copy of the handle
+    user->handle = intern_handle(handle);
     if (user->handle == NULL) {
-        free(user->handle);
-        free(user);
+        slab_free(&user_pool, user);
         return NULL;
     }
 
@@ -44,8 +47,8 @@ void user_unref(USER *user, char *why) {
         if (user->ref_count == 0) {
             // Free the handle and user object
             debug("Free User");
-            free(user->handle);
-            free(user);
+            intern_unref(user->handle);
+            slab_free(&user_pool, user);
         }
     }
 }
@@ -5,13 +5,16 @@
 #include "globals.h"
 #include "debug.h"
 #include "user.h"
+#include "intern.h"
+#include "slab.h"
 
 typedef struct user_registry_entry {
-    char *handle;
-    USER *user;
+    USER *user; // The user's interned handle serves as the key
     struct user_registry_entry *next;
 } USER_REGISTRY_ENTRY;
 
+SLAB_POOL_DEFINE(entry_pool, USER_REGISTRY_ENTRY)
+
 struct user_registry {
     USER_REGISTRY_ENTRY *head;
     pthread_mutex_t mutex;
@@ -43,10 +46,8 @@ void ureg_fini(USER_REGISTRY *ureg) {
     USER_REGISTRY_ENTRY *current = ureg->head;
     while (current != NULL) {
         USER_REGISTRY_ENTRY *next = current->next;
-        free(current->handle);
-        free(user_get_handle(current->user));
-        free(current->user);
-        free(current);
+        user_unref(current->user, "Finalizing registry");
+        slab_free(&entry_pool, current);
         current = next;
     }
 
@@ -67,20 +68,33 @@ USER *ureg_register(USER_REGISTRY *ureg, char *handle) {
     // Lock the mutex before accessing the registry
     pthread_mutex_lock(&ureg->mutex);
 
+    // Interned handles are equal exactly when they are the same pointer.
+    // The handle is interned, rather than just looked up, with the registry
+    // locked, so that concurrent first registrations of a handle find the
+    // same copy and only one of them creates a user.
+    char *key = intern_handle(handle);
+    if (key == NULL) {
+        pthread_mutex_unlock(&ureg->mutex);
+        return NULL;
+    }
+
     // Check if the handle is already registered
     USER_REGISTRY_ENTRY *current = ureg->head;
     while (current != NULL) {
-        if (strcmp(current->handle, handle) == 0) {
+        if (user_get_handle(current->user) == key) {
             // Increment the reference count and return the existing user
+            USER *user = user_ref(current->user, "Register existing user");
             pthread_mutex_unlock(&ureg->mutex);
-            return user_ref(current->user, "Register existing user");
+            intern_unref(key);
+            return user;
         }
         current = current->next;
     }
     debug("No user with this handle exists");
 
     // Create a new user object
-    USER *new_user = user_create(handle);
+    USER *new_user = user_create(key);
+    intern_unref(key);
     if (new_user == NULL) {
         pthread_mutex_unlock(&ureg->mutex);
         return NULL; // Failed to create a new user
@@ -88,12 +102,12 @@ USER *ureg_register(USER_REGISTRY *ureg, char *handle) {
     debug("User created");
 
     // Create a new entry for the registry
-    USER_REGISTRY_ENTRY *new_entry = (USER_REGISTRY_ENTRY *)malloc(sizeof(USER_REGISTRY_ENTRY));
+    USER_REGISTRY_ENTRY *new_entry = slab_alloc(&entry_pool);
     if (new_entry == NULL) {
+        user_unref(new_user, "Registry entry allocation failed");
         pthread_mutex_unlock(&ureg->mutex);
         return NULL; // Memory allocation failed
     }
-    new_entry->handle = strdup(handle);
     new_entry->user = new_user;
 
     debug("Entry made");
@@ -104,9 +118,10 @@ USER *ureg_register(USER_REGISTRY *ureg, char *handle) {
     debug("Links made");
 
     // Unlock the mutex and return the new user
+    USER *user = user_ref(new_entry->user, "New user: Pointer that is returned");
     pthread_mutex_unlock(&ureg->mutex);
     debug("User registered");
-    return user_ref(new_entry->user, "New user: Pointer that is returned");;
+    return user;
 }
 
 void ureg_unregister(USER_REGISTRY *ureg, char *handle) {
@@ -114,6 +129,12 @@ void ureg_unregister(USER_REGISTRY *ureg, char *handle) {
         return; // Invalid arguments
     }
 
+    // A handle that is not interned cannot be registered
+    char *key = intern_lookup(handle);
+    if (key == NULL) {
+        return;
+    }
+
     // Lock the mutex before accessing the registry
     pthread_mutex_lock(&ureg->mutex);
 
@@ -121,7 +142,7 @@ void ureg_unregister(USER_REGISTRY *ureg, char *handle) {
     USER_REGISTRY_ENTRY *prev = NULL;
     USER_REGISTRY_ENTRY *current = ureg->head;
     while (current != NULL) {
-        if (strcmp(current->handle, handle) == 0) {
+        if (user_get_handle(current->user) == key) {
             // Found the entry, unlink it from the registry
             if (prev == NULL) {
                 ureg->head = current->next;
@@ -131,11 +152,11 @@ void ureg_unregister(USER_REGISTRY *ureg, char *handle) {
 
             // Free resources associated with the entry
             user_unref(current->user, "Unregister");
-            free(current->handle);
-            free(current);
+            slab_free(&entry_pool, current);
 
             // Unlock the mutex and return
             pthread_mutex_unlock(&ureg->mutex);
+            intern_unref(key);
             return;
         }
         prev = current;
@@ -144,4 +165,5 @@ void ureg_unregister(USER_REGISTRY *ureg, char *handle) {
 
     // Unlock the mutex if the handle was not found
     pthread_mutex_unlock(&ureg->mutex);
+    intern_unref(key);
 }
\ No newline at end of file
@@ -5,6 +5,27 @@
 #include <fcntl.h>
 #include <signal.h>
 #include <wait.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <poll.h>
+#include <dirent.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <pwd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "protocol.h"
+#include "shm.h"
+#include "log.h"
 
 static void init() {
 #ifndef NO_SERVER
@@ -28,6 +49,229 @@ void *system_thread(void *arg) {
     return (void *)ret;
 }
 
+/*
+ * The behaviour tests below each start a server of their own, on a port of
+ * their own, and talk to it in packets rather than through util/client.
+ */
+
+#define REPLY_TIMEOUT 5000 // Milliseconds to wait for a packet from the server
+
+/*
+ * Connect to the server on a port of this host, or return -1.
+ */
+static int connect_port(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port) };
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+	close(fd);
+	return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+/*
+ * Start bin/charla with "-p <port>" and the NULL-terminated arguments that
+ * follow, and wait until it accepts connections.  With a port of 0, the
+ * server is not waited for.
+ */
+static pid_t start_server(int port, ...) {
+    char *argv[32];
+    char port_str[16];
+    int argc = 0;
+    argv[argc++] = "charla";
+    if(port > 0) {
+	snprintf(port_str, sizeof(port_str), "%d", port);
+	argv[argc++] = "-p";
+	argv[argc++] = port_str;
+    }
+    va_list ap;
+    va_start(ap, port);
+    while(argc < 31 && (argv[argc] = va_arg(ap, char *)) != NULL)
+	argc++;
+    va_end(ap);
+    argv[argc] = NULL;
+
+    pid_t pid = fork();
+    if(pid == 0) {
+	execv("bin/charla", argv);
+	fprintf(stderr, "Failed to exec server\n");
+	abort();
+    }
+    cr_assert_gt(pid, 0, "Could not fork server");
+    for(int i = 0; port > 0 && i < 100; i++) {
+	int fd = connect_port(port);
+	if(fd >= 0) {
+	    close(fd);
+	    return pid;
+	}
+	usleep(50000);
+    }
+    if(port > 0) {
+	kill(pid, SIGKILL);
+	cr_assert_fail("Server did not start on port %d", port);
+    }
+    return pid;
+}
+
+/*
+ * Wait for a server to exit, killing it if it takes more than a few
+ * seconds, and return its wait() status.
+ */
+static int reap_server(pid_t pid) {
+    int status = 0;
+    for(int i = 0; i < 50; i++) {
+	if(waitpid(pid, &status, WNOHANG) == pid)
+	    return status;
+	usleep(100000);
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, &status, 0);
+    return status;
+}
+
+/*
+ * Stop a server with SIGHUP and check that it exited normally.
+ */
+static void stop_server(pid_t pid) {
+    kill(pid, SIGHUP);
+    int status = reap_server(pid);
+    cr_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0,
+	      "Server did not exit normally after SIGHUP (status 0x%x)", status);
+}
+
+/*
+ * Send a packet, header and payload in one write.
+ */
+static void send_packet(int fd, int type, int flags, uint32_t msgid, void *payload, size_t length) {
+    char *buf = malloc(sizeof(CHLA_PACKET_HEADER) + length);
+    CHLA_PACKET_HEADER *hdr = (CHLA_PACKET_HEADER *)buf;
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->type = type;
+    hdr->flags = flags;
+    hdr->payload_length = htonl(length);
+    hdr->msgid = htonl(msgid);
+    if(length > 0)
+	memcpy(buf + sizeof(*hdr), payload, length);
+    size_t done = 0;
+    while(done < sizeof(*hdr) + length) {
+	ssize_t n = send(fd, buf + done, sizeof(*hdr) + length - done, MSG_NOSIGNAL);
+	if(n <= 0)
+	    break;
+	done += n;
+    }
+    free(buf);
+}
+
+/*
+ * Read exactly len bytes, giving up after the timeout.
+ */
+static int read_fully(int fd, void *buf, size_t len, int timeout) {
+    char *p = buf;
+    while(len > 0) {
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	if(poll(&pfd, 1, timeout) <= 0)
+	    return -1;
+	ssize_t n = read(fd, p, len);
+	if(n <= 0)
+	    return -1;
+	p += n;
+	len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Receive the next packet, with its payload NUL-terminated in a buffer
+ * the caller frees.  Returns the type of the packet, or -1 if none came
+ * within the timeout or the connection was closed.
+ */
+static int recv_packet(int fd, CHLA_PACKET_HEADER *hdr, char **payload, int timeout) {
+    *payload = NULL;
+    if(read_fully(fd, hdr, sizeof(*hdr), timeout))
+	return -1;
+    size_t length = ntohl(hdr->payload_length);
+    *payload = calloc(length + 1, 1);
+    if(length > 0 && read_fully(fd, *payload, length, timeout)) {
+	free(*payload);
+	*payload = NULL;
+	return -1;
+    }
+    return hdr->type;
+}
+
+/*
+ * Wait for a packet of a given type, and a given msgid unless it is -1,
+ * skipping other packets.  Returns 0 and the packet if it came.
+ */
+static int await_packet(int fd, int type, long msgid, CHLA_PACKET_HEADER *hdr, char **payload) {
+    CHLA_PACKET_HEADER tmp;
+    char *data;
+    if(hdr == NULL)
+	hdr = &tmp;
+    while(recv_packet(fd, hdr, &data, REPLY_TIMEOUT) >= 0) {
+	if(hdr->type == type && (msgid < 0 || ntohl(hdr->msgid) == msgid)) {
+	    if(payload != NULL)
+		*payload = data;
+	    else
+		free(data);
+	    return 0;
+	}
+	free(data);
+    }
+    return -1;
+}
+
+/*
+ * Send a request and wait for its ACK or NACK, skipping other packets.
+ * Returns the type of the reply, or -1 if none came; the header and
+ * payload of the reply are returned if asked for.
+ */
+static int request(int fd, int type, int flags, uint32_t msgid, char *payload, size_t length,
+		   CHLA_PACKET_HEADER *reply, char **data) {
+    CHLA_PACKET_HEADER tmp;
+    char *buf;
+    if(reply == NULL)
+	reply = &tmp;
+    send_packet(fd, type, flags, msgid, payload, length);
+    while(recv_packet(fd, reply, &buf, REPLY_TIMEOUT) >= 0) {
+	if((reply->type == CHLA_ACK_PKT || reply->type == CHLA_NACK_PKT)
+	   && ntohl(reply->msgid) == msgid) {
+	    if(data != NULL)
+		*data = buf;
+	    else
+		free(buf);
+	    return reply->type;
+	}
+	free(buf);
+    }
+    return -1;
+}
+
+/*
+ * Log in under a handle, and check that the login was ACKed.
+ */
+static void login(int fd, char *handle) {
+    int ret = request(fd, CHLA_LOGIN_PKT, 0, 1, handle, strlen(handle), NULL, NULL);
+    cr_assert_eq(ret, CHLA_ACK_PKT, "Login of %s was not ACKed", handle);
+}
+
+/*
+ * Send a message whose payload is "receiver\r\nbody", and return the type
+ * of the reply and the reply itself if asked for.
+ */
+static int send_message(int fd, int flags, uint32_t msgid, char *to, char *body,
+			CHLA_PACKET_HEADER *reply) {
+    size_t length = strlen(to) + 2 + strlen(body);
+    char *buf = malloc(length + 1);
+    sprintf(buf, "%s\r\n%s", to, body);
+    int ret = request(fd, CHLA_SEND_PKT, flags, msgid, buf, length, reply, NULL);
+    free(buf);
+    return ret;
+}
+
 // NOTE: This suite has to be run with sufficient concurrency to allow the
 // tests to all run at the same time (e.g. -j9).
 
@@ -100,3 +344,1531 @@ Test(blackbox_suite, 04_connect_tom, .init = init, .fini = fini, .timeout = 10)
     int ret = system("(echo login tom ; sleep 5 ; echo send carol hello; sleep 1) | util/client -p 9999");
     cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
 }
+
+Test(blackbox_suite, 49_credit_stall_and_busy, .timeout = 30) {
+    pid_t pid = start_server(10049, "-b", "200", NULL);
+    int alice = connect_port(10049);
+    int bob = connect_port(10049);
+    login(alice, "alice");
+    login(bob, "bob");
+
+    // With one message of credit, the second message waits for more
+    int ret = request(bob, CHLA_CREDIT_PKT, 0, 2, "1\r\n", 3, NULL, NULL);
+    cr_assert_eq(ret, CHLA_ACK_PKT, "CREDIT was not ACKed");
+    cr_assert_eq(send_message(alice, 0, 2, "bob", "one", NULL), CHLA_ACK_PKT);
+    cr_assert_eq(send_message(alice, 0, 3, "bob", "two", NULL), CHLA_ACK_PKT);
+    char *body;
+    cr_assert_eq(await_packet(bob, CHLA_MESG_PKT, 2, NULL, &body), 0, "First message not delivered");
+    cr_assert_str_eq(body, "alice\r\none");
+    free(body);
+    CHLA_PACKET_HEADER hdr;
+    ret = recv_packet(bob, &hdr, &body, 500);
+    cr_assert_neq(ret, CHLA_MESG_PKT, "Message delivered without credit");
+    free(body);
+    send_packet(bob, CHLA_CREDIT_PKT, 0, 3, "1\r\n", 3);
+    cr_assert_eq(await_packet(bob, CHLA_MESG_PKT, 3, NULL, &body), 0, "Credit did not release message");
+    cr_assert_str_eq(body, "alice\r\ntwo");
+    free(body);
+
+    // Out of credit, messages back up to a bound and are then NACKed as busy
+    size_t length = 100 * 1024;
+    char *big = malloc(length);
+    memset(big, 'x', length);
+    memcpy(big, "bob\r\n", 5);
+    for(int i = 0; i < 2; i++) {
+	ret = request(alice, CHLA_SEND_PKT, 0, 10 + i, big, length, NULL, NULL);
+	cr_assert_eq(ret, CHLA_ACK_PKT, "Message %d within the backlog was not ACKed", i);
+    }
+    ret = request(alice, CHLA_SEND_PKT, 0, 12, big, length, &hdr, NULL);
+    cr_assert_eq(ret, CHLA_NACK_PKT, "Message beyond the backlog was not NACKed");
+    cr_assert(hdr.flags & CHLA_BUSY_FLAG, "NACK was not flagged busy");
+    free(big);
+
+    close(alice);
+    close(bob);
+    stop_server(pid);
+}
+
+Test(blackbox_suite, 44_shed_when_out_of_descriptors, .timeout = 30) {
+    // Start the server with few descriptors to spare
+    struct rlimit saved, low;
+    getrlimit(RLIMIT_NOFILE, &saved);
+    low = saved;
+    low.rlim_cur = 24;
+    setrlimit(RLIMIT_NOFILE, &low);
+    pid_t pid = start_server(0, "-p", "10044", NULL);
+    setrlimit(RLIMIT_NOFILE, &saved);
+    int probe = -1;
+    for(int i = 0; i < 100 && (probe = connect_port(10044)) < 0; i++)
+	usleep(50000);
+    cr_assert_geq(probe, 0, "Server did not start");
+    close(probe);
+
+    // Connections beyond the limit are closed rather than left waiting
+    int fds[64];
+    for(int i = 0; i < 64; i++)
+	fds[i] = connect_port(10044);
+    sleep(2);
+    int closed = 0;
+    for(int i = 0; i < 64; i++) {
+	char c;
+	struct pollfd pfd = { .fd = fds[i], .events = POLLIN };
+	if(fds[i] < 0 || (poll(&pfd, 1, 0) == 1 && read(fds[i], &c, 1) <= 0))
+	    closed++;
+    }
+    cr_assert_gt(closed, 0, "No connection was shed");
+    cr_assert_eq(waitpid(pid, NULL, WNOHANG), 0, "Server exited when out of descriptors");
+
+    // Once descriptors are free again, connections are served
+    for(int i = 0; i < 64; i++)
+	if(fds[i] >= 0)
+	    close(fds[i]);
+    sleep(2);
+    int fd = connect_port(10044);
+    login(fd, "alice");
+    close(fd);
+    stop_server(pid);
+}
+
+Test(blackbox_suite, 50_ttl_bounce, .timeout = 30) {
+    pid_t pid = start_server(10050, NULL);
+    int alice = connect_port(10050);
+    int bob = connect_port(10050);
+    login(alice, "alice");
+    login(bob, "bob");
+
+    // Hold messages for bob, so that they wait in his mailbox
+    cr_assert_eq(request(bob, CHLA_CREDIT_PKT, 0, 2, "0\r\n", 3, NULL, NULL), CHLA_ACK_PKT);
+    cr_assert_eq(send_message(alice, CHLA_EXPIRE_FLAG, 2, "bob", "300\r\nstale", NULL),
+		 CHLA_ACK_PKT, "Message with a lifetime was not ACKed");
+    cr_assert_eq(send_message(alice, 0, 3, "bob", "fresh", NULL), CHLA_ACK_PKT);
+    cr_assert_eq(send_message(alice, CHLA_EXPIRE_FLAG, 4, "bob", "0\r\nnever", NULL),
+		 CHLA_NACK_PKT, "Message with a zero lifetime was not NACKed");
+
+    // The message that outlived its lifetime bounces, and the other stays
+    cr_assert_eq(await_packet(alice, CHLA_BOUNCE_PKT, 2, NULL, NULL), 0, "Expired message did not bounce");
+    send_packet(bob, CHLA_CREDIT_PKT, 0, 3, "2\r\n", 3);
+    CHLA_PACKET_HEADER hdr;
+    char *body;
+    cr_assert_eq(await_packet(bob, CHLA_MESG_PKT, -1, &hdr, &body), 0, "Message was not delivered");
+    cr_assert_eq(ntohl(hdr.msgid), 3, "Expired message %u was delivered", ntohl(hdr.msgid));
+    cr_assert_str_eq(body, "alice\r\nfresh");
+    free(body);
+
+    close(alice);
+    close(bob);
+    stop_server(pid);
+}
+
+Test(blackbox_suite, 33_coroutines_pipelined_replies, .timeout = 30) {
+    pid_t pid = start_server(10033, "-C", "1", "-Q", "8", NULL);
+    int fd = connect_port(10033);
+    // A long handle makes each USERS reply long enough that the replies
+    // fill the connection while requests keep arriving
+    size_t length = 50000;
+    char *handle = malloc(length + 1);
+    memset(handle, 'a', length);
+    handle[length] = '\0';
+    login(fd, handle);
+    int count = 400;
+    for(int i = 0; i < count; i++)
+	send_packet(fd, CHLA_USERS_PKT, 0, 100 + i, NULL, 0);
+    CHLA_PACKET_HEADER hdr;
+    char *payload;
+    int acked = 0;
+    while(acked < count && recv_packet(fd, &hdr, &payload, REPLY_TIMEOUT) >= 0) {
+	if(hdr.type == CHLA_ACK_PKT && ntohl(hdr.payload_length) == length + 1)
+	    acked++;
+	free(payload);
+    }
+    cr_assert_eq(acked, count, "Only %d of %d pipelined requests were answered", acked, count);
+
+    // The scheduler still serves other sessions
+    int bob = connect_port(10033);
+    login(bob, "bob");
+    cr_assert_eq(send_message(bob, 0, 2, handle, "hello", NULL), CHLA_ACK_PKT);
+    cr_assert_eq(await_packet(fd, CHLA_MESG_PKT, 2, NULL, NULL), 0, "Message was not delivered");
+    free(handle);
+    close(fd);
+    close(bob);
+    stop_server(pid);
+}
+
+Test(blackbox_suite, 26_hot_upgrade_hands_off_queued_message, .timeout = 30) {
+    char *path = "/tmp/charla_test_026.sock";
+    unlink(path);
+    pid_t old = start_server(10026, "-u", path, "-W", "500", NULL);
+    int alice = connect_port(10026);
+    int bob = connect_port(10026);
+    int carol = connect_port(10026);
+    cr_assert_eq(request(alice, CHLA_LOGIN_PKT, CHLA_BATCH_FLAG, 1, "alice", 5, NULL, NULL), CHLA_ACK_PKT);
+    login(bob, "bob");
+    login(carol, "carol");
+    cr_assert_eq(request(carol, CHLA_SUBSCRIBE_PKT, 0, 2, NULL, 0, NULL, NULL), CHLA_ACK_PKT);
+
+    // Hold a message for bob in his mailbox in the old process
+    cr_assert_eq(request(bob, CHLA_CREDIT_PKT, 0, 2, "0\r\n", 3, NULL, NULL), CHLA_ACK_PKT);
+    cr_assert_eq(send_message(alice, 0, 2, "bob", "queued", NULL), CHLA_ACK_PKT);
+
+    // With no new process to take over, the old one carries on
+    kill(old, SIGUSR2);
+    cr_assert_eq(request(alice, CHLA_USERS_PKT, 0, 9, NULL, 0, NULL, NULL), CHLA_ACK_PKT,
+		 "Service did not resume after a failed upgrade");
+    cr_assert_eq(waitpid(old, NULL, WNOHANG), 0, "Old server exited after a failed upgrade");
+
+    // Start the new process, and upgrade once it waits for the handoff
+    pid_t new = start_server(0, "-p", "10026", "-u", path, "-r", "-W", "500", NULL);
+    for(int i = 0; i < 100 && access(path, F_OK) < 0; i++)
+	usleep(50000);
+    cr_assert_eq(access(path, F_OK), 0, "New server is not waiting for the handoff");
+    kill(old, SIGUSR2);
+
+    // A request sent meanwhile is served by one process or the other
+    send_packet(alice, CHLA_SEND_PKT, 0, 3, "bob\r\nmeanwhile", 14);
+    int status = reap_server(old);
+    cr_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0,
+	      "Old server did not exit after the handoff (status 0x%x)", status);
+
+    // The new process delivers both, in order, on the same connections.
+    // It gives bob credit again, so it may deliver the first at once.
+    send_packet(bob, CHLA_CREDIT_PKT, 0, 4, "2\r\n", 3);
+    CHLA_PACKET_HEADER hdr;
+    char *body;
+    cr_assert_eq(await_packet(bob, CHLA_MESG_PKT, -1, &hdr, &body), 0, "Queued message was lost");
+    cr_assert_eq(ntohl(hdr.msgid), 2, "Message %u overtook the queued one", ntohl(hdr.msgid));
+    cr_assert_str_eq(body, "alice\r\nqueued");
+    free(body);
+    cr_assert_eq(await_packet(bob, CHLA_MESG_PKT, 3, NULL, &body), 0, "Message sent during the upgrade was lost");
+    cr_assert_str_eq(body, "alice\r\nmeanwhile");
+    free(body);
+    int acked = 0, receipted = 0;
+    while(!(acked && receipted) && recv_packet(alice, &hdr, &body, REPLY_TIMEOUT) >= 0) {
+	acked |= hdr.type == CHLA_ACK_PKT && ntohl(hdr.msgid) == 3;
+	receipted |= hdr.type == CHLA_RCVD_PKT && ntohl(hdr.msgid) == 2;
+	free(body);
+    }
+    cr_assert(acked, "Message sent during the upgrade was not ACKed");
+    cr_assert(receipted, "Queued message was not receipted");
+    cr_assert_eq(request(alice, CHLA_USERS_PKT, 0, 5, NULL, 0, NULL, NULL), CHLA_ACK_PKT,
+		 "New server did not take over the connection");
+
+    // Alice still has her receipts batched
+    for(int i = 0; i < 2; i++)
+	cr_assert_eq(send_message(alice, 0, 6 + i, "carol", "batched", NULL), CHLA_ACK_PKT);
+    cr_assert_eq(await_packet(alice, CHLA_RCVD_PKT, 6, &hdr, NULL), 0, "No receipt came back");
+    cr_assert_eq(ntohl(hdr.payload_length), 2 * sizeof(uint32_t),
+		 "Batched receipts were not kept in the upgrade");
+
+    // The subscription was handed off too
+    int dave = connect_port(10026);
+    login(dave, "dave");
+    cr_assert_eq(await_packet(carol, CHLA_PRESENCE_PKT, -1, NULL, &body), 0,
+		 "Subscription was lost in the upgrade");
+    cr_assert_str_eq(body, "+dave\n");
+    free(body);
+
+    close(alice);
+    close(bob);
+    close(carol);
+    close(dave);
+    stop_server(new);
+    unlink(path);
+}
+
+Test(blackbox_suite, 27_cluster_forwards_only_on_authenticated_links, .timeout = 30) {
+    char *key = "/tmp/charla_test_027.key";
+    FILE *f = fopen(key, "w");
+    cr_assert_not_null(f, "Could not write the cluster secret");
+    fprintf(f, "not so secret\n");
+    fclose(f);
+    char *nodes = "127.0.0.1:10027,127.0.0.1:10127";
+    // Node 0 closes idle connections, after probing them
+    pid_t node0 = start_server(10027, "-c", nodes, "-n", "0", "-K", key, "-k", "1", "-i", "2", NULL);
+    pid_t node1 = start_server(10127, "-c", nodes, "-n", "1", "-K", key, NULL);
+
+    // Each handle must log in at the node that owns it
+    int alice = connect_port(10127);
+    int bob = connect_port(10027);
+    cr_assert_eq(request(bob, CHLA_LOGIN_PKT, 0, 1, "alice", 5, NULL, NULL), CHLA_NACK_PKT,
+		 "Login was accepted at a node that does not own the handle");
+    login(alice, "alice");
+    login(bob, "bob");
+
+    // A client cannot pass itself off as a node
+    int mallory = connect_port(10027);
+    char *forged = "alice\r\nbob\r\nforged";
+    cr_assert_eq(request(mallory, CHLA_FWD_SEND_PKT, 0, 1, forged, strlen(forged), NULL, NULL),
+		 CHLA_NACK_PKT, "FWD_SEND was accepted from a client");
+    cr_assert_eq(request(mallory, CHLA_LINK_PKT, 0, 2, "guess", 5, NULL, NULL), CHLA_NACK_PKT,
+		 "LINK was accepted with the wrong secret");
+    cr_assert_eq(request(mallory, CHLA_FWD_USERS_PKT, 0, 3, NULL, 0, NULL, NULL), CHLA_NACK_PKT,
+		 "FWD_USERS was accepted from a client");
+    cr_assert_eq(request(mallory, CHLA_FWD_USERS_QUERY_PKT, 0, 4, "\r\n0\r\n", 5, NULL, NULL),
+		 CHLA_NACK_PKT, "FWD_USERS_QUERY was accepted from a client");
+    close(mallory);
+
+    // A message is forwarded to the node of the receiver
+    cr_assert_eq(send_message(alice, 0, 2, "bob", "hello", NULL), CHLA_ACK_PKT, "Forwarded SEND was not ACKed");
+    char *body;
+    cr_assert_eq(await_packet(bob, CHLA_MESG_PKT, 2, NULL, &body), 0, "Forwarded message was not delivered");
+    cr_assert_str_eq(body, "alice\r\nhello");
+    free(body);
+
+    // USERS lists the users of both nodes
+    char *users;
+    cr_assert_eq(request(alice, CHLA_USERS_PKT, 0, 3, NULL, 0, NULL, &users), CHLA_ACK_PKT);
+    cr_assert(strstr(users, "alice") != NULL && strstr(users, "bob") != NULL, "Merged users: %s", users);
+    free(users);
+
+    // USERS_QUERY pages through the users of both nodes in sorted order
+    cr_assert_eq(request(alice, CHLA_USERS_QUERY_PKT, 0, 4, "\r\n0\r\n", 5, NULL, &users), CHLA_ACK_PKT);
+    cr_assert_str_eq(users, "alice\nbob\n", "Users of other nodes were not queried");
+    free(users);
+    cr_assert_eq(request(alice, CHLA_USERS_QUERY_PKT, 0, 5, "\r\n1\r\n", 5, NULL, &users), CHLA_ACK_PKT);
+    cr_assert_str_eq(users, "alice\n");
+    free(users);
+    cr_assert_eq(request(alice, CHLA_USERS_QUERY_PKT, 0, 6, "\r\n1\r\nalice", 10, NULL, &users), CHLA_ACK_PKT);
+    cr_assert_str_eq(users, "bob\n", "Second page was not merged");
+    free(users);
+
+    // Let node 0 probe the link, and then close it for being idle,
+    // while bob keeps his own session alive
+    for(int i = 0; i < 4; i++) {
+	usleep(750000);
+	cr_assert_eq(request(bob, CHLA_PING_PKT, 0, 10 + i, NULL, 0, NULL, NULL), CHLA_ACK_PKT);
+    }
+    cr_assert_eq(send_message(alice, 0, 4, "bob", "again", NULL), CHLA_ACK_PKT,
+		 "SEND failed after the link was closed for being idle");
+    cr_assert_eq(await_packet(bob, CHLA_MESG_PKT, 4, NULL, &body), 0, "Message was not delivered over a new link");
+    cr_assert_str_eq(body, "alice\r\nagain");
+    free(body);
+
+    close(alice);
+    close(bob);
+    stop_server(node0);
+    stop_server(node1);
+    unlink(key);
+}
+
+Test(blackbox_suite, 27_cluster_forwards_both_ways_under_coroutines, .timeout = 30) {
+    char *key = "/tmp/charla_test_027b.key";
+    FILE *f = fopen(key, "w");
+    cr_assert_not_null(f, "Could not write the cluster secret");
+    fprintf(f, "not so secret\n");
+    fclose(f);
+    // Each node runs every session, links included, on one scheduler thread
+    char *nodes = "127.0.0.1:10227,127.0.0.1:10327";
+    pid_t node0 = start_server(10227, "-c", nodes, "-n", "0", "-K", key, "-C", "1", NULL);
+    pid_t node1 = start_server(10327, "-c", nodes, "-n", "1", "-K", key, "-C", "1", NULL);
+    int alice = connect_port(10327);
+    int bob = connect_port(10227);
+    login(alice, "alice");
+    login(bob, "bob");
+
+    // Messages forwarded each way at once: a session waiting on its link
+    // must not keep its node from serving the other node's request
+    for(int i = 0; i < 20; i++) {
+	send_packet(alice, CHLA_SEND_PKT, 0, 2 + i, "bob\r\nping", 9);
+	send_packet(bob, CHLA_SEND_PKT, 0, 2 + i, "alice\r\npong", 11);
+	cr_assert_eq(await_packet(alice, CHLA_ACK_PKT, 2 + i, NULL, NULL), 0, "Message %d to bob was not ACKed", i);
+	cr_assert_eq(await_packet(bob, CHLA_ACK_PKT, 2 + i, NULL, NULL), 0, "Message %d to alice was not ACKed", i);
+    }
+
+    close(alice);
+    close(bob);
+    stop_server(node0);
+    stop_server(node1);
+    unlink(key);
+}
+
+/*
+ * A client's view of who is logged in, as a list of handles kept up to
+ * date from the reply to SUBSCRIBE and the PRESENCE packets after it.
+ */
+#define MAX_VIEW 64
+
+typedef struct view {
+    char *handles[MAX_VIEW];
+    int count;
+} VIEW;
+
+static void view_set(VIEW *view, char *handle, int online) {
+    for(int i = 0; i < view->count; i++) {
+	if(strcmp(view->handles[i], handle) == 0) {
+	    if(!online) {
+		free(view->handles[i]);
+		view->handles[i] = view->handles[--view->count];
+	    }
+	    return;
+	}
+    }
+    if(online && view->count < MAX_VIEW)
+	view->handles[view->count++] = strdup(handle);
+}
+
+// Apply "handle\n" lines, or "+handle\n" and "-handle\n" lines if deltas
+static void view_apply(VIEW *view, char *lines, int deltas) {
+    for(char *line = strtok(lines, "\n"); line != NULL; line = strtok(NULL, "\n")) {
+	if(!deltas)
+	    view_set(view, line, 1);
+	else if(line[0] == '+' || line[0] == '-')
+	    view_set(view, line + 1, line[0] == '+');
+    }
+}
+
+static int view_has(VIEW *view, char *handle) {
+    for(int i = 0; i < view->count; i++) {
+	if(strcmp(view->handles[i], handle) == 0)
+	    return 1;
+    }
+    return 0;
+}
+
+// Log a handle in and out over and over, ending logged out
+static void *toggle_login(void *arg) {
+    int fd = connect_port(10028);
+    for(int i = 0; i < 200; i++) {
+	request(fd, CHLA_LOGIN_PKT, 0, 1, "dave", 4, NULL, NULL);
+	request(fd, CHLA_LOGOUT_PKT, 0, 2, NULL, 0, NULL, NULL);
+    }
+    close(fd);
+    return NULL;
+}
+
+Test(blackbox_suite, 28_subscribe_snapshot_never_older_than_changes, .timeout = 30) {
+    pid_t server = start_server(10028, NULL);
+    int fds[16];
+    VIEW views[16];
+    memset(views, 0, sizeof(views));
+
+    // Subscribe while dave keeps logging in and out
+    pthread_t tid;
+    pthread_create(&tid, NULL, toggle_login, NULL);
+    for(int i = 0; i < 16; i++) {
+	char handle[16], *list;
+	snprintf(handle, sizeof(handle), "sub%d", i);
+	fds[i] = connect_port(10028);
+	login(fds[i], handle);
+	cr_assert_eq(request(fds[i], CHLA_SUBSCRIBE_PKT, 0, 2, NULL, 0, NULL, &list), CHLA_ACK_PKT);
+	view_apply(&views[i], list, 0);
+	free(list);
+	usleep(5000);
+    }
+    pthread_join(tid, NULL);
+
+    // Once the last batch of changes is in, every view agrees with the server
+    CHLA_PACKET_HEADER hdr;
+    char *payload;
+    for(int i = 0; i < 16; i++) {
+	while(recv_packet(fds[i], &hdr, &payload, 500) >= 0) { // A few windows
+	    if(hdr.type == CHLA_PRESENCE_PKT)
+		view_apply(&views[i], payload, 1);
+	    free(payload);
+	}
+	cr_assert(!view_has(&views[i], "dave"), "Subscriber %d still sees dave logged in", i);
+	for(int j = 0; j < 16; j++) {
+	    char handle[16];
+	    snprintf(handle, sizeof(handle), "sub%d", j);
+	    cr_assert(view_has(&views[i], handle), "Subscriber %d does not see %s", i, handle);
+	}
+	cr_assert_eq(views[i].count, 16, "Subscriber %d sees %d users", i, views[i].count);
+    }
+
+    for(int i = 0; i < 16; i++)
+	close(fds[i]);
+    stop_server(server);
+}
+
+// Send a USERS_QUERY and return its reply, which the caller frees
+static char *users_query(int fd, uint32_t msgid, char *prefix, int limit, char *cursor) {
+    char buf[256], *reply = NULL;
+    int length = snprintf(buf, sizeof(buf), "%s\r\n%d\r\n%s", prefix, limit, cursor);
+    cr_assert_eq(request(fd, CHLA_USERS_QUERY_PKT, 0, msgid, buf, length, NULL, &reply), CHLA_ACK_PKT,
+		 "USERS_QUERY for \"%s\" after \"%s\" was not ACKed", prefix, cursor);
+    return reply;
+}
+
+Test(blackbox_suite, 29_users_query_pages_by_prefix, .timeout = 30) {
+    // Coroutine sessions have small stacks, which a deep trie must not overflow
+    pid_t server = start_server(10029, "-C", "1", NULL);
+    char *handles[] = { "anne", "ann", "bob", "annabel", "anna" };
+    int fds[5];
+    for(int i = 0; i < 5; i++) {
+	fds[i] = connect_port(10029);
+	login(fds[i], handles[i]);
+    }
+    int fd = fds[2];
+
+    // Pages come in sorted order, each after the cursor
+    char *page = users_query(fd, 2, "ann", 2, "");
+    cr_assert_str_eq(page, "ann\nanna\n");
+    free(page);
+    page = users_query(fd, 3, "ann", 2, "anna");
+    cr_assert_str_eq(page, "annabel\nanne\n");
+    free(page);
+    page = users_query(fd, 4, "ann", 2, "anne");
+    cr_assert_str_eq(page, "");
+    free(page);
+
+    // A handle that logs out is no longer listed, and its prefixes still are
+    close(fds[4]);
+    usleep(200000);
+    page = users_query(fd, 5, "", 0, "");
+    cr_assert_str_eq(page, "ann\nannabel\nanne\nbob\n");
+    free(page);
+
+    // A long handle is indexed and removed again
+    char *longhandle = malloc(20001);
+    memset(longhandle, 'z', 20000);
+    longhandle[20000] = '\0';
+    int zfd = connect_port(10029);
+    login(zfd, longhandle);
+    page = users_query(fd, 6, "zzz", 0, "");
+    cr_assert_eq(strlen(page), 20001, "Long handle was not listed");
+    free(page);
+    close(zfd);
+    usleep(200000);
+    page = users_query(fd, 7, "z", 0, "");
+    cr_assert_str_eq(page, "");
+    free(page);
+    free(longhandle);
+
+    for(int i = 0; i < 4; i++)
+	close(fds[i]);
+    stop_server(server);
+}
+
+// Log in under a handle on a new connection, and report whether it was ACKed
+typedef struct racer {
+    char *handle;
+    int fd;
+    int acked;
+} RACER;
+
+static void *race_login(void *arg) {
+    RACER *racer = arg;
+    racer->acked = request(racer->fd, CHLA_LOGIN_PKT, 0, 1, racer->handle, strlen(racer->handle),
+			   NULL, NULL) == CHLA_ACK_PKT;
+    return NULL;
+}
+
+Test(blackbox_suite, 30_handles_identify_one_user, .timeout = 30) {
+    pid_t server = start_server(10030, NULL);
+    int fd = connect_port(10030);
+    login(fd, "watcher");
+
+    // Of the sessions logging in at once under a new handle, exactly one may
+    for(int round = 0; round < 20; round++) {
+	char handle[16];
+	snprintf(handle, sizeof(handle), "new%d", round);
+	RACER racers[4];
+	pthread_t tids[4];
+	for(int i = 0; i < 4; i++) {
+	    racers[i].handle = handle;
+	    racers[i].fd = connect_port(10030);
+	}
+	for(int i = 0; i < 4; i++)
+	    pthread_create(&tids[i], NULL, race_login, &racers[i]);
+	int acked = 0;
+	for(int i = 0; i < 4; i++) {
+	    pthread_join(tids[i], NULL);
+	    acked += racers[i].acked;
+	}
+	cr_assert_eq(acked, 1, "%d sessions logged in as %s", acked, handle);
+
+	// A message to the handle reaches the session that logged in
+	cr_assert_eq(send_message(fd, 0, 2 + round, handle, handle, NULL), CHLA_ACK_PKT);
+	for(int i = 0; i < 4; i++) {
+	    if(racers[i].acked) {
+		char *body;
+		cr_assert_eq(await_packet(racers[i].fd, CHLA_MESG_PKT, 2 + round, NULL, &body), 0,
+			     "Message to %s was not delivered", handle);
+		cr_assert(strstr(body, handle) != NULL);
+		free(body);
+	    }
+	    close(racers[i].fd);
+	}
+    }
+
+    // Once every session of a handle has gone, it is no longer a user, and
+    // a later handle is not mistaken for it
+    usleep(200000);
+    int other = connect_port(10030);
+    login(other, "later");
+    cr_assert_eq(send_message(fd, 0, 100, "new0", "gone", NULL), CHLA_NACK_PKT,
+		 "Message to a handle that logged out was accepted");
+    cr_assert_eq(send_message(fd, 0, 101, "later", "here", NULL), CHLA_ACK_PKT);
+    char *body;
+    cr_assert_eq(await_packet(other, CHLA_MESG_PKT, 101, NULL, &body), 0);
+    cr_assert_str_eq(body, "watcher\r\nhere");
+    free(body);
+
+    close(other);
+    close(fd);
+    stop_server(server);
+}
+
+Test(blackbox_suite, 31_pool_statistics_on_shutdown, .timeout = 30) {
+    char *path = "/tmp/charla_test_031.stats";
+    unlink(path);
+    pid_t server = start_server(10031, "-s", "100", "-z", path, NULL);
+    int alice = connect_port(10031);
+    int bob = connect_port(10031);
+    login(alice, "alice");
+    login(bob, "bob");
+    for(int i = 0; i < 10; i++) {
+	cr_assert_eq(send_message(alice, 0, 2 + i, "bob", "pooled", NULL), CHLA_ACK_PKT);
+	cr_assert_eq(await_packet(bob, CHLA_MESG_PKT, 2 + i, NULL, NULL), 0);
+    }
+    close(alice);
+    close(bob);
+    stop_server(server);
+
+    // Every pool was preallocated, and every entry delivered was given back
+    FILE *f = fopen(path, "r");
+    cr_assert_not_null(f, "No statistics were written");
+    char line[256];
+    int clients = 0, entries = 0, peak = 0;
+    while(fgets(line, sizeof(line), f) != NULL) {
+	unsigned long allocs, frees, in_use, slabs;
+	if(sscanf(line, "CLIENT: %lu allocs, %lu frees, %lu in use, %lu slabs",
+		  &allocs, &frees, &in_use, &slabs) == 4) {
+	    clients = 1;
+	    cr_assert_geq(allocs, 2, "%s", line);
+	    cr_assert_geq(slabs, 2, "Pool was not preallocated: %s", line);
+	}
+	if(sscanf(line, "MAILBOX_ENTRY: %lu allocs, %lu frees, %lu in use",
+		  &allocs, &frees, &in_use) == 3) {
+	    entries = 1;
+	    cr_assert_geq(allocs, 10, "%s", line);
+	    cr_assert_eq(in_use, 0, "Delivered entries were not freed: %s", line);
+	}
+	peak |= strncmp(line, "Peak resident set size:", 23) == 0;
+    }
+    fclose(f);
+    unlink(path);
+    cr_assert(clients && entries && peak, "Statistics are missing a pool or the peak size");
+}
+
+Test(blackbox_suite, 32_single_thread_serves_requests_and_mailbox, .timeout = 30) {
+    pid_t server = start_server(10032, "-m", NULL);
+    int alice = connect_port(10032);
+    int bob = connect_port(10032);
+    login(alice, "alice");
+    login(bob, "bob");
+
+    // Messages reach bob while he sends nothing, in the order sent
+    for(int i = 0; i < 50; i++)
+	cr_assert_eq(send_message(alice, 0, 2 + i, "bob", "hello", NULL), CHLA_ACK_PKT);
+    CHLA_PACKET_HEADER hdr;
+    for(int i = 0; i < 50; i++) {
+	cr_assert_eq(await_packet(bob, CHLA_MESG_PKT, -1, &hdr, NULL), 0, "Message %d was not delivered", i);
+	cr_assert_eq(ntohl(hdr.msgid), 2 + i, "Message %u arrived out of order", ntohl(hdr.msgid));
+    }
+
+    // The same thread answers his requests while deliveries are queued
+    for(int i = 0; i < 20; i++)
+	send_packet(alice, CHLA_SEND_PKT, 0, 100 + i, "bob\r\nagain", 10);
+    send_packet(bob, CHLA_USERS_PKT, 0, 2, NULL, 0);
+    int answered = 0, delivered = 0;
+    char *body;
+    while((!answered || delivered < 20) && recv_packet(bob, &hdr, &body, REPLY_TIMEOUT) >= 0) {
+	answered |= hdr.type == CHLA_ACK_PKT && ntohl(hdr.msgid) == 2;
+	if(hdr.type == CHLA_MESG_PKT) {
+	    cr_assert_eq(ntohl(hdr.msgid), 100 + delivered, "Message %u arrived out of order", ntohl(hdr.msgid));
+	    delivered++;
+	}
+	free(body);
+    }
+    cr_assert(answered, "Request was not answered while messages were being delivered");
+    cr_assert_eq(delivered, 20);
+
+    // A new login gets a new mailbox, served by the same thread
+    cr_assert_eq(request(bob, CHLA_LOGOUT_PKT, 0, 3, NULL, 0, NULL, NULL), CHLA_ACK_PKT);
+    login(bob, "robert");
+    cr_assert_eq(send_message(alice, 0, 200, "robert", "renamed", NULL), CHLA_ACK_PKT);
+    cr_assert_eq(await_packet(bob, CHLA_MESG_PKT, 200, NULL, &body), 0);
+    cr_assert_str_eq(body, "alice\r\nrenamed");
+    free(body);
+
+    close(alice);
+    close(bob);
+    stop_server(server);
+}
+
+Test(blackbox_suite, 33_coroutines_serve_hundreds_of_sessions, .timeout = 60) {
+    // More sessions than fit in one handoff message of descriptors
+    #define MANY_SESSIONS 300
+    char *path = "/tmp/charla_test_033.sock";
+    unlink(path);
+    pid_t old = start_server(10433, "-C", "1", "-u", path, NULL);
+    int fds[MANY_SESSIONS];
+    char handle[16];
+    for(int i = 0; i < MANY_SESSIONS; i++) {
+	fds[i] = connect_port(10433);
+	snprintf(handle, sizeof(handle), "user%d", i);
+	login(fds[i], handle);
+    }
+    for(int i = 0; i < 20; i++)
+	cr_assert_eq(request(fds[i], CHLA_SUBSCRIBE_PKT, 0, 2, NULL, 0, NULL, NULL), CHLA_ACK_PKT,
+		     "Subscription %d was refused", i);
+    char *users;
+    cr_assert_eq(request(fds[0], CHLA_USERS_PKT, 0, 3, NULL, 0, NULL, &users), CHLA_ACK_PKT);
+    int lines = 0;
+    for(char *p = users; (p = strchr(p, '\n')) != NULL; p++)
+	lines++;
+    cr_assert_eq(lines, MANY_SESSIONS, "USERS listed %d of %d sessions", lines, MANY_SESSIONS);
+    free(users);
+
+    // All of them are handed off in a hot upgrade, subscriptions included
+    pid_t new = start_server(0, "-p", "10433", "-C", "1", "-u", path, "-r", NULL);
+    for(int i = 0; i < 100 && access(path, F_OK) < 0; i++)
+	usleep(50000);
+    cr_assert_eq(access(path, F_OK), 0, "New server is not waiting for the handoff");
+    kill(old, SIGUSR2);
+    int status = reap_server(old);
+    cr_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0,
+	      "Old server did not exit after the handoff (status 0x%x)", status);
+    cr_assert_eq(send_message(fds[MANY_SESSIONS - 1], 0, 4, "user0", "still here", NULL), CHLA_ACK_PKT,
+		 "Last session was not handed off");
+    cr_assert_eq(await_packet(fds[0], CHLA_MESG_PKT, 4, NULL, NULL), 0, "First session was not handed off");
+    cr_assert_eq(request(fds[MANY_SESSIONS - 1], CHLA_LOGOUT_PKT, 0, 5, NULL, 0, NULL, NULL), CHLA_ACK_PKT);
+    char *body;
+    cr_assert_eq(await_packet(fds[19], CHLA_PRESENCE_PKT, -1, NULL, &body), 0, "Subscription was lost");
+    snprintf(handle, sizeof(handle), "-user%d\n", MANY_SESSIONS - 1);
+    cr_assert_str_eq(body, handle);
+    free(body);
+
+    for(int i = 0; i < MANY_SESSIONS; i++)
+	close(fds[i]);
+    stop_server(new);
+    unlink(path);
+}
+
+Test(blackbox_suite, 34_timers_probe_close_and_expire, .timeout = 30) {
+    pid_t server = start_server(10034, "-k", "1", "-i", "3", "-e", "1", NULL);
+    int alice = connect_port(10034);
+    int bob = connect_port(10034);
+    int idle = connect_port(10034);
+    login(alice, "alice");
+    login(bob, "bob");
+
+    // A message that waits too long in a mailbox bounces
+    cr_assert_eq(request(bob, CHLA_CREDIT_PKT, 0, 2, "0\r\n", 3, NULL, NULL), CHLA_ACK_PKT);
+    cr_assert_eq(send_message(alice, 0, 2, "bob", "late", NULL), CHLA_ACK_PKT);
+    cr_assert_eq(await_packet(alice, CHLA_BOUNCE_PKT, 2, NULL, NULL), 0, "Undelivered message did not bounce");
+
+    // An idle client is probed, and stays connected while it answers
+    CHLA_PACKET_HEADER hdr;
+    char *body;
+    for(int i = 0; i < 4; i++) {
+	cr_assert_eq(recv_packet(alice, &hdr, &body, 2000), CHLA_PING_PKT, "Idle client was not probed");
+	free(body);
+	send_packet(alice, CHLA_PING_PKT, 0, 10 + i, NULL, 0);
+	cr_assert_eq(await_packet(alice, CHLA_ACK_PKT, 10 + i, NULL, NULL), 0);
+    }
+
+    // while one that does not answer is disconnected
+    int closed = 0;
+    while(!closed) {
+	int type = recv_packet(idle, &hdr, &body, REPLY_TIMEOUT);
+	free(body);
+	if(type < 0) {
+	    char c;
+	    closed = read(idle, &c, 1) == 0;
+	    cr_assert(closed, "Silent client was not disconnected");
+	} else {
+	    cr_assert_eq(type, CHLA_PING_PKT);
+	}
+    }
+
+    close(alice);
+    close(bob);
+    close(idle);
+    stop_server(server);
+}
+
+Test(blackbox_suite, 35_rate_limit_per_connection_and_handle, .timeout = 30) {
+    pid_t server = start_server(10035, "-R", "1", NULL);
+    int alice = connect_port(10035);
+    int bob = connect_port(10035);
+    login(alice, "alice");
+    login(bob, "bob");
+
+    // A burst beyond the rate is refused once the bucket is empty
+    int acked = 0, nacked = 0;
+    for(int i = 0; i < 10; i++) {
+	int ret = send_message(alice, 0, 2 + i, "bob", "burst", NULL);
+	acked += ret == CHLA_ACK_PKT;
+	nacked += ret == CHLA_NACK_PKT;
+    }
+    cr_assert(acked >= 1 && acked <= 2 && acked + nacked == 10,
+	      "%d of a burst of 10 were ACKed at 1 message/s", acked);
+
+    // Reconnecting does not refill the bucket of the handle
+    close(alice);
+    usleep(100000);
+    alice = connect_port(10035);
+    login(alice, "alice");
+    cr_assert_eq(send_message(alice, 0, 20, "bob", "again", NULL), CHLA_NACK_PKT,
+		 "Reconnecting reset the rate limit of the handle");
+
+    // but waiting does
+    usleep(1200000);
+    cr_assert_eq(send_message(alice, 0, 21, "bob", "later", NULL), CHLA_ACK_PKT,
+		 "Bucket did not refill");
+
+    close(alice);
+    close(bob);
+    stop_server(server);
+}
+
+Test(blackbox_suite, 36_urgent_messages_and_notices_overtake, .timeout = 30) {
+    pid_t server = start_server(10036, NULL);
+    int alice = connect_port(10036);
+    int bob = connect_port(10036);
+    login(alice, "alice");
+    login(bob, "bob");
+
+    // Queue ordinary messages for bob, then an urgent one
+    cr_assert_eq(request(bob, CHLA_CREDIT_PKT, 0, 2, "0\r\n", 3, NULL, NULL), CHLA_ACK_PKT);
+    for(int i = 0; i < 3; i++)
+	cr_assert_eq(send_message(alice, 0, 2 + i, "bob", "bulk", NULL), CHLA_ACK_PKT);
+    cr_assert_eq(send_message(alice, CHLA_URGENT_FLAG, 5, "bob", "urgent", NULL), CHLA_ACK_PKT);
+
+    // The urgent message is delivered first, then the others in order
+    send_packet(bob, CHLA_CREDIT_PKT, 0, 3, "4\r\n", 3);
+    uint32_t expected[] = { 5, 2, 3, 4 };
+    CHLA_PACKET_HEADER hdr;
+    for(int i = 0; i < 4; i++) {
+	cr_assert_eq(await_packet(bob, CHLA_MESG_PKT, -1, &hdr, NULL), 0, "Message was not delivered");
+	cr_assert_eq(ntohl(hdr.msgid), expected[i], "Message %u was delivered in place of %u",
+		     ntohl(hdr.msgid), expected[i]);
+    }
+
+    // A notice to alice is not held back by messages queued for her
+    cr_assert_eq(request(bob, CHLA_CREDIT_PKT, 0, 4, "10\r\n", 4, NULL, NULL), CHLA_ACK_PKT);
+    cr_assert_eq(request(alice, CHLA_CREDIT_PKT, 0, 6, "0\r\n", 3, NULL, NULL), CHLA_ACK_PKT);
+    cr_assert_eq(send_message(bob, 0, 10, "alice", "held", NULL), CHLA_ACK_PKT);
+    cr_assert_eq(send_message(alice, 0, 7, "bob", "receipted", NULL), CHLA_ACK_PKT);
+    cr_assert_eq(await_packet(bob, CHLA_MESG_PKT, 7, NULL, NULL), 0);
+    cr_assert_eq(await_packet(alice, CHLA_RCVD_PKT, 7, NULL, NULL), 0,
+		 "Receipt was held back behind a message waiting for credit");
+
+    close(alice);
+    close(bob);
+    stop_server(server);
+}
+
+Test(blackbox_suite, 37_retried_send_is_delivered_once, .timeout = 30) {
+    pid_t server = start_server(10037, "-D", "5", NULL);
+    int alice = connect_port(10037);
+    int bob = connect_port(10037);
+    login(alice, "alice");
+    login(bob, "bob");
+
+    // A retry with the same msgid is ACKed but not delivered again
+    cr_assert_eq(send_message(alice, 0, 2, "bob", "once", NULL), CHLA_ACK_PKT);
+    cr_assert_eq(send_message(alice, 0, 2, "bob", "once", NULL), CHLA_ACK_PKT, "Retry was not ACKed");
+    cr_assert_eq(send_message(alice, 0, 3, "bob", "next", NULL), CHLA_ACK_PKT);
+    // The same msgid from another sender is another message
+    int carol = connect_port(10037);
+    login(carol, "carol");
+    cr_assert_eq(send_message(carol, 0, 2, "bob", "own", NULL), CHLA_ACK_PKT);
+
+    CHLA_PACKET_HEADER hdr;
+    char *body;
+    char *expected[] = { "alice\r\nonce", "alice\r\nnext", "carol\r\nown" };
+    for(int i = 0; i < 3; i++) {
+	cr_assert_eq(await_packet(bob, CHLA_MESG_PKT, -1, &hdr, &body), 0, "Message %d was not delivered", i);
+	cr_assert_str_eq(body, expected[i], "Retry was delivered again");
+	free(body);
+    }
+    cr_assert_eq(recv_packet(bob, &hdr, &body, 500), -1, "Unexpected packet type %d", hdr.type);
+
+    close(alice);
+    close(bob);
+    close(carol);
+    stop_server(server);
+}
+
+Test(blackbox_suite, 38_large_message_relayed_in_parts, .timeout = 30) {
+    pid_t server = start_server(10038, "-P", "1000", NULL);
+    int alice = connect_port(10038);
+    int bob = connect_port(10038);
+    int carol = connect_port(10038);
+    login(alice, "alice");
+    login(bob, "bob");
+    login(carol, "carol");
+
+    // Each part is relayed as it comes, and ACKed once delivered
+    cr_assert_eq(request(alice, CHLA_SEND_PKT, CHLA_MORE_FLAG, 2, "bob\r\npart0", 10, NULL, NULL), CHLA_ACK_PKT);
+    cr_assert_eq(request(alice, CHLA_CHUNK_PKT, CHLA_MORE_FLAG, 2, "part1", 5, NULL, NULL), CHLA_ACK_PKT);
+    cr_assert_eq(request(alice, CHLA_CHUNK_PKT, 0, 2, "part2", 5, NULL, NULL), CHLA_ACK_PKT);
+    CHLA_PACKET_HEADER hdr;
+    char *body;
+    cr_assert_eq(await_packet(bob, CHLA_MESG_PKT, 2, &hdr, &body), 0);
+    cr_assert(hdr.flags & CHLA_MORE_FLAG, "First part did not say more follow");
+    cr_assert_str_eq(body, "alice\r\npart0");
+    free(body);
+    cr_assert_eq(await_packet(bob, CHLA_CHUNK_PKT, 2, &hdr, &body), 0);
+    cr_assert(hdr.flags & CHLA_MORE_FLAG);
+    cr_assert_str_eq(body, "alice\r\npart1");
+    free(body);
+    cr_assert_eq(await_packet(bob, CHLA_CHUNK_PKT, 2, &hdr, &body), 0);
+    cr_assert(!(hdr.flags & CHLA_MORE_FLAG), "Last part said more follow");
+    cr_assert_str_eq(body, "alice\r\npart2");
+    free(body);
+    cr_assert_eq(await_packet(alice, CHLA_RCVD_PKT, 2, NULL, NULL), 0, "Message in parts was not receipted");
+
+    // A sender that goes away in the middle aborts the transfer
+    cr_assert_eq(request(carol, CHLA_SEND_PKT, CHLA_MORE_FLAG, 3, "bob\r\nstart", 10, NULL, NULL), CHLA_ACK_PKT);
+    close(carol);
+    cr_assert_eq(await_packet(bob, CHLA_MESG_PKT, 3, NULL, NULL), 0);
+    cr_assert_eq(await_packet(bob, CHLA_CHUNK_PKT, 3, &hdr, NULL), 0, "Abandoned transfer was not aborted");
+    cr_assert(hdr.flags & CHLA_ABORT_FLAG, "Last part of an abandoned transfer was not an abort");
+
+    // A payload over the cap closes the connection
+    char big[2000];
+    memset(big, 'x', sizeof(big));
+    memcpy(big, "bob\r\n", 5);
+    send_packet(alice, CHLA_SEND_PKT, 0, 4, big, sizeof(big));
+    while(recv_packet(alice, &hdr, &body, REPLY_TIMEOUT) >= 0) {
+	cr_assert_neq(hdr.type, CHLA_ACK_PKT, "Oversized payload was ACKed");
+	free(body);
+    }
+    char c;
+    cr_assert_eq(read(alice, &c, 1), 0, "Connection stayed open after an oversized payload");
+
+    close(alice);
+    close(bob);
+    stop_server(server);
+}
+
+Test(blackbox_suite, 39_receipts_batched_per_sender, .timeout = 30) {
+    pid_t server = start_server(10039, "-W", "500", NULL);
+    int alice = connect_port(10039);
+    int bob = connect_port(10039);
+    int carol = connect_port(10039);
+    // Only alice asks for her receipts to be batched
+    cr_assert_eq(request(alice, CHLA_LOGIN_PKT, CHLA_BATCH_FLAG, 1, "alice", 5, NULL, NULL),
+		 CHLA_ACK_PKT, "Login asking for batched receipts was not ACKed");
+    login(bob, "bob");
+    login(carol, "carol");
+
+    for(int i = 0; i < 3; i++)
+	cr_assert_eq(send_message(alice, 0, 2 + i, "bob", "batched", NULL), CHLA_ACK_PKT);
+    send_packet(carol, CHLA_SEND_PKT, 0, 7, "bob\r\napart", 10);
+    send_packet(carol, CHLA_SEND_PKT, 0, 8, "bob\r\napart", 10);
+
+    // Alice's three deliveries come back in one receipt, led by the first
+    CHLA_PACKET_HEADER hdr;
+    char *body;
+    cr_assert_eq(await_packet(alice, CHLA_RCVD_PKT, -1, &hdr, &body), 0, "No receipt came back");
+    cr_assert_eq(ntohl(hdr.msgid), 2);
+    cr_assert_eq(ntohl(hdr.payload_length), 3 * sizeof(uint32_t), "Receipts were not batched");
+    for(int i = 0; i < 3; i++) {
+	uint32_t msgid;
+	memcpy(&msgid, body + i * sizeof(msgid), sizeof(msgid));
+	cr_assert_eq(ntohl(msgid), 2 + i);
+    }
+    free(body);
+
+    // Carol, who did not ask, gets a receipt of the usual kind for each
+    int acked = 0, receipted = 0;
+    while(!(acked == 2 && receipted == 2) && recv_packet(carol, &hdr, &body, REPLY_TIMEOUT) >= 0) {
+	free(body);
+	if(hdr.type == CHLA_ACK_PKT) {
+	    acked++;
+	} else if(hdr.type == CHLA_RCVD_PKT) {
+	    cr_assert_eq(ntohl(hdr.msgid), 7 + receipted, "Another sender's receipt was lost");
+	    cr_assert_eq(ntohl(hdr.payload_length), 0, "Receipts were batched without being asked for");
+	    receipted++;
+	}
+    }
+    cr_assert_eq(acked, 2, "Messages were not ACKed");
+    cr_assert_eq(receipted, 2, "Another sender's receipt was lost");
+
+    close(alice);
+    close(bob);
+    close(carol);
+    stop_server(server);
+}
+
+Test(blackbox_suite, 40_pipelined_requests_answered_by_msgid, .timeout = 30) {
+    pid_t server = start_server(10040, "-Q", "8", NULL);
+    int alice = connect_port(10040);
+    int bob = connect_port(10040);
+    int carol = connect_port(10040);
+    login(alice, "alice");
+    login(bob, "bob");
+    login(carol, "carol");
+
+    // Requests go out without waiting; each is answered once, and a
+    // logout behind them waits for them all
+    int count = 40;
+    for(int i = 0; i < count; i++) {
+	char buf[32];
+	int length = sprintf(buf, "%s\r\n%d", i % 2 ? "carol" : "bob", i);
+	send_packet(alice, CHLA_SEND_PKT, 0, 100 + i, buf, length);
+    }
+    send_packet(alice, CHLA_LOGOUT_PKT, 0, 99, NULL, 0);
+    int answered[40] = { 0 };
+    int acked = 0;
+    CHLA_PACKET_HEADER hdr;
+    char *body;
+    while(recv_packet(alice, &hdr, &body, REPLY_TIMEOUT) >= 0) {
+	free(body);
+	if(hdr.type != CHLA_ACK_PKT)
+	    continue;
+	uint32_t msgid = ntohl(hdr.msgid);
+	if(msgid == 99)
+	    break;
+	cr_assert(msgid >= 100 && msgid < 100 + count, "ACK of unknown msgid %u", msgid);
+	cr_assert_eq(answered[msgid - 100]++, 0, "Request %u was answered twice", msgid);
+	acked++;
+    }
+    cr_assert_eq(hdr.type, CHLA_ACK_PKT, "Logout was not answered");
+    cr_assert_eq(acked, count, "Logout was answered before %d of %d requests", count - acked, count);
+
+    // Each receiver gets its messages in the order sent
+    for(int fd = bob, first = 0; first < 2; fd = carol, first++) {
+	for(int i = first; i < count; i += 2) {
+	    cr_assert_eq(await_packet(fd, CHLA_MESG_PKT, -1, &hdr, &body), 0);
+	    char expected[32];
+	    sprintf(expected, "alice\r\n%d", i);
+	    cr_assert_str_eq(body, expected, "Messages to one receiver were reordered");
+	    free(body);
+	}
+    }
+
+    close(alice);
+    close(bob);
+    close(carol);
+    stop_server(server);
+}
+
+/*
+ * Connect to the server's Unix-domain socket at a path.
+ */
+static int connect_unix(char *path) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+	close(fd);
+	return -1;
+    }
+    return fd;
+}
+
+Test(blackbox_suite, 41_unix_socket_logs_in_local_user, .timeout = 30) {
+    char *path = "/tmp/charla_test_041.sock";
+    unlink(path);
+    pid_t server = start_server(10041, "-L", path, NULL);
+    int local = connect_unix(path);
+    cr_assert(local >= 0, "Could not connect to the Unix-domain socket");
+    int remote = connect_port(10041);
+
+    // An empty login names the local user on the Unix-domain socket only
+    cr_assert_eq(request(remote, CHLA_LOGIN_PKT, 0, 1, "", 0, NULL, NULL), CHLA_NACK_PKT,
+		 "Empty login was accepted over TCP");
+    login(remote, "alice");
+    cr_assert_eq(request(local, CHLA_LOGIN_PKT, 0, 1, "", 0, NULL, NULL), CHLA_ACK_PKT,
+		 "Empty login was refused on the Unix-domain socket");
+
+    // Clients on either socket talk to each other
+    struct passwd *pw = getpwuid(geteuid());
+    cr_assert_not_null(pw);
+    cr_assert_eq(send_message(remote, 0, 2, pw->pw_name, "over tcp", NULL), CHLA_ACK_PKT,
+		 "Local user is not logged in as %s", pw->pw_name);
+    char *body;
+    cr_assert_eq(await_packet(local, CHLA_MESG_PKT, 2, NULL, &body), 0);
+    cr_assert_str_eq(body, "alice\r\nover tcp");
+    free(body);
+    cr_assert_eq(send_message(local, 0, 3, "alice", "over unix", NULL), CHLA_ACK_PKT);
+    cr_assert_eq(await_packet(remote, CHLA_MESG_PKT, 3, NULL, &body), 0);
+    char expected[256];
+    snprintf(expected, sizeof(expected), "%s\r\nover unix", pw->pw_name);
+    cr_assert_str_eq(body, expected);
+    free(body);
+
+    close(local);
+    close(remote);
+    stop_server(server);
+    unlink(path);
+}
+
+/*
+ * Switch a Unix-domain connection to the shared-memory transport, and
+ * map the region the server passes back with the ACK.
+ */
+static SHM_REGION *attach_shm(int fd) {
+    send_packet(fd, CHLA_SHM_PKT, 0, 1, NULL, 0);
+    CHLA_PACKET_HEADER hdr;
+    struct iovec iov = { .iov_base = &hdr, .iov_len = sizeof(hdr) };
+    union {
+	char buf[CMSG_SPACE(sizeof(int))];
+	struct cmsghdr align;
+    } control;
+    struct msghdr msg = {
+	.msg_iov = &iov, .msg_iovlen = 1,
+	.msg_control = control.buf, .msg_controllen = sizeof(control.buf)
+    };
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    if(poll(&pfd, 1, REPLY_TIMEOUT) <= 0 || recvmsg(fd, &msg, 0) != sizeof(hdr)
+       || hdr.type != CHLA_ACK_PKT)
+	return NULL;
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if(cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS)
+	return NULL;
+    int memfd;
+    memcpy(&memfd, CMSG_DATA(cmsg), sizeof(int));
+    SHM_REGION *region = mmap(NULL, sizeof(SHM_REGION), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    close(memfd);
+    return region == MAP_FAILED || region->magic != SHM_MAGIC ? NULL : region;
+}
+
+/*
+ * Publish a new tail on a ring, and wake the server if it sleeps on it.
+ */
+static void shm_publish(SHM_RING *ring, uint32_t tail) {
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&ring->tail_waiters, __ATOMIC_SEQ_CST))
+	syscall(SYS_futex, &ring->tail, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+/*
+ * Write a packet into the server's ring, which must have room for it.
+ */
+static void shm_put_packet(SHM_REGION *region, int type, uint32_t msgid, char *payload, size_t length) {
+    SHM_RING *ring = &region->to_server;
+    CHLA_PACKET_HEADER hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.type = type;
+    hdr.payload_length = htonl(length);
+    hdr.msgid = htonl(msgid);
+    uint32_t tail = ring->tail;
+    for(size_t i = 0; i < sizeof(hdr) + length; i++, tail++)
+	ring->data[tail % SHM_RING_SIZE] = i < sizeof(hdr) ? ((char *)&hdr)[i] : payload[i - sizeof(hdr)];
+    shm_publish(ring, tail);
+}
+
+/*
+ * Read the next packet from the client's ring, polling for it, with its
+ * payload NUL-terminated in a buffer the caller frees.  Returns the type
+ * of the packet, or -1 if none came within the timeout.
+ */
+static int shm_get_packet(SHM_REGION *region, CHLA_PACKET_HEADER *hdr, char **payload) {
+    SHM_RING *ring = &region->to_client;
+    uint32_t head = ring->head;
+    for(int waited = 0; __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) - head < sizeof(*hdr); waited++) {
+	if(waited == REPLY_TIMEOUT)
+	    return -1;
+	usleep(1000);
+    }
+    for(size_t i = 0; i < sizeof(*hdr); i++, head++)
+	((char *)hdr)[i] = ring->data[head % SHM_RING_SIZE];
+    size_t length = ntohl(hdr->payload_length);
+    *payload = calloc(length + 1, 1);
+    for(size_t i = 0; i < length; i++, head++) {
+	while(__atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) == head)
+	    usleep(1000);
+	(*payload)[i] = ring->data[head % SHM_RING_SIZE];
+    }
+    __atomic_store_n(&ring->head, head, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&ring->head_waiters, __ATOMIC_SEQ_CST))
+	syscall(SYS_futex, &ring->head, FUTEX_WAKE, 1, NULL, NULL, 0);
+    return hdr->type;
+}
+
+Test(blackbox_suite, 42_shared_memory_transport, .timeout = 30) {
+    char *path = "/tmp/charla_test_042.sock";
+    unlink(path);
+    pid_t server = start_server(10042, "-L", path, NULL);
+    int fd = connect_unix(path);
+    int bob = connect_port(10042);
+    login(bob, "bob");
+    SHM_REGION *region = attach_shm(fd);
+    cr_assert_not_null(region, "Shared-memory transport was not set up");
+
+    // Requests and replies go through the rings
+    CHLA_PACKET_HEADER hdr;
+    char *body;
+    shm_put_packet(region, CHLA_LOGIN_PKT, 2, "alice", 5);
+    cr_assert_eq(shm_get_packet(region, &hdr, &body), CHLA_ACK_PKT, "Login over the rings was not ACKed");
+    cr_assert_eq(ntohl(hdr.msgid), 2);
+    free(body);
+    cr_assert_eq(send_message(bob, 0, 3, "alice", "to the ring", NULL), CHLA_ACK_PKT);
+    cr_assert_eq(shm_get_packet(region, &hdr, &body), CHLA_MESG_PKT, "Message was not delivered through the ring");
+    cr_assert_str_eq(body, "bob\r\nto the ring");
+    free(body);
+    shm_put_packet(region, CHLA_SEND_PKT, 4, "bob\r\nfrom the ring", 18);
+    cr_assert_eq(await_packet(bob, CHLA_MESG_PKT, 4, NULL, &body), 0, "Message sent through the ring was lost");
+    cr_assert_str_eq(body, "alice\r\nfrom the ring");
+    free(body);
+    // The ACK and the receipt may come in either order
+    for(int acked = 0, receipted = 0; !(acked && receipted); ) {
+	cr_assert_neq(shm_get_packet(region, &hdr, &body), -1, "Reply was not delivered through the ring");
+	acked |= hdr.type == CHLA_ACK_PKT;
+	receipted |= hdr.type == CHLA_RCVD_PKT;
+	free(body);
+    }
+
+    // A tail more than a ring ahead of the server's head ends the session,
+    // without the server reading anything from the ring
+    SHM_RING *ring = &region->to_server;
+    uint32_t replies = region->to_client.tail;
+    shm_publish(ring, ring->head + SHM_RING_SIZE + 1);
+    char c;
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    cr_assert_eq(poll(&pfd, 1, REPLY_TIMEOUT), 1, "Session with a corrupted ring was not ended");
+    cr_assert_eq(read(fd, &c, 1), 0, "Session with a corrupted ring was not ended");
+    cr_assert_eq(region->to_client.tail, replies, "Server served requests from a corrupted ring");
+    cr_assert_eq(send_message(bob, 0, 5, "alice", "gone", NULL), CHLA_NACK_PKT,
+		 "Client with a corrupted ring is still logged in");
+
+    munmap(region, sizeof(SHM_REGION));
+    close(fd);
+    close(bob);
+    stop_server(server);
+    unlink(path);
+}
+
+/*
+ * Run a server that writes a binary log at a level, have two clients talk
+ * through it, and check that the log is well formed.  Returns the number
+ * of events recorded, and the lowest level of any of them.
+ */
+static int logged_session(int port, char *level, int *lowest) {
+    char path[64];
+    sprintf(path, "/tmp/charla_test_043_%s.log", level);
+    unlink(path);
+    char portstr[16];
+    sprintf(portstr, "%d", port);
+    pid_t server = start_server(port, "-o", path, "-l", level, NULL);
+    int alice = connect_port(port);
+    int bob = connect_port(port);
+    login(alice, "alice");
+    login(bob, "bob");
+    cr_assert_eq(send_message(alice, 0, 2, "bob", "logged", NULL), CHLA_ACK_PKT);
+    cr_assert_eq(await_packet(bob, CHLA_MESG_PKT, 2, NULL, NULL), 0);
+    close(alice);
+    close(bob);
+    stop_server(server);
+
+    // Every record is written out by the time the server exits
+    FILE *f = fopen(path, "r");
+    cr_assert_not_null(f, "Log file %s was not written", path);
+    char magic[sizeof(LOG_FILE_MAGIC) - 1];
+    cr_assert_eq(fread(magic, 1, sizeof(magic), f), sizeof(magic));
+    cr_assert_eq(memcmp(magic, LOG_FILE_MAGIC, sizeof(magic)), 0, "Log file has no magic number");
+    int levels[4096] = { 0 };
+    uint32_t sites = 0;
+    int events = 0;
+    *lowest = LOG_OFF;
+    LOG_ENTRY_HEADER hdr;
+    while(fread(&hdr, sizeof(hdr), 1, f) == 1) {
+	char *body = malloc(hdr.length + 1);
+	cr_assert_eq(fread(body, 1, hdr.length, f), hdr.length, "Log entry was cut short");
+	if(hdr.kind == LOG_ENTRY_SITE) {
+	    uint32_t id;
+	    memcpy(&id, body, sizeof(id));
+	    cr_assert_eq(id, sites + 1, "Sites are not numbered in order");
+	    cr_assert(id < 4096);
+	    levels[id] = hdr.level;
+	    sites = id;
+	} else if(hdr.kind == LOG_ENTRY_EVENT) {
+	    LOG_EVENT event;
+	    cr_assert(hdr.length >= sizeof(event));
+	    memcpy(&event, body, sizeof(event));
+	    cr_assert(event.site >= 1 && event.site <= sites, "Event of a site not yet described");
+	    if(levels[event.site] < *lowest)
+		*lowest = levels[event.site];
+	    events++;
+	} else {
+	    cr_assert_eq(hdr.kind, LOG_ENTRY_DROPPED, "Unknown log entry %d", hdr.kind);
+	}
+	free(body);
+    }
+    fclose(f);
+    unlink(path);
+    return events;
+}
+
+Test(blackbox_suite, 43_binary_log_at_a_threshold, .timeout = 60) {
+    // Which levels are recorded at all depends on those compiled in
+    // (see debug.h); none below the threshold ever is
+    int lowest;
+    logged_session(10043, "debug", &lowest);
+    logged_session(10043, "warn", &lowest);
+    cr_assert(lowest >= LOG_WARN, "Event at level %d was recorded above it", lowest);
+    cr_assert_eq(logged_session(10043, "off", &lowest), 0, "Events were recorded with logging off");
+}
+
+/*
+ * Check that every thread of a process may run only on the CPUs of a
+ * list, as the kernel writes it in /proc (e.g. "0" or "2-3").  Returns
+ * the number of threads.
+ */
+static int threads_pinned(pid_t pid, char *cpus) {
+    char path[64];
+    sprintf(path, "/proc/%d/task", pid);
+    DIR *dir = opendir(path);
+    cr_assert_not_null(dir);
+    int threads = 0;
+    struct dirent *d;
+    while((d = readdir(dir)) != NULL) {
+	if(d->d_name[0] == '.')
+	    continue;
+	char status[384], line[256];
+	snprintf(status, sizeof(status), "%s/%s/status", path, d->d_name);
+	FILE *f = fopen(status, "r");
+	if(f == NULL)
+	    continue; // The thread has exited
+	while(fgets(line, sizeof(line), f) != NULL) {
+	    if(strncmp(line, "Cpus_allowed_list:", 18) == 0) {
+		char *list = line + 18 + strspn(line + 18, " \t");
+		list[strcspn(list, "\n")] = '\0';
+		cr_assert_str_eq(list, cpus, "Thread %s may run on %s", d->d_name, list);
+		threads++;
+	    }
+	}
+	fclose(f);
+    }
+    closedir(dir);
+    return threads;
+}
+
+Test(blackbox_suite, 45_threads_pinned_to_their_roles, .timeout = 30) {
+    // Specifications that name an unknown role or no usable CPU are refused
+    char *bad[] = { "dispatcher=0", "io=", "io=4096", "acceptor" };
+    for(size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+	pid_t server = start_server(0, "-p", "10045", "-a", bad[i], NULL);
+	int status = reap_server(server);
+	cr_assert(WIFEXITED(status), "Server with placement \"%s\" did not exit", bad[i]);
+	cr_assert_lt(connect_port(10045), 0, "Server started with placement \"%s\"", bad[i]);
+    }
+
+    // With every role on CPU 0, and steering, every thread stays there and
+    // the server works as usual
+    pid_t server = start_server(10045, "-a", "acceptor=0:io=0:worker=0", "-S", NULL);
+    int alice = connect_port(10045);
+    int bob = connect_port(10045);
+    login(alice, "alice");
+    login(bob, "bob");
+    cr_assert_eq(send_message(alice, 0, 2, "bob", "pinned", NULL), CHLA_ACK_PKT);
+    cr_assert_eq(await_packet(bob, CHLA_MESG_PKT, 2, NULL, NULL), 0);
+    cr_assert_geq(threads_pinned(server, "0"), 5, "Too few threads to have served two clients");
+
+    close(alice);
+    close(bob);
+    stop_server(server);
+}
+
+/*
+ * Search the messages of a client, waiting a while for ones just sent to
+ * be indexed, until at least the expected number of lines come back.
+ * Returns the lines, or NULL if the search was NACKed.
+ */
+static char *search(int fd, uint32_t msgid, char *query, int expected) {
+    char *reply = NULL;
+    for(int i = 0; i < 50; i++) {
+	free(reply);
+	reply = NULL;
+	if(request(fd, CHLA_SEARCH_PKT, 0, msgid, query, strlen(query), NULL, &reply) != CHLA_ACK_PKT) {
+	    free(reply);
+	    return NULL;
+	}
+	int lines = 0;
+	for(char *p = reply; (p = strstr(p, "\r\n")) != NULL; p += 2)
+	    lines++;
+	if(lines >= expected)
+	    break;
+	usleep(100000);
+    }
+    return reply;
+}
+
+/*
+ * Count the lines of a search result, checking that each has five fields.
+ */
+static int result_lines(char *reply) {
+    int lines = 0;
+    for(char *line = reply, *end; (end = strstr(line, "\r\n")) != NULL; line = end + 2, lines++) {
+	int tabs = 0;
+	for(char *p = line; p < end; p++)
+	    tabs += *p == '\t';
+	cr_assert_eq(tabs, 4, "Search result line has %d fields", tabs + 1);
+    }
+    return lines;
+}
+
+Test(blackbox_suite, 46_search_own_messages_across_restart, .timeout = 60) {
+    char *dir = "/tmp/charla_test_046";
+    system("rm -rf /tmp/charla_test_046");
+    mkdir(dir, 0700);
+    pid_t server = start_server(10046, "-X", dir, NULL);
+    int alice = connect_port(10046);
+    int bob = connect_port(10046);
+    int carol = connect_port(10046);
+    login(alice, "alice");
+    login(bob, "bob");
+    login(carol, "carol");
+    cr_assert_eq(send_message(alice, 0, 2, "bob", "Quarterly REPORT is ready", NULL), CHLA_ACK_PKT);
+    cr_assert_eq(send_message(alice, 0, 3, "carol", "the report for carol", NULL), CHLA_ACK_PKT);
+    cr_assert_eq(send_message(bob, 0, 4, "alice", "lunch today?", NULL), CHLA_ACK_PKT);
+
+    // Words match whatever their case, newest first, and only among the
+    // caller's own messages
+    char *reply = search(alice, 5, "report", 2);
+    cr_assert_not_null(reply, "Search was NACKed");
+    cr_assert_eq(result_lines(reply), 2);
+    cr_assert(strncmp(reply, "3\talice\tcarol\t", 14) == 0, "Newest message was not first: %s", reply);
+    free(reply);
+    reply = search(bob, 5, "quarterly report", 1);
+    cr_assert_eq(result_lines(reply), 1);
+    cr_assert(strncmp(reply, "2\talice\tbob\t", 12) == 0);
+    free(reply);
+    reply = search(carol, 5, "lunch", 0);
+    cr_assert_eq(result_lines(reply), 0, "Search found another user's message");
+    free(reply);
+    reply = search(alice, 5, "report\r\n1", 1);
+    cr_assert_eq(result_lines(reply), 1, "Limit on results was not kept");
+    free(reply);
+
+    // A message that bounces instead of being delivered is not indexed
+    cr_assert_eq(request(carol, CHLA_CREDIT_PKT, 0, 6, "0\r\n", 3, NULL, NULL), CHLA_ACK_PKT);
+    cr_assert_eq(send_message(alice, 0, 6, "carol", "secret plans", NULL), CHLA_ACK_PKT);
+    cr_assert_eq(request(carol, CHLA_LOGOUT_PKT, 0, 7, NULL, 0, NULL, NULL), CHLA_ACK_PKT);
+    cr_assert_eq(await_packet(alice, CHLA_BOUNCE_PKT, 6, NULL, NULL), 0, "Discarded message was not bounced");
+    login(carol, "carol");
+    cr_assert_eq(send_message(alice, 0, 8, "carol", "new plans", NULL), CHLA_ACK_PKT);
+    cr_assert_eq(await_packet(carol, CHLA_MESG_PKT, 8, NULL, NULL), 0);
+    reply = search(carol, 8, "plans", 1);
+    cr_assert_eq(result_lines(reply), 1, "Search found a message that was never delivered: %s", reply);
+    cr_assert(strncmp(reply, "8\talice\tcarol\t", 14) == 0);
+    free(reply);
+    reply = search(alice, 9, "plans", 1);
+    cr_assert_eq(result_lines(reply), 1, "Search found a message that was never delivered: %s", reply);
+    free(reply);
+    close(alice);
+    close(bob);
+    close(carol);
+    stop_server(server);
+
+    // The index outlives the server
+    server = start_server(10046, "-X", dir, NULL);
+    bob = connect_port(10046);
+    login(bob, "bob");
+    reply = search(bob, 2, "lunch", 1);
+    cr_assert_eq(result_lines(reply), 1, "Message was lost from the index on restart");
+    cr_assert(strncmp(reply, "4\tbob\talice\t", 12) == 0);
+    free(reply);
+    close(bob);
+    stop_server(server);
+    system("rm -rf /tmp/charla_test_046");
+}
+
+Test(blackbox_suite, 47_undelivered_mail_survives_restart, .timeout = 60) {
+    char *path = "/tmp/charla_test_047.snap";
+    unlink(path);
+    pid_t server = start_server(10047, "-f", path, NULL);
+    int alice = connect_port(10047);
+    int bob = connect_port(10047);
+    login(alice, "alice");
+    login(bob, "bob");
+
+    // Hold two messages in bob's mailbox over a clean shutdown
+    cr_assert_eq(request(bob, CHLA_CREDIT_PKT, 0, 2, "0\r\n", 3, NULL, NULL), CHLA_ACK_PKT);
+    cr_assert_eq(send_message(alice, 0, 2, "bob", "first", NULL), CHLA_ACK_PKT);
+    cr_assert_eq(send_message(alice, 0, 3, "bob", "second", NULL), CHLA_ACK_PKT);
+    stop_server(server);
+    close(alice);
+    close(bob);
+
+    // Bob gets them, in order, when he next logs in, and alice the receipts
+    server = start_server(10047, "-f", path, NULL);
+    alice = connect_port(10047);
+    bob = connect_port(10047);
+    login(alice, "alice");
+    login(bob, "bob");
+    char *body;
+    cr_assert_eq(await_packet(bob, CHLA_MESG_PKT, 2, NULL, &body), 0, "Queued message was lost in the restart");
+    cr_assert_str_eq(body, "alice\r\nfirst");
+    free(body);
+    cr_assert_eq(await_packet(bob, CHLA_MESG_PKT, 3, NULL, &body), 0, "Queued message was lost in the restart");
+    cr_assert_str_eq(body, "alice\r\nsecond");
+    free(body);
+    cr_assert_eq(await_packet(alice, CHLA_RCVD_PKT, 3, NULL, NULL), 0, "Restored message was not receipted");
+    stop_server(server);
+    close(alice);
+    close(bob);
+
+    // A periodic snapshot keeps mail over a crash
+    server = start_server(10047, "-f", path, "-t", "1", NULL);
+    alice = connect_port(10047);
+    bob = connect_port(10047);
+    login(alice, "alice");
+    login(bob, "bob");
+    cr_assert_eq(request(bob, CHLA_CREDIT_PKT, 0, 2, "0\r\n", 3, NULL, NULL), CHLA_ACK_PKT);
+    cr_assert_eq(send_message(alice, 0, 4, "bob", "before the crash", NULL), CHLA_ACK_PKT);
+    usleep(2500000);
+    kill(server, SIGKILL);
+    reap_server(server);
+    close(alice);
+    close(bob);
+    server = start_server(10047, "-f", path, NULL);
+    bob = connect_port(10047);
+    login(bob, "bob");
+    cr_assert_eq(await_packet(bob, CHLA_MESG_PKT, 4, NULL, &body), 0, "Periodic snapshot lost the message");
+    cr_assert_str_eq(body, "alice\r\nbefore the crash");
+    free(body);
+    close(bob);
+    stop_server(server);
+    unlink(path);
+}
+
+/*
+ * Get the CPU time a process has used so far, in clock ticks.
+ */
+static long cpu_ticks(pid_t pid) {
+    char path[64], buf[1024];
+    sprintf(path, "/proc/%d/stat", pid);
+    FILE *f = fopen(path, "r");
+    cr_assert_not_null(f);
+    size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[n] = '\0';
+    // The fields after the command, which is in parentheses, start with
+    // the state; utime and stime are the 12th and 13th after it
+    char *p = strrchr(buf, ')') + 2;
+    for(int i = 0; i < 11; i++)
+	p = strchr(p, ' ') + 1;
+    long utime, stime;
+    sscanf(p, "%ld %ld", &utime, &stime);
+    return utime + stime;
+}
+
+Test(blackbox_suite, 48_busy_poll_then_sleep, .timeout = 30) {
+    pid_t server = start_server(10048, "-b", "2000", NULL);
+    int alice = connect_port(10048);
+    int bob = connect_port(10048);
+    login(alice, "alice");
+    login(bob, "bob");
+    for(int i = 0; i < 50; i++) {
+	cr_assert_eq(send_message(alice, 0, 2 + i, "bob", "spun", NULL), CHLA_ACK_PKT);
+	cr_assert_eq(await_packet(bob, CHLA_MESG_PKT, 2 + i, NULL, NULL), 0);
+    }
+
+    // Once idle, the threads that spun go to sleep
+    usleep(200000);
+    long before = cpu_ticks(server);
+    usleep(1000000);
+    long used = cpu_ticks(server) - before;
+    cr_assert_lt(used, sysconf(_SC_CLK_TCK) / 5, "Idle server used %ld ticks in a second", used);
+
+    close(alice);
+    close(bob);
+    stop_server(server);
+}
@@ -0,0 +1,299 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "protocol.h"
+
+/*
+ * Load generator for a running server.
+ *
+ * Usage: chlabench throughput <from> <from-handle> <to> <to-handle> <count> [<window>]
+ *        chlabench latency <from> <from-handle> <to> <to-handle> <count>
+ *
+ * Logs in <from-handle> at the server at <from> and <to-handle> at the
+ * server at <to>, each given as host:port or as unix:path for the
+ * server's Unix-domain socket (charla -L), and sends <count> messages
+ * from one to the other.
+ *
+ * The throughput test keeps up to <window> (default 32) messages
+ * unacknowledged at a time, and prints the rate at which they were
+ * delivered.  With <from> and <to> at two nodes of a cluster, each owning
+ * one of the handles, every message crosses the link between the nodes
+ * (see cluster.h).
+ *
+ * The latency test sends one message at a time, waiting for it to be
+ * delivered and ACKed before sending the next, and prints the median,
+ * 99th percentile and largest time from sending a message to its
+ * delivery.  Run it once against the TCP port and once against the
+ * Unix-domain socket of the same server to compare the two, and with and
+ * without charla -b to see what busy polling buys.
+ *
+ * It needs nothing from the server but protocol.h:
+ *
+ *     cc -Iinclude tools/chlabench.c -o chlabench
+ *
+ * The numbers measure the host they are taken on, the benchmark itself
+ * included; they say nothing about a host with more or fewer CPUs.
+ */
+
+#define BODY "benchmark message"
+
+// Connect to "host:port" or "unix:path", or return -1
+static int connect_to(char *addr) {
+    if (strncmp(addr, "unix:", 5) == 0) {
+        struct sockaddr_un sun = { .sun_family = AF_UNIX };
+        if (strlen(addr + 5) >= sizeof(sun.sun_path)) {
+            return -1;
+        }
+        strcpy(sun.sun_path, addr + 5);
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd >= 0 && connect(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+            close(fd);
+            fd = -1;
+        }
+        return fd;
+    }
+    char *colon = strrchr(addr, ':');
+    if (colon == NULL) {
+        return -1;
+    }
+    char host[256];
+    snprintf(host, sizeof(host), "%.*s", (int)(colon - addr), addr);
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM }, *res;
+    if (getaddrinfo(host, colon + 1, &hints, &res)) {
+        return -1;
+    }
+    int fd = -1;
+    for (struct addrinfo *ai = res; ai != NULL && fd < 0; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(res);
+    if (fd >= 0) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return fd;
+}
+
+// Write a whole buffer
+static int write_fully(int fd, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Read a whole buffer
+static int read_fully(int fd, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Send a request, header and payload in one write
+static int send_request(int fd, int type, uint32_t msgid, void *payload, size_t length) {
+    char buf[sizeof(CHLA_PACKET_HEADER) + 512];
+    if (length > sizeof(buf) - sizeof(CHLA_PACKET_HEADER)) {
+        return -1;
+    }
+    CHLA_PACKET_HEADER *hdr = (CHLA_PACKET_HEADER *)buf;
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->type = type;
+    hdr->payload_length = htonl(length);
+    hdr->msgid = htonl(msgid);
+    memcpy(buf + sizeof(*hdr), payload, length);
+    return write_fully(fd, buf, sizeof(*hdr) + length);
+}
+
+// Receive a packet, discarding its payload
+static int recv_reply(int fd, CHLA_PACKET_HEADER *hdr) {
+    if (read_fully(fd, hdr, sizeof(*hdr))) {
+        return -1;
+    }
+    char buf[512];
+    for (size_t left = ntohl(hdr->payload_length); left > 0; ) {
+        size_t n = left < sizeof(buf) ? left : sizeof(buf);
+        if (read_fully(fd, buf, n)) {
+            return -1;
+        }
+        left -= n;
+    }
+    return 0;
+}
+
+// Log in, and wait for the ACK
+static int login(int fd, char *handle) {
+    if (send_request(fd, CHLA_LOGIN_PKT, 1, handle, strlen(handle))) {
+        return -1;
+    }
+    CHLA_PACKET_HEADER hdr;
+    do {
+        if (recv_reply(fd, &hdr)) {
+            return -1;
+        }
+    } while (hdr.type != CHLA_ACK_PKT && hdr.type != CHLA_NACK_PKT);
+    return hdr.type == CHLA_ACK_PKT ? 0 : -1;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int throughput(char *from, char *from_handle, char *to, char *to_handle, long count, long window) {
+    int sender = connect_to(from);
+    int receiver = connect_to(to);
+    if (sender < 0 || receiver < 0) {
+        fprintf(stderr, "Could not connect.\n");
+        return -1;
+    }
+    if (login(sender, from_handle) || login(receiver, to_handle)) {
+        fprintf(stderr, "Could not log in.\n");
+        return -1;
+    }
+    char payload[512];
+    size_t length = snprintf(payload, sizeof(payload), "%s\r\n%s", to_handle, BODY);
+
+    long sent = 0, acked = 0, nacked = 0, delivered = 0;
+    double start = now();
+    while (delivered + nacked < count) {
+        while (sent < count && sent - acked - nacked < window) {
+            if (send_request(sender, CHLA_SEND_PKT, 2 + sent, payload, length)) {
+                fprintf(stderr, "Sender disconnected.\n");
+                return -1;
+            }
+            sent++;
+        }
+        struct pollfd pfds[2] = { { .fd = sender, .events = POLLIN }, { .fd = receiver, .events = POLLIN } };
+        if (poll(pfds, 2, 5000) <= 0) {
+            fprintf(stderr, "Timed out with %ld of %ld messages delivered.\n", delivered, count);
+            return -1;
+        }
+        CHLA_PACKET_HEADER hdr;
+        if (pfds[0].revents) {
+            if (recv_reply(sender, &hdr)) {
+                fprintf(stderr, "Sender disconnected.\n");
+                return -1;
+            }
+            acked += hdr.type == CHLA_ACK_PKT;
+            nacked += hdr.type == CHLA_NACK_PKT;
+        }
+        if (pfds[1].revents) {
+            if (recv_reply(receiver, &hdr)) {
+                fprintf(stderr, "Receiver disconnected.\n");
+                return -1;
+            }
+            delivered += hdr.type == CHLA_MESG_PKT;
+        }
+    }
+    double elapsed = now() - start;
+    printf("%ld messages delivered, %ld refused, in %.3f s: %.0f messages/s\n",
+           delivered, nacked, elapsed, delivered / elapsed);
+    close(sender);
+    close(receiver);
+    return 0;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static int latency(char *from, char *from_handle, char *to, char *to_handle, long count) {
+    int sender = connect_to(from);
+    int receiver = connect_to(to);
+    if (sender < 0 || receiver < 0) {
+        fprintf(stderr, "Could not connect.\n");
+        return -1;
+    }
+    if (login(sender, from_handle) || login(receiver, to_handle)) {
+        fprintf(stderr, "Could not log in.\n");
+        return -1;
+    }
+    char payload[512];
+    size_t length = snprintf(payload, sizeof(payload), "%s\r\n%s", to_handle, BODY);
+    double *samples = malloc(count * sizeof(double));
+    if (samples == NULL) {
+        return -1;
+    }
+
+    for (long i = 0; i < count; i++) {
+        uint32_t msgid = 2 + i;
+        double start = now();
+        if (send_request(sender, CHLA_SEND_PKT, msgid, payload, length)) {
+            fprintf(stderr, "Sender disconnected.\n");
+            return -1;
+        }
+        CHLA_PACKET_HEADER hdr;
+        do {
+            if (recv_reply(receiver, &hdr)) {
+                fprintf(stderr, "Receiver disconnected.\n");
+                return -1;
+            }
+        } while (hdr.type != CHLA_MESG_PKT || ntohl(hdr.msgid) != msgid);
+        samples[i] = now() - start;
+        // The receipt of the previous message may come before the ACK
+        do {
+            if (recv_reply(sender, &hdr)) {
+                fprintf(stderr, "Sender disconnected.\n");
+                return -1;
+            }
+        } while ((hdr.type != CHLA_ACK_PKT && hdr.type != CHLA_NACK_PKT) || ntohl(hdr.msgid) != msgid);
+        if (hdr.type == CHLA_NACK_PKT) {
+            fprintf(stderr, "Message %ld was refused.\n", i);
+            return -1;
+        }
+    }
+    qsort(samples, count, sizeof(double), compare_doubles);
+    printf("%ld messages: p50 %.1f us, p99 %.1f us, max %.1f us\n", count,
+           samples[count / 2] * 1e6, samples[count * 99 / 100] * 1e6, samples[count - 1] * 1e6);
+    free(samples);
+    close(sender);
+    close(receiver);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if ((argc == 7 || argc == 8) && strcmp(argv[1], "throughput") == 0) {
+        long count = strtol(argv[6], NULL, 10);
+        long window = argc == 8 ? strtol(argv[7], NULL, 10) : 32;
+        if (count > 0 && window > 0) {
+            return throughput(argv[2], argv[3], argv[4], argv[5], count, window) ? EXIT_FAILURE : EXIT_SUCCESS;
+        }
+    }
+    if (argc == 7 && strcmp(argv[1], "latency") == 0) {
+        long count = strtol(argv[6], NULL, 10);
+        if (count > 0) {
+            return latency(argv[2], argv[3], argv[4], argv[5], count) ? EXIT_FAILURE : EXIT_SUCCESS;
+        }
+    }
+    fprintf(stderr, "Usage: %s throughput <from> <from-handle> <to> <to-handle> <count> [<window>]\n"
+            "       %s latency <from> <from-handle> <to> <to-handle> <count>\n", argv[0], argv[0]);
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,136 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "log.h"
+
+/*
+ * Decoder for the binary log written by "charla -o <path>" (see log.h).
+ *
+ * Usage: logdecode [<path>]
+ *
+ * Prints each record of the log, or of the standard input if no path is
+ * given, as a line of text, as the server would have printed it to
+ * stderr.  The log must have been written on a host with the same byte
+ * order.  Build it with the server's log.c:
+ *
+ *     cc -Iinclude tools/logdecode.c src/log.c -lpthread -o logdecode
+ */
+
+static LOG_SITE *sites;
+static size_t site_count;
+
+// Record a site described in the log
+static int add_site(LOG_ENTRY_HEADER *hdr, char *body) {
+    uint32_t fields[2];
+    if (hdr->length < sizeof(fields) + 3 || body[hdr->length - 1] != '\0') {
+        return -1;
+    }
+    memcpy(fields, body, sizeof(fields));
+    char *file = body + sizeof(fields);
+    char *func = file + strlen(file) + 1;
+    if (func >= body + hdr->length) {
+        return -1;
+    }
+    char *format = func + strlen(func) + 1;
+    if (format >= body + hdr->length || fields[0] == 0) {
+        return -1;
+    }
+    if (fields[0] > site_count) {
+        LOG_SITE *more = realloc(sites, fields[0] * sizeof(LOG_SITE));
+        if (more == NULL) {
+            return -1;
+        }
+        memset(more + site_count, 0, (fields[0] - site_count) * sizeof(LOG_SITE));
+        sites = more;
+        site_count = fields[0];
+    }
+    LOG_SITE *site = &sites[fields[0] - 1];
+    site->id = fields[0];
+    site->level = hdr->level;
+    site->line = fields[1];
+    site->file = file;
+    site->func = func;
+    site->format = format;
+    return 0;
+}
+
+// Print an event recorded in the log
+static int print_event(LOG_ENTRY_HEADER *hdr, char *body) {
+    LOG_EVENT event;
+    size_t used = hdr->length - sizeof(event);
+    if (hdr->length < sizeof(event) || used > LOG_STRINGS) {
+        return -1;
+    }
+    memcpy(&event, body, sizeof(event));
+    if (event.site == 0 || event.site > site_count || sites[event.site - 1].id == 0
+        || event.nargs > LOG_MAX_ARGS) {
+        return -1;
+    }
+    LOG_RECORD rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.site = &sites[event.site - 1];
+    rec.time = event.time;
+    rec.tid = event.tid;
+    rec.nargs = event.nargs;
+    memcpy(rec.types, event.types, sizeof(rec.types));
+    memcpy(rec.args, event.args, sizeof(rec.args));
+    memcpy(rec.strings, body + sizeof(event), used);
+    rec.used = used;
+    log_print(stdout, &rec);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 2) {
+        fprintf(stderr, "Usage: %s [<path>]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    FILE *in = argc == 2 ? fopen(argv[1], "r") : stdin;
+    if (in == NULL) {
+        perror(argv[1]);
+        exit(EXIT_FAILURE);
+    }
+    char magic[sizeof(LOG_FILE_MAGIC) - 1];
+    if (fread(magic, sizeof(magic), 1, in) != 1 || memcmp(magic, LOG_FILE_MAGIC, sizeof(magic))) {
+        fprintf(stderr, "Not a charla log.\n");
+        exit(EXIT_FAILURE);
+    }
+    LOG_ENTRY_HEADER hdr;
+    while (fread(&hdr, sizeof(hdr), 1, in) == 1) {
+        // Bodies of sites are kept, since the sites point into them
+        char *body = malloc(hdr.length > 0 ? hdr.length : 1);
+        if (body == NULL || fread(body, 1, hdr.length, in) != hdr.length) {
+            fprintf(stderr, "Truncated log.\n");
+            exit(EXIT_FAILURE);
+        }
+        int ret = 0;
+        LOG_DROPPED dropped;
+        switch (hdr.kind) {
+        case LOG_ENTRY_SITE:
+            ret = add_site(&hdr, body);
+            break;
+        case LOG_ENTRY_EVENT:
+            ret = print_event(&hdr, body);
+            free(body);
+            break;
+        case LOG_ENTRY_DROPPED:
+            if (hdr.length != sizeof(dropped)) {
+                ret = -1;
+            } else {
+                memcpy(&dropped, body, sizeof(dropped));
+                printf("[%u] %lu log records dropped\n", dropped.tid, (unsigned long)dropped.count);
+            }
+            free(body);
+            break;
+        default:
+            // Skip kinds of entries this decoder does not know
+            free(body);
+            break;
+        }
+        if (ret) {
+            fprintf(stderr, "Malformed log entry.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return 0;
+}